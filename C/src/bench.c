@@ -0,0 +1,718 @@
+/* ************************************************************************** */
+/** @file bench.c
+ *
+ *  @brief The main function of mcrt_bench, which times the functions on the
+ *  hot path of the transport on their own and the whole simulation over a
+ *  grid of parameters.
+ *
+ *  Usage: mcrt_bench [options]
+ *
+ *    --calls n          calls of each function per repeat, default 1e7
+ *    --photons n        photons in each simulation, default 2e4
+ *    --repeats n        repeats of each timing, the fastest is kept, default 3
+ *    --tau list         tau_max of the simulations, default 1,5,20
+ *    --albedo list      scatter_albedo of the simulations, default 0.5,1
+ *    --levels list      moments.n_levels of the simulations, default 20,200
+ *    --threads list     OpenMP threads of the simulations, default 1 and the
+ *                       maximum
+ *    --input file       an input file with the other parameters of the
+ *                       simulations, such as the transport engine or the MRW
+ *    --functions        only time the functions
+ *    --directions n     only test each direction sampler for isotropy with n
+ *                       directions and time it, see direction.c
+ *    --transport        only time the simulations
+ *    --output file      where to write the results, default bench.json
+ *    --compare file     compare the results with an earlier results file
+ *    --tolerance x      the fractional slow down which counts as a
+ *                       regression, default 0.1
+ *
+ *  The results are written as JSON, one result per line, which is also the
+ *  format read for --compare. With --compare, the program exits with 1 if any
+ *  result regressed, so it can be used as a check. With --directions, it also
+ *  exits with 1 if any sampler failed its tests.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#ifdef MPI_ON
+#include <mpi.h>
+#endif
+
+#include "variables.h"
+#include "functions.h"
+
+#if defined (_OPENMP)
+#include <omp.h>
+#endif
+
+/* Results are added here, so the compiler cannot remove the timed calls */
+static volatile double bench_sink;
+
+static BenchResult_t results[BENCH_MAX_RESULTS];
+static int n_results;
+
+/* ************************************************************************** */
+/** add_result
+ *
+ *  @brief Add a result to the list of results and print it.
+ *
+ *  @param[in] *name    The function or simulation timed.
+ *  @param[in] *metric  METRIC_NS_PER_CALL or METRIC_PHOTONS_PER_SECOND.
+ *  @param[in] value    The value of the result.
+ *
+ * ************************************************************************** */
+
+static void
+add_result(const char *name, const char *metric, double value)
+{
+  if(n_results == BENCH_MAX_RESULTS)
+  {
+    printf("Too many benchmark results, at most %d are allowed\n", BENCH_MAX_RESULTS);
+    exit(1);
+  }
+
+  BenchResult_t *result = &results[n_results++];
+  snprintf(result->name, sizeof result->name, "%s", name);
+  snprintf(result->metric, sizeof result->metric, "%s", metric);
+  result->value = value;
+
+  if(RANK == 0)
+    printf("%-70s %12.4g %s\n", name, value, metric);
+}
+
+/* ************************************************************************** */
+/** parse_list
+ *
+ *  @brief Parse a comma separated list of numbers.
+ *
+ *  @param[in] *option   The command line option, for error messages.
+ *  @param[in] *list     The list.
+ *  @param[out] *values  The numbers, at most BENCH_MAX_GRID of them.
+ *
+ *  @return The number of values.
+ *
+ * ************************************************************************** */
+
+static int
+parse_list(const char *option, const char *list, double *values)
+{
+  char copy[LINE_LEN];
+  int n = 0;
+
+  snprintf(copy, sizeof copy, "%s", list);
+  for(char *token = strtok(copy, ","); token != NULL; token = strtok(NULL, ","))
+  {
+    char *end;
+    if(n == BENCH_MAX_GRID)
+    {
+      printf("%s can have at most %d values\n", option, BENCH_MAX_GRID);
+      exit(1);
+    }
+    values[n++] = strtod(token, &end);
+    if(end == token || *end != '\0')
+    {
+      printf("Invalid value '%s' for %s\n", token, option);
+      exit(1);
+    }
+  }
+
+  return n;
+}
+
+/* ************************************************************************** */
+/** time_functions
+ *
+ *  @brief Time each function on the hot path of the transport on its own.
+ *
+ *  @param[in] n_calls    The number of calls of each function per repeat.
+ *  @param[in] n_repeats  The number of repeats, the fastest is kept.
+ *
+ *  @details
+ *
+ *  The inputs of the functions are drawn before the clock starts and cycled
+ *  through, so only the functions which draw their own random numbers include
+ *  the cost of the random number generator. The moments and histogram have
+ *  as many levels and bins as a typical simulation. The steps given to the
+ *  moment estimators are as long as those in a slab of tau_max 10, so most
+ *  cross a level or two.
+ *
+ *  The batched kernels of the event engine are timed as the event engine uses
+ *  them, drawing EVENT_LANES random numbers from as many streams at once, and
+ *  are reported per optical depth or direction. They compare with random_tau
+ *  and isotropic_scatter_photon, which the history engine calls instead.
+ *
+ * ************************************************************************** */
+
+static void
+time_functions(long n_calls, int n_repeats)
+{
+  enum {MOVE_PHOTON, RANDOM_TAU, RANDOM_THETA_PHI, ISOTROPIC_SCATTER, INCREMENT_MOMENTS, BIN_HISTOGRAM,
+        SAMPLE_OPTICAL_DEPTHS, SAMPLE_DIRECTIONS, N_FUNCTIONS};
+  const char *names[N_FUNCTIONS] = {"move_photon", "random_tau", "random_theta_phi", "isotropic_scatter_photon",
+                                    "increment_radiation_moment_estimators", "bin_photon_to_histogram",
+                                    "sample_optical_depths", "sample_isotropic_directions"};
+
+  RNGStream_t rng;
+  PhotonPacket_t packet = PHOTON_INIT;
+  Histogram_t hist;
+  Moments_t moments;
+  double *z_pre = malloc(BENCH_INPUTS * sizeof *z_pre);
+  double *z_post = malloc(BENCH_INPUTS * sizeof *z_post);
+  double *costheta = malloc(BENCH_INPUTS * sizeof *costheta);
+  double *ds = malloc(BENCH_INPUTS * sizeof *ds);
+  RNGStream_t *lanes = malloc(EVENT_LANES * sizeof *lanes);
+  double *lane_u = malloc(EVENT_LANES * sizeof *lane_u);
+  double *lane_v = malloc(EVENT_LANES * sizeof *lane_v);
+  double *lane_out = malloc(4 * EVENT_LANES * sizeof *lane_out);
+  long n_batched = (n_calls + EVENT_LANES - 1) / EVENT_LANES * EVENT_LANES;
+
+  init_rng_stream(&rng, 1, 0);
+  for(int l = 0; l < EVENT_LANES; l++)
+    init_rng_stream(&lanes[l], 1, l + 1);
+  for(int i = 0; i < BENCH_INPUTS; i++)
+  {
+    costheta[i] = random_number(&rng, -1, 1);
+    ds[i] = random_tau(&rng) / 10.0;
+    z_pre[i] = random_number(&rng, 0, 1);
+    z_post[i] = z_pre[i] + ds[i] * costheta[i];
+    if(random_number(&rng, 0, 1) < 0.5)
+      ds[i] = -ds[i];
+  }
+
+  hist.n_bins = 40;
+  moments.n_levels = 200;
+  init_histogram(&hist);
+  init_moments(&moments);
+  isotropic_emit_photon(&packet, &rng);
+
+  for(int f = 0; f < N_FUNCTIONS; f++)
+  {
+    double best = 1e300;
+
+    for(int r = 0; r < n_repeats; r++)
+    {
+      double sum = 0;
+      double start = get_wall_time();
+
+      switch(f)
+      {
+        case MOVE_PHOTON:
+          for(long i = 0; i < n_calls; i++)
+            move_photon(&packet, ds[i & (BENCH_INPUTS - 1)]);
+          sum = packet.x + packet.y + packet.z;
+          break;
+        case RANDOM_TAU:
+          for(long i = 0; i < n_calls; i++)
+            sum += random_tau(&rng);
+          break;
+        case RANDOM_THETA_PHI:
+          for(long i = 0; i < n_calls; i++)
+          {
+            double theta, phi;
+            random_theta_phi(&rng, &theta, &phi);
+            sum += theta + phi;
+          }
+          break;
+        case ISOTROPIC_SCATTER:
+          for(long i = 0; i < n_calls; i++)
+          {
+            isotropic_scatter_photon(&packet, &rng);
+            sum += packet.costheta;
+          }
+          break;
+        case INCREMENT_MOMENTS:
+          for(long i = 0; i < n_calls; i++)
+          {
+            int j = i & (BENCH_INPUTS - 1);
+            increment_radiation_moment_estimators(&moments, z_pre[j], z_post[j], costheta[j], 1.0);
+          }
+          sum = moments.level[N_MOMENTS];
+          break;
+        case BIN_HISTOGRAM:
+          for(long i = 0; i < n_calls; i++)
+            bin_photon_to_histogram(&hist, fabs(costheta[i & (BENCH_INPUTS - 1)]), 1.0);
+          sum = hist.weight[0];
+          break;
+        case SAMPLE_OPTICAL_DEPTHS:
+          for(long i = 0; i < n_batched; i += EVENT_LANES)
+          {
+            gather_random_numbers(EVENT_LANES, lanes, lane_u);
+            sample_optical_depths(EVENT_LANES, lane_u, 1.0, lane_out);
+            sum += lane_out[0];
+          }
+          break;
+        case SAMPLE_DIRECTIONS:
+          for(long i = 0; i < n_batched; i += EVENT_LANES)
+          {
+            gather_random_numbers(EVENT_LANES, lanes, lane_u);
+            gather_random_numbers(EVENT_LANES, lanes, lane_v);
+            sample_isotropic_directions(EVENT_LANES, lane_u, lane_v, lane_out, lane_out + EVENT_LANES,
+                                        lane_out + 2 * EVENT_LANES, lane_out + 3 * EVENT_LANES);
+            sum += lane_out[0];
+          }
+          break;
+        default:
+          break;
+      }
+
+      double elapsed = get_wall_time() - start;
+      bench_sink += sum;
+      if(elapsed < best)
+        best = elapsed;
+    }
+
+    long calls = f == SAMPLE_OPTICAL_DEPTHS || f == SAMPLE_DIRECTIONS ? n_batched : n_calls;
+    add_result(names[f], METRIC_NS_PER_CALL, best / calls * 1e9);
+  }
+
+  free_hist(&hist);
+  free_moments(&moments);
+  free(z_pre);
+  free(z_post);
+  free(costheta);
+  free(ds);
+  free(lanes);
+  free(lane_u);
+  free(lane_v);
+  free(lane_out);
+}
+
+/* ************************************************************************** */
+/** time_directions
+ *
+ *  @brief Time sample_direction with each direction sampler.
+ *
+ *  @param[in] n_calls    The number of calls per repeat.
+ *  @param[in] n_repeats  The number of repeats, the fastest is kept.
+ *
+ * ************************************************************************** */
+
+static void
+time_directions(long n_calls, int n_repeats)
+{
+  RNGStream_t rng;
+
+  init_directions();
+  init_rng_stream(&rng, 1, 0);
+
+  for(int s = 0; s < N_DIRECTION_SAMPLERS; s++)
+  {
+    char name[LINE_LEN];
+    double best = 1e300;
+
+    for(int r = 0; r < n_repeats; r++)
+    {
+      double sum = 0;
+      double start = get_wall_time();
+
+      for(long i = 0; i < n_calls; i++)
+      {
+        double costheta, sintheta, cosphi, sinphi;
+        sample_direction(s, &rng, &costheta, &sintheta, &cosphi, &sinphi);
+        sum += costheta + sintheta * cosphi + sinphi;
+      }
+
+      double elapsed = get_wall_time() - start;
+      bench_sink += sum;
+      if(elapsed < best)
+        best = elapsed;
+    }
+
+    snprintf(name, sizeof name, "sample_direction direction.sampler=%s", direction_sampler_name(s));
+    add_result(name, METRIC_NS_PER_CALL, best / n_calls * 1e9);
+  }
+}
+
+/* ************************************************************************** */
+/** time_simulation
+ *
+ *  @brief Time a whole simulation, without writing any output.
+ *
+ *  @param[in] *input      An input file with the other parameters, or NULL.
+ *  @param[in] n_photons   The number of photons to transport.
+ *  @param[in] tau_max     The optical depth of the slab.
+ *  @param[in] albedo      The scattering albedo.
+ *  @param[in] n_levels    The number of moment levels.
+ *  @param[in] n_repeats   The number of repeats, the fastest is kept.
+ *
+ *  @return The number of photons transported per second.
+ *
+ *  @details
+ *
+ *  The parameters are read as they are by mcrt, from the input file if one is
+ *  given and with the parameters of the grid set on top. Output, checkpoints
+ *  and the escape log are turned off.
+ *
+ * ************************************************************************** */
+
+static double
+time_simulation(char *input, long n_photons, double tau_max, double albedo, int n_levels, int n_repeats)
+{
+  ParameterTable_t table = {0, NULL};
+  char value[LINE_LEN];
+  Histogram_t hist;
+  Moments_t moments;
+  double best = 1e300;
+
+  if(input != NULL)
+    read_parameter_table(input, &table);
+  if(find_parameter(&table, "seed") == NULL)
+    set_parameter(&table, "seed", "1");
+  if(find_parameter(&table, "hist.n_bins") == NULL)
+    set_parameter(&table, "hist.n_bins", "40");
+
+  snprintf(value, sizeof value, "%ld", n_photons);
+  set_parameter(&table, "n_photons", value);
+  snprintf(value, sizeof value, "%ld", n_photons + 1);
+  set_parameter(&table, "output_frequency", value);
+  snprintf(value, sizeof value, "%.17g", tau_max);
+  set_parameter(&table, "tau_max", value);
+  snprintf(value, sizeof value, "%.17g", albedo);
+  set_parameter(&table, "scatter_albedo", value);
+  snprintf(value, sizeof value, "%d", n_levels);
+  set_parameter(&table, "moments.n_levels", value);
+  set_parameter(&table, "output.format", "text");
+  set_parameter(&table, "escape_log", "0");
+  set_parameter(&table, "checkpoint.interval", "0");
+  set_parameter(&table, "progress.interval", "0");
+
+  get_all_parameters(&table, &hist, &moments);
+  if(n_parameter_points(&table) > 1 || MRW_VALIDATE || STRETCH_VALIDATE || ENGINE_VALIDATE)
+  {
+    printf("The benchmark input cannot be a parameter sweep or a validation\n");
+    exit(1);
+  }
+
+  Histogram_t *hists = malloc(N_TALLY_SETS * sizeof *hists);
+  Moments_t *moments_sets = malloc(N_TALLY_SETS * sizeof *moments_sets);
+
+  for(int r = 0; r < n_repeats; r++)
+  {
+    for(int s = 0; s < N_TALLY_SETS; s++)
+    {
+      hists[s].n_bins = hist.n_bins;
+      moments_sets[s].n_levels = moments.n_levels;
+      init_histogram(&hists[s]);
+      init_moments(&moments_sets[s]);
+    }
+
+#ifdef MPI_ON
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
+    double start = get_wall_time();
+    long n_done = run_transport(hists, moments_sets, false);
+    double elapsed = get_wall_time() - start;
+
+    if(n_done == TRANSPORT_STOPPED)
+      exit_after_stop();
+
+    if(elapsed / n_done < best)
+      best = elapsed / n_done;
+
+    for(int s = 0; s < N_TALLY_SETS; s++)
+    {
+      free_hist(&hists[s]);
+      free_moments(&moments_sets[s]);
+    }
+  }
+
+  free(hists);
+  free(moments_sets);
+  free_parameter_table(&table);
+
+  return 1.0 / best;
+}
+
+/* ************************************************************************** */
+/** write_results_json
+ *
+ *  @brief Write the results to a JSON file.
+ *
+ *  @param[in] *file_name  The name of the file.
+ *
+ * ************************************************************************** */
+
+static void
+write_results_json(const char *file_name)
+{
+  FILE *f = fopen(file_name, "w");
+  if(f == NULL)
+  {
+    printf("Cannot open file %s\n", file_name);
+    exit(1);
+  }
+
+  fprintf(f, "{\n  \"version\": 1,\n  \"results\": [\n");
+  for(int i = 0; i < n_results; i++)
+    fprintf(f, "    {\"name\": \"%s\", \"metric\": \"%s\", \"value\": %.6e}%s\n", results[i].name, results[i].metric,
+            results[i].value, i < n_results - 1 ? "," : "");
+  fprintf(f, "  ]\n}\n");
+
+  if(fclose(f))
+  {
+    printf("Cannot close file %s\n", file_name);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** read_results_json
+ *
+ *  @brief Read the results from a JSON file written by write_results_json.
+ *
+ *  @param[in] *file_name     The name of the file.
+ *  @param[out] *baseline     The results read.
+ *
+ *  @return The number of results read.
+ *
+ *  @details
+ *
+ *  Only the layout written by mcrt_bench is understood, with one result per
+ *  line, rather than any JSON.
+ *
+ * ************************************************************************** */
+
+static int
+read_results_json(const char *file_name, BenchResult_t *baseline)
+{
+  char line[2 * LINE_LEN];
+  int n = 0;
+
+  FILE *f = fopen(file_name, "r");
+  if(f == NULL)
+  {
+    printf("Cannot open file %s\n", file_name);
+    exit(1);
+  }
+
+  while(fgets(line, sizeof line, f) != NULL && n < BENCH_MAX_RESULTS)
+  {
+    char *name = strstr(line, "\"name\": \"");
+    char *metric = strstr(line, "\"metric\": \"");
+    char *value = strstr(line, "\"value\": ");
+    if(name == NULL || metric == NULL || value == NULL)
+      continue;
+
+    name += strlen("\"name\": \"");
+    metric += strlen("\"metric\": \"");
+    *strchr(name, '"') = '\0';
+    *strchr(metric, '"') = '\0';
+    snprintf(baseline[n].name, sizeof baseline[n].name, "%s", name);
+    snprintf(baseline[n].metric, sizeof baseline[n].metric, "%s", metric);
+    baseline[n].value = strtod(value + strlen("\"value\": "), NULL);
+    n++;
+  }
+
+  fclose(f);
+
+  return n;
+}
+
+/* ************************************************************************** */
+/** compare_results
+ *
+ *  @brief Compare the results with those of an earlier run.
+ *
+ *  @param[in] *file_name  The results file of the earlier run.
+ *  @param[in] tolerance   The fractional slow down which is a regression.
+ *
+ *  @return The number of results which regressed.
+ *
+ *  @details
+ *
+ *  Results are matched by name. A function regresses if it takes longer per
+ *  call, and a simulation if it transports fewer photons per second, by more
+ *  than the tolerance.
+ *
+ * ************************************************************************** */
+
+static int
+compare_results(const char *file_name, double tolerance)
+{
+  BenchResult_t *baseline = malloc(BENCH_MAX_RESULTS * sizeof *baseline);
+  int n_baseline = read_results_json(file_name, baseline);
+  int n_regressions = 0;
+
+  printf("\n%-70s %12s %12s %8s\n", "comparison with baseline", "baseline", "current", "change");
+  for(int i = 0; i < n_results; i++)
+  {
+    BenchResult_t *base = NULL;
+    for(int j = 0; j < n_baseline; j++)
+      if(strcmp(baseline[j].name, results[i].name) == 0 && strcmp(baseline[j].metric, results[i].metric) == 0)
+        base = &baseline[j];
+
+    if(base == NULL || base->value <= 0)
+    {
+      printf("%-70s %12s %12.4g %8s\n", results[i].name, "-", results[i].value, "new");
+      continue;
+    }
+
+    double change = results[i].value / base->value - 1.0;
+    double slow_down = strcmp(results[i].metric, METRIC_NS_PER_CALL) == 0 ? change : -change;
+    int regressed = slow_down > tolerance;
+    n_regressions += regressed;
+    printf("%-70s %12.4g %12.4g %+7.1f%%%s\n", results[i].name, base->value, results[i].value, 100 * change,
+           regressed ? " REGRESSION" : "");
+  }
+
+  printf("\n%d of %d results regressed by more than %g%%\n", n_regressions, n_results, 100 * tolerance);
+  free(baseline);
+
+  return n_regressions;
+}
+
+/* ************************************************************************** */
+/** main
+ *
+ *  @brief The main function of mcrt_bench.
+ *
+ *  @param[in] int argc. Number of command line arguments provided.
+ *  @param[in] char *argv[]. The command line arguments provided.
+ *
+ *  @return 0, or 1 if a result regressed compared to the baseline.
+ *
+ *  @details
+ *
+ *  With MPI, the simulations are split between the ranks as in mcrt, and only
+ *  rank 0 prints and writes the results.
+ *
+ * ************************************************************************** */
+
+int
+main(int argc, char *argv[])
+{
+  long n_calls = 10000000;
+  long n_photons = 20000;
+  int n_repeats = 3;
+  int time_funcs = true;
+  int time_transport = true;
+  long n_directions = 0;
+  char *input = NULL;
+  char *output = "bench.json";
+  char *baseline = NULL;
+  double tolerance = 0.1;
+  double tau_max[BENCH_MAX_GRID] = {1, 5, 20};
+  double albedo[BENCH_MAX_GRID] = {0.5, 1};
+  double levels[BENCH_MAX_GRID] = {20, 200};
+  double threads[BENCH_MAX_GRID] = {1};
+  int n_tau_max = 3, n_albedo = 2, n_levels = 2, n_threads = 1;
+
+#ifdef MPI_ON
+  int thread_support;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+  MPI_Comm_rank(MPI_COMM_WORLD, &RANK);
+  MPI_Comm_size(MPI_COMM_WORLD, &N_RANKS);
+#endif
+
+#if defined(_OPENMP)
+  int max_threads = omp_get_max_threads();
+  if(max_threads > 1)
+    threads[n_threads++] = max_threads;
+#endif
+
+  for(int i = 1; i < argc; i++)
+  {
+    int has_value = i + 1 < argc;
+    if(strcmp(argv[i], "--functions") == 0)
+      time_transport = false;
+    else if(strcmp(argv[i], "--transport") == 0)
+      time_funcs = false;
+    else if(strcmp(argv[i], "--directions") == 0 && has_value)
+      n_directions = (long) strtod(argv[++i], NULL);
+    else if(strcmp(argv[i], "--calls") == 0 && has_value)
+      n_calls = (long) strtod(argv[++i], NULL);
+    else if(strcmp(argv[i], "--photons") == 0 && has_value)
+      n_photons = (long) strtod(argv[++i], NULL);
+    else if(strcmp(argv[i], "--repeats") == 0 && has_value)
+      n_repeats = (int) strtol(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--tau") == 0 && has_value)
+      n_tau_max = parse_list("--tau", argv[++i], tau_max);
+    else if(strcmp(argv[i], "--albedo") == 0 && has_value)
+      n_albedo = parse_list("--albedo", argv[++i], albedo);
+    else if(strcmp(argv[i], "--levels") == 0 && has_value)
+      n_levels = parse_list("--levels", argv[++i], levels);
+    else if(strcmp(argv[i], "--threads") == 0 && has_value)
+      n_threads = parse_list("--threads", argv[++i], threads);
+    else if(strcmp(argv[i], "--input") == 0 && has_value)
+      input = argv[++i];
+    else if(strcmp(argv[i], "--output") == 0 && has_value)
+      output = argv[++i];
+    else if(strcmp(argv[i], "--compare") == 0 && has_value)
+      baseline = argv[++i];
+    else if(strcmp(argv[i], "--tolerance") == 0 && has_value)
+      tolerance = strtod(argv[++i], NULL);
+    else
+    {
+      if(RANK == 0)
+        printf("Unknown option %s, see the top of src/bench.c for the options\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  if(n_calls < 1 || n_photons < 1 || n_repeats < 1)
+  {
+    printf("--calls, --photons and --repeats must be at least 1\n");
+    exit(1);
+  }
+
+  int n_failed = 0;
+  if(n_directions > 0)
+  {
+    if(RANK == 0)
+      n_failed = check_direction_samplers(n_directions, 1);
+    time_directions(n_calls, n_repeats);
+    time_funcs = time_transport = false;
+  }
+
+  if(time_funcs)
+    time_functions(n_calls, n_repeats);
+
+  if(time_transport)
+  {
+    for(int t = 0; t < n_threads; t++)
+    {
+#if defined(_OPENMP)
+      omp_set_num_threads((int) threads[t]);
+#else
+      if(threads[t] != 1)
+        continue;
+#endif
+      for(int a = 0; a < n_tau_max; a++)
+      {
+        for(int b = 0; b < n_albedo; b++)
+        {
+          for(int l = 0; l < n_levels; l++)
+          {
+            char name[LINE_LEN];
+            double rate = time_simulation(input, n_photons, tau_max[a], albedo[b], (int) levels[l], n_repeats);
+            snprintf(name, sizeof name, "transport %s tau_max=%g albedo=%g n_levels=%d threads=%d",
+                     TRANSPORT_ENGINE == ENGINE_EVENT ? "event" : "history", tau_max[a], albedo[b],
+                     (int) levels[l], (int) threads[t]);
+            add_result(name, METRIC_PHOTONS_PER_SECOND, rate);
+          }
+        }
+      }
+    }
+  }
+
+  int n_regressions = 0;
+  if(RANK == 0)
+  {
+    write_results_json(output);
+    if(baseline != NULL)
+      n_regressions = compare_results(baseline, tolerance);
+  }
+
+#ifdef MPI_ON
+  MPI_Bcast(&n_regressions, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&n_failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Finalize();
+#endif
+
+  return n_regressions > 0 || n_failed > 0;
+}
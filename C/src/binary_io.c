@@ -0,0 +1,124 @@
+/* ************************************************************************** */
+/** @file binary_io.c
+ *
+ *  @brief Functions for reading and writing little-endian binary files.
+ *
+ *  Binary output files are always little-endian, so that they can be read on
+ *  any machine. On a little-endian machine the values are read and written
+ *  as they are, otherwise their bytes are reversed.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "variables.h"
+#include "functions.h"
+
+/* ************************************************************************** */
+/** host_is_little_endian
+ *
+ *  @brief Check the byte order of this machine.
+ *
+ *  @return 1 if the machine is little-endian, otherwise 0.
+ *
+ * ************************************************************************** */
+
+static int
+host_is_little_endian(void)
+{
+  uint16_t one = 1;
+  uint8_t first_byte;
+
+  memcpy(&first_byte, &one, 1);
+
+  return first_byte == 1;
+}
+
+/* ************************************************************************** */
+/** reverse_bytes
+ *
+ *  @brief Reverse the bytes of each value in an array.
+ *
+ *  @param[in, out] *values  The array of values.
+ *  @param[in] size          The size of a value in bytes.
+ *  @param[in] n             The number of values.
+ *
+ * ************************************************************************** */
+
+static void
+reverse_bytes(void *values, size_t size, size_t n)
+{
+  uint8_t *bytes = values;
+
+  for(size_t i = 0; i < n; i++, bytes += size)
+  {
+    for(size_t j = 0; j < size / 2; j++)
+    {
+      uint8_t tmp = bytes[j];
+      bytes[j] = bytes[size - 1 - j];
+      bytes[size - 1 - j] = tmp;
+    }
+  }
+}
+
+/* ************************************************************************** */
+/** write_le
+ *
+ *  @brief Write an array of values to a file in little-endian byte order.
+ *
+ *  @param[in] *values  The array of values.
+ *  @param[in] size     The size of a value in bytes.
+ *  @param[in] n        The number of values.
+ *  @param[in] *f       The open file.
+ *
+ *  @return 1 if every value was written, otherwise 0.
+ *
+ * ************************************************************************** */
+
+int
+write_le(const void *values, size_t size, size_t n, FILE *f)
+{
+  if(host_is_little_endian())
+    return fwrite(values, size, n, f) == n;
+
+  const uint8_t *bytes = values;
+  uint8_t value[sizeof(uint64_t)];
+
+  for(size_t i = 0; i < n; i++)
+  {
+    memcpy(value, bytes + i * size, size);
+    reverse_bytes(value, size, 1);
+    if(fwrite(value, size, 1, f) != 1)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* ************************************************************************** */
+/** read_le
+ *
+ *  @brief Read an array of little-endian values from a file.
+ *
+ *  @param[out] *values  The array to read the values into.
+ *  @param[in] size      The size of a value in bytes.
+ *  @param[in] n         The number of values.
+ *  @param[in] *f        The open file.
+ *
+ *  @return 1 if every value was read, otherwise 0.
+ *
+ * ************************************************************************** */
+
+int
+read_le(void *values, size_t size, size_t n, FILE *f)
+{
+  if(fread(values, size, n, f) != n)
+    return 0;
+
+  if(!host_is_little_endian())
+    reverse_bytes(values, size, n);
+
+  return 1;
+}
@@ -0,0 +1,452 @@
+/* ************************************************************************** */
+/** @file binary_output.c
+ *
+ *  @brief Functions for writing the results to a binary file, and for writing
+ *  snapshots of the results from a background thread whilst photons are being
+ *  transported.
+ *
+ *  A binary output file starts with the magic string BINARY_MAGIC and two
+ *  32 bit integers, the version BINARY_VERSION and a reserved 0. It is
+ *  followed by any number of records, each of which starts with the magic
+ *  string BINARY_RECORD_MAGIC, the kind of record and the number of sections
+ *  as 32 bit integers and the number of photons as a 64 bit integer. Each
+ *  section has a name of BINARY_NAME_LEN bytes, its type and a reserved 0 as
+ *  32 bit integers and the number of values as a 64 bit integer, followed by
+ *  the values. Everything is little-endian.
+ *
+ *  The sections of a record are
+ *
+ *    metadata        SECTION_TEXT, lines of a key and a value
+ *    theta           the angle of each escape bin
+ *    weight          the escape weight of each bin
+ *    intensity       the intensity of each bin
+ *    error           the error of the intensity of each bin
+ *    peel_mu         the cosine of each peel-off observer, if any
+ *    peel_intensity  the peel-off intensity of each observer
+ *    peel_error      the error of the peel-off intensity
+ *    moments         the moments at each level, in the order given by the
+ *                    moments_columns metadata
+ *    moments_error   the errors of the moments
+ *
+ *  A reader should skip sections it does not know, so that sections can be
+ *  added without changing the version. mcrt_convert turns a record back into
+ *  the text output files.
+ *
+ *  Whilst a simulation runs, the thread which submits the batch crossing each
+ *  multiple of OUTPUT_FREQUENCY photons copies the partial sums of the
+ *  TallyReducer_t and hands them to the writer thread. The copy is the only
+ *  work done by the transporting threads, so they never wait for the file to
+ *  be written. If the writer is still busy with the last snapshot, a newer one
+ *  replaces the one waiting to be written.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "variables.h"
+#include "functions.h"
+
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static int writer_running = false;
+static int writer_stop = false;
+static int snapshot_ready = false;
+static int snapshot_in_progress = false;
+static long n_submitted;
+static long writer_first_photon;
+static long writer_last_photon;
+static Checkpoint_t snapshots[3];
+static Checkpoint_t *writing = &snapshots[0];
+static Checkpoint_t *ready = &snapshots[1];
+static Checkpoint_t *spare = &snapshots[2];
+static Histogram_t *writer_hist;
+static Moments_t *writer_moments;
+
+/* ************************************************************************** */
+/** write_section_header
+ *
+ *  @brief Write the header of a section of a record.
+ *
+ *  @param[in] *f       The open output file.
+ *  @param[in] *name    The name of the section.
+ *  @param[in] type     SECTION_DOUBLE or SECTION_TEXT.
+ *  @param[in] n        The number of values in the section.
+ *
+ *  @return 1 if the header was written, otherwise 0.
+ *
+ * ************************************************************************** */
+
+static int
+write_section_header(FILE *f, const char *name, uint32_t type, uint64_t n)
+{
+  char padded_name[BINARY_NAME_LEN] = {0};
+  uint32_t reserved = 0;
+
+  strncpy(padded_name, name, BINARY_NAME_LEN - 1);
+
+  return fwrite(padded_name, 1, BINARY_NAME_LEN, f) == BINARY_NAME_LEN && write_le(&type, sizeof type, 1, f) &&
+         write_le(&reserved, sizeof reserved, 1, f) && write_le(&n, sizeof n, 1, f);
+}
+
+/* ************************************************************************** */
+/** write_double_section
+ *
+ *  @brief Write a section of doubles.
+ *
+ *  @param[in] *f       The open output file.
+ *  @param[in] *name    The name of the section.
+ *  @param[in] *values  The values.
+ *  @param[in] n        The number of values.
+ *
+ *  @return 1 if the section was written, otherwise 0.
+ *
+ * ************************************************************************** */
+
+static int
+write_double_section(FILE *f, const char *name, const double *values, uint64_t n)
+{
+  return write_section_header(f, name, SECTION_DOUBLE, n) && write_le(values, sizeof *values, n, f);
+}
+
+/* ************************************************************************** */
+/** write_binary_record
+ *
+ *  @brief Add the results of a tally set to the end of a binary output file.
+ *
+ *  @param[in] *path       The path of the binary output file.
+ *  @param[in] kind        RECORD_SNAPSHOT or RECORD_FINAL.
+ *  @param[in] *hist       A Histogram_t struct, converted to intensities.
+ *  @param[in] *moments    An integrated Moments_t struct.
+ *  @param[in] set         The tally set the results are for.
+ *  @param[in] n_photons   The number of photons transported.
+ *
+ *  @details
+ *
+ *  The file header is written if the file is empty. Records can be written by
+ *  the snapshot writer and a checkpoint at the same time, so only one thread
+ *  writes to a file at once.
+ *
+ * ************************************************************************** */
+
+void
+write_binary_record(const char *path, int kind, Histogram_t *hist, Moments_t *moments, int set, long n_photons)
+{
+  int ok = true;
+  int n_rows = moments->n_levels + 1;
+  char metadata[4 * LINE_LEN];
+  int n_metadata = 0;
+
+  double *moment_values = malloc(2 * N_MOMENTS * n_rows * sizeof *moment_values);
+  double *moment_errors = moment_values + N_MOMENTS * n_rows;
+  normalise_moments(moments, n_photons, moment_values, moment_errors);
+
+  n_metadata += snprintf(metadata + n_metadata, sizeof metadata - n_metadata,
+    "n_photons %ld\nn_batches %ld\nseed %d\ntau_max %.17g\nscatter_albedo %.17g\n", n_photons, hist->n_batches, SEED,
+    TAU_MAX, N_SWEEP > 0 ? SWEEP_ALBEDOS[set] : SCATTERING_ALBEDO);
+  if(OUTPUT_POINT >= 0)
+    n_metadata += snprintf(metadata + n_metadata, sizeof metadata - n_metadata, "point %d\n", OUTPUT_POINT);
+  n_metadata += snprintf(metadata + n_metadata, sizeof metadata - n_metadata,
+    "moments_columns j_plus,j_minus,h_plus,h_minus,k_plus,k_minus\n");
+
+  uint32_t record_kind = kind;
+  uint32_t n_sections = hist->n_peel > 0 ? 10 : 7;
+  uint64_t record_photons = n_photons;
+
+  pthread_mutex_lock(&file_lock);
+
+  FILE *f = fopen(path, "ab");
+  if(f == NULL)
+  {
+    printf("Cannot open file %s\n", path);
+    pthread_mutex_unlock(&file_lock);
+    free(moment_values);
+    return;
+  }
+
+  fseek(f, 0, SEEK_END);
+  if(ftell(f) == 0)
+  {
+    uint32_t header[2] = {BINARY_VERSION, 0};
+    ok = fwrite(BINARY_MAGIC, 1, sizeof BINARY_MAGIC, f) == sizeof BINARY_MAGIC && write_le(header, sizeof *header, 2, f);
+  }
+
+  ok = ok && fwrite(BINARY_RECORD_MAGIC, 1, sizeof BINARY_RECORD_MAGIC, f) == sizeof BINARY_RECORD_MAGIC &&
+       write_le(&record_kind, sizeof record_kind, 1, f) && write_le(&n_sections, sizeof n_sections, 1, f) &&
+       write_le(&record_photons, sizeof record_photons, 1, f);
+
+  ok = ok && write_section_header(f, "metadata", SECTION_TEXT, n_metadata) &&
+       fwrite(metadata, 1, n_metadata, f) == (size_t) n_metadata;
+  ok = ok && write_double_section(f, "theta", hist->theta, hist->n_bins);
+  ok = ok && write_double_section(f, "weight", hist->weight, hist->n_bins);
+  ok = ok && write_double_section(f, "intensity", hist->intensity, hist->n_bins);
+  ok = ok && write_double_section(f, "error", hist->error, hist->n_bins);
+  if(hist->n_peel > 0)
+  {
+    ok = ok && write_double_section(f, "peel_mu", PEEL_MU, hist->n_peel);
+    ok = ok && write_double_section(f, "peel_intensity", hist->peel_intensity, hist->n_peel);
+    ok = ok && write_double_section(f, "peel_error", hist->peel_error, hist->n_peel);
+  }
+  ok = ok && write_double_section(f, "moments", moment_values, N_MOMENTS * n_rows);
+  ok = ok && write_double_section(f, "moments_error", moment_errors, N_MOMENTS * n_rows);
+
+  if(fclose(f) || !ok)
+  {
+    printf("Cannot write file %s\n", path);
+    exit(-1);
+  }
+
+  pthread_mutex_unlock(&file_lock);
+  free(moment_values);
+}
+
+/* ************************************************************************** */
+/** begin_binary_output
+ *
+ *  @brief Empty the binary output file of each tally set before a simulation.
+ *
+ *  @param[in] restart  If true, the records of the earlier run are kept.
+ *
+ *  @details
+ *
+ *  When the points of a parameter sweep share the output files, only the
+ *  first point empties them.
+ *
+ * ************************************************************************** */
+
+void
+begin_binary_output(int restart)
+{
+  char path[LINE_LEN];
+
+  make_output_dirs();
+  if(restart || OUTPUT_POINT > 0)
+    return;
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    output_set_path(path, s, OUTPUT_FILE_BINARY);
+    FILE *f = fopen(path, "wb");
+    if(f == NULL || fclose(f))
+    {
+      printf("Cannot open file %s\n", path);
+      exit(1);
+    }
+  }
+}
+
+/* ************************************************************************** */
+/** write_snapshot
+ *
+ *  @brief Write a snapshot of the partial sums as a record for each tally
+ *         set.
+ *
+ *  @param[in, out] *snapshot  The copy of the partial sums, which is
+ *                             destroyed.
+ *
+ * ************************************************************************** */
+
+static void
+write_snapshot(Checkpoint_t *snapshot)
+{
+  char path[LINE_LEN];
+
+  if(snapshot->n_stack == 0)
+    return;
+
+  for(int i = snapshot->n_stack - 2; i >= 0; i--)
+    add_tally(&snapshot->stack[i], &snapshot->stack[i + 1]);
+
+  long n_photons = writer_first_photon + snapshot->next_batch * BATCH_SIZE;
+  if(n_photons > writer_last_photon)
+    n_photons = writer_last_photon;
+  n_photons -= writer_first_photon;
+
+  copy_tally_totals(&snapshot->stack[0], &snapshot->squares, snapshot->next_batch, writer_hist, writer_moments);
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    integrate_moments(&writer_moments[s]);
+    convert_weight_to_intensity(&writer_hist[s], n_photons);
+    output_set_path(path, s, OUTPUT_FILE_BINARY);
+    write_binary_record(path, RECORD_SNAPSHOT, &writer_hist[s], &writer_moments[s], s, n_photons);
+  }
+}
+
+/* ************************************************************************** */
+/** snapshot_writer
+ *
+ *  @brief The main function of the writer thread.
+ *
+ *  @details
+ *
+ *  Waits for a snapshot to be handed over and writes it, until it is told to
+ *  stop. A snapshot waiting when the thread is told to stop is still written.
+ *
+ * ************************************************************************** */
+
+static void *
+snapshot_writer(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&writer_lock);
+  while(true)
+  {
+    while(!snapshot_ready && !writer_stop)
+      pthread_cond_wait(&writer_wake, &writer_lock);
+    if(!snapshot_ready)
+      break;
+
+    Checkpoint_t *tmp = writing;
+    writing = ready;
+    ready = tmp;
+    snapshot_ready = false;
+
+    pthread_mutex_unlock(&writer_lock);
+    write_snapshot(writing);
+    pthread_mutex_lock(&writer_lock);
+  }
+  pthread_mutex_unlock(&writer_lock);
+
+  return NULL;
+}
+
+/* ************************************************************************** */
+/** start_snapshot_writer
+ *
+ *  @brief Start the thread which writes snapshots of the results.
+ *
+ *  @param[in] *reducer      The reducer of the simulation.
+ *  @param[in] first_photon  The first photon transported by this rank.
+ *  @param[in] last_photon   One past the last photon transported by this rank.
+ *  @param[in] n_done        The number of photons already transported, when
+ *                           restarting.
+ *
+ *  @details
+ *
+ *  Snapshots are only written with FORMAT_BINARY. They are not written with
+ *  MPI, as the tallies of the other ranks are not available, or whilst
+ *  validating, as the reference run would be written too.
+ *
+ * ************************************************************************** */
+
+void
+start_snapshot_writer(TallyReducer_t *reducer, long first_photon, long last_photon, long n_done)
+{
+  writer_running = false;
+  if(OUTPUT_FORMAT != FORMAT_BINARY || N_RANKS > 1 || MRW_VALIDATE || STRETCH_VALIDATE)
+    return;
+
+  writer_first_photon = first_photon;
+  writer_last_photon = last_photon;
+  n_submitted = n_done;
+  writer_stop = false;
+  snapshot_ready = false;
+  snapshot_in_progress = false;
+
+  writer_hist = malloc(N_TALLY_SETS * sizeof *writer_hist);
+  writer_moments = malloc(N_TALLY_SETS * sizeof *writer_moments);
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    writer_hist[s].n_bins = reducer->n_bins;
+    writer_moments[s].n_levels = reducer->n_levels;
+    init_histogram(&writer_hist[s]);
+    init_moments(&writer_moments[s]);
+  }
+
+  if(pthread_create(&writer_thread, NULL, snapshot_writer, NULL))
+  {
+    printf("Unable to start the snapshot writer, no snapshots will be written\n");
+    return;
+  }
+
+  writer_running = true;
+}
+
+/* ************************************************************************** */
+/** poll_snapshot
+ *
+ *  @brief Hand a snapshot to the writer thread, if one is due.
+ *
+ *  @param[in] *reducer          The reducer of the running simulation.
+ *  @param[in] n_batch_photons   The number of photons in the batch just
+ *                               submitted.
+ *
+ *  @details
+ *
+ *  Called by each thread after it submits a batch. A snapshot is due when the
+ *  photons submitted pass a multiple of OUTPUT_FREQUENCY. Only one thread
+ *  copies a snapshot at a time, and a due snapshot is skipped if another
+ *  thread is still copying one.
+ *
+ * ************************************************************************** */
+
+void
+poll_snapshot(TallyReducer_t *reducer, long n_batch_photons)
+{
+  long n_done;
+  int busy;
+
+  if(!writer_running)
+    return;
+
+#pragma omp atomic capture
+  n_done = n_submitted += n_batch_photons;
+  if((n_done - n_batch_photons) / OUTPUT_FREQUENCY == n_done / OUTPUT_FREQUENCY)
+    return;
+
+#pragma omp atomic capture
+  { busy = snapshot_in_progress; snapshot_in_progress = true; }
+  if(busy)
+    return;
+
+  snapshot_tally_reducer(reducer, spare);
+
+  pthread_mutex_lock(&writer_lock);
+  Checkpoint_t *tmp = ready;
+  ready = spare;
+  spare = tmp;
+  snapshot_ready = true;
+  pthread_cond_signal(&writer_wake);
+  pthread_mutex_unlock(&writer_lock);
+
+#pragma omp atomic write
+  snapshot_in_progress = false;
+}
+
+/* ************************************************************************** */
+/** stop_snapshot_writer
+ *
+ *  @brief Wait for the writer thread to write the last snapshot and stop it.
+ *
+ * ************************************************************************** */
+
+void
+stop_snapshot_writer(void)
+{
+  if(!writer_running)
+    return;
+
+  pthread_mutex_lock(&writer_lock);
+  writer_stop = true;
+  pthread_cond_signal(&writer_wake);
+  pthread_mutex_unlock(&writer_lock);
+  pthread_join(writer_thread, NULL);
+  writer_running = false;
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    free_hist(&writer_hist[s]);
+    free_moments(&writer_moments[s]);
+  }
+  free(writer_hist);
+  free(writer_moments);
+  for(int i = 0; i < 3; i++)
+    free_snapshot(&snapshots[i]);
+}
@@ -0,0 +1,559 @@
+/* ************************************************************************** */
+/** @file checkpoint.c
+ *
+ *  @brief Functions for writing checkpoints of the tallies during a simulation
+ *  and for restarting from them.
+ *
+ *  A checkpoint is a copy of the partial sums held by the TallyReducer_t. Each
+ *  photon has its own random number stream, so the number of batches summed is
+ *  all that is needed to know where every stream is. A simulation restarted
+ *  from a checkpoint gives identical results to one which was never stopped.
+ *
+ *  Checkpoints are written every CHECKPOINT_INTERVAL seconds, or when the
+ *  process receives SIGUSR1. SIGTERM writes a checkpoint and stops the
+ *  simulation once the batches being transported have finished. The current
+ *  results are also written out with each checkpoint, unless running with
+ *  MPI where the tallies of the other ranks are not available.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+
+#ifdef MPI_ON
+#include <mpi.h>
+#endif
+
+#include "variables.h"
+#include "functions.h"
+
+#define CHECKPOINT_MAGIC "MCRTCHK"
+#define CHECKPOINT_VERSION 2
+
+static volatile sig_atomic_t signal_received = 0;
+static int checkpoint_in_progress = false;
+static int stop_simulation = false;
+static double last_checkpoint_time;
+static Checkpoint_t snapshot;
+
+/* ************************************************************************** */
+/** checkpoint_signal_handler
+ *
+ *  @brief Record that a checkpoint signal has been received.
+ *
+ *  @param[in] signal_number  The signal received.
+ *
+ *  @details
+ *
+ *  The checkpoint is written by a worker thread the next time it finishes a
+ *  batch, as very little is safe to do within a signal handler.
+ *
+ * ************************************************************************** */
+
+static void
+checkpoint_signal_handler(int signal_number)
+{
+  signal_received = signal_number;
+}
+
+/* ************************************************************************** */
+/** init_checkpoints
+ *
+ *  @brief Install the signal handlers and start the checkpoint timer.
+ *
+ * ************************************************************************** */
+
+void
+init_checkpoints(void)
+{
+  last_checkpoint_time = get_wall_time();
+  stop_simulation = false;
+  free_snapshot(&snapshot);
+
+#ifdef SIGUSR1
+  struct sigaction action;
+  memset(&action, 0, sizeof action);
+  action.sa_handler = checkpoint_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+#else
+  signal(SIGTERM, checkpoint_signal_handler);
+#endif
+}
+
+/* ************************************************************************** */
+/** hash_bytes
+ *
+ *  @brief Add some bytes to a 64 bit FNV-1a hash.
+ *
+ *  @param[in] hash     The hash so far.
+ *  @param[in] *bytes   The bytes to add.
+ *  @param[in] n_bytes  The number of bytes.
+ *
+ *  @return The new hash.
+ *
+ * ************************************************************************** */
+
+static uint64_t
+hash_bytes(uint64_t hash, const void *bytes, size_t n_bytes)
+{
+  const unsigned char *b = bytes;
+
+  for(size_t i = 0; i < n_bytes; i++)
+  {
+    hash ^= b[i];
+    hash *= 0x100000001B3ULL;
+  }
+
+  return hash;
+}
+
+/* ************************************************************************** */
+/** config_hash
+ *
+ *  @brief Hash every parameter which changes the results of a simulation.
+ *
+ *  @param[in] *reducer  The reducer, for the size of the tallies.
+ *
+ *  @return The hash of the parameters.
+ *
+ *  @details
+ *
+ *  A checkpoint can only be restarted by a simulation with the same hash.
+ *
+ * ************************************************************************** */
+
+static uint64_t
+config_hash(TallyReducer_t *reducer)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  hash = hash_bytes(hash, &N_PHOTONS, sizeof N_PHOTONS);
+  hash = hash_bytes(hash, &BATCH_SIZE, sizeof BATCH_SIZE);
+  hash = hash_bytes(hash, &SEED, sizeof SEED);
+  hash = hash_bytes(hash, &TAU_MAX, sizeof TAU_MAX);
+  hash = hash_bytes(hash, &SCATTERING_ALBEDO, sizeof SCATTERING_ALBEDO);
+  hash = hash_bytes(hash, &TRANSPORT_ENGINE, sizeof TRANSPORT_ENGINE);
+  hash = hash_bytes(hash, &DIRECTION_SAMPLER, sizeof DIRECTION_SAMPLER);
+  hash = hash_bytes(hash, &PHASE_FUNCTION, sizeof PHASE_FUNCTION);
+  hash = hash_bytes(hash, &PHASE_G, sizeof PHASE_G);
+  if(PHASE_TABLE != NULL)
+  {
+    hash = hash_bytes(hash, &PHASE_TABLE->n_nodes, sizeof PHASE_TABLE->n_nodes);
+    hash = hash_bytes(hash, PHASE_TABLE->mu, PHASE_TABLE->n_nodes * sizeof *PHASE_TABLE->mu);
+    hash = hash_bytes(hash, PHASE_TABLE->value, PHASE_TABLE->n_nodes * sizeof *PHASE_TABLE->value);
+  }
+  hash = hash_bytes(hash, &MRW_ENABLED, sizeof MRW_ENABLED);
+  hash = hash_bytes(hash, &MRW_CRITICAL_SCATTERS, sizeof MRW_CRITICAL_SCATTERS);
+  hash = hash_bytes(hash, &MRW_MIN_RADIUS, sizeof MRW_MIN_RADIUS);
+  hash = hash_bytes(hash, &IMPLICIT_CAPTURE, sizeof IMPLICIT_CAPTURE);
+  hash = hash_bytes(hash, &ROULETTE_THRESHOLD, sizeof ROULETTE_THRESHOLD);
+  hash = hash_bytes(hash, &ROULETTE_SURVIVAL, sizeof ROULETTE_SURVIVAL);
+  hash = hash_bytes(hash, &PATH_STRETCH, sizeof PATH_STRETCH);
+  if(LAYERS != NULL)
+  {
+    hash = hash_bytes(hash, &LAYERS->n_layers, sizeof LAYERS->n_layers);
+    hash = hash_bytes(hash, LAYERS->layer, (LAYERS->n_layers + 1) * sizeof *LAYERS->layer);
+  }
+  hash = hash_bytes(hash, &N_SWEEP, sizeof N_SWEEP);
+  hash = hash_bytes(hash, SWEEP_ALBEDOS, N_SWEEP * sizeof *SWEEP_ALBEDOS);
+  hash = hash_bytes(hash, &N_PEEL, sizeof N_PEEL);
+  hash = hash_bytes(hash, PEEL_MU, N_PEEL * sizeof *PEEL_MU);
+  hash = hash_bytes(hash, &TARGET_REL_ERROR, sizeof TARGET_REL_ERROR);
+  hash = hash_bytes(hash, &TARGET_MOMENTS, sizeof TARGET_MOMENTS);
+  hash = hash_bytes(hash, &RANK, sizeof RANK);
+  hash = hash_bytes(hash, &N_RANKS, sizeof N_RANKS);
+  hash = hash_bytes(hash, &reducer->n_bins, sizeof reducer->n_bins);
+  hash = hash_bytes(hash, &reducer->n_levels, sizeof reducer->n_levels);
+
+  return hash;
+}
+
+/* ************************************************************************** */
+/** write_or_exit
+ *
+ *  @brief fwrite, exiting if the write fails.
+ *
+ * ************************************************************************** */
+
+static void
+write_or_exit(const void *ptr, size_t size, size_t n, FILE *f)
+{
+  if(fwrite(ptr, size, n, f) != n)
+  {
+    printf("Unable to write checkpoint file %s\n", CHECKPOINT_FILE);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** read_or_exit
+ *
+ *  @brief fread, exiting if the read fails.
+ *
+ * ************************************************************************** */
+
+static void
+read_or_exit(void *ptr, size_t size, size_t n, FILE *f)
+{
+  if(fread(ptr, size, n, f) != n)
+  {
+    printf("Unable to read checkpoint file %s, it may be truncated\n", CHECKPOINT_FILE);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** write_partial_results
+ *
+ *  @brief Write out the results of the batches in the snapshot.
+ *
+ *  @param[in] *reducer    The reducer, for the size of the tallies.
+ *  @param[in] n_photons   The number of photons in the snapshot.
+ *
+ *  @details
+ *
+ *  The partial sums are added from the top of the stack down, in the same way
+ *  as finish_tally_reducer, which destroys the snapshot.
+ *
+ * ************************************************************************** */
+
+static void
+write_partial_results(TallyReducer_t *reducer, long n_photons)
+{
+  if(snapshot.n_stack == 0 || n_photons == 0)
+    return;
+
+  for(int i = snapshot.n_stack - 2; i >= 0; i--)
+    add_tally(&snapshot.stack[i], &snapshot.stack[i + 1]);
+
+  Histogram_t *hist = malloc(N_TALLY_SETS * sizeof *hist);
+  Moments_t *moments = malloc(N_TALLY_SETS * sizeof *moments);
+  Tally_t *total = &snapshot.stack[0];
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    hist[s].n_bins = reducer->n_bins;
+    moments[s].n_levels = reducer->n_levels;
+    init_histogram(&hist[s]);
+    init_moments(&moments[s]);
+  }
+
+  copy_tally_totals(total, &snapshot.squares, snapshot.next_batch, hist, moments);
+  for(int s = 0; s < N_TALLY_SETS; s++)
+    integrate_moments(&moments[s]);
+  write_results(hist, moments, n_photons, RECORD_SNAPSHOT);
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    free_hist(&hist[s]);
+    free_moments(&moments[s]);
+  }
+  free(hist);
+  free(moments);
+}
+
+/* ************************************************************************** */
+/** write_checkpoint
+ *
+ *  @brief Write the in order partial sums of a reducer to CHECKPOINT_FILE.
+ *
+ *  @param[in] *reducer      The reducer of the running simulation.
+ *  @param[in] first_photon  The first photon transported by this rank.
+ *  @param[in] last_photon   One past the last photon transported by this rank.
+ *
+ *  @details
+ *
+ *  The checkpoint is written to a temporary file which then replaces the old
+ *  checkpoint, so a valid checkpoint always exists even if the process is
+ *  killed part way through.
+ *
+ *  The file contains a header of the magic string, the version, the config
+ *  hash, the number of photons and batches completed, the batch the reducer
+ *  stops at, the number of bins and levels and the number of partial sums,
+ *  followed by the order and data of each partial sum and the sum of the
+ *  squares of the batches.
+ *
+ * ************************************************************************** */
+
+void
+write_checkpoint(TallyReducer_t *reducer, long first_photon, long last_photon)
+{
+  char tmp_file[LINE_LEN + 8];
+  int version = CHECKPOINT_VERSION;
+  uint64_t hash = config_hash(reducer);
+
+  snapshot_tally_reducer(reducer, &snapshot);
+
+  long n_photons = first_photon + snapshot.next_batch * BATCH_SIZE;
+  if(n_photons > last_photon)
+    n_photons = last_photon;
+  n_photons -= first_photon;
+
+  snprintf(tmp_file, sizeof tmp_file, "%s.tmp", CHECKPOINT_FILE);
+
+  FILE *f = fopen(tmp_file, "wb");
+  if(f == NULL)
+  {
+    printf("Unable to open checkpoint file %s\n", tmp_file);
+    return;
+  }
+
+  write_or_exit(CHECKPOINT_MAGIC, 1, sizeof CHECKPOINT_MAGIC, f);
+  write_or_exit(&version, sizeof version, 1, f);
+  write_or_exit(&hash, sizeof hash, 1, f);
+  write_or_exit(&n_photons, sizeof n_photons, 1, f);
+  write_or_exit(&snapshot.next_batch, sizeof snapshot.next_batch, 1, f);
+  write_or_exit(&snapshot.stop_batch, sizeof snapshot.stop_batch, 1, f);
+  write_or_exit(&reducer->n_bins, sizeof reducer->n_bins, 1, f);
+  write_or_exit(&reducer->n_levels, sizeof reducer->n_levels, 1, f);
+  write_or_exit(&snapshot.n_stack, sizeof snapshot.n_stack, 1, f);
+  for(int i = 0; i < snapshot.n_stack; i++)
+  {
+    write_or_exit(&snapshot.stack_order[i], sizeof snapshot.stack_order[i], 1, f);
+    write_or_exit(snapshot.stack[i].data, sizeof(double), snapshot.stack[i].n_data, f);
+  }
+  write_or_exit(snapshot.squares.data, sizeof(double), snapshot.squares.n_data, f);
+
+  if(fclose(f) || rename(tmp_file, CHECKPOINT_FILE))
+  {
+    printf("Unable to write checkpoint file %s\n", CHECKPOINT_FILE);
+    return;
+  }
+
+  printf("Checkpoint written to %s after %ld photons\n", CHECKPOINT_FILE, n_photons);
+
+  if(N_RANKS == 1)
+    write_partial_results(reducer, n_photons);
+}
+
+/* ************************************************************************** */
+/** read_checkpoint
+ *
+ *  @brief Restore the state of a reducer from CHECKPOINT_FILE.
+ *
+ *  @param[in, out] *reducer  A TallyReducer_t struct, straight from
+ *                            init_tally_reducer.
+ *
+ *  @return The number of batches which have already been completed.
+ *
+ *  @details
+ *
+ *  The simulation exits if the checkpoint was written by a simulation with
+ *  different parameters.
+ *
+ * ************************************************************************** */
+
+long
+read_checkpoint(TallyReducer_t *reducer)
+{
+  char magic[sizeof CHECKPOINT_MAGIC];
+  int version, n_bins, n_levels;
+  uint64_t hash;
+  long n_photons;
+
+  FILE *f = fopen(CHECKPOINT_FILE, "rb");
+  if(f == NULL)
+  {
+    printf("Unable to open checkpoint file %s to restart from\n", CHECKPOINT_FILE);
+    exit(1);
+  }
+
+  read_or_exit(magic, 1, sizeof magic, f);
+  read_or_exit(&version, sizeof version, 1, f);
+  if(memcmp(magic, CHECKPOINT_MAGIC, sizeof magic) != 0 || version != CHECKPOINT_VERSION)
+  {
+    printf("%s is not a version %d checkpoint file\n", CHECKPOINT_FILE, CHECKPOINT_VERSION);
+    exit(1);
+  }
+
+  read_or_exit(&hash, sizeof hash, 1, f);
+  if(hash != config_hash(reducer))
+  {
+    printf("Checkpoint %s was written by a simulation with different parameters\n", CHECKPOINT_FILE);
+    exit(1);
+  }
+
+  read_or_exit(&n_photons, sizeof n_photons, 1, f);
+  read_or_exit(&snapshot.next_batch, sizeof snapshot.next_batch, 1, f);
+  read_or_exit(&snapshot.stop_batch, sizeof snapshot.stop_batch, 1, f);
+  read_or_exit(&n_bins, sizeof n_bins, 1, f);
+  read_or_exit(&n_levels, sizeof n_levels, 1, f);
+  read_or_exit(&snapshot.n_stack, sizeof snapshot.n_stack, 1, f);
+  if(snapshot.n_stack < 0 || snapshot.n_stack > MAX_STACK_ORDER)
+  {
+    printf("Checkpoint %s is corrupt\n", CHECKPOINT_FILE);
+    exit(1);
+  }
+
+  for(int i = 0; i < snapshot.n_stack; i++)
+  {
+    if(i >= snapshot.n_allocated)
+    {
+      init_tally(&snapshot.stack[i], n_bins, n_levels);
+      snapshot.n_allocated = i + 1;
+    }
+    read_or_exit(&snapshot.stack_order[i], sizeof snapshot.stack_order[i], 1, f);
+    read_or_exit(snapshot.stack[i].data, sizeof(double), snapshot.stack[i].n_data, f);
+  }
+
+  if(snapshot.squares.data == NULL)
+    init_tally(&snapshot.squares, n_bins, n_levels);
+  read_or_exit(snapshot.squares.data, sizeof(double), snapshot.squares.n_data, f);
+
+  fclose(f);
+
+  restore_tally_reducer(reducer, &snapshot);
+  printf("Restarting from %s after %ld photons\n", CHECKPOINT_FILE, n_photons);
+
+  return snapshot.next_batch;
+}
+
+/* ************************************************************************** */
+/** poll_checkpoint
+ *
+ *  @brief Write a checkpoint if one is due or has been asked for by a signal.
+ *
+ *  @param[in] *reducer      The reducer of the running simulation.
+ *  @param[in] first_photon  The first photon transported by this rank.
+ *  @param[in] last_photon   One past the last photon transported by this rank.
+ *
+ *  @details
+ *
+ *  Called by each thread after it submits a batch. Only one thread writes a
+ *  checkpoint at a time, and the others carry on transporting photons. After
+ *  SIGTERM, no checkpoint is written here; instead the simulation is stopped
+ *  and the checkpoint is written by run_transport once the threads are idle.
+ *
+ * ************************************************************************** */
+
+void
+poll_checkpoint(TallyReducer_t *reducer, long first_photon, long last_photon)
+{
+  int busy;
+  int signal_number = signal_received;
+  double last_time;
+
+  if(EMBEDDED)
+    return;
+
+#pragma omp atomic read
+  last_time = last_checkpoint_time;
+
+  if(signal_number == 0 && (CHECKPOINT_INTERVAL <= 0 || get_wall_time() - last_time < CHECKPOINT_INTERVAL))
+    return;
+
+#pragma omp atomic capture
+  { busy = checkpoint_in_progress; checkpoint_in_progress = true; }
+  if(busy)
+    return;
+
+  signal_received = 0;
+  if(signal_number == SIGTERM)
+  {
+#pragma omp atomic write
+    stop_simulation = true;
+  }
+  else
+  {
+    write_checkpoint(reducer, first_photon, last_photon);
+  }
+
+#pragma omp atomic write
+  last_checkpoint_time = get_wall_time();
+#pragma omp atomic write
+  checkpoint_in_progress = false;
+}
+
+/* ************************************************************************** */
+/** checkpoint_stop_requested
+ *
+ *  @brief Check whether the simulation has been asked to stop by SIGTERM.
+ *
+ *  @return true if no more batches should be started. Always false when
+ *  EMBEDDED, as no signal handlers are installed.
+ *
+ * ************************************************************************** */
+
+int
+checkpoint_stop_requested(void)
+{
+  int stop;
+
+  if(EMBEDDED)
+    return false;
+
+#pragma omp atomic read
+  stop = stop_simulation;
+
+  return stop;
+}
+
+/* ************************************************************************** */
+/** checkpoint_stop_agreed
+ *
+ *  @brief Check whether any rank has been asked to stop by SIGTERM.
+ *
+ *  @return true if every rank should write its checkpoint and stop.
+ *
+ *  @details
+ *
+ *  Called by every rank once its transport loop has finished. With MPI, the
+ *  ranks which were not signalled stop as well, so that no rank is left
+ *  waiting in a reduction for a rank which has stopped.
+ *
+ * ************************************************************************** */
+
+int
+checkpoint_stop_agreed(void)
+{
+  int stop = checkpoint_stop_requested();
+
+  if(EMBEDDED)
+    return false;
+
+#ifdef MPI_ON
+  MPI_Allreduce(MPI_IN_PLACE, &stop, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+#endif
+
+  if(stop)
+  {
+#pragma omp atomic write
+    stop_simulation = true;
+  }
+
+  return stop;
+}
+
+/* ************************************************************************** */
+/** exit_after_stop
+ *
+ *  @brief End a program whose simulation was stopped by SIGTERM.
+ *
+ *  @details
+ *
+ *  For the tools which run simulations outside of main.c. Every rank has
+ *  written its checkpoint by the time run_transport returns
+ *  TRANSPORT_STOPPED, so the ranks wait for each other and finalise MPI
+ *  before exiting, rather than have the MPI launcher abort the job.
+ *
+ * ************************************************************************** */
+
+void
+exit_after_stop(void)
+{
+  if(RANK == 0)
+    printf("Stopping after SIGTERM\n");
+
+#ifdef MPI_ON
+  MPI_Barrier(MPI_COMM_WORLD);
+  MPI_Finalize();
+#endif
+
+  exit(0);
+}
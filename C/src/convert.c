@@ -0,0 +1,373 @@
+/* ************************************************************************** */
+/** @file convert.c
+ *
+ *  @brief The main function of mcrt_convert, which converts a record of a
+ *  binary output file into the text output files.
+ *
+ *  Usage: mcrt_convert [--list] [--record n] file.bin [output_dir]
+ *
+ *  By default the last record is converted, which is the final result once a
+ *  simulation has finished. --list prints the records in the file instead.
+ *  The text files are written as mcrt would have written them with
+ *  output.format text.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "variables.h"
+#include "functions.h"
+
+/* ************************************************************************** */
+/** free_record
+ *
+ *  @brief Free the sections of a record.
+ *
+ *  @param[in, out] *record  The record to free.
+ *
+ * ************************************************************************** */
+
+static void
+free_record(BinaryRecord_t *record)
+{
+  for(uint32_t i = 0; i < record->n_sections; i++)
+    free(record->sections[i].data);
+  free(record->sections);
+  record->sections = NULL;
+  record->n_sections = 0;
+}
+
+/* ************************************************************************** */
+/** read_record
+ *
+ *  @brief Read the next record of a binary output file.
+ *
+ *  @param[in] *f            The open binary output file, after the header.
+ *  @param[in] *file_name    The name of the file, for error messages.
+ *  @param[out] *record      The record read.
+ *
+ *  @return 1 if a record was read, or 0 at the end of the file.
+ *
+ *  @details
+ *
+ *  The program exits if the file is corrupt. A record cut short, as the
+ *  simulation was killed whilst writing it, counts as the end of the file.
+ *
+ * ************************************************************************** */
+
+static int
+read_record(FILE *f, const char *file_name, BinaryRecord_t *record)
+{
+  char magic[sizeof BINARY_RECORD_MAGIC];
+
+  record->n_sections = 0;
+  record->sections = NULL;
+
+  if(fread(magic, 1, sizeof magic, f) != sizeof magic)
+    return 0;
+
+  if(memcmp(magic, BINARY_RECORD_MAGIC, sizeof magic) != 0)
+  {
+    printf("%s is corrupt\n", file_name);
+    exit(1);
+  }
+
+  uint32_t n_sections;
+  if(!read_le(&record->kind, sizeof record->kind, 1, f) || !read_le(&n_sections, sizeof n_sections, 1, f) ||
+     !read_le(&record->n_photons, sizeof record->n_photons, 1, f))
+    return 0;
+
+  record->sections = calloc(n_sections, sizeof *record->sections);
+  for(uint32_t i = 0; i < n_sections; i++)
+  {
+    BinarySection_t *section = &record->sections[i];
+    uint32_t reserved;
+
+    if(fread(section->name, 1, BINARY_NAME_LEN, f) != BINARY_NAME_LEN ||
+       !read_le(&section->type, sizeof section->type, 1, f) || !read_le(&reserved, sizeof reserved, 1, f) ||
+       !read_le(&section->n, sizeof section->n, 1, f))
+    {
+      free_record(record);
+      return 0;
+    }
+    section->name[BINARY_NAME_LEN - 1] = '\0';
+
+    int ok;
+    if(section->type == SECTION_DOUBLE)
+    {
+      section->data = malloc(section->n * sizeof(double) + 1);
+      ok = read_le(section->data, sizeof(double), section->n, f);
+    }
+    else
+    {
+      section->data = malloc(section->n + 1);
+      ok = fread(section->data, 1, section->n, f) == section->n;
+      ((char *) section->data)[section->n] = '\0';
+    }
+    record->n_sections = i + 1;
+
+    if(!ok)
+    {
+      free_record(record);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* ************************************************************************** */
+/** find_section
+ *
+ *  @brief Find a section of a record by its name.
+ *
+ *  @param[in] *record  The record.
+ *  @param[in] *name    The name of the section.
+ *
+ *  @return The section, or NULL if the record does not have it.
+ *
+ * ************************************************************************** */
+
+static BinarySection_t *
+find_section(BinaryRecord_t *record, const char *name)
+{
+  for(uint32_t i = 0; i < record->n_sections; i++)
+    if(strcmp(record->sections[i].name, name) == 0)
+      return &record->sections[i];
+
+  return NULL;
+}
+
+/* ************************************************************************** */
+/** get_doubles
+ *
+ *  @brief Get a section of doubles which must be in a record.
+ *
+ *  @param[in] *record  The record.
+ *  @param[in] *name    The name of the section.
+ *  @param[in] n        The number of values expected, or 0 for any number.
+ *
+ *  @return The values of the section.
+ *
+ * ************************************************************************** */
+
+static double *
+get_doubles(BinaryRecord_t *record, const char *name, uint64_t n)
+{
+  BinarySection_t *section = find_section(record, name);
+
+  if(section == NULL || section->type != SECTION_DOUBLE || (n > 0 && section->n != n))
+  {
+    printf("The record has no valid %s section\n", name);
+    exit(1);
+  }
+
+  return section->data;
+}
+
+/* ************************************************************************** */
+/** open_text_file
+ *
+ *  @brief Open a text output file in the output directory.
+ *
+ *  @param[in] *dir        The output directory.
+ *  @param[in] *file_name  The name of the file.
+ *
+ *  @return The open file.
+ *
+ * ************************************************************************** */
+
+static FILE *
+open_text_file(const char *dir, const char *file_name)
+{
+  char path[2 * LINE_LEN];
+  FILE *f;
+
+  snprintf(path, sizeof path, "%s/%s", dir, file_name);
+  if((f = fopen(path, "w")) == NULL)
+  {
+    printf("Cannot open file %s\n", path);
+    exit(1);
+  }
+
+  return f;
+}
+
+/* ************************************************************************** */
+/** write_text_files
+ *
+ *  @brief Write a record out as the text output files.
+ *
+ *  @param[in] *record  The record.
+ *  @param[in] *dir     The directory to write the files to.
+ *
+ * ************************************************************************** */
+
+static void
+write_text_files(BinaryRecord_t *record, const char *dir)
+{
+  FILE *f;
+  BinarySection_t *section = find_section(record, "theta");
+  if(section == NULL)
+  {
+    printf("The record has no valid theta section\n");
+    exit(1);
+  }
+
+  uint64_t n_bins = section->n;
+  double *theta = get_doubles(record, "theta", n_bins);
+  double *weight = get_doubles(record, "weight", n_bins);
+  double *intensity = get_doubles(record, "intensity", n_bins);
+  double *error = get_doubles(record, "error", n_bins);
+
+  f = open_text_file(dir, OUTPUT_FILE_INTENS);
+  fprintf(f, "%-12s %-12s %-12s %-12s\n", "angle", "weight", "intensity", "error");
+  for(uint64_t i = 0; i < n_bins; i++)
+    fprintf(f, "%-12f %-12e %-12e %-12e\n", theta[i], weight[i], intensity[i], error[i]);
+  fclose(f);
+
+  if((section = find_section(record, "peel_mu")) != NULL)
+  {
+    uint64_t n_peel = section->n;
+    double *mu = get_doubles(record, "peel_mu", n_peel);
+    double *peel_intensity = get_doubles(record, "peel_intensity", n_peel);
+    double *peel_error = get_doubles(record, "peel_error", n_peel);
+
+    f = open_text_file(dir, OUTPUT_FILE_PEEL);
+    fprintf(f, "%-12s %-12s %-12s %-12s\n", "angle", "mu", "intensity", "error");
+    for(uint64_t i = 0; i < n_peel; i++)
+      fprintf(f, "%-12f %-12f %-12e %-12e\n", acos(mu[i]), mu[i], peel_intensity[i], peel_error[i]);
+    fclose(f);
+  }
+
+  section = find_section(record, "moments");
+  if(section == NULL || section->n % N_MOMENTS != 0)
+  {
+    printf("The record has no valid moments section\n");
+    exit(1);
+  }
+
+  uint64_t n_rows = section->n / N_MOMENTS;
+  double *moments = get_doubles(record, "moments", n_rows * N_MOMENTS);
+  double *moments_error = get_doubles(record, "moments_error", n_rows * N_MOMENTS);
+
+  f = open_text_file(dir, OUTPUT_FILE_MOMENTS);
+  fprintf(f, "%-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s\n", "level", "j_plus",
+    "j_minus", "h_plus", "h_minus", "k_plus", "k_minus", "j_plus_err", "j_minus_err", "h_plus_err", "h_minus_err",
+    "k_plus_err", "k_minus_err");
+  for(uint64_t i = 0; i < n_rows; i++)
+  {
+    fprintf(f, "%-12d", (int) i + 1);
+    for(int m = 0; m < N_MOMENTS; m++)
+      fprintf(f, " %-12e", moments[N_MOMENTS * i + m]);
+    for(int m = 0; m < N_MOMENTS; m++)
+      fprintf(f, " %-12e", moments_error[N_MOMENTS * i + m]);
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
+
+/* ************************************************************************** */
+/** main
+ *
+ *  @brief The main function of mcrt_convert.
+ *
+ *  @param[in] int argc. Number of command line arguments provided.
+ *  @param[in] char *argv[]. The command line arguments provided.
+ *
+ *  @return 0 on success, otherwise 1.
+ *
+ * ************************************************************************** */
+
+int
+main(int argc, char *argv[])
+{
+  char *file_name = NULL;
+  char *dir = ".";
+  int list = 0;
+  long wanted = -1;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "--list") == 0)
+      list = 1;
+    else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+      wanted = strtol(argv[++i], NULL, 10);
+    else if(file_name == NULL)
+      file_name = argv[i];
+    else
+      dir = argv[i];
+  }
+
+  if(file_name == NULL)
+  {
+    printf("Usage: mcrt_convert [--list] [--record n] file.bin [output_dir]\n");
+    return 1;
+  }
+
+  FILE *f = fopen(file_name, "rb");
+  if(f == NULL)
+  {
+    printf("Cannot open file %s\n", file_name);
+    return 1;
+  }
+
+  char magic[sizeof BINARY_MAGIC];
+  uint32_t header[2];
+  if(fread(magic, 1, sizeof magic, f) != sizeof magic || memcmp(magic, BINARY_MAGIC, sizeof magic) != 0 ||
+     !read_le(header, sizeof *header, 2, f))
+  {
+    printf("%s is not an mcrt binary output file\n", file_name);
+    return 1;
+  }
+  if(header[0] != BINARY_VERSION)
+  {
+    printf("%s is version %u, but only version %d can be read\n", file_name, header[0], BINARY_VERSION);
+    return 1;
+  }
+
+  BinaryRecord_t record;
+  BinaryRecord_t chosen = {0, 0, 0, NULL};
+  long n_records = 0;
+
+  while(read_record(f, file_name, &record))
+  {
+    if(list)
+    {
+      BinarySection_t *metadata = find_section(&record, "metadata");
+      printf("record %ld: %s, %lu photons\n", n_records, record.kind == RECORD_FINAL ? "final" : "snapshot",
+             (unsigned long) record.n_photons);
+      if(metadata != NULL && metadata->type == SECTION_TEXT)
+        printf("%s", (char *) metadata->data);
+    }
+
+    if(wanted < 0 || n_records == wanted)
+    {
+      free_record(&chosen);
+      chosen = record;
+    }
+    else
+    {
+      free_record(&record);
+    }
+    n_records++;
+  }
+  fclose(f);
+
+  if(list)
+    return 0;
+
+  if(chosen.sections == NULL)
+  {
+    printf("%s has no record %ld\n", file_name, wanted);
+    return 1;
+  }
+
+  write_text_files(&chosen, dir);
+  free_record(&chosen);
+
+  return 0;
+}
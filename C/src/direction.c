@@ -0,0 +1,633 @@
+/* ************************************************************************** */
+/** @file direction.c
+ *
+ *  @brief Functions for giving photons random isotropic directions, and the
+ *  statistical tests of them.
+ *
+ *  A direction is stored as the sine and cosine of theta and phi. There are
+ *  several ways of sampling one, chosen with direction.sampler:
+ *
+ *    trig       theta = acos(2u - 1) and phi = 2 pi u, then the sine and
+ *               cosine of each, i.e. five calls to the C library.
+ *    sqrt       costheta = 2u - 1 is used directly, with sintheta from sqrt,
+ *               and the sine and cosine of phi from the C library.
+ *    rejection  Marsaglia's method, which picks a point in the unit disc by
+ *               rejection and needs only sqrt and a division. It uses 2.55
+ *               random numbers per direction on average, rather than 2.
+ *    table      as sqrt, but the sine and cosine of phi are found from a
+ *               table of AZIMUTH_TABLE_SIZE angles and a short series for the
+ *               remainder.
+ *
+ *  All four are exact to within rounding, which check_direction_samplers
+ *  tests with chi squared and Kolmogorov-Smirnov tests. Which is fastest
+ *  depends on the CPU and the C library; mcrt_bench --directions runs the
+ *  tests and times each one. trig is the default, as it reproduces the
+ *  results of earlier versions of mcrt for the same SEED.
+ *
+ *  The event engine scatters with the vectorised kernel in sampling.c for trig
+ *  and sqrt, which draws the same random numbers, and with sample_direction
+ *  for the other two.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#define AZIMUTH_TABLE_SIZE 256
+#define CHI2_BINS 64
+#define CHI2_JOINT_BINS 16
+#define MIN_P_VALUE 1.0e-4
+
+static double azimuth_cos[AZIMUTH_TABLE_SIZE];
+static double azimuth_sin[AZIMUTH_TABLE_SIZE];
+static pthread_once_t azimuths_tabulated = PTHREAD_ONCE_INIT;
+
+static const char *sampler_names[N_DIRECTION_SAMPLERS] = {"trig", "sqrt", "rejection", "table"};
+
+/* ************************************************************************** */
+/** tabulate_azimuths
+ *
+ *  @brief Tabulate the sine and cosine of AZIMUTH_TABLE_SIZE equally spaced
+ *  angles around a circle.
+ *
+ * ************************************************************************** */
+
+static void
+tabulate_azimuths(void)
+{
+  for(int i = 0; i < AZIMUTH_TABLE_SIZE; i++)
+  {
+    double phi = 2.0 * PI * i / AZIMUTH_TABLE_SIZE;
+    azimuth_cos[i] = cos(phi);
+    azimuth_sin[i] = sin(phi);
+  }
+}
+
+/* ************************************************************************** */
+/** init_directions
+ *
+ *  @brief Tabulate the angles used by the table sampler, if they have not
+ *  been already.
+ *
+ *  @details
+ *
+ *  The table does not depend on the parameters, so it is shared by every
+ *  simulation and only tabulated once, however many threads call this.
+ *
+ * ************************************************************************** */
+
+void
+init_directions(void)
+{
+  pthread_once(&azimuths_tabulated, tabulate_azimuths);
+}
+
+/* ************************************************************************** */
+/** direction_sampler_name
+ *
+ *  @brief The input value of a direction sampler.
+ *
+ *  @param[in] sampler  The sampler, e.g. DIRECTION_TRIG.
+ *
+ *  @return The name of the sampler.
+ *
+ * ************************************************************************** */
+
+const char *
+direction_sampler_name(int sampler)
+{
+  if(sampler < 0 || sampler >= N_DIRECTION_SAMPLERS)
+    return "unknown";
+
+  return sampler_names[sampler];
+}
+
+/* ************************************************************************** */
+/** table_azimuth
+ *
+ *  @brief The sine and cosine of phi = 2 pi u, from the table of angles.
+ *
+ *  @param[in] u         A random number in (0, 1).
+ *  @param[out] *cosphi  The cosine of phi.
+ *  @param[out] *sinphi  The sine of phi.
+ *
+ *  @details
+ *
+ *  phi is split into the tabulated angle below it and a remainder d, which is
+ *  less than 2 pi / AZIMUTH_TABLE_SIZE. The sine and cosine of d are found
+ *  from their Taylor series, which are accurate to double precision by the
+ *  d^7 and d^8 terms, and combined with those of the table with the angle
+ *  addition formulae.
+ *
+ * ************************************************************************** */
+
+static inline void
+table_azimuth(double u, double *cosphi, double *sinphi)
+{
+  double x = u * AZIMUTH_TABLE_SIZE;
+  int i = (int) x;
+  double d = (x - i) * (2.0 * PI / AZIMUTH_TABLE_SIZE);
+  double d2 = d * d;
+
+  double sin_d = d * (1.0 - d2 / 6.0 * (1.0 - d2 / 20.0 * (1.0 - d2 / 42.0)));
+  double cos_d = 1.0 - d2 / 2.0 * (1.0 - d2 / 12.0 * (1.0 - d2 / 30.0 * (1.0 - d2 / 56.0)));
+
+  *cosphi = azimuth_cos[i] * cos_d - azimuth_sin[i] * sin_d;
+  *sinphi = azimuth_sin[i] * cos_d + azimuth_cos[i] * sin_d;
+}
+
+/* ************************************************************************** */
+/** random_unit_disc
+ *
+ *  @brief Pick a point uniformly from within the unit disc, by rejection.
+ *
+ *  @param[in, out] *rng  The photon's random number stream.
+ *  @param[out] *x1       The x coordinate of the point.
+ *  @param[out] *x2       The y coordinate of the point.
+ *
+ *  @return The squared distance of the point from the centre, in (0, 1).
+ *
+ * ************************************************************************** */
+
+static inline double
+random_unit_disc(RNGStream_t *rng, double *x1, double *x2)
+{
+  double s;
+
+  do
+  {
+    *x1 = 2.0 * random_number(rng, 0, 1) - 1.0;
+    *x2 = 2.0 * random_number(rng, 0, 1) - 1.0;
+    s = *x1 * *x1 + *x2 * *x2;
+  } while(s >= 1.0 || s == 0.0);
+
+  return s;
+}
+
+/* ************************************************************************** */
+/** sample_azimuth
+ *
+ *  @brief Sample an isotropic phi direction.
+ *
+ *  @param[in] sampler    The sampler to use, e.g. DIRECTION_TRIG.
+ *  @param[in, out] *rng  The photon's random number stream.
+ *  @param[out] *cosphi   The cosine of phi.
+ *  @param[out] *sinphi   The sine of phi.
+ *
+ *  @details
+ *
+ *  The rejection sampler normalises a point in the unit disc, the others
+ *  take phi = 2 pi u.
+ *
+ * ************************************************************************** */
+
+void
+sample_azimuth(int sampler, RNGStream_t *rng, double *cosphi, double *sinphi)
+{
+  switch(sampler)
+  {
+    case DIRECTION_REJECTION:
+    {
+      double x1, x2;
+      double r = 1.0 / sqrt(random_unit_disc(rng, &x1, &x2));
+      *cosphi = x1 * r;
+      *sinphi = x2 * r;
+      break;
+    }
+    case DIRECTION_TABLE:
+      table_azimuth(random_number(rng, 0, 1), cosphi, sinphi);
+      break;
+    default:
+    {
+      double phi = 2 * PI * random_number(rng, 0, 1);
+      *cosphi = cos(phi);
+      *sinphi = sin(phi);
+      break;
+    }
+  }
+}
+
+/* ************************************************************************** */
+/** sample_direction
+ *
+ *  @brief Sample an isotropic direction.
+ *
+ *  @param[in] sampler     The sampler to use, e.g. DIRECTION_TRIG.
+ *  @param[in, out] *rng   The photon's random number stream.
+ *  @param[out] *costheta  The cosine of theta.
+ *  @param[out] *sintheta  The sine of theta.
+ *  @param[out] *cosphi    The cosine of phi.
+ *  @param[out] *sinphi    The sine of phi.
+ *
+ *  @details
+ *
+ *  For the rejection sampler, a point (x1, x2) in the unit disc with
+ *  s = x1^2 + x2^2 gives costheta = 1 - 2s, which is uniform in [-1, 1] as s
+ *  is uniform in [0, 1], and a phi independent of it with
+ *  cosphi = x1 / sqrt(s).
+ *
+ * ************************************************************************** */
+
+void
+sample_direction(int sampler, RNGStream_t *rng, double *costheta, double *sintheta, double *cosphi, double *sinphi)
+{
+  switch(sampler)
+  {
+    case DIRECTION_SQRT:
+    case DIRECTION_TABLE:
+    {
+      double mu = 2.0 * random_number(rng, 0, 1) - 1.0;
+      *costheta = mu;
+      *sintheta = sqrt(1.0 - mu * mu);
+      sample_azimuth(sampler, rng, cosphi, sinphi);
+      break;
+    }
+    case DIRECTION_REJECTION:
+    {
+      double x1, x2;
+      double s = random_unit_disc(rng, &x1, &x2);
+      double r = 1.0 / sqrt(s);
+      *costheta = 1.0 - 2.0 * s;
+      *sintheta = 2.0 * sqrt(s * (1.0 - s));
+      *cosphi = x1 * r;
+      *sinphi = x2 * r;
+      break;
+    }
+    default:
+    {
+      double theta, phi;
+      random_theta_phi(rng, &theta, &phi);
+      *cosphi = cos(phi);
+      *sinphi = sin(phi);
+      *costheta = cos(theta);
+      *sintheta = sin(theta);
+      break;
+    }
+  }
+}
+
+/* ************************************************************************** */
+/** isotropic_emit_photon
+ *
+ *  @brief Emit a photon at the origin of the plane isotropically.
+ *
+ *  @param[in,out] *packet  A pointer to the current MC photon packet.
+ *  @param[in,out] *rng     The photon's random number stream.
+ *
+ *  @details
+ *
+ *  Places a photon at the origin of the semi-infinte slab pointing in a
+ *  randomly chosen direction. Various counters and indicator flags are set
+ *  to show that the photon is newly emitted.
+ *
+ *  The trig sampler draws, and discards, a theta direction first, so that
+ *  the results of earlier versions are reproduced.
+ *
+ * ************************************************************************** */
+
+void
+isotropic_emit_photon(PhotonPacket_t *packet, RNGStream_t *rng)
+{
+  if(DIRECTION_SAMPLER == DIRECTION_TRIG)
+    random_number(rng, 0, 1);
+
+  sample_azimuth(DIRECTION_SAMPLER, rng, &packet->cosphi, &packet->sinphi);
+  packet->x = 0.0;
+  packet->y = 0.0;
+  packet->z = 0.0;
+  packet->costheta = sqrt(random_number(rng, 0, 1));
+  packet->sintheta = sqrt(1 - packet->costheta * packet->costheta);
+  packet->absorb = false;
+  packet->escaped = false;
+}
+
+/* ************************************************************************** */
+/** isotropic_scatter_photon
+ *
+ *  @brief Points the photon packet in a new isotropic direction.
+ *
+ *  @param[in, out] packet  A pointer to the current photon
+ *  @param[in, out] rng     The photon's random number stream.
+ *
+ *  @details
+ *
+ *  Points a photon packet in a new direction after an isotropic scattering
+ *  event, sampled with DIRECTION_SAMPLER.
+ *
+ * ************************************************************************** */
+
+void
+isotropic_scatter_photon(PhotonPacket_t *packet, RNGStream_t *rng)
+{
+  sample_direction(DIRECTION_SAMPLER, rng, &packet->costheta, &packet->sintheta, &packet->cosphi, &packet->sinphi);
+}
+
+/* ************************************************************************** */
+/** chi2_p_value
+ *
+ *  @brief The probability of a chi squared at least as large as that found.
+ *
+ *  @param[in] chi2  The chi squared.
+ *  @param[in] dof   The number of degrees of freedom.
+ *
+ *  @return The p-value, Q(dof / 2, chi2 / 2).
+ *
+ *  @details
+ *
+ *  The regularised upper incomplete gamma function Q(a, x) is found from its
+ *  series below x = a + 1, and from its continued fraction above.
+ *
+ * ************************************************************************** */
+
+static double
+chi2_p_value(double chi2, int dof)
+{
+  double a = 0.5 * dof;
+  double x = 0.5 * chi2;
+
+  if(x <= 0)
+    return 1.0;
+
+  double prefactor = exp(a * log(x) - x - lgamma(a));
+
+  if(x < a + 1)
+  {
+    double term = 1.0 / a;
+    double sum = term;
+    for(int n = 1; n < 1000 && fabs(term) > 1e-16 * fabs(sum); n++)
+    {
+      term *= x / (a + n);
+      sum += term;
+    }
+    return 1.0 - sum * prefactor;
+  }
+
+  double b = x + 1 - a;
+  double c = 1e300;
+  double d = 1 / b;
+  double h = d;
+  for(int n = 1; n < 1000; n++)
+  {
+    double an = -n * (n - a);
+    b += 2;
+    d = an * d + b;
+    c = b + an / c;
+    d = 1 / d;
+    double delta = d * c;
+    h *= delta;
+    if(fabs(delta - 1) < 1e-16)
+      break;
+  }
+
+  return prefactor * h;
+}
+
+/* ************************************************************************** */
+/** ks_p_value
+ *
+ *  @brief The probability of a Kolmogorov-Smirnov statistic at least as large
+ *  as that found.
+ *
+ *  @param[in] d  The largest distance between the sample and expected
+ *                cumulative distributions.
+ *  @param[in] n  The number of samples.
+ *
+ *  @return The p-value, from the asymptotic Kolmogorov distribution.
+ *
+ * ************************************************************************** */
+
+static double
+ks_p_value(double d, long n)
+{
+  double sqrt_n = sqrt((double) n);
+  double lambda = (sqrt_n + 0.12 + 0.11 / sqrt_n) * d;
+  double sum = 0;
+
+  if(lambda < 0.2)
+    return 1.0;
+
+  for(int k = 1; k <= 100; k++)
+  {
+    double term = exp(-2.0 * k * k * lambda * lambda);
+    sum += (k % 2 ? 2.0 : -2.0) * term;
+    if(term < 1e-16)
+      break;
+  }
+
+  return sum < 0 ? 0 : sum > 1 ? 1 : sum;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* ************************************************************************** */
+/** ks_uniform_p_value
+ *
+ *  @brief The Kolmogorov-Smirnov test of a sample against a uniform
+ *  distribution on [0, 1].
+ *
+ *  @param[in, out] *x  The samples, which are sorted.
+ *  @param[in] n        The number of samples.
+ *
+ *  @return The p-value.
+ *
+ * ************************************************************************** */
+
+static double
+ks_uniform_p_value(double *x, long n)
+{
+  double d = 0;
+
+  qsort(x, n, sizeof *x, compare_doubles);
+  for(long i = 0; i < n; i++)
+  {
+    double below = x[i] - (double) i / n;
+    double above = (double) (i + 1) / n - x[i];
+    if(below > d)
+      d = below;
+    if(above > d)
+      d = above;
+  }
+
+  return ks_p_value(d, n);
+}
+
+/* ************************************************************************** */
+/** chi2_uniform_p_value
+ *
+ *  @brief The chi squared test of binned samples against a uniform
+ *  distribution.
+ *
+ *  @param[in] *counts  The number of samples in each bin.
+ *  @param[in] n_bins   The number of bins.
+ *  @param[in] n        The number of samples.
+ *
+ *  @return The p-value.
+ *
+ * ************************************************************************** */
+
+static double
+chi2_uniform_p_value(const long *counts, int n_bins, long n)
+{
+  double expected = (double) n / n_bins;
+  double chi2 = 0;
+
+  for(int i = 0; i < n_bins; i++)
+    chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+
+  return chi2_p_value(chi2, n_bins - 1);
+}
+
+/* ************************************************************************** */
+/** unit_mu, unit_phi and bin_unit
+ *
+ *  @brief Map costheta or phi onto [0, 1], where it is uniform if isotropic,
+ *  and find the bin of it.
+ *
+ * ************************************************************************** */
+
+static inline double
+unit_mu(double costheta)
+{
+  return 0.5 * (costheta + 1.0);
+}
+
+static inline double
+unit_phi(double cosphi, double sinphi)
+{
+  double phi = atan2(sinphi, cosphi) / (2.0 * PI);
+  return phi < 0 ? phi + 1.0 : phi;
+}
+
+static inline int
+bin_unit(double x, int n_bins)
+{
+  int i = (int) (x * n_bins);
+  return i < 0 ? 0 : i >= n_bins ? n_bins - 1 : i;
+}
+
+/* ************************************************************************** */
+/** check_direction_samplers
+ *
+ *  @brief Test that every direction sampler is isotropic.
+ *
+ *  @param[in] n_samples  The number of directions drawn from each sampler.
+ *  @param[in] seed       The seed of the random numbers.
+ *
+ *  @return The number of samplers which failed a test.
+ *
+ *  @details
+ *
+ *  For each sampler, costheta and phi should each be uniform and independent
+ *  of each other. They are tested with
+ *
+ *    - a chi squared test of costheta and of phi in CHI2_BINS bins,
+ *    - a chi squared test of the two together in CHI2_JOINT_BINS^2 bins,
+ *    - a Kolmogorov-Smirnov test of costheta and of phi,
+ *    - a chi squared and Kolmogorov-Smirnov test of the phi of emission,
+ *
+ *  and a sampler fails if any p-value is below MIN_P_VALUE, or if any sine
+ *  and cosine pair is not normalised to within 1e-12. The same seed is used
+ *  for every sampler, so the results are reproducible.
+ *
+ * ************************************************************************** */
+
+int
+check_direction_samplers(long n_samples, uint64_t seed)
+{
+  enum {MU_CHI2, PHI_CHI2, JOINT_CHI2, MU_KS, PHI_KS, EMIT_CHI2, EMIT_KS, N_TESTS};
+  const char *test_names[N_TESTS] = {"mu chi2", "phi chi2", "joint chi2", "mu KS", "phi KS", "emit chi2", "emit KS"};
+
+  int n_failed = 0;
+  double *mu = malloc(n_samples * sizeof *mu);
+  double *phi = malloc(n_samples * sizeof *phi);
+
+  if(mu == NULL || phi == NULL)
+  {
+    printf("Unable to allocate memory for %ld directions\n", n_samples);
+    exit(1);
+  }
+
+  init_directions();
+
+  printf("%-10s", "sampler");
+  for(int t = 0; t < N_TESTS; t++)
+    printf(" %11s", test_names[t]);
+  printf(" %11s %s\n", "norm error", "result");
+
+  for(int s = 0; s < N_DIRECTION_SAMPLERS; s++)
+  {
+    RNGStream_t rng;
+    double p[N_TESTS];
+    double norm_error = 0;
+    long counts_mu[CHI2_BINS] = {0};
+    long counts_phi[CHI2_BINS] = {0};
+    long counts_emit[CHI2_BINS] = {0};
+    long counts_joint[CHI2_JOINT_BINS * CHI2_JOINT_BINS] = {0};
+
+    init_rng_stream(&rng, seed, 0);
+    for(long i = 0; i < n_samples; i++)
+    {
+      double costheta, sintheta, cosphi, sinphi;
+      sample_direction(s, &rng, &costheta, &sintheta, &cosphi, &sinphi);
+      mu[i] = unit_mu(costheta);
+      phi[i] = unit_phi(cosphi, sinphi);
+      counts_mu[bin_unit(mu[i], CHI2_BINS)]++;
+      counts_phi[bin_unit(phi[i], CHI2_BINS)]++;
+      counts_joint[bin_unit(mu[i], CHI2_JOINT_BINS) * CHI2_JOINT_BINS + bin_unit(phi[i], CHI2_JOINT_BINS)]++;
+      norm_error = fmax(norm_error, fabs(costheta * costheta + sintheta * sintheta - 1.0));
+      norm_error = fmax(norm_error, fabs(cosphi * cosphi + sinphi * sinphi - 1.0));
+      if(sintheta < 0)
+        norm_error = 1;
+    }
+
+    p[MU_CHI2] = chi2_uniform_p_value(counts_mu, CHI2_BINS, n_samples);
+    p[PHI_CHI2] = chi2_uniform_p_value(counts_phi, CHI2_BINS, n_samples);
+    p[JOINT_CHI2] = chi2_uniform_p_value(counts_joint, CHI2_JOINT_BINS * CHI2_JOINT_BINS, n_samples);
+    p[MU_KS] = ks_uniform_p_value(mu, n_samples);
+    p[PHI_KS] = ks_uniform_p_value(phi, n_samples);
+
+    init_rng_stream(&rng, seed, 1);
+    for(long i = 0; i < n_samples; i++)
+    {
+      double cosphi, sinphi;
+      sample_azimuth(s, &rng, &cosphi, &sinphi);
+      phi[i] = unit_phi(cosphi, sinphi);
+      counts_emit[bin_unit(phi[i], CHI2_BINS)]++;
+      norm_error = fmax(norm_error, fabs(cosphi * cosphi + sinphi * sinphi - 1.0));
+    }
+
+    p[EMIT_CHI2] = chi2_uniform_p_value(counts_emit, CHI2_BINS, n_samples);
+    p[EMIT_KS] = ks_uniform_p_value(phi, n_samples);
+
+    bool passed = norm_error < 1e-12;
+    printf("%-10s", direction_sampler_name(s));
+    for(int t = 0; t < N_TESTS; t++)
+    {
+      printf(" %11.4f", p[t]);
+      if(p[t] < MIN_P_VALUE)
+        passed = false;
+    }
+    printf(" %11.2e %s\n", norm_error, passed ? "pass" : "FAIL");
+
+    if(!passed)
+      n_failed++;
+  }
+
+  free(mu);
+  free(phi);
+
+  return n_failed;
+}
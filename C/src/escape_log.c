@@ -0,0 +1,366 @@
+/* ************************************************************************** */
+/** @file escape_log.c
+ *
+ *  @brief Functions for logging every escaping photon to a file, so that the
+ *  escapes can be binned again afterwards with mcrt_rebin.
+ *
+ *  The log starts with a header of ESCAPE_HEADER_SIZE bytes: the magic string
+ *  ESCAPE_MAGIC, the version ESCAPE_VERSION and the size of an event as 32 bit
+ *  integers, the number of events and the number of photons transported as
+ *  64 bit integers, then TAU_MAX and SCATTERING_ALBEDO as doubles. The rest of
+ *  the header is zero. It is followed by an array of EscapeEvent_t, so the
+ *  file can be memory mapped. Everything is little-endian. costheta is a
+ *  double, so that mcrt_rebin at the run's n_bins puts every event in the
+ *  same bin as the histogram, and the other fields are floats.
+ *
+ *  Each thread fills its own buffer of events, and a full buffer is handed to
+ *  a writer thread which writes it whilst the thread carries on with a new
+ *  buffer. Buffers are re-used once they have been written. A thread only
+ *  waits if the writer falls so far behind that every buffer is full. The
+ *  order of the events depends on the threads, so a log is not reproducible
+ *  byte for byte, only as a set of events.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#if defined (_OPENMP)
+#include <omp.h>
+#endif
+
+static FILE *log_file;
+static char log_path[LINE_LEN + 32];
+static uint64_t n_logged;
+
+static EscapeBuffer_t **thread_buffers;
+static int n_threads;
+static int n_buffers;
+static int max_buffers;
+static EscapeBuffer_t *free_buffers;
+static EscapeBuffer_t *full_buffers;
+static EscapeBuffer_t *last_full_buffer;
+
+static pthread_t writer_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t buffer_free = PTHREAD_COND_INITIALIZER;
+static int writer_stop;
+
+/* ************************************************************************** */
+/** write_log_header
+ *
+ *  @brief Write the header of the escape log.
+ *
+ *  @param[in] n_photons  The number of photons transported, or 0 whilst the
+ *                        simulation is running.
+ *
+ * ************************************************************************** */
+
+static void
+write_log_header(uint64_t n_photons)
+{
+  uint8_t padding[ESCAPE_HEADER_SIZE] = {0};
+  uint32_t version[2] = {ESCAPE_VERSION, sizeof(EscapeEvent_t)};
+  double parameters[2] = {TAU_MAX, SCATTERING_ALBEDO};
+  uint64_t counts[2] = {n_logged, n_photons};
+
+  rewind(log_file);
+  int ok = fwrite(ESCAPE_MAGIC, 1, sizeof ESCAPE_MAGIC, log_file) == sizeof ESCAPE_MAGIC &&
+           write_le(version, sizeof *version, 2, log_file) && write_le(counts, sizeof *counts, 2, log_file) &&
+           write_le(parameters, sizeof *parameters, 2, log_file);
+  long size = ftell(log_file);
+  ok = ok && fwrite(padding, 1, ESCAPE_HEADER_SIZE - size, log_file) == (size_t) (ESCAPE_HEADER_SIZE - size);
+
+  if(!ok)
+  {
+    printf("Unable to write escape log %s\n", log_path);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** write_log_events
+ *
+ *  @brief Write a buffer of events to the escape log.
+ *
+ *  @param[in] *buffer  The buffer of events.
+ *
+ *  @return 1 if every event was written, otherwise 0.
+ *
+ * ************************************************************************** */
+
+static int
+write_log_events(const EscapeBuffer_t *buffer)
+{
+  for(int i = 0; i < buffer->n_events; i++)
+  {
+    const EscapeEvent_t *event = &buffer->events[i];
+    if(!write_le(&event->costheta, sizeof event->costheta, 1, log_file) ||
+       !write_le(&event->phi, sizeof event->phi, ESCAPE_FLOATS, log_file))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* ************************************************************************** */
+/** escape_log_writer
+ *
+ *  @brief The main function of the writer thread.
+ *
+ *  @details
+ *
+ *  Writes full buffers in the order they were handed over, until it is told
+ *  to stop and there are none left.
+ *
+ * ************************************************************************** */
+
+static void *
+escape_log_writer(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&log_lock);
+  while(true)
+  {
+    while(full_buffers == NULL && !writer_stop)
+      pthread_cond_wait(&buffer_full, &log_lock);
+    if(full_buffers == NULL)
+      break;
+
+    EscapeBuffer_t *buffer = full_buffers;
+    full_buffers = buffer->next;
+    if(full_buffers == NULL)
+      last_full_buffer = NULL;
+    pthread_mutex_unlock(&log_lock);
+
+    if(!write_log_events(buffer))
+    {
+      printf("Unable to write escape log %s\n", log_path);
+      exit(1);
+    }
+    n_logged += buffer->n_events;
+    buffer->n_events = 0;
+
+    pthread_mutex_lock(&log_lock);
+    buffer->next = free_buffers;
+    free_buffers = buffer;
+    pthread_cond_signal(&buffer_free);
+  }
+  pthread_mutex_unlock(&log_lock);
+
+  return NULL;
+}
+
+/* ************************************************************************** */
+/** swap_buffer
+ *
+ *  @brief Hand a buffer to the writer thread and get an empty one.
+ *
+ *  @param[in] *buffer  The buffer to write, or NULL.
+ *
+ *  @return An empty buffer.
+ *
+ *  @details
+ *
+ *  A new buffer is allocated if none are free, up to a limit, after which the
+ *  thread waits for the writer to free one.
+ *
+ * ************************************************************************** */
+
+static EscapeBuffer_t *
+swap_buffer(EscapeBuffer_t *buffer)
+{
+  EscapeBuffer_t *empty = NULL;
+
+  pthread_mutex_lock(&log_lock);
+
+  if(buffer != NULL)
+  {
+    buffer->next = NULL;
+    if(last_full_buffer == NULL)
+      full_buffers = buffer;
+    else
+      last_full_buffer->next = buffer;
+    last_full_buffer = buffer;
+    pthread_cond_signal(&buffer_full);
+  }
+
+  while(free_buffers == NULL && n_buffers >= max_buffers)
+    pthread_cond_wait(&buffer_free, &log_lock);
+
+  if(free_buffers != NULL)
+  {
+    empty = free_buffers;
+    free_buffers = empty->next;
+  }
+  else
+  {
+    empty = malloc(sizeof *empty);
+    if(empty == NULL)
+    {
+      printf("Unable to allocate memory for the escape log\n");
+      exit(1);
+    }
+    empty->n_events = 0;
+    n_buffers++;
+  }
+
+  pthread_mutex_unlock(&log_lock);
+
+  return empty;
+}
+
+/* ************************************************************************** */
+/** start_escape_log
+ *
+ *  @brief Open the escape log and start the writer thread.
+ *
+ *  @details
+ *
+ *  The log is written to OUTPUT_FILE_ESCAPES in OUTPUT_DIR. When the points of
+ *  a parameter sweep share the output files, the point is added to the name,
+ *  and with MPI each rank writes its own log with the rank added to the name.
+ *
+ * ************************************************************************** */
+
+void
+start_escape_log(void)
+{
+  char dir_path[LINE_LEN];
+
+  if(!ESCAPE_LOG)
+    return;
+
+  make_output_dirs();
+  output_set_path(dir_path, 0, OUTPUT_FILE_ESCAPES);
+  if(OUTPUT_POINT >= 0)
+    snprintf(log_path, sizeof log_path, "%s.%d", dir_path, OUTPUT_POINT);
+  else
+    snprintf(log_path, sizeof log_path, "%s", dir_path);
+  if(N_RANKS > 1)
+    snprintf(log_path + strlen(log_path), sizeof log_path - strlen(log_path), ".%d", RANK);
+
+  if((log_file = fopen(log_path, "wb")) == NULL)
+  {
+    printf("Unable to open escape log %s\n", log_path);
+    exit(1);
+  }
+
+  n_logged = 0;
+  write_log_header(0);
+
+#if defined(_OPENMP)
+  n_threads = omp_get_max_threads();
+#else
+  n_threads = 1;
+#endif
+
+  n_buffers = 0;
+  max_buffers = 4 * n_threads;
+  free_buffers = full_buffers = last_full_buffer = NULL;
+  writer_stop = false;
+
+  thread_buffers = malloc(n_threads * sizeof *thread_buffers);
+  for(int i = 0; i < n_threads; i++)
+    thread_buffers[i] = swap_buffer(NULL);
+
+  if(pthread_create(&writer_thread, NULL, escape_log_writer, NULL))
+  {
+    printf("Unable to start the escape log writer\n");
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** log_escape
+ *
+ *  @brief Add an escaping photon to the buffer of the calling thread.
+ *
+ *  @param[in] *packet  The photon, which has just left the top of the slab.
+ *
+ *  @details
+ *
+ *  The photon is moved back along its direction to where it crossed the top
+ *  of the slab, so x and y are the position it escaped from in units of the
+ *  thickness of the slab.
+ *
+ * ************************************************************************** */
+
+void
+log_escape(const PhotonPacket_t *packet)
+{
+#if defined(_OPENMP)
+  int thread = omp_get_thread_num();
+#else
+  int thread = 0;
+#endif
+
+  EscapeBuffer_t *buffer = thread_buffers[thread];
+  double back = (packet->z - 1.0) / packet->costheta;
+  EscapeEvent_t *event = &buffer->events[buffer->n_events++];
+
+  event->costheta = packet->costheta;
+  event->phi = (float) atan2(packet->sinphi, packet->cosphi);
+  event->x = (float) (packet->x - back * packet->sintheta * packet->cosphi);
+  event->y = (float) (packet->y - back * packet->sintheta * packet->sinphi);
+  event->weight = (float) packet->weight;
+
+  if(buffer->n_events == ESCAPE_BUFFER_EVENTS)
+    thread_buffers[thread] = swap_buffer(buffer);
+}
+
+/* ************************************************************************** */
+/** stop_escape_log
+ *
+ *  @brief Write the events left in the buffers and close the escape log.
+ *
+ *  @param[in] n_photons  The number of photons transported by this rank.
+ *
+ * ************************************************************************** */
+
+void
+stop_escape_log(long n_photons)
+{
+  if(!ESCAPE_LOG)
+    return;
+
+  pthread_mutex_lock(&log_lock);
+  for(int i = 0; i < n_threads; i++)
+  {
+    EscapeBuffer_t *buffer = thread_buffers[i];
+    buffer->next = NULL;
+    if(last_full_buffer == NULL)
+      full_buffers = buffer;
+    else
+      last_full_buffer->next = buffer;
+    last_full_buffer = buffer;
+  }
+  writer_stop = true;
+  pthread_cond_signal(&buffer_full);
+  pthread_mutex_unlock(&log_lock);
+  pthread_join(writer_thread, NULL);
+
+  write_log_header((uint64_t) n_photons);
+  if(fclose(log_file))
+  {
+    printf("Unable to write escape log %s\n", log_path);
+    exit(1);
+  }
+
+  while(free_buffers != NULL)
+  {
+    EscapeBuffer_t *next = free_buffers->next;
+    free(free_buffers);
+    free_buffers = next;
+  }
+  free(thread_buffers);
+}
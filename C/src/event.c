@@ -0,0 +1,516 @@
+/* ************************************************************************** */
+/** @file event.c
+ *
+ *  @brief Contains the event based transport engine.
+ *
+ *  Rather than following one photon history at a time, many photons are held
+ *  in a structure of arrays and advanced together one stage at a time: sample
+ *  a path length, move, tally and then interact. The sample and move stages
+ *  are simple loops over contiguous arrays without branches, so they can be
+ *  vectorised by the compiler. Photons which have finished are replaced by a
+ *  new photon in the same lane, or compacted away once the batch runs dry.
+ *
+ *  Each photon uses its own random number stream and draws its random numbers
+ *  in the same order as in transport_single_photon. Optical depths, and new
+ *  directions for the trig and sqrt samplers, are computed from these with the
+ *  batched kernels in sampling.c, whose polynomial log and sincos differ from
+ *  the C library by about an ulp. A history therefore only follows the same
+ *  path as in the history engine until a rounding difference changes which
+ *  side of a level or boundary a photon lands on, and the two engines agree
+ *  statistically rather than photon for photon. transport_engine.validate
+ *  checks this, see validate.c.
+ *
+ * ************************************************************************** */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdbool.h>
+
+#include "variables.h"
+#include "functions.h"
+
+/* ************************************************************************** */
+/** init_photon_batch
+ *
+ *  @brief Allocate the arrays for a PhotonBatch_t struct.
+ *
+ *  @param[in, out] *batch  An uninitialised PhotonBatch_t struct.
+ *  @param[in] capacity     The number of lanes.
+ *
+ *  @details
+ *
+ *  The double arrays are placed in a single cache line aligned block, with
+ *  each array starting on a new cache line.
+ *
+ * ************************************************************************** */
+
+void
+init_photon_batch(PhotonBatch_t *batch, int capacity)
+{
+  size_t per_line = CACHE_LINE / sizeof(double);
+  size_t len = (capacity + per_line - 1) / per_line * per_line;
+
+  batch->capacity = capacity;
+  batch->n_active = 0;
+  batch->data = aligned_calloc(16 * len, sizeof *batch->data);
+  batch->x = batch->data;
+  batch->y = batch->data + len;
+  batch->z = batch->data + 2 * len;
+  batch->costheta = batch->data + 3 * len;
+  batch->sintheta = batch->data + 4 * len;
+  batch->cosphi = batch->data + 5 * len;
+  batch->sinphi = batch->data + 6 * len;
+  batch->z_orig = batch->data + 7 * len;
+  batch->ds = batch->data + 8 * len;
+  batch->u = batch->data + 9 * len;
+  batch->v = batch->data + 10 * len;
+  batch->new_costheta = batch->data + 11 * len;
+  batch->new_sintheta = batch->data + 12 * len;
+  batch->new_cosphi = batch->data + 13 * len;
+  batch->new_sinphi = batch->data + 14 * len;
+  batch->weight = batch->data + 15 * len;
+  batch->status = aligned_calloc(capacity, sizeof *batch->status);
+  batch->scattered = aligned_calloc(capacity, sizeof *batch->scattered);
+  batch->rng = aligned_calloc(capacity, sizeof *batch->rng);
+}
+
+/* ************************************************************************** */
+/** free_photon_batch
+ *
+ *  @brief Free the arrays of a PhotonBatch_t struct.
+ *
+ *  @param[in, out] *batch  An initialised PhotonBatch_t struct.
+ *
+ * ************************************************************************** */
+
+void
+free_photon_batch(PhotonBatch_t *batch)
+{
+  aligned_free(batch->data);
+  aligned_free(batch->status);
+  aligned_free(batch->scattered);
+  aligned_free(batch->rng);
+  batch->capacity = 0;
+  batch->n_active = 0;
+}
+
+/* ************************************************************************** */
+/** load_lane
+ *
+ *  @brief Copy a photon packet into a lane of the batch.
+ *
+ *  @param[in, out] *batch   An initialised PhotonBatch_t struct.
+ *  @param[in] lane          The lane to write to.
+ *  @param[in] *packet       The photon packet to copy.
+ *
+ *  @details
+ *
+ *  The weight of the lane is left alone, as a photon re-emitted from the
+ *  bottom of the slab keeps its weight.
+ *
+ * ************************************************************************** */
+
+static void
+load_lane(PhotonBatch_t *batch, int lane, PhotonPacket_t *packet)
+{
+  batch->x[lane] = packet->x;
+  batch->y[lane] = packet->y;
+  batch->z[lane] = packet->z;
+  batch->costheta[lane] = packet->costheta;
+  batch->sintheta[lane] = packet->sintheta;
+  batch->cosphi[lane] = packet->cosphi;
+  batch->sinphi[lane] = packet->sinphi;
+  batch->status[lane] = PHOTON_ACTIVE;
+}
+
+/* ************************************************************************** */
+/** log_lane_escape
+ *
+ *  @brief Add the photon escaping from a lane to the escape log.
+ *
+ *  @param[in] *batch   An initialised PhotonBatch_t struct.
+ *  @param[in] lane     The lane of the escaping photon.
+ *
+ * ************************************************************************** */
+
+static void
+log_lane_escape(PhotonBatch_t *batch, int lane)
+{
+  PhotonPacket_t packet = PHOTON_INIT;
+
+  packet.x = batch->x[lane];
+  packet.y = batch->y[lane];
+  packet.z = batch->z[lane];
+  packet.costheta = batch->costheta[lane];
+  packet.sintheta = batch->sintheta[lane];
+  packet.cosphi = batch->cosphi[lane];
+  packet.sinphi = batch->sinphi[lane];
+  packet.weight = batch->weight[lane];
+  log_escape(&packet);
+}
+
+/* ************************************************************************** */
+/** emit_photon_into_lane
+ *
+ *  @brief Emit a new photon from the bottom of the slab into a lane.
+ *
+ *  @param[in, out] *batch   An initialised PhotonBatch_t struct.
+ *  @param[in] lane          The lane to emit the photon into.
+ *
+ *  @details
+ *
+ *  The lane's random number stream must already be initialised. The emission
+ *  is done through isotropic_emit_photon so the random numbers are consumed in
+ *  the same way as for the history based engine.
+ *
+ * ************************************************************************** */
+
+static void
+emit_photon_into_lane(PhotonBatch_t *batch, int lane)
+{
+  PhotonPacket_t packet = PHOTON_INIT;
+  isotropic_emit_photon(&packet, &batch->rng[lane]);
+  load_lane(batch, lane, &packet);
+}
+
+/* ************************************************************************** */
+/** start_photon_in_lane
+ *
+ *  @brief Start transporting photon number i in a lane.
+ *
+ *  @param[in, out] *batch   An initialised PhotonBatch_t struct.
+ *  @param[in, out] *hist    The histogram to peel the emitted photon off into.
+ *  @param[in] lane          The lane to start the photon in.
+ *  @param[in] i             The photon number, i.e. its random number stream.
+ *
+ * ************************************************************************** */
+
+static void
+start_photon_in_lane(PhotonBatch_t *batch, Histogram_t *hist, int lane, long i)
+{
+  init_rng_stream(&batch->rng[lane], (uint64_t) SEED, (uint64_t) i);
+  batch->weight[lane] = 1.0;
+  emit_photon_into_lane(batch, lane);
+  peel_off_to_histogram(hist, batch->z[lane], batch->weight[lane], true);
+}
+
+/* ************************************************************************** */
+/** copy_lane
+ *
+ *  @brief Copy the photon in one lane to another lane.
+ *
+ *  @param[in, out] *batch   An initialised PhotonBatch_t struct.
+ *  @param[in] dst           The lane to copy to.
+ *  @param[in] src           The lane to copy from.
+ *
+ * ************************************************************************** */
+
+static void
+copy_lane(PhotonBatch_t *batch, int dst, int src)
+{
+  batch->x[dst] = batch->x[src];
+  batch->y[dst] = batch->y[src];
+  batch->z[dst] = batch->z[src];
+  batch->costheta[dst] = batch->costheta[src];
+  batch->sintheta[dst] = batch->sintheta[src];
+  batch->cosphi[dst] = batch->cosphi[src];
+  batch->sinphi[dst] = batch->sinphi[src];
+  batch->weight[dst] = batch->weight[src];
+  batch->status[dst] = batch->status[src];
+  batch->rng[dst] = batch->rng[src];
+}
+
+/* ************************************************************************** */
+/** sample_path_stage
+ *
+ *  @brief Sample the distance each active photon will travel.
+ *
+ *  @param[in, out] *batch  An initialised PhotonBatch_t struct.
+ *
+ *  @details
+ *
+ *  One random number is gathered from each photon's stream, and these are
+ *  then converted into distances all at once.
+ *
+ * ************************************************************************** */
+
+static void
+sample_path_stage(PhotonBatch_t *batch)
+{
+  gather_random_numbers(batch->n_active, batch->rng, batch->u);
+  sample_optical_depths(batch->n_active, batch->u, 1.0 / TAU_MAX, batch->ds);
+}
+
+/* ************************************************************************** */
+/** move_stage
+ *
+ *  @brief Move every active photon by its sampled distance.
+ *
+ *  @param[in, out] *batch  An initialised PhotonBatch_t struct.
+ *
+ *  @details
+ *
+ *  This is the same spherical step as move_photon, written over the arrays so
+ *  the loop can be vectorised.
+ *
+ * ************************************************************************** */
+
+static void
+move_stage(PhotonBatch_t *batch)
+{
+  double *restrict x = batch->x;
+  double *restrict y = batch->y;
+  double *restrict z = batch->z;
+  double *restrict z_orig = batch->z_orig;
+  const double *restrict ds = batch->ds;
+  const double *restrict costheta = batch->costheta;
+  const double *restrict sintheta = batch->sintheta;
+  const double *restrict cosphi = batch->cosphi;
+  const double *restrict sinphi = batch->sinphi;
+
+#pragma omp simd
+  for(int i = 0; i < batch->n_active; i++)
+  {
+    z_orig[i] = z[i];
+    x[i] += ds[i] * sintheta[i] * cosphi[i];
+    y[i] += ds[i] * sintheta[i] * sinphi[i];
+    z[i] += ds[i] * costheta[i];
+  }
+}
+
+/* ************************************************************************** */
+/** tally_stage
+ *
+ *  @brief Update the radiation moment estimators for every active photon.
+ *
+ *  @param[in, out] *batch    An initialised PhotonBatch_t struct.
+ *  @param[in, out] *moments  The moments to update.
+ *
+ * ************************************************************************** */
+
+static void
+tally_stage(PhotonBatch_t *batch, Moments_t *moments)
+{
+  for(int i = 0; i < batch->n_active; i++)
+    increment_radiation_moment_estimators(moments, batch->z_orig[i], batch->z[i], batch->costheta[i],
+                                          batch->weight[i]);
+}
+
+/* ************************************************************************** */
+/** vectorised_sampler
+ *
+ *  @brief Whether the scatter directions of DIRECTION_SAMPLER can be found
+ *         with sample_isotropic_directions.
+ *
+ *  @return true for the trig and sqrt samplers, which take costheta from one
+ *          random number and phi from the next.
+ *
+ * ************************************************************************** */
+
+static int
+vectorised_sampler(void)
+{
+  return DIRECTION_SAMPLER == DIRECTION_TRIG || DIRECTION_SAMPLER == DIRECTION_SQRT;
+}
+
+/* ************************************************************************** */
+/** queue_scatter
+ *
+ *  @brief Add a lane to the lanes which scatter in this interact stage.
+ *
+ *  @param[in, out] *batch  An initialised PhotonBatch_t struct.
+ *  @param[in] i            The lane which scatters.
+ *  @param[in] j            The number of lanes queued before it.
+ *
+ *  @details
+ *
+ *  For a vectorised_sampler, the two random numbers of the new direction are
+ *  drawn and the direction is found later for every queued lane at once.
+ *  Otherwise the direction is sampled now with DIRECTION_SAMPLER, as in the
+ *  history engine.
+ *
+ * ************************************************************************** */
+
+static void
+queue_scatter(PhotonBatch_t *batch, int i, int j)
+{
+  batch->scattered[j] = i;
+
+  if(vectorised_sampler())
+  {
+    batch->u[j] = random_number(&batch->rng[i], 0, 1);
+    batch->v[j] = random_number(&batch->rng[i], 0, 1);
+  }
+  else
+  {
+    sample_direction(DIRECTION_SAMPLER, &batch->rng[i], &batch->new_costheta[j], &batch->new_sintheta[j],
+                     &batch->new_cosphi[j], &batch->new_sinphi[j]);
+  }
+}
+
+/* ************************************************************************** */
+/** interact_stage
+ *
+ *  @brief Decide whether each active photon escapes, scatters or is absorbed.
+ *
+ *  @param[in, out] *batch  An initialised PhotonBatch_t struct.
+ *  @param[in, out] *hist   The histogram to bin escaping photons into.
+ *
+ *  @details
+ *
+ *  Follows the same logic as the body of the loop in transport_single_photon,
+ *  including re-emitting photons which have left through the bottom of the
+ *  slab. The lanes which scatter are collected by queue_scatter first, so
+ *  that all of the new directions can be computed at once.
+ *
+ * ************************************************************************** */
+
+static void
+interact_stage(PhotonBatch_t *batch, Histogram_t *hist)
+{
+  int n_scattered = 0;
+
+  for(int i = 0; i < batch->n_active; i++)
+  {
+    if(batch->z[i] < 0.0)
+    {
+      emit_photon_into_lane(batch, i);
+      METRIC_ADD(COUNTER_REEMISSIONS, 1);
+    }
+    if(batch->z[i] > 1.0)
+    {
+      batch->status[i] = PHOTON_ESCAPED;
+      bin_photon_to_histogram(hist, batch->costheta[i], batch->weight[i]);
+      METRIC_ADD(COUNTER_ESCAPES, 1);
+      if(ESCAPE_LOG)
+        log_lane_escape(batch, i);
+    }
+    else if(IMPLICIT_CAPTURE)
+    {
+      batch->weight[i] *= SCATTERING_ALBEDO;
+      if(russian_roulette(&batch->weight[i], &batch->rng[i]))
+      {
+        queue_scatter(batch, i, n_scattered++);
+      }
+      else
+      {
+        batch->status[i] = PHOTON_ABSORBED;
+        METRIC_ADD(COUNTER_ABSORPTIONS, 1);
+      }
+    }
+    else if(random_number(&batch->rng[i], 0, 1) < SCATTERING_ALBEDO)
+    {
+      queue_scatter(batch, i, n_scattered++);
+    }
+    else
+    {
+      batch->status[i] = PHOTON_ABSORBED;
+      METRIC_ADD(COUNTER_ABSORPTIONS, 1);
+    }
+  }
+
+  METRIC_ADD(COUNTER_SCATTERS, n_scattered);
+  if(vectorised_sampler())
+    sample_isotropic_directions(n_scattered, batch->u, batch->v, batch->new_costheta, batch->new_sintheta,
+                                batch->new_cosphi, batch->new_sinphi);
+
+  for(int j = 0; j < n_scattered; j++)
+  {
+    int i = batch->scattered[j];
+    batch->costheta[i] = batch->new_costheta[j];
+    batch->sintheta[i] = batch->new_sintheta[j];
+    batch->cosphi[i] = batch->new_cosphi[j];
+    batch->sinphi[i] = batch->new_sinphi[j];
+    peel_off_to_histogram(hist, batch->z[i], batch->weight[i], false);
+  }
+}
+
+/* ************************************************************************** */
+/** compact_stage
+ *
+ *  @brief Replace or remove the photons which have finished.
+ *
+ *  @param[in, out] *batch  An initialised PhotonBatch_t struct.
+ *  @param[in, out] *hist   The histogram to peel new photons off into.
+ *  @param[in, out] *next   The next photon number to be started.
+ *  @param[in] last         One past the last photon number in this batch.
+ *
+ *  @details
+ *
+ *  A finished photon is replaced by a new photon in the same lane whilst there
+ *  are photons left to start. Otherwise the last active lane is moved into its
+ *  place, so the active lanes remain contiguous.
+ *
+ * ************************************************************************** */
+
+static void
+compact_stage(PhotonBatch_t *batch, Histogram_t *hist, long *next, long last)
+{
+  int i = 0;
+
+  while(i < batch->n_active)
+  {
+    if(batch->status[i] == PHOTON_ACTIVE)
+    {
+      i++;
+      continue;
+    }
+
+    if(*next < last)
+    {
+      start_photon_in_lane(batch, hist, i, (*next)++);
+      i++;
+    }
+    else
+    {
+      batch->n_active--;
+      if(i != batch->n_active)
+        copy_lane(batch, i, batch->n_active);
+    }
+  }
+}
+
+/* ************************************************************************** */
+/** transport_photon_batch
+ *
+ *  @brief Transport photons first to last - 1 with the event based engine.
+ *
+ *  @param[in, out] *tally  The tally to accumulate the photons into.
+ *  @param[in] first        The first photon number.
+ *  @param[in] last         One past the last photon number.
+ *
+ *  @details
+ *
+ *  Up to EVENT_LANES photons are started, then all of the photons in flight
+ *  are advanced a stage at a time until every photon has escaped or been
+ *  absorbed.
+ *
+ * ************************************************************************** */
+
+void
+transport_photon_batch(Tally_t *tally, long first, long last)
+{
+  PhotonBatch_t batch;
+  long next = first;
+  int capacity = last - first < EVENT_LANES ? (int) (last - first) : EVENT_LANES;
+
+  if(capacity < 1)
+    return;
+
+  init_photon_batch(&batch, capacity);
+
+  while(batch.n_active < batch.capacity)
+    start_photon_in_lane(&batch, tally->hist, batch.n_active++, next++);
+
+  while(batch.n_active > 0)
+  {
+    sample_path_stage(&batch);
+    move_stage(&batch);
+    tally_stage(&batch, tally->moments);
+    interact_stage(&batch, tally->hist);
+    compact_stage(&batch, tally->hist, &next, last);
+  }
+
+  free_photon_batch(&batch);
+}
@@ -0,0 +1,556 @@
+/* ************************************************************************** */
+/** @file fom.c
+ *
+ *  @brief The main function of mcrt_fom, which measures the accuracy and
+ *  efficiency of the simulation against the analytic solution for a
+ *  conservatively scattering semi-infinite atmosphere.
+ *
+ *  Usage: mcrt_fom [options]
+ *
+ *    --budgets list     the wall time of each simulation in seconds,
+ *                       default 1,4
+ *    --photons n        run one simulation of n photons instead, whose
+ *                       results only depend on the seed
+ *    --tau x            tau_max of the slab, default 20
+ *    --input file       an input file with the other parameters, such as the
+ *                       transport engine, the MRW or the peel-off estimator
+ *    --output file      where to write the results, default fom.json
+ *    --max-chi2 x       exit with 1 if the chi squared per bin of any
+ *                       estimator is above x, or if it has no bins with errors
+ *    --reference        print the table of the H-function and stop
+ *
+ *  For isotropic scattering with an albedo of 1, the emergent intensity of a
+ *  semi-infinite atmosphere with a constant flux is
+ *
+ *      I(mu) = sqrt(3) / 4 H(mu),
+ *
+ *  normalised as in convert_weight_to_intensity, where H is Chandrasekhar's
+ *  H-function. As the slab is finite, the simulated intensity differs from
+ *  this by a little, less as tau_max grows, which shows up as a chi squared
+ *  well above 1 once the errors are small enough.
+ *
+ *  Each simulation is stopped by time_limit. For each one, the chi squared
+ *  per bin and the RMS difference of the intensity from the reference are
+ *  reported, as well as the figure of merit of each bin, 1 / (r^2 T), where r
+ *  is the relative error of the bin and T the wall time. The figure of merit
+ *  does not depend on T for a given engine and estimator, so it can be used to
+ *  compare them.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#ifdef MPI_ON
+#include <mpi.h>
+#endif
+
+#include "variables.h"
+#include "functions.h"
+
+#define H_NODES 64
+#define BIN_NODES 8
+
+static double h_mu[H_NODES];
+static double h_weight[H_NODES];
+static double h_value[H_NODES];
+
+/* ************************************************************************** */
+/** gauss_legendre
+ *
+ *  @brief Find the nodes and weights of Gauss-Legendre quadrature on [a, b].
+ *
+ *  @param[in] n    The number of nodes.
+ *  @param[in] a    The lower limit.
+ *  @param[in] b    The upper limit.
+ *  @param[out] *x  The n nodes.
+ *  @param[out] *w  The n weights.
+ *
+ *  @details
+ *
+ *  The roots of the Legendre polynomial are found by Newton's method,
+ *  starting from the usual approximation.
+ *
+ * ************************************************************************** */
+
+static void
+gauss_legendre(int n, double a, double b, double *x, double *w)
+{
+  for(int i = 0; i < n; i++)
+  {
+    double z = cos(PI * (i + 0.75) / (n + 0.5));
+    double dp;
+
+    for(int iter = 0; iter < 100; iter++)
+    {
+      double p0 = 1.0, p1 = z;
+      for(int k = 2; k <= n; k++)
+      {
+        double p2 = ((2 * k - 1) * z * p1 - (k - 1) * p0) / k;
+        p0 = p1;
+        p1 = p2;
+      }
+      dp = n * (z * p1 - p0) / (z * z - 1);
+      double dz = p1 / dp;
+      z -= dz;
+      if(fabs(dz) < 1e-15)
+        break;
+    }
+
+    x[i] = 0.5 * (a + b) - 0.5 * (b - a) * z;
+    w[i] = (b - a) / ((1 - z * z) * dp * dp);
+  }
+}
+
+/* ************************************************************************** */
+/** h_function
+ *
+ *  @brief Evaluate the H-function for conservative isotropic scattering.
+ *
+ *  @param[in] mu  The cosine of the angle, between 0 and 1.
+ *
+ *  @return H(mu).
+ *
+ *  @details
+ *
+ *  Uses the integral equation 1 / H(mu) = 1/2 int mu' H(mu') / (mu + mu') dmu'
+ *  with the values of H at the quadrature nodes from init_h_function.
+ *
+ * ************************************************************************** */
+
+static double
+h_function(double mu)
+{
+  double sum = 0;
+
+  for(int j = 0; j < H_NODES; j++)
+    sum += h_weight[j] * h_mu[j] * h_value[j] / (mu + h_mu[j]);
+
+  return 1.0 / (0.5 * sum);
+}
+
+/* ************************************************************************** */
+/** init_h_function
+ *
+ *  @brief Solve for the H-function at the quadrature nodes.
+ *
+ *  @details
+ *
+ *  The integral equation is iterated from H = 1 until it converges, and the
+ *  result checked against the zeroth moment of H, which is 2 for
+ *  conservative scattering. Scaling H by c scales the right hand side by
+ *  1 / c, so plain iteration flips between two solutions, which is damped by
+ *  taking the geometric mean of each iterate and the last.
+ *
+ * ************************************************************************** */
+
+static void
+init_h_function(void)
+{
+  double next[H_NODES];
+
+  gauss_legendre(H_NODES, 0, 1, h_mu, h_weight);
+  for(int i = 0; i < H_NODES; i++)
+    h_value[i] = 1.0;
+
+  for(int iter = 0; iter < 10000; iter++)
+  {
+    double change = 0;
+    for(int i = 0; i < H_NODES; i++)
+      next[i] = sqrt(h_value[i] * h_function(h_mu[i]));
+    for(int i = 0; i < H_NODES; i++)
+    {
+      change = fmax(change, fabs(next[i] - h_value[i]));
+      h_value[i] = next[i];
+    }
+    if(change < 1e-13)
+      break;
+  }
+
+  double h0 = 0;
+  for(int i = 0; i < H_NODES; i++)
+    h0 += h_weight[i] * h_value[i];
+
+  if(fabs(h0 - 2.0) > 1e-4)
+  {
+    printf("The H-function did not converge, its zeroth moment is %f rather than 2\n", h0);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** reference_bin_intensity
+ *
+ *  @brief The reference intensity of a histogram bin.
+ *
+ *  @param[in] i       The index of the bin.
+ *  @param[in] n_bins  The number of bins.
+ *
+ *  @return The intensity the histogram would have in the bin with no noise.
+ *
+ *  @details
+ *
+ *  The histogram counts the flux, mu I(mu), over each bin and divides it by
+ *  the mu of the bin centre, so the reference is averaged in the same way.
+ *
+ * ************************************************************************** */
+
+static double
+reference_bin_intensity(int i, int n_bins)
+{
+  double x[BIN_NODES], w[BIN_NODES];
+  double mu_lower = (double) i / n_bins;
+  double mu_upper = (double) (i + 1) / n_bins;
+  double flux = 0;
+
+  gauss_legendre(BIN_NODES, mu_lower, mu_upper, x, w);
+  for(int j = 0; j < BIN_NODES; j++)
+    flux += w[j] * x[j] * sqrt(3.0) / 4.0 * h_function(x[j]);
+
+  return flux / ((mu_upper - mu_lower) * 0.5 * (mu_lower + mu_upper));
+}
+
+/* ************************************************************************** */
+/** write_estimator
+ *
+ *  @brief Compare the intensities of an estimator to the reference and write
+ *         them out.
+ *
+ *  @param[in] *f            The open results file.
+ *  @param[in] *label        The name of the estimator.
+ *  @param[in] n             The number of intensities.
+ *  @param[in] *mu           The cosine of the angle of each intensity.
+ *  @param[in] *intensity    The intensities.
+ *  @param[in] *error        The errors of the intensities.
+ *  @param[in] *reference    The reference intensities.
+ *  @param[in] seconds       The wall time of the simulation.
+ *
+ *  @details
+ *
+ *  The summary is printed as well as written. Intensities without an error,
+ *  which means fewer than two batches reached them, are left out of the
+ *  chi squared.
+ *
+ *  @return The chi squared per bin, or HUGE_VAL if no bin has an error.
+ *
+ * ************************************************************************** */
+
+static double
+write_estimator(FILE *f, const char *label, int n, const double *mu, const double *intensity, const double *error,
+                const double *reference, double seconds)
+{
+  double chi_sq = 0, sum_sq = 0, fom_sum = 0, fom_min = 1e300;
+  int n_used = 0;
+
+  fprintf(f, "      \"%s\": {\n        \"bins\": [\n", label);
+  for(int i = 0; i < n; i++)
+  {
+    double diff = intensity[i] - reference[i];
+    double fom = 0;
+
+    sum_sq += diff * diff;
+    if(error[i] > 0 && intensity[i] > 0)
+    {
+      double rel_error = error[i] / intensity[i];
+      fom = 1.0 / (rel_error * rel_error * seconds);
+      chi_sq += diff * diff / (error[i] * error[i]);
+      fom_sum += fom;
+      fom_min = fmin(fom_min, fom);
+      n_used++;
+    }
+
+    fprintf(f, "          {\"mu\": %.6f, \"intensity\": %.6e, \"error\": %.6e, \"reference\": %.6e, \"fom\": %.6e}%s\n",
+            mu[i], intensity[i], error[i], reference[i], fom, i < n - 1 ? "," : "");
+  }
+
+  double rms = sqrt(sum_sq / n);
+  chi_sq = n_used > 0 ? chi_sq / n_used : 0;
+  double fom_mean = n_used > 0 ? fom_sum / n_used : 0;
+  if(n_used == 0)
+    fom_min = 0;
+
+  fprintf(f, "        ],\n");
+  fprintf(f, "        \"chi_sq_per_bin\": %.6e,\n        \"rms\": %.6e,\n", chi_sq, rms);
+  fprintf(f, "        \"fom_mean\": %.6e,\n        \"fom_min\": %.6e\n      }", fom_mean, fom_min);
+
+  printf("%-10s chi^2/bin %10.4g  rms %10.4g  mean fom %10.4g  min fom %10.4g\n", label, chi_sq, rms, fom_mean,
+         fom_min);
+
+  return n_used > 0 ? chi_sq : HUGE_VAL;
+}
+
+/* ************************************************************************** */
+/** run_budget
+ *
+ *  @brief Run the simulation for a wall time budget and write out how close
+ *         it is to the reference.
+ *
+ *  @param[in] *f          The open results file, or NULL on ranks other than
+ *                         0.
+ *  @param[in] *input      An input file with the other parameters, or NULL.
+ *  @param[in] tau_max     The optical depth of the slab.
+ *  @param[in] budget      The wall time in seconds, or 0 to run n_photons.
+ *  @param[in] n_photons   The number of photons if budget is 0.
+ *  @param[in] max_chi_sq  The largest chi squared per bin of an estimator
+ *                         which passes, or 0 to pass any.
+ *  @param[in] last        true for the last budget, to end the JSON list.
+ *
+ *  @return false if an estimator is above max_chi_sq. Always true on ranks
+ *          other than 0.
+ *
+ * ************************************************************************** */
+
+static int
+run_budget(FILE *f, char *input, double tau_max, double budget, long n_photons, double max_chi_sq, int last)
+{
+  int passed = true;
+  double chi_sq;
+  ParameterTable_t table = {0, NULL};
+  char value[LINE_LEN];
+  Histogram_t hist;
+  Moments_t moments;
+
+  if(input != NULL)
+    read_parameter_table(input, &table);
+  if(find_parameter(&table, "seed") == NULL)
+    set_parameter(&table, "seed", "1");
+  if(find_parameter(&table, "hist.n_bins") == NULL)
+    set_parameter(&table, "hist.n_bins", "20");
+  if(find_parameter(&table, "moments.n_levels") == NULL)
+    set_parameter(&table, "moments.n_levels", "20");
+  if(find_parameter(&table, "batch_size") == NULL)
+    set_parameter(&table, "batch_size", "1000");
+
+  snprintf(value, sizeof value, "%ld", budget > 0 ? (long) 1e12 : n_photons);
+  set_parameter(&table, "n_photons", value);
+  set_parameter(&table, "output_frequency", "2e12");
+  snprintf(value, sizeof value, "%.17g", tau_max);
+  set_parameter(&table, "tau_max", value);
+  set_parameter(&table, "scatter_albedo", "1");
+  snprintf(value, sizeof value, "%.17g", budget);
+  set_parameter(&table, "time_limit", value);
+  set_parameter(&table, "output.format", "text");
+  set_parameter(&table, "escape_log", "0");
+  set_parameter(&table, "checkpoint.interval", "0");
+  set_parameter(&table, "progress.interval", "0");
+  set_parameter(&table, "target_rel_error", "0");
+
+  get_all_parameters(&table, &hist, &moments);
+  if(n_parameter_points(&table) > 1 || N_SWEEP > 0 || MRW_VALIDATE || STRETCH_VALIDATE || ENGINE_VALIDATE)
+  {
+    printf("The input cannot be a parameter sweep, an albedo sweep or a validation\n");
+    exit(1);
+  }
+
+  init_histogram(&hist);
+  init_moments(&moments);
+
+#ifdef MPI_ON
+  MPI_Barrier(MPI_COMM_WORLD);
+#endif
+  double start = get_wall_time();
+  n_photons = run_transport(&hist, &moments, false);
+  double seconds = get_wall_time() - start;
+
+  if(n_photons == TRANSPORT_STOPPED)
+    exit_after_stop();
+
+  if(f != NULL)
+  {
+    int n_bins = hist.n_bins;
+    double *mu = malloc(n_bins * sizeof *mu);
+    double *reference = malloc((n_bins > N_PEEL ? n_bins : N_PEEL) * sizeof *reference);
+
+    convert_weight_to_intensity(&hist, n_photons);
+
+    if(budget > 0)
+      printf("\nBudget %g s: %ld photons in %.3f s\n", budget, n_photons, seconds);
+    else
+      printf("\n%ld photons in %.3f s\n", n_photons, seconds);
+    fprintf(f, "    {\n      \"budget\": %g,\n      \"seconds\": %.6f,\n      \"n_photons\": %ld,\n", budget, seconds,
+            n_photons);
+
+    for(int i = 0; i < n_bins; i++)
+    {
+      mu[i] = cos(hist.theta[i]);
+      reference[i] = reference_bin_intensity(i, n_bins);
+    }
+    chi_sq = write_estimator(f, "histogram", n_bins, mu, hist.intensity, hist.error, reference, seconds);
+    if(max_chi_sq > 0 && chi_sq > max_chi_sq)
+      passed = false;
+
+    if(N_PEEL > 0)
+    {
+      for(int i = 0; i < N_PEEL; i++)
+        reference[i] = sqrt(3.0) / 4.0 * h_function(PEEL_MU[i]);
+      fprintf(f, ",\n");
+      chi_sq = write_estimator(f, "peel_off", N_PEEL, PEEL_MU, hist.peel_intensity, hist.peel_error, reference,
+                               seconds);
+      if(max_chi_sq > 0 && chi_sq > max_chi_sq)
+        passed = false;
+    }
+
+    fprintf(f, "\n    }%s\n", last ? "" : ",");
+    free(mu);
+    free(reference);
+  }
+
+  free_hist(&hist);
+  free_moments(&moments);
+  free_parameter_table(&table);
+
+  return passed;
+}
+
+/* ************************************************************************** */
+/** main
+ *
+ *  @brief The main function of mcrt_fom.
+ *
+ *  @param[in] int argc. Number of command line arguments provided.
+ *  @param[in] char *argv[]. The command line arguments provided.
+ *
+ *  @return 0, or 1 if an estimator is above --max-chi2.
+ *
+ * ************************************************************************** */
+
+int
+main(int argc, char *argv[])
+{
+  double budgets[BENCH_MAX_GRID] = {1, 4};
+  int n_budgets = 2;
+  long n_photons = 0;
+  double max_chi_sq = 0;
+  int passed = true;
+  double tau_max = 20;
+  char *input = NULL;
+  char *output = "fom.json";
+  int reference = false;
+
+#ifdef MPI_ON
+  int thread_support;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+  MPI_Comm_rank(MPI_COMM_WORLD, &RANK);
+  MPI_Comm_size(MPI_COMM_WORLD, &N_RANKS);
+#endif
+
+  for(int i = 1; i < argc; i++)
+  {
+    int has_value = i + 1 < argc;
+    if(strcmp(argv[i], "--reference") == 0)
+    {
+      reference = true;
+    }
+    else if(strcmp(argv[i], "--budgets") == 0 && has_value)
+    {
+      char *end;
+      n_budgets = 0;
+      for(char *token = strtok(argv[++i], ","); token != NULL && n_budgets < BENCH_MAX_GRID;
+          token = strtok(NULL, ","))
+      {
+        budgets[n_budgets] = strtod(token, &end);
+        if(end == token || *end != '\0' || budgets[n_budgets] <= 0)
+        {
+          printf("Invalid budget '%s'\n", token);
+          exit(1);
+        }
+        n_budgets++;
+      }
+    }
+    else if(strcmp(argv[i], "--photons") == 0 && has_value)
+    {
+      n_photons = (long) strtod(argv[++i], NULL);
+      if(n_photons < 1)
+      {
+        printf("--photons must be at least 1\n");
+        exit(1);
+      }
+    }
+    else if(strcmp(argv[i], "--max-chi2") == 0 && has_value)
+    {
+      max_chi_sq = strtod(argv[++i], NULL);
+    }
+    else if(strcmp(argv[i], "--tau") == 0 && has_value)
+    {
+      tau_max = strtod(argv[++i], NULL);
+    }
+    else if(strcmp(argv[i], "--input") == 0 && has_value)
+    {
+      input = argv[++i];
+    }
+    else if(strcmp(argv[i], "--output") == 0 && has_value)
+    {
+      output = argv[++i];
+    }
+    else
+    {
+      if(RANK == 0)
+        printf("Unknown option %s, see the top of src/fom.c for the options\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  init_h_function();
+
+  if(reference)
+  {
+    if(RANK == 0)
+    {
+      printf("%-12s %-12s %-12s\n", "mu", "H", "intensity");
+      for(int i = 0; i <= 20; i++)
+        printf("%-12f %-12f %-12f\n", i / 20.0, h_function(i / 20.0), sqrt(3.0) / 4.0 * h_function(i / 20.0));
+    }
+#ifdef MPI_ON
+    MPI_Finalize();
+#endif
+    return 0;
+  }
+
+  FILE *f = NULL;
+  if(RANK == 0)
+  {
+    if((f = fopen(output, "w")) == NULL)
+    {
+      printf("Cannot open file %s\n", output);
+      exit(1);
+    }
+    fprintf(f, "{\n  \"version\": 1,\n  \"tau_max\": %g,\n  \"n_ranks\": %d,\n  \"runs\": [\n", tau_max, N_RANKS);
+  }
+
+  if(n_photons > 0)
+  {
+    passed = run_budget(f, input, tau_max, 0, n_photons, max_chi_sq, true);
+  }
+  else
+  {
+    for(int b = 0; b < n_budgets; b++)
+      if(!run_budget(f, input, tau_max, budgets[b], 0, max_chi_sq, b == n_budgets - 1))
+        passed = false;
+  }
+
+  if(f != NULL)
+  {
+    fprintf(f, "  ]\n}\n");
+    if(fclose(f))
+    {
+      printf("Cannot close file %s\n", output);
+      exit(1);
+    }
+  }
+
+#ifdef MPI_ON
+  MPI_Finalize();
+#endif
+
+  if(!passed)
+  {
+    if(RANK == 0)
+      printf("\nAn estimator is above the chi^2/bin of %g\n", max_chi_sq);
+    return 1;
+  }
+
+  return 0;
+}
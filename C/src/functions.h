@@ -1,22 +1,112 @@
-void bin_photon_to_histogram(Histogram_t *hist, double costheta);
-void convert_weight_to_intensity(Histogram_t *hist);
+void bin_photon_to_histogram(Histogram_t *hist, double costheta, double weight);
+void peel_off_to_histogram(Histogram_t *hist, double z, double weight, int emitted);
+void peel_off_to_histograms(Histogram_t *hist, int n_sets, double z, const double *weight, int emitted);
+void convert_weight_to_intensity(Histogram_t *hist, long n_photons);
 void init_histogram(Histogram_t *hist);
-void increment_radiation_moment_estimators(Moments_t *moments, double z_pre, double z_post, double costheta);
+void increment_radiation_moment_estimators(Moments_t *moments, double z_pre, double z_post, double costheta, double weight);
+void increment_stretched_moment_estimators(Moments_t *moments, double z_pre, double z_post, double costheta, double weight, double rate);
 void init_moments(Moments_t *moments);
+void integrate_moments(Moments_t *moments);
+void normalise_moments(Moments_t *moments, long n_photons, double *values, double *errors);
 int main(int argc, char *argv[]);
-double gsl_rand_num(double min, double max);
-void init_gsl_seed(int seed);
-void random_theta_phi(double *cos_theta, double *phi);
-void isotropic_scatter_photon(PhotonPacket_t *packet);
-double random_tau(void);
-void get_all_parameters(char *file_name, Histogram_t *hist, Moments_t *moments);
-union ParameterUnion get_single_parameter(FILE *f, char *name, int type);
+void init_rng_stream(RNGStream_t *rng, uint64_t seed, uint64_t stream);
+double random_number(RNGStream_t *rng, double min, double max);
+double random_tau(RNGStream_t *rng);
+void random_theta_phi(RNGStream_t *rng, double *theta, double *phi);
+void init_parameters(Parameters_t *parameters);
+void free_parameters(Parameters_t *parameters);
+void parameter_error(const char *format, ...);
+int read_parameter_table(char *file_name, ParameterTable_t *table);
+void set_parameter(ParameterTable_t *table, char *name, char *value);
+void free_parameter_table(ParameterTable_t *table);
+Parameter_t *find_parameter(ParameterTable_t *table, char *name);
+union ParameterUnion get_single_parameter(ParameterTable_t *table, char *name, int type);
+union ParameterUnion get_optional_parameter(ParameterTable_t *table, char *name, int type, union ParameterUnion default_value);
+void get_optional_string_parameter(ParameterTable_t *table, char *name, char *value, char *default_value);
+int n_parameter_points(ParameterTable_t *table);
+void select_parameter_point(ParameterTable_t *table, int point);
+int get_all_parameters(ParameterTable_t *table, Histogram_t *hist, Moments_t *moments);
+void init_tally(Tally_t *tally, int n_bins, int n_levels);
+void zero_tally(Tally_t *tally);
+void add_tally(Tally_t *total, const Tally_t *tally);
+void free_tally(Tally_t *tally);
+void init_tally_reducer(TallyReducer_t *reducer, int n_bins, int n_levels);
+double batch_means_error(double sum, double sum_sq, long n_batches);
+int batch_wanted(TallyReducer_t *reducer, long batch);
+Tally_t *get_batch_tally(TallyReducer_t *reducer, long batch);
+void submit_batch_tally(TallyReducer_t *reducer, Tally_t *tally);
+void snapshot_tally_reducer(TallyReducer_t *reducer, Checkpoint_t *checkpoint);
+void free_snapshot(Checkpoint_t *checkpoint);
+void restore_tally_reducer(TallyReducer_t *reducer, Checkpoint_t *checkpoint);
+void copy_tally_totals(const Tally_t *total, const Tally_t *squares, long n_batches, Histogram_t *hist, Moments_t *moments);
+long finish_tally_reducer(TallyReducer_t *reducer, Histogram_t *hist, Moments_t *moments);
+void reduce_tally_across_ranks(Histogram_t *hist, Moments_t *moments, long *n_photons);
+void gather_random_numbers(int n, RNGStream_t *rng, double *u);
+void sample_optical_depths(int n, const double *u, double scale, double *tau);
+void sample_isotropic_directions(int n, const double *u_theta, const double *u_phi, double *costheta, double *sintheta, double *cosphi, double *sinphi);
 void print_time(void);
-void isotropic_emit_photon(PhotonPacket_t *packet);
+double get_wall_time(void);
+void get_deadline(double seconds, struct timespec *deadline);
+void init_directions(void);
+const char *direction_sampler_name(int sampler);
+void sample_azimuth(int sampler, RNGStream_t *rng, double *cosphi, double *sinphi);
+void sample_direction(int sampler, RNGStream_t *rng, double *costheta, double *sintheta, double *cosphi, double *sinphi);
+void isotropic_emit_photon(PhotonPacket_t *packet, RNGStream_t *rng);
+void isotropic_scatter_photon(PhotonPacket_t *packet, RNGStream_t *rng);
+int check_direction_samplers(long n_samples, uint64_t seed);
+PhaseTable_t *read_phase_table(const char *file_name);
+void free_phase_table(PhaseTable_t *table);
+void anisotropic_scatter_photon(PhotonPacket_t *packet, RNGStream_t *rng);
+Layers_t *init_layers(int n_layers, const double *thickness, const double *opacity, const double *albedo);
+Layers_t *read_layers(const char *file_name);
+void free_layers(Layers_t *layers);
+double layered_path_length(const Layers_t *layers, double z, double costheta, double tau, int *index);
+void stretched_scatter_photon(PhotonPacket_t *packet, RNGStream_t *rng);
 void move_photon(PhotonPacket_t *packet, double ds);
-void transport_all_photons(char *file_name);
-void transport_single_photon(Histogram_t *hist, Moments_t *moments);
+int russian_roulette(double *weight, RNGStream_t *rng);
+void transport_single_photon(Histogram_t *hist, Moments_t *moments, RNGStream_t *rng);
+void transport_sweep_photon(Histogram_t *hist, Moments_t *moments, RNGStream_t *rng);
+long run_transport(Histogram_t *hist, Moments_t *moments, int restart);
+int transport_all_photons(char *file_name, int restart);
+void init_photon_batch(PhotonBatch_t *batch, int capacity);
+void free_photon_batch(PhotonBatch_t *batch);
+void transport_photon_batch(Tally_t *tally, long first, long last);
+void mrw_increment_moments(Moments_t *moments, double z_centre, double z_end, double radius, double weight, double weight_out);
+double mrw_sphere_radius(PhotonPacket_t *packet);
+void modified_random_walk(PhotonPacket_t *packet, Moments_t *moments, RNGStream_t *rng, double radius);
 void free_moments(Moments_t *moments);
 void free_hist(Histogram_t *hist);
+void *aligned_calloc(size_t n, size_t size);
+void aligned_free(void *ptr);
+void output_set_path(char *path, int set, const char *file_name);
+void make_output_dirs(void);
 void ouput_intensity_to_file(Histogram_t *hist);
-void output_radiation_moments_to_file(Moments_t *moments);
+void output_radiation_moments_to_file(Moments_t *moments, long n_photons);
+void write_results(Histogram_t *hist, Moments_t *moments, long n_photons, int kind);
+void write_sweep_points(ParameterTable_t *table, int n_points, int combined);
+long validate_mrw(Histogram_t *hist, Moments_t *moments, int *agree);
+long validate_path_stretch(Histogram_t *hist, Moments_t *moments, int *agree);
+long validate_event_engine(Histogram_t *hist, Moments_t *moments, int *agree);
+void init_checkpoints(void);
+void write_checkpoint(TallyReducer_t *reducer, long first_photon, long last_photon);
+long read_checkpoint(TallyReducer_t *reducer);
+void poll_checkpoint(TallyReducer_t *reducer, long first_photon, long last_photon);
+int checkpoint_stop_requested(void);
+int checkpoint_stop_agreed(void);
+void exit_after_stop(void);
+int write_le(const void *values, size_t size, size_t n, FILE *f);
+int read_le(void *values, size_t size, size_t n, FILE *f);
+void write_binary_record(const char *path, int kind, Histogram_t *hist, Moments_t *moments, int set, long n_photons);
+void begin_binary_output(int restart);
+void start_snapshot_writer(TallyReducer_t *reducer, long first_photon, long last_photon, long n_done);
+void poll_snapshot(TallyReducer_t *reducer, long n_batch_photons);
+void stop_snapshot_writer(void);
+void start_escape_log(void);
+void log_escape(const PhotonPacket_t *packet);
+void stop_escape_log(long n_photons);
+void start_metrics(void);
+void attach_thread_metrics(void);
+void stop_metrics(void);
+void start_progress(Progress_t *progress, long n_photons, long n_done);
+void add_progress(Progress_t *progress, long n_photons);
+void stop_progress(Progress_t *progress);
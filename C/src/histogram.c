@@ -27,7 +27,8 @@
  *
  *  Takes in an uninitialised Histogram_t struct, allocates memory for the
  *  pointers within the struct with mu_bin elements and calculates the
- *  bin's escape angle value and sets the bin counts to 0.
+ *  bin's escape angle value and sets the bin counts to 0. The peel-off arrays
+ *  have N_PEEL elements.
  *
  * ************************************************************************** */
 
@@ -38,8 +39,17 @@ init_histogram(Histogram_t *hist)
   double half_width = 0.5 * d_theta;
 
   hist->weight = calloc(hist->n_bins, sizeof *hist->weight);
+  hist->weight_sq = calloc(hist->n_bins, sizeof *hist->weight_sq);
   hist->theta = calloc(hist->n_bins, sizeof *hist->theta);
   hist->intensity = calloc(hist->n_bins, sizeof *hist->intensity);
+  hist->error = calloc(hist->n_bins, sizeof *hist->error);
+  hist->n_batches = 0;
+
+  hist->n_peel = N_PEEL;
+  hist->peel_weight = calloc(N_PEEL, sizeof *hist->peel_weight);
+  hist->peel_weight_sq = calloc(N_PEEL, sizeof *hist->peel_weight_sq);
+  hist->peel_intensity = calloc(N_PEEL, sizeof *hist->peel_intensity);
+  hist->peel_error = calloc(N_PEEL, sizeof *hist->peel_error);
 
   for(int i = 0; i < hist->n_bins; i++)
     hist->theta[i] = acos(i * d_theta + half_width);
@@ -54,20 +64,98 @@ init_histogram(Histogram_t *hist)
  *
  *  @param[in] double costheta. A photon's escape angle, mu = cos(theta).
  *
+ *  @param[in] double weight. The weight of the photon packet.
+ *
  *  @return 0.
  *
  *  @details
  *
  *  Converts the photon's escape angle into a binned angle index and increments
- *  the bin count by 1 for that escape angle.
+ *  the bin count by the packet's weight for that escape angle. A photon
+ *  escaping along the normal, costheta == 1, goes in the last bin.
  *
  * ************************************************************************** */
 
 void
-bin_photon_to_histogram(Histogram_t *hist, double costheta)
+bin_photon_to_histogram(Histogram_t *hist, double costheta, double weight)
 {
   int index = abs((int) (costheta * hist->n_bins));
-  hist->weight[index] += 1;
+  if(index >= hist->n_bins)
+    index = hist->n_bins - 1;
+  hist->weight[index] += weight;
+}
+
+/* ************************************************************************** */
+/** peel_off_to_histogram
+ *
+ *  @brief Add the probability of a photon escaping towards each observer.
+ *
+ *  @param[in, out] *hist  An initialised Histogram_t struct.
+ *  @param[in] z           The position of the emission or scattering event.
+ *  @param[in] weight      The weight of the photon packet.
+ *  @param[in] emitted     true for an emission from the bottom of the slab,
+ *                         false for an isotropic scattering.
+ *
+ *  @details
+ *
+ *  The next event estimator: for each observer at mu in PEEL_MU, the
+ *  probability per unit mu of the new direction being mu, times the
+ *  probability of reaching the top of the slab without another interaction,
+ *
+ *      p(mu) exp(-(1 - z) TAU_MAX / mu).
+ *
+ *  Photons are emitted with p(mu) = 2 mu for mu > 0 and scatter with
+ *  p(mu) = 1 / 2. Every photon contributes to every observer, not only those
+ *  which happen to escape into a bin, so grazing angles have far less noise.
+ *
+ * ************************************************************************** */
+
+void
+peel_off_to_histogram(Histogram_t *hist, double z, double weight, int emitted)
+{
+  double tau = (1.0 - z) * TAU_MAX;
+
+  for(int i = 0; i < hist->n_peel; i++)
+  {
+    double mu = PEEL_MU[i];
+    double p = emitted ? 2.0 * mu : 0.5;
+    hist->peel_weight[i] += weight * p * exp(-tau / mu);
+  }
+}
+
+/* ************************************************************************** */
+/** peel_off_to_histograms
+ *
+ *  @brief Add the probability of a photon escaping towards each observer to
+ *         several histograms at once.
+ *
+ *  @param[in, out] *hist  n_sets initialised Histogram_t structs.
+ *  @param[in] n_sets      The number of histograms.
+ *  @param[in] z           The position of the emission or scattering event.
+ *  @param[in] *weight     The weight of the photon packet for each histogram.
+ *  @param[in] emitted     true for an emission from the bottom of the slab,
+ *                         false for an isotropic scattering.
+ *
+ *  @details
+ *
+ *  The same as calling peel_off_to_histogram for each histogram, but the
+ *  escape probability towards each observer is only calculated once.
+ *
+ * ************************************************************************** */
+
+void
+peel_off_to_histograms(Histogram_t *hist, int n_sets, double z, const double *weight, int emitted)
+{
+  double tau = (1.0 - z) * TAU_MAX;
+
+  for(int i = 0; i < hist->n_peel; i++)
+  {
+    double mu = PEEL_MU[i];
+    double p = emitted ? 2.0 * mu : 0.5;
+    double escape = p * exp(-tau / mu);
+    for(int s = 0; s < n_sets; s++)
+      hist[s].peel_weight[i] += weight[s] * escape;
+  }
 }
 
 /* ************************************************************************** */
@@ -81,6 +169,8 @@ bin_photon_to_histogram(Histogram_t *hist, double costheta)
  *  @param[in, out] double *intensity. A pointer to an empty array with mu_bins
  *  elements.
  *
+ *  @param[in] long n_photons. The number of photons transported.
+ *
  *  @return 0
  *
  *  @details
@@ -88,13 +178,26 @@ bin_photon_to_histogram(Histogram_t *hist, double costheta)
  *  The idea behind calculating the intensity at the various binned angles is
  *  to count the escaped photons at that bin. Thus by doing this, and diving by
  *  the number of photons, the flux normalised intensity of the escape angles
- *  is easily calculated.
+ *  is easily calculated. The error of each bin is found from the spread of
+ *  the weights of each batch. The peel-off weights are already per unit mu,
+ *  so they are not multiplied by the number of bins.
  *
  * ************************************************************************** */
 
 void
-convert_weight_to_intensity(Histogram_t *hist)
+convert_weight_to_intensity(Histogram_t *hist, long n_photons)
 {
   for(int i = 0; i < hist->n_bins; i++)
-    hist->intensity[i] = (hist->weight[i] * hist->n_bins) / (2.0 * N_PHOTONS * cos(hist->theta[i]));
+  {
+    double norm = hist->n_bins / (2.0 * n_photons * cos(hist->theta[i]));
+    hist->intensity[i] = hist->weight[i] * norm;
+    hist->error[i] = batch_means_error(hist->weight[i], hist->weight_sq[i], hist->n_batches) * norm;
+  }
+
+  for(int i = 0; i < hist->n_peel; i++)
+  {
+    double norm = 1.0 / (2.0 * n_photons * PEEL_MU[i]);
+    hist->peel_intensity[i] = hist->peel_weight[i] * norm;
+    hist->peel_error[i] = batch_means_error(hist->peel_weight[i], hist->peel_weight_sq[i], hist->n_batches) * norm;
+  }
 }
@@ -0,0 +1,338 @@
+/* ************************************************************************** */
+/** @file layers.c
+ *
+ *  @brief Functions for a slab made of a stack of layers, each with its own
+ *  opacity and albedo.
+ *
+ *  The layers are given from the bottom of the slab to the top, either as
+ *  comma separated lists,
+ *
+ *      layers.opacity    1,5,2
+ *      layers.thickness  0.2,0.5,0.3
+ *      layers.albedo     0.9,1,0.5
+ *
+ *  or as the rows of layers.file, "thickness opacity [albedo]". The
+ *  thicknesses and opacities are relative: the thicknesses are scaled to fill
+ *  the slab, equal if none are given, and the opacities so that the optical
+ *  depth of the whole slab is TAU_MAX. A layer without an albedo has
+ *  SCATTERING_ALBEDO.
+ *
+ *  The optical depth from the bottom of the slab, measured vertically, is
+ *  linear within each layer. A photon at z travelling at costheta through a
+ *  random optical depth tau moves to where this is tau * costheta further
+ *  on, which is found with a guide table: the optical depth of the slab is
+ *  split into GUIDE_CELLS_PER_LAYER equal cells for each layer, and each cell
+ *  records the first layer in it. Unless many thin layers fall in one cell,
+ *  finding the layer takes a step or two, whatever the number of layers, and
+ *  never more than a binary search.
+ *
+ *  The moments and the escape histogram only depend on z and the direction,
+ *  so they are tallied exactly as for a uniform slab.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#define GUIDE_CELLS_PER_LAYER 4
+
+/* ************************************************************************** */
+/** init_layers
+ *
+ *  @brief Build the table of layers of the slab.
+ *
+ *  @param[in] n_layers    The number of layers.
+ *  @param[in] *thickness  The relative thickness of each layer, or NULL for
+ *                         layers of equal thickness.
+ *  @param[in] *opacity    The relative opacity of each layer.
+ *  @param[in] *albedo     The albedo of each layer, or NULL for
+ *                         SCATTERING_ALBEDO.
+ *
+ *  @return The layers, which are freed with free_layers, or NULL if they
+ *  cannot be used when EMBEDDED.
+ *
+ *  @details
+ *
+ *  Every thickness must be above 0 and no opacity can be negative. A layer
+ *  with an opacity of 0 is empty, and photons cross it without interacting.
+ *
+ * ************************************************************************** */
+
+Layers_t *
+init_layers(int n_layers, const double *thickness, const double *opacity, const double *albedo)
+{
+  double total_thickness = 0;
+  double total_tau = 0;
+
+  if(n_layers < 1)
+  {
+    parameter_error("The slab must have at least one layer");
+    return NULL;
+  }
+
+  for(int i = 0; i < n_layers; i++)
+  {
+    double h = thickness ? thickness[i] : 1.0;
+    if(!(h > 0) || !(opacity[i] >= 0) || (albedo && !(albedo[i] >= 0 && albedo[i] <= 1)))
+    {
+      parameter_error("Layer %d must have a thickness above 0, an opacity of at least 0 and an albedo between 0 and 1",
+                      i + 1);
+      return NULL;
+    }
+    total_thickness += h;
+    total_tau += h * opacity[i];
+  }
+
+  if(total_tau == 0)
+  {
+    parameter_error("At least one layer must have an opacity above 0");
+    return NULL;
+  }
+
+  Layers_t *layers = malloc(sizeof *layers);
+  layers->n_layers = n_layers;
+  layers->layer = malloc((n_layers + 1) * sizeof *layers->layer);
+  layers->tau_max = TAU_MAX;
+
+  double z = 0, tau = 0;
+  for(int i = 0; i < n_layers; i++)
+  {
+    double h = (thickness ? thickness[i] : 1.0) / total_thickness;
+    Layer_t *layer = &layers->layer[i];
+    layer->z = z;
+    layer->tau = tau;
+    layer->opacity = opacity[i] / total_tau * total_thickness * TAU_MAX;
+    layer->albedo = albedo ? albedo[i] : SCATTERING_ALBEDO;
+    z += h;
+    tau += h * layer->opacity;
+  }
+
+  layers->layer[n_layers] = (Layer_t) {1.0, TAU_MAX, 0, 0};
+
+  layers->n_guide = GUIDE_CELLS_PER_LAYER * n_layers;
+  layers->guide_scale = layers->n_guide / TAU_MAX;
+  layers->guide = malloc((layers->n_guide + 1) * sizeof *layers->guide);
+  for(int j = 0, k = 0; j < layers->n_guide; j++)
+  {
+    double cell_tau = j / layers->guide_scale;
+    while(k < n_layers - 1 && layers->layer[k + 1].tau <= cell_tau)
+      k++;
+    layers->guide[j] = k;
+  }
+  layers->guide[layers->n_guide] = n_layers - 1;
+
+  return layers;
+}
+
+/* ************************************************************************** */
+/** read_layers
+ *
+ *  @brief Read the layers of the slab from file.
+ *
+ *  @param[in] *file_name  The filename of the layers file.
+ *
+ *  @return The layers, which are freed with free_layers, or NULL if the file
+ *  cannot be used when EMBEDDED.
+ *
+ *  @details
+ *
+ *  Each row is a layer, from the bottom of the slab, with the columns
+ *  thickness, opacity and optionally albedo. Lines starting with # are
+ *  ignored.
+ *
+ * ************************************************************************** */
+
+Layers_t *
+read_layers(const char *file_name)
+{
+  FILE *f;
+  char line[LINE_LEN];
+  int n_layers = 0;
+  int n_albedos = 0;
+  int capacity = 64;
+  int readable = true;
+
+  if((f = fopen(file_name, "r")) == NULL)
+  {
+    parameter_error("Unable to open the layers file %s", file_name);
+    return NULL;
+  }
+
+  double *thickness = malloc(capacity * sizeof *thickness);
+  double *opacity = malloc(capacity * sizeof *opacity);
+  double *albedo = malloc(capacity * sizeof *albedo);
+
+  while(fgets(line, LINE_LEN, f) != NULL)
+  {
+    char *start = line + strspn(line, " \t");
+
+    if(*start == '#' || *start == '\n' || *start == '\r' || *start == '\0')
+      continue;
+
+    if(n_layers == capacity)
+    {
+      capacity *= 2;
+      thickness = realloc(thickness, capacity * sizeof *thickness);
+      opacity = realloc(opacity, capacity * sizeof *opacity);
+      albedo = realloc(albedo, capacity * sizeof *albedo);
+    }
+
+    int n_columns = sscanf(start, "%lf %lf %lf", &thickness[n_layers], &opacity[n_layers], &albedo[n_layers]);
+    if(n_columns < 2 || (n_layers > 0 && (n_columns == 3) != (n_albedos > 0)))
+    {
+      parameter_error("Unable to read the line '%s' of the layers file %s, every line must have a thickness, an "
+                      "opacity and optionally an albedo", strtok(start, "\r\n"), file_name);
+      readable = false;
+      break;
+    }
+
+    if(n_columns == 3)
+      n_albedos++;
+    n_layers++;
+  }
+
+  fclose(f);
+
+  Layers_t *layers = NULL;
+  if(readable)
+    layers = init_layers(n_layers, thickness, opacity, n_albedos > 0 ? albedo : NULL);
+
+  free(thickness);
+  free(opacity);
+  free(albedo);
+
+  return layers;
+}
+
+/* ************************************************************************** */
+/** free_layers
+ *
+ *  @brief Free the layers of the slab.
+ *
+ *  @param[in, out] *layers  The layers, or NULL.
+ *
+ * ************************************************************************** */
+
+void
+free_layers(Layers_t *layers)
+{
+  if(layers == NULL)
+    return;
+
+  free(layers->layer);
+  free(layers->guide);
+  free(layers);
+}
+
+/* ************************************************************************** */
+/** find_layer
+ *
+ *  @brief Find the layer in which the vertical optical depth from the bottom
+ *  of the slab is tau.
+ *
+ *  @param[in] *layers  The layers of the slab.
+ *  @param[in] tau      The optical depth, between 0 and the optical depth of
+ *                      the slab.
+ *
+ *  @return The index of the layer, which never has an opacity of 0.
+ *
+ *  @details
+ *
+ *  The layer lies between those of the guide cells either side of tau, which
+ *  are searched with a binary search. The cell found from tau can be one out
+ *  through rounding, so the range is widened if it does not hold tau.
+ *
+ * ************************************************************************** */
+
+static inline int
+find_layer(const Layers_t *layers, double tau)
+{
+  const Layer_t *layer = layers->layer;
+  int j = (int) (tau * layers->guide_scale);
+
+  if(j >= layers->n_guide)
+    j = layers->n_guide - 1;
+
+  int lo = layers->guide[j];
+  int hi = layers->guide[j + 1];
+
+  while(lo > 0 && layer[lo].tau > tau)
+    lo--;
+  while(hi < layers->n_layers - 1 && layer[hi + 1].tau <= tau)
+    hi++;
+
+  while(lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if(layer[mid].tau <= tau)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+/* ************************************************************************** */
+/** layered_path_length
+ *
+ *  @brief Convert a random optical depth into a distance through the layers.
+ *
+ *  @param[in] *layers      The layers of the slab.
+ *  @param[in] z            The position of the photon.
+ *  @param[in] costheta     The direction of the photon.
+ *  @param[in] tau          The optical depth the photon travels through.
+ *  @param[in, out] *index  The layer the photon is in, which is updated to
+ *                          the layer it ends up in.
+ *
+ *  @return The distance the photon travels, in units of the thickness of the
+ *  slab, as for random_tau / TAU_MAX in a uniform slab.
+ *
+ *  @details
+ *
+ *  A photon which leaves the slab is moved on as if the layer it left
+ *  through carried on, and its layer is that one. A photon travelling
+ *  parallel to the layers stays in its layer, and in an empty layer it never
+ *  interacts again, so it is moved a long way.
+ *
+ * ************************************************************************** */
+
+double
+layered_path_length(const Layers_t *layers, double z, double costheta, double tau, int *index)
+{
+  const Layer_t *layer = layers->layer;
+  int i = *index;
+
+  if(costheta == 0)
+    return layer[i].opacity > 0 ? tau / layer[i].opacity : 1.0e30;
+
+  double tau_z = layer[i].tau + (z - layer[i].z) * layer[i].opacity;
+  double tau_end = tau_z + tau * costheta;
+  double z_end;
+
+  if(tau_end >= layers->tau_max)
+  {
+    i = layers->n_layers - 1;
+    z_end = 1.0 + (tau_end - layers->tau_max) / (layer[i].opacity > 0 ? layer[i].opacity : layers->tau_max);
+  }
+  else if(tau_end <= 0)
+  {
+    i = 0;
+    z_end = tau_end / (layer[0].opacity > 0 ? layer[0].opacity : layers->tau_max);
+  }
+  else
+  {
+    i = find_layer(layers, tau_end);
+    z_end = layer[i].z + (tau_end - layer[i].tau) / layer[i].opacity;
+  }
+
+  *index = i;
+
+  return (z_end - z) / costheta;
+}
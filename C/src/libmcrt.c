@@ -0,0 +1,576 @@
+/* ************************************************************************** */
+/** @file libmcrt.c
+ *
+ *  @brief The functions of the libmcrt API, see mcrt.h.
+ *
+ *  Each MCRTContext_t holds its own Parameters_t, which PARAMETERS points to
+ *  on the calling thread and its OpenMP threads whilst the simulation runs.
+ *  The simulation is run by run_transport, as it is by mcrt, but EMBEDDED so
+ *  nothing shared with the rest of the process is touched.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "mcrt.h"
+#include "variables.h"
+#include "functions.h"
+
+/* ************************************************************************** */
+/** free_results
+ *
+ *  @brief Free the results of the last run of a context.
+ *
+ *  @param[in, out] *context  The context.
+ *
+ * ************************************************************************** */
+
+static void
+free_results(MCRTContext_t *context)
+{
+  for(int s = 0; s < context->n_sets; s++)
+  {
+    free_hist(&context->hist[s]);
+    free_moments(&context->moments[s]);
+  }
+  free(context->hist);
+  free(context->moments);
+  free(context->moment_values);
+  free(context->albedo);
+  context->hist = NULL;
+  context->moments = NULL;
+  context->moment_values = NULL;
+  context->albedo = NULL;
+  context->n_sets = 0;
+  context->n_photons = 0;
+}
+
+/* ************************************************************************** */
+/** check_embeddable
+ *
+ *  @brief Check that the parameters of a context can be run EMBEDDED.
+ *
+ *  @param[in, out] *context  The context, after get_all_parameters.
+ *
+ *  @return MCRT_OK, or MCRT_ERROR with the reason in the error of context.
+ *
+ * ************************************************************************** */
+
+static int
+check_embeddable(MCRTContext_t *context)
+{
+  char *reason = NULL;
+
+  if(n_parameter_points(&context->table) > 1)
+    reason = "parameter sweeps are not supported, create a context for each point";
+  else if(MRW_VALIDATE || STRETCH_VALIDATE || ENGINE_VALIDATE)
+    reason = "mrw.validate, path_stretch.validate and transport_engine.validate are not supported";
+  else if(OUTPUT_FORMAT != FORMAT_TEXT)
+    reason = "output.format binary is not supported, as nothing is written to file";
+  else if(ESCAPE_LOG)
+    reason = "escape_log is not supported, as nothing is written to file";
+  else if(CHECKPOINT_INTERVAL > 0)
+    reason = "checkpoint.interval is not supported, as nothing is written to file";
+
+  if(reason == NULL)
+    return MCRT_OK;
+
+  snprintf(context->error, LINE_LEN, "%s", reason);
+  return MCRT_ERROR;
+}
+
+/* ************************************************************************** */
+/** mcrt_create
+ *
+ *  @brief Create a context with no parameters set.
+ *
+ *  @return The context, or NULL if there is not enough memory.
+ *
+ * ************************************************************************** */
+
+MCRTContext_t *
+mcrt_create(void)
+{
+  MCRTContext_t *context = calloc(1, sizeof *context);
+  if(context == NULL)
+    return NULL;
+
+  init_parameters(&context->parameters);
+
+  return context;
+}
+
+/* ************************************************************************** */
+/** mcrt_destroy
+ *
+ *  @brief Free a context and its results.
+ *
+ *  @param[in, out] *context  The context, which may be NULL.
+ *
+ * ************************************************************************** */
+
+void
+mcrt_destroy(MCRTContext_t *context)
+{
+  if(context == NULL)
+    return;
+
+  free_results(context);
+  free_parameters(&context->parameters);
+  free_parameter_table(&context->table);
+  free(context);
+}
+
+/* ************************************************************************** */
+/** mcrt_set
+ *
+ *  @brief Set a parameter of a context.
+ *
+ *  @param[in, out] *context  The context.
+ *  @param[in] *name          The name of the parameter, as in the input file.
+ *  @param[in] *value         The value of the parameter, as in the input file.
+ *
+ *  @return MCRT_OK, or MCRT_ERROR if the name or value is too long.
+ *
+ *  @details
+ *
+ *  The parameters are only read when the simulation is run, so they can be
+ *  set in any order and changed between runs.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_set(MCRTContext_t *context, const char *name, const char *value)
+{
+  if(strlen(name) >= LINE_LEN || strlen(value) >= LINE_LEN)
+  {
+    snprintf(context->error, LINE_LEN, "the parameter %.64s is too long", name);
+    return MCRT_ERROR;
+  }
+
+  set_parameter(&context->table, (char *) name, (char *) value);
+
+  return MCRT_OK;
+}
+
+/* ************************************************************************** */
+/** mcrt_read_input
+ *
+ *  @brief Set the parameters of a context from an input file.
+ *
+ *  @param[in, out] *context  The context.
+ *  @param[in] *file_name     The input file.
+ *
+ *  @return MCRT_OK, or MCRT_ERROR if the file cannot be opened or read.
+ *
+ *  @details
+ *
+ *  The parameters in the file replace any with the same name which are
+ *  already set. If the file cannot be read, none of them are set.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_read_input(MCRTContext_t *context, const char *file_name)
+{
+  ParameterTable_t table;
+  Parameters_t *previous = PARAMETERS;
+  int status = MCRT_OK;
+
+  PARAMETERS = &context->parameters;
+  EMBEDDED = true;
+  PARAMETER_ERROR[0] = '\0';
+
+  if(read_parameter_table((char *) file_name, &table))
+  {
+    for(int i = 0; i < table.n_parameters; i++)
+      set_parameter(&context->table, table.parameters[i].name, table.parameters[i].value);
+  }
+  else
+  {
+    snprintf(context->error, LINE_LEN, "%s", PARAMETER_ERROR);
+    status = MCRT_ERROR;
+  }
+  free_parameter_table(&table);
+
+  PARAMETERS = previous;
+
+  return status;
+}
+
+/* ************************************************************************** */
+/** mcrt_run
+ *
+ *  @brief Run the simulation of a context.
+ *
+ *  @param[in, out] *context  The context.
+ *
+ *  @return MCRT_OK, or MCRT_ERROR if the parameters cannot be run.
+ *
+ *  @details
+ *
+ *  Any results of an earlier run are replaced. PARAMETERS is pointed at the
+ *  parameters of the context for the run and put back afterwards. As the run
+ *  is EMBEDDED, a parameter which cannot be used is returned as an error
+ *  rather than ending the program.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_run(MCRTContext_t *context)
+{
+  Histogram_t hist;
+  Moments_t moments;
+  Parameters_t *previous = PARAMETERS;
+
+  free_results(context);
+  PARAMETERS = &context->parameters;
+  EMBEDDED = true;
+  PARAMETER_ERROR[0] = '\0';
+
+  if(!get_all_parameters(&context->table, &hist, &moments))
+  {
+    snprintf(context->error, LINE_LEN, "%s", PARAMETER_ERROR);
+    PARAMETERS = previous;
+    return MCRT_ERROR;
+  }
+
+  if(check_embeddable(context) != MCRT_OK)
+  {
+    PARAMETERS = previous;
+    return MCRT_ERROR;
+  }
+
+  context->n_sets = N_TALLY_SETS;
+  context->hist = malloc(context->n_sets * sizeof *context->hist);
+  context->moments = malloc(context->n_sets * sizeof *context->moments);
+  context->albedo = malloc(context->n_sets * sizeof *context->albedo);
+  for(int s = 0; s < context->n_sets; s++)
+  {
+    context->hist[s].n_bins = hist.n_bins;
+    context->moments[s].n_levels = moments.n_levels;
+    init_histogram(&context->hist[s]);
+    init_moments(&context->moments[s]);
+    context->albedo[s] = N_SWEEP > 0 ? SWEEP_ALBEDOS[s] : SCATTERING_ALBEDO;
+  }
+
+  context->n_photons = run_transport(context->hist, context->moments, false);
+
+  int n_values = N_MOMENTS * (moments.n_levels + 1);
+  context->moment_values = calloc(2 * n_values * context->n_sets, sizeof *context->moment_values);
+  if(RANK == 0)
+  {
+    for(int s = 0; s < context->n_sets; s++)
+    {
+      convert_weight_to_intensity(&context->hist[s], context->n_photons);
+      normalise_moments(&context->moments[s], context->n_photons, &context->moment_values[2 * n_values * s],
+                        &context->moment_values[2 * n_values * s + n_values]);
+    }
+  }
+
+  PARAMETERS = previous;
+
+  return MCRT_OK;
+}
+
+/* ************************************************************************** */
+/** mcrt_error
+ *
+ *  @brief Return the message of the last error of a context.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return The message, which is empty if there has not been an error.
+ *
+ * ************************************************************************** */
+
+const char *
+mcrt_error(const MCRTContext_t *context)
+{
+  return context->error;
+}
+
+/* ************************************************************************** */
+/** mcrt_n_photons
+ *
+ *  @brief Return the number of photons transported by the last run.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return The number of photons, which is less than n_photons if
+ *  target_rel_error or time_limit was reached, or 0 before a run.
+ *
+ * ************************************************************************** */
+
+long
+mcrt_n_photons(const MCRTContext_t *context)
+{
+  return context->n_photons;
+}
+
+/* ************************************************************************** */
+/** mcrt_n_sets
+ *
+ *  @brief Return the number of sets of results of the last run.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return One set for each albedo of an albedo_sweep, otherwise 1, or 0
+ *  before a run.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_n_sets(const MCRTContext_t *context)
+{
+  return context->n_sets;
+}
+
+/* ************************************************************************** */
+/** mcrt_n_bins
+ *
+ *  @brief Return the number of escape histogram bins of the last run.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return The number of bins, or 0 before a run.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_n_bins(const MCRTContext_t *context)
+{
+  return context->n_sets > 0 ? context->hist[0].n_bins : 0;
+}
+
+/* ************************************************************************** */
+/** mcrt_n_levels
+ *
+ *  @brief Return the number of rows of the moments of the last run.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return moments.n_levels + 1, as for OUTPUT_FILE_MOMENTS, or 0 before a
+ *  run.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_n_levels(const MCRTContext_t *context)
+{
+  return context->n_sets > 0 ? context->moments[0].n_levels + 1 : 0;
+}
+
+/* ************************************************************************** */
+/** mcrt_n_peel
+ *
+ *  @brief Return the number of peel-off observer angles of the last run.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return The number of observers, or 0 if the peel-off estimator was not
+ *  used.
+ *
+ * ************************************************************************** */
+
+int
+mcrt_n_peel(const MCRTContext_t *context)
+{
+  return context->n_sets > 0 ? context->hist[0].n_peel : 0;
+}
+
+/* ************************************************************************** */
+/** mcrt_albedo
+ *
+ *  @brief Return the albedo of a set of results.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set, from 0 to mcrt_n_sets - 1.
+ *
+ *  @return The albedo, or -1 if there is no such set.
+ *
+ * ************************************************************************** */
+
+double
+mcrt_albedo(const MCRTContext_t *context, int set)
+{
+  return set >= 0 && set < context->n_sets ? context->albedo[set] : -1;
+}
+
+/* ************************************************************************** */
+/** set_histogram
+ *
+ *  @brief Return the histogram of a set of results.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set.
+ *
+ *  @return The histogram, or NULL if there is no such set.
+ *
+ * ************************************************************************** */
+
+static const Histogram_t *
+set_histogram(const MCRTContext_t *context, int set)
+{
+  return set >= 0 && set < context->n_sets ? &context->hist[set] : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_theta
+ *
+ *  @brief Return the escape angle of the centre of each histogram bin.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return mcrt_n_bins angles in radians, or NULL before a run.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_theta(const MCRTContext_t *context)
+{
+  const Histogram_t *hist = set_histogram(context, 0);
+  return hist ? hist->theta : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_intensity
+ *
+ *  @brief Return the flux normalised intensity of each histogram bin.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set of results.
+ *
+ *  @return mcrt_n_bins intensities, or NULL if there is no such set.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_intensity(const MCRTContext_t *context, int set)
+{
+  const Histogram_t *hist = set_histogram(context, set);
+  return hist ? hist->intensity : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_intensity_error
+ *
+ *  @brief Return the standard error of the intensity of each histogram bin.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set of results.
+ *
+ *  @return mcrt_n_bins errors, or NULL if there is no such set.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_intensity_error(const MCRTContext_t *context, int set)
+{
+  const Histogram_t *hist = set_histogram(context, set);
+  return hist ? hist->error : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_peel_mu
+ *
+ *  @brief Return the cosine of each peel-off observer angle.
+ *
+ *  @param[in] *context  The context.
+ *
+ *  @return mcrt_n_peel cosines, or NULL if the peel-off estimator was not
+ *  used.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_peel_mu(const MCRTContext_t *context)
+{
+  return mcrt_n_peel(context) > 0 ? context->parameters.peel_mu : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_peel_intensity
+ *
+ *  @brief Return the peel-off estimate of the intensity towards each
+ *         observer.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set of results.
+ *
+ *  @return mcrt_n_peel intensities, or NULL if there is no such set or the
+ *  peel-off estimator was not used.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_peel_intensity(const MCRTContext_t *context, int set)
+{
+  const Histogram_t *hist = set_histogram(context, set);
+  return hist && hist->n_peel > 0 ? hist->peel_intensity : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_peel_error
+ *
+ *  @brief Return the standard error of the peel-off intensities.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set of results.
+ *
+ *  @return mcrt_n_peel errors, or NULL if there is no such set or the
+ *  peel-off estimator was not used.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_peel_error(const MCRTContext_t *context, int set)
+{
+  const Histogram_t *hist = set_histogram(context, set);
+  return hist && hist->n_peel > 0 ? hist->peel_error : NULL;
+}
+
+/* ************************************************************************** */
+/** mcrt_moments
+ *
+ *  @brief Return the moments of the radiation field at each level.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set of results.
+ *
+ *  @return mcrt_n_levels rows of MCRT_N_MOMENTS moments, divided by the
+ *  number of photons, or NULL if there is no such set.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_moments(const MCRTContext_t *context, int set)
+{
+  if(set < 0 || set >= context->n_sets)
+    return NULL;
+
+  return &context->moment_values[2 * N_MOMENTS * mcrt_n_levels(context) * set];
+}
+
+/* ************************************************************************** */
+/** mcrt_moment_errors
+ *
+ *  @brief Return the batch means errors of the moments.
+ *
+ *  @param[in] *context  The context.
+ *  @param[in] set       The set of results.
+ *
+ *  @return The errors, laid out as mcrt_moments, or NULL if there is no such
+ *  set.
+ *
+ * ************************************************************************** */
+
+const double *
+mcrt_moment_errors(const MCRTContext_t *context, int set)
+{
+  const double *values = mcrt_moments(context, set);
+  return values ? values + N_MOMENTS * mcrt_n_levels(context) : NULL;
+}
@@ -8,8 +8,14 @@
  * ************************************************************************** */
 
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
 #include <time.h>
 
+#ifdef MPI_ON
+#include <mpi.h>
+#endif
+
 #include "variables.h"
 #include "functions.h"
 
@@ -21,36 +27,73 @@
  *  @param[in] int argc. Number of command line arguments provided.
  *  @param[int] char *argv[]. The command line arguments provided.
  *
- *  @return 0
+ *  @return 0, or 1 if mrw.validate or path_stretch.validate failed.
  *
  *  @details
  *
- *  Controls the flow of the program.
+ *  Controls the flow of the program. The input file is given as an argument,
+ *  along with --restart to continue from the last checkpoint. When built with
+ *  MPI, every rank runs the whole program but only rank 0 writes output. After
+ *  SIGTERM, the ranks wait for each other to write their checkpoints before
+ *  MPI is finalised.
  *
  * ************************************************************************** */
 
 int main(int argc, char *argv[])
 {
-  char *ini_file;
-  if(argc >= 2)
+  char *ini_file = NULL;
+  int restart = false;
+
+#ifdef MPI_ON
+  int thread_support;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+  MPI_Comm_rank(MPI_COMM_WORLD, &RANK);
+  MPI_Comm_size(MPI_COMM_WORLD, &N_RANKS);
+  if(thread_support < MPI_THREAD_FUNNELED && RANK == 0)
+    printf("The MPI library does not support threads, OpenMP may not be safe\n");
+#endif
+
+  for(int i = 1; i < argc; i++)
   {
-    ini_file = argv[1];
+    if(strcmp(argv[i], "--restart") == 0)
+      restart = true;
+    else
+      ini_file = argv[i];
   }
-  else
+
+  if(ini_file == NULL)
   {
     printf("No configuration file provided. Assuming default path.\n");
     ini_file = DEFAULT_INI_FILE;
   }
 
   time_t start = time(NULL);
-  printf("\nBeginning simulation\n");
-  print_time();
+  if(RANK == 0)
+  {
+    printf("\nBeginning simulation\n");
+    if(N_RANKS > 1)
+      printf("Running on %d MPI ranks\n", N_RANKS);
+    print_time();
+  }
 
-  transport_all_photons(ini_file);
+  int status = transport_all_photons(ini_file, restart);
 
   time_t stop = time(NULL);
-  printf("\nTotal run time %3.2f s\n", difftime(stop, start));
-  printf("\n-------------\n");
+  if(RANK == 0)
+  {
+    if(status == SIMULATION_STOPPED)
+      printf("\nStopped the simulation after SIGTERM, restart with --restart\n");
+    printf("\nTotal run time %3.2f s\n", difftime(stop, start));
+    printf("\n-------------\n");
+  }
+
+#ifdef MPI_ON
+  MPI_Barrier(MPI_COMM_WORLD);
+  MPI_Finalize();
+#endif
+
+  if(status == SIMULATION_FAILED)
+    return 1;
 
   return 0;
 }
@@ -0,0 +1,88 @@
+/* ************************************************************************** */
+/** @file mcrt.h
+ *
+ *  @brief The libmcrt API, for running simulations from another program.
+ *
+ *  A simulation is held by an MCRTContext_t. It is configured with the same
+ *  parameters as the input file of mcrt, run, and its results are then read
+ *  from arrays owned by the context:
+ *
+ *      MCRTContext_t *context = mcrt_create();
+ *      mcrt_set(context, "n_photons", "1e6");
+ *      ...
+ *      if(mcrt_run(context) != MCRT_OK)
+ *        printf("%s\n", mcrt_error(context));
+ *      const double *intensity = mcrt_intensity(context, 0);
+ *      mcrt_destroy(context);
+ *
+ *  Contexts are independent, so several can be run at once on different
+ *  threads. Each run uses the OpenMP threads of the thread which calls
+ *  mcrt_run. A context must only be used by one thread at a time.
+ *
+ *  Nothing is written to file: output.format binary, escape_log,
+ *  checkpoint.interval, parameter sweeps and validation are refused, as they
+ *  write files or compare runs. Create a context for each point of a sweep
+ *  instead. An albedo_sweep gives a set of results for each albedo.
+ *
+ *  A missing parameter, or one with a value which cannot be used such as an
+ *  unknown transport_engine, makes mcrt_run return MCRT_ERROR with the reason
+ *  in mcrt_error, rather than ending the program as it does for mcrt.
+ *
+ *  When built with MCRT_MPI, the program must initialise MPI, every rank must
+ *  run the same contexts in the same order, and only rank 0 has the results.
+ *
+ * ************************************************************************** */
+
+#ifndef MCRT_H
+#define MCRT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ************************************************************************** */
+/**
+ *  @def MCRT_OK
+ *  Returned by a function which succeeded.
+ *  @def MCRT_ERROR
+ *  Returned by a function which failed, see mcrt_error.
+ *  @def MCRT_N_MOMENTS
+ *  The number of moments at each level, in the order j_plus, j_minus, h_plus,
+ *  h_minus, k_plus, k_minus.
+ *
+ * ************************************************************************** */
+
+#define MCRT_OK 0
+#define MCRT_ERROR 1
+#define MCRT_N_MOMENTS 6
+
+typedef struct mcrt_context MCRTContext_t;
+
+MCRTContext_t *mcrt_create(void);
+void mcrt_destroy(MCRTContext_t *context);
+int mcrt_set(MCRTContext_t *context, const char *name, const char *value);
+int mcrt_read_input(MCRTContext_t *context, const char *file_name);
+int mcrt_run(MCRTContext_t *context);
+const char *mcrt_error(const MCRTContext_t *context);
+
+long mcrt_n_photons(const MCRTContext_t *context);
+int mcrt_n_sets(const MCRTContext_t *context);
+int mcrt_n_bins(const MCRTContext_t *context);
+int mcrt_n_levels(const MCRTContext_t *context);
+int mcrt_n_peel(const MCRTContext_t *context);
+double mcrt_albedo(const MCRTContext_t *context, int set);
+
+const double *mcrt_theta(const MCRTContext_t *context);
+const double *mcrt_intensity(const MCRTContext_t *context, int set);
+const double *mcrt_intensity_error(const MCRTContext_t *context, int set);
+const double *mcrt_peel_mu(const MCRTContext_t *context);
+const double *mcrt_peel_intensity(const MCRTContext_t *context, int set);
+const double *mcrt_peel_error(const MCRTContext_t *context, int set);
+const double *mcrt_moments(const MCRTContext_t *context, int set);
+const double *mcrt_moment_errors(const MCRTContext_t *context, int set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,618 @@
+/* ************************************************************************** */
+/** @file mcrtmodule.c
+ *
+ *  @brief The mcrt Python module, which runs simulations through libmcrt.
+ *
+ *      import mcrt
+ *      import numpy as np
+ *
+ *      result = mcrt.run({"n_photons": 1e6, "seed": 1, "tau_max": 7, "scatter_albedo": 1,
+ *                         "hist.n_bins": 40, "moments.n_levels": 20})
+ *      intensity = np.asarray(result.intensity())
+ *
+ *  The parameters are those of the input file of mcrt. output_frequency is
+ *  optional, as nothing is written to file. The simulation runs with the GIL
+ *  released, so several can run at once on Python threads.
+ *
+ *  The arrays of a Result are memoryviews of the arrays held by its
+ *  MCRTContext_t, so numpy.asarray makes no copy of them. The context is only
+ *  freed once the Result and every view of it are gone.
+ *
+ * ************************************************************************** */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "mcrt.h"
+
+/* ************************************************************************** */
+/** @struct ResultObject
+ *
+ *  @brief A Result, which owns the context of a finished simulation.
+ *
+ *  @var ResultObject::context
+ *  The context the simulation was run in.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    PyObject_HEAD
+    MCRTContext_t *context;
+} ResultObject;
+
+/* ************************************************************************** */
+/** @struct ArrayObject
+ *
+ *  @brief Exports an array of doubles held by a Result through the buffer
+ *  protocol.
+ *
+ *  @var ArrayObject::owner
+ *  The Result the array belongs to, kept alive whilst the array is.
+ *  @var ArrayObject::data
+ *  The first element of the array.
+ *  @var ArrayObject::ndim
+ *  The number of dimensions, at most 3.
+ *  @var ArrayObject::shape
+ *  The number of elements along each dimension.
+ *  @var ArrayObject::strides
+ *  The number of bytes between elements along each dimension.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    PyObject_HEAD
+    PyObject *owner;
+    const double *data;
+    int ndim;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+} ArrayObject;
+
+static PyTypeObject ResultType;
+static PyTypeObject ArrayType;
+
+/* ************************************************************************** */
+/** array_getbuffer
+ *
+ *  @brief Fill in a read only buffer for an ArrayObject.
+ *
+ * ************************************************************************** */
+
+static int
+array_getbuffer(PyObject *object, Py_buffer *view, int flags)
+{
+  ArrayObject *array = (ArrayObject *) object;
+
+  if(flags & PyBUF_WRITABLE)
+  {
+    PyErr_SetString(PyExc_BufferError, "the results of a simulation are read only");
+    return -1;
+  }
+
+  view->obj = Py_NewRef(object);
+  view->buf = (void *) array->data;
+  view->itemsize = sizeof(double);
+  view->len = sizeof(double);
+  for(int i = 0; i < array->ndim; i++)
+    view->len *= array->shape[i];
+  view->readonly = 1;
+  view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+  view->ndim = array->ndim;
+  view->shape = (flags & PyBUF_ND) ? array->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? array->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+
+  if(view->strides == NULL && array->ndim > 1 && array->strides[0] != array->shape[1] * array->strides[1])
+  {
+    Py_CLEAR(view->obj);
+    PyErr_SetString(PyExc_BufferError, "the array is not contiguous, ask for a strided buffer");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ************************************************************************** */
+/** array_dealloc
+ *
+ *  @brief Free an ArrayObject and release its Result.
+ *
+ * ************************************************************************** */
+
+static void
+array_dealloc(PyObject *object)
+{
+  Py_XDECREF(((ArrayObject *) object)->owner);
+  Py_TYPE(object)->tp_free(object);
+}
+
+static PyBufferProcs array_buffer_procs = {array_getbuffer, NULL};
+
+static PyTypeObject ArrayType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "mcrt._Array",
+  .tp_basicsize = sizeof(ArrayObject),
+  .tp_dealloc = array_dealloc,
+  .tp_as_buffer = &array_buffer_procs,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "The buffer behind a memoryview of the results of a simulation.",
+};
+
+/* ************************************************************************** */
+/** array_view
+ *
+ *  @brief Return a memoryview of an array held by a Result.
+ *
+ *  @param[in] *owner    The Result.
+ *  @param[in] *data     The first element, or NULL for no array.
+ *  @param[in] ndim      The number of dimensions.
+ *  @param[in] *shape    The number of elements along each dimension.
+ *  @param[in] *strides  The number of doubles between elements along each
+ *                       dimension, or NULL for a C contiguous array.
+ *
+ *  @return A new memoryview, None if data is NULL, or NULL on error.
+ *
+ * ************************************************************************** */
+
+static PyObject *
+array_view(PyObject *owner, const double *data, int ndim, const Py_ssize_t *shape, const Py_ssize_t *strides)
+{
+  if(data == NULL)
+    Py_RETURN_NONE;
+
+  ArrayObject *array = PyObject_New(ArrayObject, &ArrayType);
+  if(array == NULL)
+    return NULL;
+
+  array->owner = Py_NewRef(owner);
+  array->data = data;
+  array->ndim = ndim;
+  for(int i = ndim - 1; i >= 0; i--)
+  {
+    array->shape[i] = shape[i];
+    if(strides)
+      array->strides[i] = strides[i] * (Py_ssize_t) sizeof(double);
+    else
+      array->strides[i] = i == ndim - 1 ? (Py_ssize_t) sizeof(double) : array->strides[i + 1] * shape[i + 1];
+  }
+
+  PyObject *view = PyMemoryView_FromObject((PyObject *) array);
+  Py_DECREF(array);
+
+  return view;
+}
+
+/* ************************************************************************** */
+/** parse_set
+ *
+ *  @brief Parse the optional set argument of a Result method.
+ *
+ *  @return 0 on success, otherwise -1 with an exception set.
+ *
+ * ************************************************************************** */
+
+static int
+parse_set(ResultObject *result, PyObject *args, PyObject *kwargs, int *set)
+{
+  static char *keywords[] = {"set", NULL};
+
+  *set = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", keywords, set))
+    return -1;
+
+  if(*set < 0 || *set >= mcrt_n_sets(result->context))
+  {
+    PyErr_Format(PyExc_IndexError, "set %d is out of range, there are %d", *set, mcrt_n_sets(result->context));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ************************************************************************** */
+/** Result methods
+ *
+ *  @brief Each returns a memoryview of one array of the results of a set,
+ *  for the set given by the optional set argument, 0 by default.
+ *
+ * ************************************************************************** */
+
+static PyObject *
+result_intensity(ResultObject *self, PyObject *args, PyObject *kwargs)
+{
+  int set;
+  if(parse_set(self, args, kwargs, &set))
+    return NULL;
+  Py_ssize_t shape[1] = {mcrt_n_bins(self->context)};
+  return array_view((PyObject *) self, mcrt_intensity(self->context, set), 1, shape, NULL);
+}
+
+static PyObject *
+result_intensity_error(ResultObject *self, PyObject *args, PyObject *kwargs)
+{
+  int set;
+  if(parse_set(self, args, kwargs, &set))
+    return NULL;
+  Py_ssize_t shape[1] = {mcrt_n_bins(self->context)};
+  return array_view((PyObject *) self, mcrt_intensity_error(self->context, set), 1, shape, NULL);
+}
+
+static PyObject *
+result_peel_intensity(ResultObject *self, PyObject *args, PyObject *kwargs)
+{
+  int set;
+  if(parse_set(self, args, kwargs, &set))
+    return NULL;
+  Py_ssize_t shape[1] = {mcrt_n_peel(self->context)};
+  return array_view((PyObject *) self, mcrt_peel_intensity(self->context, set), 1, shape, NULL);
+}
+
+static PyObject *
+result_peel_error(ResultObject *self, PyObject *args, PyObject *kwargs)
+{
+  int set;
+  if(parse_set(self, args, kwargs, &set))
+    return NULL;
+  Py_ssize_t shape[1] = {mcrt_n_peel(self->context)};
+  return array_view((PyObject *) self, mcrt_peel_error(self->context, set), 1, shape, NULL);
+}
+
+static PyObject *
+result_moments(ResultObject *self, PyObject *args, PyObject *kwargs)
+{
+  int set;
+  if(parse_set(self, args, kwargs, &set))
+    return NULL;
+  Py_ssize_t shape[2] = {mcrt_n_levels(self->context), MCRT_N_MOMENTS};
+  return array_view((PyObject *) self, mcrt_moments(self->context, set), 2, shape, NULL);
+}
+
+static PyObject *
+result_moment_errors(ResultObject *self, PyObject *args, PyObject *kwargs)
+{
+  int set;
+  if(parse_set(self, args, kwargs, &set))
+    return NULL;
+  Py_ssize_t shape[2] = {mcrt_n_levels(self->context), MCRT_N_MOMENTS};
+  return array_view((PyObject *) self, mcrt_moment_errors(self->context, set), 2, shape, NULL);
+}
+
+static PyMethodDef result_methods[] = {
+  {"intensity", (PyCFunction) (void (*)(void)) result_intensity, METH_VARARGS | METH_KEYWORDS,
+   "intensity(set=0)\n\nThe flux normalised intensity of each histogram bin."},
+  {"intensity_error", (PyCFunction) (void (*)(void)) result_intensity_error, METH_VARARGS | METH_KEYWORDS,
+   "intensity_error(set=0)\n\nThe standard error of the intensity of each histogram bin."},
+  {"peel_intensity", (PyCFunction) (void (*)(void)) result_peel_intensity, METH_VARARGS | METH_KEYWORDS,
+   "peel_intensity(set=0)\n\nThe peel-off intensity towards each observer, or None without peel_off."},
+  {"peel_error", (PyCFunction) (void (*)(void)) result_peel_error, METH_VARARGS | METH_KEYWORDS,
+   "peel_error(set=0)\n\nThe standard error of the peel-off intensities, or None without peel_off."},
+  {"moments", (PyCFunction) (void (*)(void)) result_moments, METH_VARARGS | METH_KEYWORDS,
+   "moments(set=0)\n\nThe moments at each level, of shape (n_levels + 1, 6), with the columns of moments.txt."},
+  {"moment_errors", (PyCFunction) (void (*)(void)) result_moment_errors, METH_VARARGS | METH_KEYWORDS,
+   "moment_errors(set=0)\n\nThe batch means errors of the moments, shaped as moments."},
+  {NULL, NULL, 0, NULL}
+};
+
+/* ************************************************************************** */
+/** Result attributes
+ *
+ *  @brief The arrays shared by every set and the sizes of the results.
+ *
+ * ************************************************************************** */
+
+static PyObject *
+result_get_theta(ResultObject *self, void *closure)
+{
+  (void) closure;
+  Py_ssize_t shape[1] = {mcrt_n_bins(self->context)};
+  return array_view((PyObject *) self, mcrt_theta(self->context), 1, shape, NULL);
+}
+
+static PyObject *
+result_get_peel_mu(ResultObject *self, void *closure)
+{
+  (void) closure;
+  Py_ssize_t shape[1] = {mcrt_n_peel(self->context)};
+  return array_view((PyObject *) self, mcrt_peel_mu(self->context), 1, shape, NULL);
+}
+
+static PyObject *
+result_get_n_photons(ResultObject *self, void *closure)
+{
+  (void) closure;
+  return PyLong_FromLong(mcrt_n_photons(self->context));
+}
+
+static PyObject *
+result_get_n_sets(ResultObject *self, void *closure)
+{
+  (void) closure;
+  return PyLong_FromLong(mcrt_n_sets(self->context));
+}
+
+static PyObject *
+result_get_albedo(ResultObject *self, void *closure)
+{
+  (void) closure;
+  int n_sets = mcrt_n_sets(self->context);
+  PyObject *albedo = PyTuple_New(n_sets);
+  if(albedo == NULL)
+    return NULL;
+
+  for(int s = 0; s < n_sets; s++)
+  {
+    PyObject *value = PyFloat_FromDouble(mcrt_albedo(self->context, s));
+    if(value == NULL)
+    {
+      Py_DECREF(albedo);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(albedo, s, value);
+  }
+
+  return albedo;
+}
+
+static PyGetSetDef result_getset[] = {
+  {"theta", (getter) result_get_theta, NULL, "The escape angle of the centre of each bin, in radians.", NULL},
+  {"peel_mu", (getter) result_get_peel_mu, NULL, "The cosine of each peel-off observer angle, or None.", NULL},
+  {"n_photons", (getter) result_get_n_photons, NULL, "The number of photons transported.", NULL},
+  {"n_sets", (getter) result_get_n_sets, NULL, "The number of sets, one for each albedo of albedo_sweep.", NULL},
+  {"albedo", (getter) result_get_albedo, NULL, "The albedo of each set.", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+/* ************************************************************************** */
+/** result_dealloc
+ *
+ *  @brief Free a Result and its context.
+ *
+ * ************************************************************************** */
+
+static void
+result_dealloc(PyObject *object)
+{
+  mcrt_destroy(((ResultObject *) object)->context);
+  Py_TYPE(object)->tp_free(object);
+}
+
+static PyTypeObject ResultType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "mcrt.Result",
+  .tp_basicsize = sizeof(ResultObject),
+  .tp_dealloc = result_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "The results of a simulation, returned by mcrt.run.",
+  .tp_methods = result_methods,
+  .tp_getset = result_getset,
+};
+
+/* ************************************************************************** */
+/** scalar_parameter_text
+ *
+ *  @brief Convert a single Python value into the text of a parameter.
+ *
+ *  @return A new string, or NULL with an exception set.
+ *
+ *  @details
+ *
+ *  Strings are used as they are and booleans become 0 or 1. Integers,
+ *  including NumPy's, are written exactly, and any other number is converted
+ *  with float and written with 17 significant digits, so NumPy floats do not
+ *  go through a repr such as "np.float64(2.0)". Anything else is a TypeError.
+ *
+ * ************************************************************************** */
+
+static PyObject *
+scalar_parameter_text(PyObject *value)
+{
+  char buffer[32];
+
+  if(PyUnicode_Check(value))
+    return Py_NewRef(value);
+
+  if(PyBool_Check(value))
+    return PyUnicode_FromString(value == Py_True ? "1" : "0");
+
+  if(PyIndex_Check(value))
+  {
+    PyObject *integer = PyNumber_Index(value);
+    if(integer == NULL)
+      return NULL;
+    PyObject *text = PyObject_Str(integer);
+    Py_DECREF(integer);
+    return text;
+  }
+
+  if(PyNumber_Check(value))
+  {
+    PyObject *number = PyNumber_Float(value);
+    if(number == NULL)
+      return NULL;
+    snprintf(buffer, sizeof buffer, "%.17g", PyFloat_AS_DOUBLE(number));
+    Py_DECREF(number);
+    return PyUnicode_FromString(buffer);
+  }
+
+  PyErr_Format(PyExc_TypeError, "parameter values must be numbers, strings or lists of them, not %s",
+               Py_TYPE(value)->tp_name);
+
+  return NULL;
+}
+
+/* ************************************************************************** */
+/** set_parameter_from_object
+ *
+ *  @brief Set a parameter of a context from a Python value.
+ *
+ *  @return 0 on success, otherwise -1 with an exception set.
+ *
+ *  @details
+ *
+ *  Lists and tuples become comma separated lists, and every value is
+ *  converted with scalar_parameter_text.
+ *
+ * ************************************************************************** */
+
+static int
+set_parameter_from_object(MCRTContext_t *context, PyObject *key, PyObject *value)
+{
+  PyObject *text;
+
+  if(!PyUnicode_Check(key))
+  {
+    PyErr_SetString(PyExc_TypeError, "parameter names must be strings");
+    return -1;
+  }
+
+  if(PyList_Check(value) || PyTuple_Check(value))
+  {
+    PyObject *items = PySequence_List(value);
+    if(items == NULL)
+      return -1;
+    for(Py_ssize_t i = 0; i < PyList_GET_SIZE(items); i++)
+    {
+      PyObject *item = PyList_GET_ITEM(items, i);
+      PyObject *item_text = scalar_parameter_text(item);
+      if(item_text == NULL)
+      {
+        Py_DECREF(items);
+        return -1;
+      }
+      PyList_SET_ITEM(items, i, item_text);
+      Py_DECREF(item);
+    }
+    PyObject *separator = PyUnicode_FromString(",");
+    text = separator ? PyUnicode_Join(separator, items) : NULL;
+    Py_XDECREF(separator);
+    Py_DECREF(items);
+  }
+  else
+  {
+    text = scalar_parameter_text(value);
+  }
+
+  if(text == NULL)
+    return -1;
+
+  const char *name = PyUnicode_AsUTF8(key);
+  const char *value_text = PyUnicode_AsUTF8(text);
+  int status = -1;
+  if(name && value_text)
+  {
+    if(mcrt_set(context, name, value_text) == MCRT_OK)
+      status = 0;
+    else
+      PyErr_SetString(PyExc_ValueError, mcrt_error(context));
+  }
+
+  Py_DECREF(text);
+
+  return status;
+}
+
+/* ************************************************************************** */
+/** mcrt_module_run
+ *
+ *  @brief Run a simulation, mcrt.run(parameters).
+ *
+ *  @return A new Result, or NULL with an exception set.
+ *
+ * ************************************************************************** */
+
+static PyObject *
+mcrt_module_run(PyObject *module, PyObject *args)
+{
+  PyObject *parameters;
+  PyObject *key, *value;
+  Py_ssize_t position = 0;
+  int status;
+
+  (void) module;
+  if(!PyArg_ParseTuple(args, "O!", &PyDict_Type, &parameters))
+    return NULL;
+
+  ResultObject *result = PyObject_New(ResultObject, &ResultType);
+  if(result == NULL)
+    return NULL;
+
+  result->context = mcrt_create();
+  if(result->context == NULL)
+  {
+    Py_DECREF(result);
+    return PyErr_NoMemory();
+  }
+
+  if(mcrt_set(result->context, "output_frequency", "1") != MCRT_OK)
+  {
+    Py_DECREF(result);
+    return PyErr_NoMemory();
+  }
+
+  while(PyDict_Next(parameters, &position, &key, &value))
+  {
+    if(set_parameter_from_object(result->context, key, value))
+    {
+      Py_DECREF(result);
+      return NULL;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  status = mcrt_run(result->context);
+  Py_END_ALLOW_THREADS
+
+  if(status != MCRT_OK)
+  {
+    PyErr_SetString(PyExc_ValueError, mcrt_error(result->context));
+    Py_DECREF(result);
+    return NULL;
+  }
+
+  return (PyObject *) result;
+}
+
+static PyMethodDef mcrt_module_methods[] = {
+  {"run", mcrt_module_run, METH_VARARGS,
+   "run(parameters)\n\nRun a simulation with the parameters of the input file of mcrt, given as a dict, and return "
+   "a Result. The GIL is released whilst the simulation runs."},
+  {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef mcrt_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "mcrt",
+  .m_doc = "Monte Carlo radiative transfer through a plane parallel slab, run in process by libmcrt.",
+  .m_size = -1,
+  .m_methods = mcrt_module_methods,
+};
+
+/* ************************************************************************** */
+/** PyInit_mcrt
+ *
+ *  @brief Create the mcrt module.
+ *
+ * ************************************************************************** */
+
+PyMODINIT_FUNC
+PyInit_mcrt(void)
+{
+  if(PyType_Ready(&ResultType) < 0 || PyType_Ready(&ArrayType) < 0)
+    return NULL;
+
+  PyObject *module = PyModule_Create(&mcrt_module);
+  if(module == NULL)
+    return NULL;
+
+  if(PyModule_AddObject(module, "Result", Py_NewRef((PyObject *) &ResultType)) < 0)
+  {
+    Py_DECREF(&ResultType);
+    Py_DECREF(module);
+    return NULL;
+  }
+
+  return module;
+}
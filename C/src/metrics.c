@@ -0,0 +1,274 @@
+/* ************************************************************************** */
+/** @file metrics.c
+ *
+ *  @brief Functions for counting what the transport does and writing the
+ *  counts to a metrics file, when built with MCRT_METRICS.
+ *
+ *  Each OpenMP thread adds to its own ThreadMetrics_t through the METRIC_*
+ *  macros in variables.h. A writer thread sums them every METRICS_INTERVAL
+ *  seconds and writes OUTPUT_FILE_METRICS in the Prometheus text format, so
+ *  it can be scraped whilst a long simulation runs, for example by the
+ *  textfile collector of the node exporter. The file is written to a
+ *  temporary file and renamed, so a reader never sees half a file. It is
+ *  written a last time when the transport finishes. With MPI, each rank
+ *  writes its own file with the rank added to the name.
+ *
+ *  Without MCRT_METRICS the macros compile to nothing and these functions do
+ *  nothing.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#if defined (_OPENMP)
+#include <omp.h>
+#endif
+
+#ifdef METRICS_ON
+
+static ThreadMetrics_t discarded;
+_Thread_local ThreadMetrics_t *THREAD_METRICS = &discarded;
+
+static ThreadMetrics_t *thread_metrics;
+static int n_threads;
+static int n_allocated;
+static double start_time;
+static char metrics_path[LINE_LEN + 32];
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static int writer_running = false;
+static int writer_stop = false;
+
+static const char *counter_names[N_COUNTERS] = {"photons", "scatters", "reemissions", "levels_crossed",
+                                                "absorptions", "escapes", "mrw_steps"};
+static const char *counter_help[N_COUNTERS] = {
+  "Photons transported.",
+  "Scatters, not counting MRW steps.",
+  "Photons re-emitted after leaving through the bottom of the slab.",
+  "Moment levels crossed, summed over every step.",
+  "Photons absorbed or ended by Russian roulette.",
+  "Photons escaped through the top of the slab.",
+  "MRW steps."
+};
+static const char *timer_names[N_TIMERS] = {"transport", "reduce"};
+
+/* ************************************************************************** */
+/** write_metrics
+ *
+ *  @brief Sum the counters of every thread and write the metrics file.
+ *
+ * ************************************************************************** */
+
+static void
+write_metrics(void)
+{
+  char tmp_path[LINE_LEN + 40];
+  uint64_t counters[N_COUNTERS] = {0};
+  FILE *f;
+
+  snprintf(tmp_path, sizeof tmp_path, "%s.tmp", metrics_path);
+  if((f = fopen(tmp_path, "w")) == NULL)
+  {
+    printf("Unable to open metrics file %s\n", tmp_path);
+    return;
+  }
+
+  for(int c = 0; c < N_COUNTERS; c++)
+  {
+    fprintf(f, "# HELP mcrt_%s_total %s\n# TYPE mcrt_%s_total counter\n", counter_names[c], counter_help[c],
+            counter_names[c]);
+    for(int t = 0; t < n_threads; t++)
+    {
+      uint64_t value = atomic_load_explicit(&thread_metrics[t].counters[c], memory_order_relaxed);
+      counters[c] += value;
+      fprintf(f, "mcrt_%s_total{rank=\"%d\",thread=\"%d\"} %lu\n", counter_names[c], RANK, t, (unsigned long) value);
+    }
+  }
+
+  fprintf(f, "# HELP mcrt_phase_seconds_total Wall time spent in each phase.\n");
+  fprintf(f, "# TYPE mcrt_phase_seconds_total counter\n");
+  for(int p = 0; p < N_TIMERS; p++)
+    for(int t = 0; t < n_threads; t++)
+      fprintf(f, "mcrt_phase_seconds_total{rank=\"%d\",thread=\"%d\",phase=\"%s\"} %.6f\n", RANK, t, timer_names[p],
+              1e-9 * atomic_load_explicit(&thread_metrics[t].timer_ns[p], memory_order_relaxed));
+
+  fprintf(f, "# HELP mcrt_photons_per_second Photons transported per second spent transporting.\n");
+  fprintf(f, "# TYPE mcrt_photons_per_second gauge\n");
+  for(int t = 0; t < n_threads; t++)
+  {
+    double seconds = 1e-9 * atomic_load_explicit(&thread_metrics[t].timer_ns[TIMER_TRANSPORT], memory_order_relaxed);
+    uint64_t photons = atomic_load_explicit(&thread_metrics[t].counters[COUNTER_PHOTONS], memory_order_relaxed);
+    fprintf(f, "mcrt_photons_per_second{rank=\"%d\",thread=\"%d\"} %.6g\n", RANK, t,
+            seconds > 0 ? photons / seconds : 0.0);
+  }
+
+  double n_photons = counters[COUNTER_PHOTONS] > 0 ? (double) counters[COUNTER_PHOTONS] : 1.0;
+  fprintf(f, "# HELP mcrt_scatters_per_photon Scatters per photon transported.\n");
+  fprintf(f, "# TYPE mcrt_scatters_per_photon gauge\n");
+  fprintf(f, "mcrt_scatters_per_photon{rank=\"%d\"} %.6g\n", RANK, counters[COUNTER_SCATTERS] / n_photons);
+  fprintf(f, "# HELP mcrt_levels_crossed_per_photon Moment levels crossed per photon transported.\n");
+  fprintf(f, "# TYPE mcrt_levels_crossed_per_photon gauge\n");
+  fprintf(f, "mcrt_levels_crossed_per_photon{rank=\"%d\"} %.6g\n", RANK,
+          counters[COUNTER_LEVELS_CROSSED] / n_photons);
+  fprintf(f, "# HELP mcrt_elapsed_seconds Wall time since the transport started.\n");
+  fprintf(f, "# TYPE mcrt_elapsed_seconds gauge\n");
+  fprintf(f, "mcrt_elapsed_seconds{rank=\"%d\"} %.3f\n", RANK, get_wall_time() - start_time);
+  fprintf(f, "# HELP mcrt_threads OpenMP threads transporting photons.\n");
+  fprintf(f, "# TYPE mcrt_threads gauge\n");
+  fprintf(f, "mcrt_threads{rank=\"%d\"} %d\n", RANK, n_threads);
+
+  if(fclose(f) || rename(tmp_path, metrics_path))
+    printf("Unable to write metrics file %s\n", metrics_path);
+}
+
+/* ************************************************************************** */
+/** metrics_writer
+ *
+ *  @brief The main function of the writer thread.
+ *
+ *  @details
+ *
+ *  Writes the metrics file every METRICS_INTERVAL seconds until it is told to
+ *  stop.
+ *
+ * ************************************************************************** */
+
+static void *
+metrics_writer(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&writer_lock);
+  while(!writer_stop)
+  {
+    struct timespec wake;
+    get_deadline(METRICS_INTERVAL, &wake);
+    while(!writer_stop && pthread_cond_timedwait(&writer_wake, &writer_lock, &wake) == 0)
+      ;
+    if(writer_stop)
+      break;
+
+    pthread_mutex_unlock(&writer_lock);
+    write_metrics();
+    pthread_mutex_lock(&writer_lock);
+  }
+  pthread_mutex_unlock(&writer_lock);
+
+  return NULL;
+}
+
+#endif
+
+/* ************************************************************************** */
+/** start_metrics
+ *
+ *  @brief Zero the counters of every thread and start the writer thread.
+ *
+ *  @details
+ *
+ *  The writer thread is only started if METRICS_INTERVAL is above 0. The
+ *  counters are kept from one simulation to the next, as the OpenMP threads
+ *  still point at them, and only grow if there are more threads.
+ *
+ * ************************************************************************** */
+
+void
+start_metrics(void)
+{
+#ifdef METRICS_ON
+#if defined(_OPENMP)
+  n_threads = omp_get_max_threads();
+#else
+  n_threads = 1;
+#endif
+
+  if(n_threads > n_allocated)
+  {
+    aligned_free(thread_metrics);
+    thread_metrics = aligned_calloc(n_threads, sizeof *thread_metrics);
+    n_allocated = n_threads;
+  }
+  memset(thread_metrics, 0, n_allocated * sizeof *thread_metrics);
+  start_time = get_wall_time();
+
+  char dir_path[LINE_LEN];
+  make_output_dirs();
+  output_set_path(dir_path, 0, OUTPUT_FILE_METRICS);
+  if(N_RANKS > 1)
+    snprintf(metrics_path, sizeof metrics_path, "%s.%d", dir_path, RANK);
+  else
+    snprintf(metrics_path, sizeof metrics_path, "%s", dir_path);
+
+  writer_stop = false;
+  writer_running = false;
+  if(METRICS_INTERVAL > 0)
+  {
+    if(pthread_create(&writer_thread, NULL, metrics_writer, NULL))
+    {
+      printf("Unable to start the metrics writer\n");
+      exit(1);
+    }
+    writer_running = true;
+  }
+#endif
+}
+
+/* ************************************************************************** */
+/** attach_thread_metrics
+ *
+ *  @brief Point THREAD_METRICS at the counters of the calling thread.
+ *
+ *  @details
+ *
+ *  Counts made by a thread which is not attached, for example outside of the
+ *  transport or when EMBEDDED, are added to a set of counters which is never
+ *  written.
+ *
+ * ************************************************************************** */
+
+void
+attach_thread_metrics(void)
+{
+#ifdef METRICS_ON
+#if defined(_OPENMP)
+  int thread = omp_get_thread_num();
+#else
+  int thread = 0;
+#endif
+  THREAD_METRICS = !EMBEDDED && thread < n_threads ? &thread_metrics[thread] : &discarded;
+#endif
+}
+
+/* ************************************************************************** */
+/** stop_metrics
+ *
+ *  @brief Stop the writer thread and write the metrics file a last time.
+ *
+ * ************************************************************************** */
+
+void
+stop_metrics(void)
+{
+#ifdef METRICS_ON
+  if(writer_running)
+  {
+    pthread_mutex_lock(&writer_lock);
+    writer_stop = true;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer_thread, NULL);
+    writer_running = false;
+  }
+
+  write_metrics();
+#endif
+}
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdbool.h>
 
 #include "variables.h"
 #include "functions.h"
@@ -26,21 +27,97 @@
  *
  *  @details
  *
- *  Allocates memory for the pointers in a Moments_t struct with n_levels + 1
- *  elements. The elements of these arrays are initialised to zero. Calloc may
- *  have been a better alternative here than malloc followed by a loop.
+ *  Allocates memory for the N_MOMENTS moments at n_levels + 1 levels, plus the
+ *  end marker level used by the difference array. The elements are
+ *  initialised to zero.
  *
  * ************************************************************************** */
 
 void
 init_moments(Moments_t *moments)
 {
-  moments->j_plus = calloc(moments->n_levels + 1, sizeof *moments->j_plus);
-  moments->h_plus = calloc(moments->n_levels + 1, sizeof *moments->h_plus);
-  moments->k_plus = calloc(moments->n_levels + 1, sizeof *moments->k_plus);
-  moments->j_minus = calloc(moments->n_levels + 1, sizeof *moments->j_minus);
-  moments->h_minus = calloc(moments->n_levels + 1, sizeof *moments->h_minus);
-  moments->k_minus = calloc(moments->n_levels + 1, sizeof *moments->k_minus);
+  moments->level = calloc(N_MOMENTS * (moments->n_levels + 2), sizeof *moments->level);
+  moments->level_sq = calloc(N_MOMENTS * (moments->n_levels + 2), sizeof *moments->level_sq);
+  moments->n_batches = 0;
+  if(moments->level == NULL || moments->level_sq == NULL)
+  {
+    printf("Unable to allocate memory for %d levels of radiation moments\n", moments->n_levels);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** crossed_levels
+ *
+ *  @brief Find the range of levels crossed by a photon.
+ *
+ *  @param[in] *moments   A pointer to an initialised Moments_t structure.
+ *  @param[in] z_pre      The position before the photon was moved.
+ *  @param[in] z_post     The position after the photon was moved.
+ *  @param[in] costheta   The cosine of the theta direction of the photon.
+ *  @param[out] *first    The lowest level crossed.
+ *  @param[out] *last     The highest level crossed.
+ *
+ *  @return true if at least one level was crossed.
+ *
+ *  @details
+ *
+ *  The level a position corresponds to is found, and the levels between the
+ *  pre and post scattering positions are counted as crossed. Photons leaving
+ *  the slab cross every level up to the boundary.
+ *
+ * ************************************************************************** */
+
+static int
+crossed_levels(Moments_t *moments, double z_pre, double z_post, double costheta, int *first, int *last)
+{
+  /*
+   * If the photon hasn't moved a vast distance, then we don't need to do
+   * anything
+   */
+
+  if((z_pre > 0) && (z_post > 0) && (((int) (z_pre * moments->n_levels)) == ((int) (z_post * moments->n_levels))))
+    return false;
+
+  if(costheta > 0)
+  {
+    if(z_pre <= 0)
+    {
+      *first = 0;
+    }
+    else
+    {
+      *first = (int) (z_pre * moments->n_levels) + 1;
+    }
+
+    if(z_post >= 1)
+    {
+      *last = moments->n_levels;
+    }
+    else
+    {
+      *last = (int) (z_post * moments->n_levels);
+    }
+  }
+  else if(costheta < 0)
+  {
+    *last = (int) (z_pre * moments->n_levels);
+
+    if(z_post <= 0)
+    {
+      *first = 0;
+    }
+    else
+    {
+      *first = (int) (z_post * moments->n_levels) + 1;
+    }
+  }
+  else
+  {
+    return false;
+  }
+
+  return *first <= *last;
 }
 
 /* ************************************************************************** */
@@ -55,6 +132,7 @@ init_moments(Moments_t *moments)
  *                             been transported a length ds.
  *  @param[in] costheta        The cosine of the theta direction of the
  *                             photon.
+ *  @param[in] weight          The weight of the photon packet.
  *
  *  @details
  *
@@ -71,69 +149,169 @@ init_moments(Moments_t *moments)
  *  the final value will be the sum of the upwards and downwards direction.
  *
  *  The moments are calculated essentially by photon counters, i.e. it counts
- *  how many times photons pass through this level.
+ *  how many times photons pass through this level, with each crossing counted
+ *  by the packet's weight.
+ *
+ *  Every level between the two positions is incremented by the same amount, so
+ *  rather than looping over the levels the increment is added to the first
+ *  level crossed and subtracted from the level after the last, in the
+ *  difference array. The cost is therefore the same no matter how many levels
+ *  are crossed, and the moments are recovered with integrate_moments once all
+ *  photons have been transported.
  *
  * ************************************************************************** */
 
 void
-increment_radiation_moment_estimators(Moments_t *moments, double z_pre, double z_post, double costheta)
+increment_radiation_moment_estimators(Moments_t *moments, double z_pre, double z_post, double costheta, double weight)
 {
-  /*
-   * If the photon hasn't moved a vast distance, then we don't need to do
-   * anything
-   */
+  int first_level, last_level;
 
-  if((z_pre > 0) && (z_post > 0) && (((int) (z_pre * moments->n_levels)) == ((int) (z_post * moments->n_levels))))
+  if(!crossed_levels(moments, z_pre, z_post, costheta, &first_level, &last_level))
     return;
 
-  int pre_scat_level_ele;
-  int post_scat_level_ele;
+  METRIC_ADD(COUNTER_LEVELS_CROSSED, last_level - first_level + 1);
+  double *first = &MOMENT(moments, first_level, 0);
+  double *end = &MOMENT(moments, last_level + 1, 0);
 
   if(costheta > 0)
   {
-    if(z_pre <= 0)
-    {
-      pre_scat_level_ele = 0;
-    }
-    else
-    {
-      pre_scat_level_ele = (int) (z_pre * moments->n_levels) + 1;
-    }
+    double j = weight / costheta;
+    double k = weight * costheta;
 
-    if(z_post >= 1)
-    {
-      post_scat_level_ele = moments->n_levels;
-    }
-    else
-    {
-      post_scat_level_ele = (int) (z_post * moments->n_levels);
-    }
+    first[MOMENT_J_PLUS] += j;
+    first[MOMENT_H_PLUS] += weight;
+    first[MOMENT_K_PLUS] += k;
+    end[MOMENT_J_PLUS] -= j;
+    end[MOMENT_H_PLUS] -= weight;
+    end[MOMENT_K_PLUS] -= k;
+  }
+  else
+  {
+    double j = weight / fabs(costheta);
+    double k = weight * fabs(costheta);
 
-    for(int i = pre_scat_level_ele; i <= post_scat_level_ele; i++)
-    {
-      moments->j_plus[i] += 1.0 / costheta;
-      moments->h_plus[i] += 1;
-      moments->k_plus[i] += costheta;
-    }
+    first[MOMENT_J_MINUS] += j;
+    first[MOMENT_H_MINUS] -= weight;
+    first[MOMENT_K_MINUS] += k;
+    end[MOMENT_J_MINUS] -= j;
+    end[MOMENT_H_MINUS] += weight;
+    end[MOMENT_K_MINUS] -= k;
   }
-  else if(costheta < 0)
+}
+
+/* ************************************************************************** */
+/** increment_stretched_moment_estimators
+ *
+ *  @brief Update the moments of the radiation field for a photon whose path
+ *  length was sampled with path length stretching.
+ *
+ *  @param[in,out] *moments  A pointer to an initialised Moments_t structure.
+ *  @param[in] z_pre         The position before the photon was moved.
+ *  @param[in] z_post        The position after the photon was moved.
+ *  @param[in] costheta      The cosine of the theta direction of the photon.
+ *  @param[in] weight        The weight of the photon packet at z_pre.
+ *  @param[in] rate          The rate, per unit z, at which the weight of the
+ *                           packet changes along its path.
+ *
+ *  @details
+ *
+ *  The same as increment_radiation_moment_estimators, except that a crossing
+ *  of the level at z is counted with the weight
+ *
+ *      weight * exp(-rate * (z - z_pre)),
+ *
+ *  the ratio of the true and the stretched probabilities of the photon getting
+ *  that far. As the increment differs at each level, the difference between
+ *  each level and the one below is added to the difference array, with the
+ *  weight at each level found from the one before.
+ *
+ * ************************************************************************** */
+
+void
+increment_stretched_moment_estimators(Moments_t *moments, double z_pre, double z_post, double costheta,
+                                      double weight, double rate)
+{
+  int first_level, last_level;
+
+  if(!crossed_levels(moments, z_pre, z_post, costheta, &first_level, &last_level))
+    return;
+
+  METRIC_ADD(COUNTER_LEVELS_CROSSED, last_level - first_level + 1);
+  double mu = fabs(costheta);
+  double step = exp(-rate / moments->n_levels);
+  double w = weight * exp(-rate * ((double) first_level / moments->n_levels - z_pre));
+  int j_index = costheta > 0 ? MOMENT_J_PLUS : MOMENT_J_MINUS;
+  int h_index = costheta > 0 ? MOMENT_H_PLUS : MOMENT_H_MINUS;
+  int k_index = costheta > 0 ? MOMENT_K_PLUS : MOMENT_K_MINUS;
+  double h_sign = costheta > 0 ? 1.0 : -1.0;
+  double previous = 0;
+
+  for(int i = first_level; i <= last_level; i++)
   {
-    pre_scat_level_ele = (int) (z_pre * moments->n_levels);
+    MOMENT(moments, i, j_index) += (w - previous) / mu;
+    MOMENT(moments, i, h_index) += h_sign * (w - previous);
+    MOMENT(moments, i, k_index) += (w - previous) * mu;
+    previous = w;
+    w *= step;
+  }
 
-    if(z_post <= 0)
-    {
-      post_scat_level_ele = 0;
-    }
-    else
-    {
-      post_scat_level_ele = (int) (z_post * moments->n_levels) + 1;
-    }
+  MOMENT(moments, last_level + 1, j_index) -= previous / mu;
+  MOMENT(moments, last_level + 1, h_index) -= h_sign * previous;
+  MOMENT(moments, last_level + 1, k_index) -= previous * mu;
+}
 
-    for(int i = post_scat_level_ele; i <= pre_scat_level_ele; i++)
+/* ************************************************************************** */
+/** integrate_moments
+ *
+ *  @brief Turn the difference array of the moment estimators into the moments.
+ *
+ *  @param[in, out] *moments  A Moments_t struct holding the summed difference
+ *                            array of every photon.
+ *
+ *  @details
+ *
+ *  A running sum over the levels, for each moment. The difference arrays of
+ *  separate tallies can be added together before this is done, so it is only
+ *  required once at the end of a simulation.
+ *
+ * ************************************************************************** */
+
+void
+integrate_moments(Moments_t *moments)
+{
+  for(int i = 1; i < moments->n_levels + 2; i++)
+    for(int m = 0; m < N_MOMENTS; m++)
+      MOMENT(moments, i, m) += MOMENT(moments, i - 1, m);
+}
+
+/* ************************************************************************** */
+/** normalise_moments
+ *
+ *  @brief Divide the integrated moments and their errors by the number of
+ *         photons, in the column order of OUTPUT_FILE_MOMENTS.
+ *
+ *  @param[in] *moments   An integrated Moments_t struct.
+ *  @param[in] n_photons  The number of photons transported.
+ *  @param[out] *values   The moments, N_MOMENTS for each of the n_levels + 1
+ *                        levels, in the order j_plus, j_minus, h_plus,
+ *                        h_minus, k_plus, k_minus.
+ *  @param[out] *errors   The batch means errors of the moments, laid out as
+ *                        values.
+ *
+ * ************************************************************************** */
+
+void
+normalise_moments(Moments_t *moments, long n_photons, double *values, double *errors)
+{
+  int order[N_MOMENTS] = {MOMENT_J_PLUS, MOMENT_J_MINUS, MOMENT_H_PLUS, MOMENT_H_MINUS, MOMENT_K_PLUS, MOMENT_K_MINUS};
+
+  for(int i = 0; i < moments->n_levels + 1; i++)
+  {
+    for(int m = 0; m < N_MOMENTS; m++)
     {
-      moments->j_minus[i] += 1.0 / fabs(costheta);
-      moments->h_minus[i] -= 1;
-      moments->k_minus[i] += fabs(costheta);
+      values[N_MOMENTS * i + m] = MOMENT(moments, i, order[m]) / n_photons;
+      errors[N_MOMENTS * i + m] = batch_means_error(MOMENT(moments, i, order[m]), MOMENT_SQ(moments, i, order[m]),
+                                                    moments->n_batches) / n_photons;
     }
   }
 }
@@ -12,36 +12,131 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
 
 #include "variables.h"
 #include "functions.h"
 
+static Parameters_t program_parameters = {.output_point = -1};
+_Thread_local Parameters_t *PARAMETERS = &program_parameters;
+int RANK = 0;
+int N_RANKS = 1;
+
 /* ************************************************************************** */
-/** read_double
+/** init_parameters
  *
- *  @brief Main control function for getting parameters from file
+ *  @brief Set a Parameters_t struct to the state before any parameters are
+ *         read.
+ *
+ *  @param[out] *parameters  The struct to initialise.
+ *
+ * ************************************************************************** */
+
+void
+init_parameters(Parameters_t *parameters)
+{
+  memset(parameters, 0, sizeof *parameters);
+  parameters->output_point = -1;
+}
+
+/* ************************************************************************** */
+/** free_parameters
  *
- *  @param[in]
+ *  @brief Free the memory held by a Parameters_t struct.
  *
- *  @return 0
+ *  @param[in, out] *parameters  The struct to free.
+ *
+ * ************************************************************************** */
+
+void
+free_parameters(Parameters_t *parameters)
+{
+  free(parameters->sweep_albedos);
+  free(parameters->peel_mu);
+  free_phase_table(parameters->phase_table);
+  free_layers(parameters->layers);
+  parameters->sweep_albedos = NULL;
+  parameters->peel_mu = NULL;
+  parameters->phase_table = NULL;
+  parameters->layers = NULL;
+  parameters->phase_function = PHASE_ISOTROPIC;
+  parameters->n_sweep = 0;
+  parameters->n_peel = 0;
+}
+
+/* ************************************************************************** */
+/** parameter_error
+ *
+ *  @brief Report a parameter which cannot be used.
+ *
+ *  @param[in] *format  The printf format of the message, without a newline.
  *
  *  @details
  *
+ *  The program exits with the message, as a simulation cannot be run with the
+ *  parameter. When EMBEDDED, the first message is kept in PARAMETER_ERROR
+ *  instead and this returns, so the caller must return a failure in turn.
+ *
  * ************************************************************************** */
 
-union ParameterUnion
-get_single_parameter(FILE *f, char *name, int type)
+void
+parameter_error(const char *format, ...)
 {
-  union ParameterUnion data;
+  va_list args;
+
+  va_start(args, format);
+  if(!EMBEDDED)
+  {
+    vprintf(format, args);
+    printf("\n");
+    exit(1);
+  }
+
+  if(PARAMETER_ERROR[0] == '\0')
+    vsnprintf(PARAMETER_ERROR, LINE_LEN, format, args);
+  va_end(args);
+}
+
+/* ************************************************************************** */
+/** read_parameter_table
+ *
+ *  @brief Read every parameter in the input file into a table.
+ *
+ *  @param[in] *file_name  The filename of the input file.
+ *  @param[out] *table     The table of parameters.
+ *
+ *  @return true if the file was read, which is always the case unless
+ *  EMBEDDED.
+ *
+ *  @details
+ *
+ *  The input file is only read once, and the parameters are then looked up in
+ *  the table. If a parameter is given more than once, the last occurrence is
+ *  used.
+ *
+ * ************************************************************************** */
+
+int
+read_parameter_table(char *file_name, ParameterTable_t *table)
+{
+  FILE *f;
   char line[LINE_LEN];
   char c_parameter[LINE_LEN];
   char c_value[LINE_LEN];
-  char value[LINE_LEN];
 
-  rewind(f);
+  table->n_parameters = 0;
+  table->parameters = NULL;
+
+  if((f = fopen(file_name, "r")) == NULL)
+  {
+    parameter_error("Cannot open input file %s", file_name);
+    return false;
+  }
 
-  value[0] = NO_PARAMETER;
   int linenum = 0;
   while(fgets(line, LINE_LEN, f) != NULL)
   {
@@ -51,69 +146,953 @@ get_single_parameter(FILE *f, char *name, int type)
 
     if(sscanf(line, "%s %s", c_parameter, c_value) != 2)
     {
-      printf("Syntax error: line %d for parameter %s\n", linenum, c_parameter);
-      exit(1);
+      fclose(f);
+      parameter_error("Syntax error: line %d for parameter %s", linenum, c_parameter);
+      return false;
     }
 
-    if(strcmp(name, c_parameter) == 0)
-      strcpy(value, c_value);
+    set_parameter(table, c_parameter, c_value);
+  }
+
+  if(fclose(f))
+  {
+    parameter_error("Cannot close file %s", file_name);
+    return false;
   }
 
-  if(value[0] == NO_PARAMETER)
+  return true;
+}
+
+/* ************************************************************************** */
+/** set_parameter
+ *
+ *  @brief Set the value of a parameter in a table, adding it if it is not
+ *         already in the table.
+ *
+ *  @param[in, out] *table  The table of parameters.
+ *  @param[in] *name        The name of the parameter.
+ *  @param[in] *value       The value of the parameter, as it would be written
+ *                          in the input file.
+ *
+ *  @details
+ *
+ *  The table grows in powers of two. A table can be built this way without an
+ *  input file, starting from n_parameters = 0 and parameters = NULL.
+ *
+ * ************************************************************************** */
+
+void
+set_parameter(ParameterTable_t *table, char *name, char *value)
+{
+  if(strlen(name) >= LINE_LEN || strlen(value) >= LINE_LEN)
   {
-    printf("Parameter '%s' not found\n", name);
+    printf("The parameter %s is too long\n", name);
     exit(1);
   }
 
-  if(type == TYPE_INT)
+  Parameter_t *parameter = find_parameter(table, name);
+  if(parameter == NULL)
+  {
+    int n = table->n_parameters;
+    if(n == 0 || (n >= 32 && (n & (n - 1)) == 0))
+    {
+      int n_allocated = n < 32 ? 32 : 2 * n;
+      table->parameters = realloc(table->parameters, n_allocated * sizeof *table->parameters);
+      if(table->parameters == NULL)
+      {
+        printf("Unable to allocate memory for the parameters\n");
+        exit(1);
+      }
+    }
+    parameter = &table->parameters[table->n_parameters++];
+    strcpy(parameter->name, name);
+  }
+  else
+  {
+    free(parameter->values);
+  }
+
+  strcpy(parameter->value, value);
+  parameter->n_values = 0;
+  parameter->index = 0;
+  parameter->values = NULL;
+}
+
+/* ************************************************************************** */
+/** free_parameter_table
+ *
+ *  @brief Free the memory of a table of parameters.
+ *
+ *  @param[in, out] *table  The table to free.
+ *
+ * ************************************************************************** */
+
+void
+free_parameter_table(ParameterTable_t *table)
+{
+  for(int i = 0; i < table->n_parameters; i++)
+    free(table->parameters[i].values);
+  free(table->parameters);
+  table->parameters = NULL;
+  table->n_parameters = 0;
+}
+
+/* ************************************************************************** */
+/** find_parameter
+ *
+ *  @brief Search the table of parameters for a parameter.
+ *
+ *  @param[in] *table  The table of parameters.
+ *  @param[in] *name   The name of the parameter.
+ *
+ *  @return The parameter, or NULL if it is not in the table.
+ *
+ * ************************************************************************** */
+
+Parameter_t *
+find_parameter(ParameterTable_t *table, char *name)
+{
+  for(int i = 0; i < table->n_parameters; i++)
+    if(strcmp(name, table->parameters[i].name) == 0)
+      return &table->parameters[i];
+
+  return NULL;
+}
+
+/* ************************************************************************** */
+/** init_sweep_axis
+ *
+ *  @brief Turn a parameter into an axis of a parameter sweep.
+ *
+ *  @param[in, out] *parameter  A parameter whose value is a comma separated
+ *                              list or a range start:stop:step.
+ *
+ * ************************************************************************** */
+
+static void
+init_sweep_axis(Parameter_t *parameter)
+{
+  char value[LINE_LEN];
+  char *end;
+
+  strcpy(value, parameter->value);
+
+  if(strchr(value, ':') != NULL)
+  {
+    double range[3];
+    char *save;
+    char *token = strtok_r(value, ":", &save);
+    for(int i = 0; i < 3; i++)
+    {
+      range[i] = token == NULL ? NAN : strtod(token, &end);
+      if(token == NULL || end == token || *end != '\0')
+      {
+        parameter_error("Parameter '%s' must be a range start:stop:step, not '%s'", parameter->name, parameter->value);
+        return;
+      }
+      token = strtok_r(NULL, ":", &save);
+    }
+
+    double n_steps = (range[1] - range[0]) / range[2];
+    if(token != NULL || range[2] == 0 || n_steps < 0 || n_steps > 1e6)
+    {
+      parameter_error("Parameter '%s' must be a range start:stop:step, not '%s'", parameter->name, parameter->value);
+      return;
+    }
+
+    parameter->n_values = (int) floor(n_steps + 1e-9) + 1;
+    parameter->values = malloc(parameter->n_values * sizeof *parameter->values);
+    for(int i = 0; i < parameter->n_values; i++)
+      parameter->values[i] = range[0] + i * range[2];
+  }
+  else
+  {
+    parameter->values = malloc((strlen(value) / 2 + 1) * sizeof *parameter->values);
+    for(char *save, *token = strtok_r(value, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+      double x = strtod(token, &end);
+      if(end == token || *end != '\0')
+      {
+        parameter_error("Parameter '%s' must be a comma separated list of numbers, not '%s'", parameter->name,
+                        parameter->value);
+        free(parameter->values);
+        parameter->values = NULL;
+        parameter->n_values = 0;
+        return;
+      }
+      parameter->values[parameter->n_values++] = x;
+    }
+  }
+
+  parameter->index = 0;
+}
+
+/* ************************************************************************** */
+/** convert_parameter
+ *
+ *  @brief Convert the value of a parameter into the requested type.
+ *
+ *  @param[in, out] *parameter  The parameter.
+ *  @param[in] type             TYPE_INT or TYPE_DOUBLE.
+ *
+ *  @return The converted value.
+ *
+ *  @details
+ *
+ *  A value which is a list or a range makes the parameter an axis of a
+ *  parameter sweep, and the value of the current sweep point is returned.
+ *
+ * ************************************************************************** */
+
+static union ParameterUnion
+convert_parameter(Parameter_t *parameter, int type)
+{
+  union ParameterUnion data;
+
+  if(parameter->n_values == 0 && strpbrk(parameter->value, ",:") != NULL)
+    init_sweep_axis(parameter);
+
+  if(parameter->n_values > 0)
   {
-    data._int = (int) strtol(value, NULL, 10);
+    double value = parameter->values[parameter->index];
+    if(type == TYPE_INT)
+      data._int = (int) lround(value);
+    else
+      data._double = value;
+  }
+  else if(type == TYPE_INT)
+  {
+    data._int = (int) strtol(parameter->value, NULL, 10);
   }
   else
   {
-    data._double = strtod(value, NULL);
+    data._double = strtod(parameter->value, NULL);
   }
 
   return data;
 }
 
+/* ************************************************************************** */
+/** get_single_parameter
+ *
+ *  @brief Get a parameter which must be present in the input file.
+ *
+ *  @param[in] *table  The table of parameters.
+ *  @param[in] *name   The name of the parameter.
+ *  @param[in] type    TYPE_INT or TYPE_DOUBLE.
+ *
+ *  @return The value of the parameter.
+ *
+ *  @details
+ *
+ *  The program exits if the parameter cannot be found, or when EMBEDDED it
+ *  is reported by parameter_error and 0 is returned.
+ *
+ * ************************************************************************** */
+
+union ParameterUnion
+get_single_parameter(ParameterTable_t *table, char *name, int type)
+{
+  Parameter_t *parameter = find_parameter(table, name);
+
+  if(parameter == NULL)
+  {
+    union ParameterUnion none = {0};
+    parameter_error("Parameter '%s' not found", name);
+    return none;
+  }
+
+  return convert_parameter(parameter, type);
+}
+
+/* ************************************************************************** */
+/** get_optional_parameter
+ *
+ *  @brief Get a parameter which can be left out of the input file.
+ *
+ *  @param[in] *table            The table of parameters.
+ *  @param[in] *name             The name of the parameter.
+ *  @param[in] type              TYPE_INT or TYPE_DOUBLE.
+ *  @param[in] default_value     The value used if the parameter is not found.
+ *
+ *  @return The value of the parameter.
+ *
+ * ************************************************************************** */
+
+union ParameterUnion
+get_optional_parameter(ParameterTable_t *table, char *name, int type, union ParameterUnion default_value)
+{
+  Parameter_t *parameter = find_parameter(table, name);
+
+  if(parameter == NULL)
+    return default_value;
+
+  return convert_parameter(parameter, type);
+}
+
+/* ************************************************************************** */
+/** get_optional_string_parameter
+ *
+ *  @brief Get a string parameter which can be left out of the input file.
+ *
+ *  @param[in] *table          The table of parameters.
+ *  @param[in] *name           The name of the parameter.
+ *  @param[out] *value         The value of the parameter, at least LINE_LEN
+ *                             characters long.
+ *  @param[in] *default_value  The value used if the parameter is not found.
+ *
+ *  @details
+ *
+ *  String parameters are never an axis of a parameter sweep, so a comma
+ *  separated list is returned as it is.
+ *
+ * ************************************************************************** */
+
+void
+get_optional_string_parameter(ParameterTable_t *table, char *name, char *value, char *default_value)
+{
+  Parameter_t *parameter = find_parameter(table, name);
+
+  if(parameter == NULL)
+    strcpy(value, default_value);
+  else
+    strcpy(value, parameter->value);
+}
+
+/* ************************************************************************** */
+/** n_parameter_points
+ *
+ *  @brief Count the points of a parameter sweep.
+ *
+ *  @param[in] *table  The table of parameters, after get_all_parameters.
+ *
+ *  @return The number of points, which is 1 if nothing is swept.
+ *
+ *  @details
+ *
+ *  A parameter only becomes an axis once it has been read as a number, so
+ *  get_all_parameters must have been called first.
+ *
+ * ************************************************************************** */
+
+int
+n_parameter_points(ParameterTable_t *table)
+{
+  long n_points = 1;
+
+  for(int i = 0; i < table->n_parameters; i++)
+  {
+    if(table->parameters[i].n_values > 0)
+      n_points *= table->parameters[i].n_values;
+    if(n_points > INT_MAX)
+    {
+      parameter_error("The parameter sweep has too many points");
+      return 1;
+    }
+  }
+
+  return (int) n_points;
+}
+
+/* ************************************************************************** */
+/** select_parameter_point
+ *
+ *  @brief Choose the values of the swept parameters for a sweep point.
+ *
+ *  @param[in, out] *table  The table of parameters.
+ *  @param[in] point        The sweep point, from 0 to n_parameter_points - 1.
+ *
+ *  @details
+ *
+ *  The last axis in the input file changes fastest. get_all_parameters has to
+ *  be called again to set the parameters of the point.
+ *
+ * ************************************************************************** */
+
+void
+select_parameter_point(ParameterTable_t *table, int point)
+{
+  for(int i = table->n_parameters - 1; i >= 0; i--)
+  {
+    Parameter_t *parameter = &table->parameters[i];
+    if(parameter->n_values == 0)
+      continue;
+    parameter->index = point % parameter->n_values;
+    point /= parameter->n_values;
+  }
+}
+
+/* ************************************************************************** */
+/** init_peel_off_angles
+ *
+ *  @brief Set the observer angles for the peel-off estimator.
+ *
+ *  @param[in] peel_off  Whether to use the peel-off estimator.
+ *  @param[in] *mu_list  A comma separated list of the cosines of the observer
+ *                       angles, or an empty string for the bin centres.
+ *  @param[in] n_bins    The number of bins in the escape histogram.
+ *
+ *  @details
+ *
+ *  Giving a list of angles turns on the peel-off estimator, even if peel_off
+ *  is false.
+ *
+ * ************************************************************************** */
+
+static void
+init_peel_off_angles(int peel_off, char *mu_list, int n_bins)
+{
+  free(PEEL_MU);
+  PEEL_MU = NULL;
+  N_PEEL = 0;
+
+  if(strlen(mu_list) > 0)
+  {
+    PEEL_MU = malloc((strlen(mu_list) / 2 + 1) * sizeof *PEEL_MU);
+    for(char *save, *token = strtok_r(mu_list, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+      char *end;
+      double mu = strtod(token, &end);
+      if(end == token || *end != '\0' || mu <= 0 || mu > 1)
+      {
+        parameter_error("peel_off.mu must be a comma separated list of cosines between 0 and 1, not '%s'", token);
+        return;
+      }
+      PEEL_MU[N_PEEL++] = mu;
+    }
+  }
+  else if(peel_off)
+  {
+    PEEL_MU = malloc(n_bins * sizeof *PEEL_MU);
+    for(int i = 0; i < n_bins; i++)
+      PEEL_MU[i] = (i + 0.5) / n_bins;
+    N_PEEL = n_bins;
+  }
+}
+
+/* ************************************************************************** */
+/** init_phase_function
+ *
+ *  @brief Set the phase function of scattering.
+ *
+ *  @param[in] *phase_file  The filename of a tabulated phase function, or an
+ *                          empty string to use PHASE_G.
+ *
+ *  @details
+ *
+ *  Scattering is isotropic unless a phase file or a PHASE_G other than 0 is
+ *  given. Both cannot be given at once.
+ *
+ * ************************************************************************** */
+
+static void
+init_phase_function(char *phase_file)
+{
+  free_phase_table(PHASE_TABLE);
+  PHASE_TABLE = NULL;
+  PHASE_FUNCTION = PHASE_ISOTROPIC;
+
+  if(PHASE_G <= -1 || PHASE_G >= 1)
+  {
+    parameter_error("scatter.g must be greater than -1 and less than 1");
+    return;
+  }
+
+  if(strlen(phase_file) > 0)
+  {
+    if(PHASE_G != 0)
+    {
+      parameter_error("scatter.g and scatter.phase_file cannot be used together");
+      return;
+    }
+    PHASE_TABLE = read_phase_table(phase_file);
+    if(PHASE_TABLE != NULL)
+      PHASE_FUNCTION = PHASE_TABULATED;
+  }
+  else if(PHASE_G != 0)
+  {
+    PHASE_FUNCTION = PHASE_HENYEY_GREENSTEIN;
+  }
+}
+
+/* ************************************************************************** */
+/** init_albedo_sweep
+ *
+ *  @brief Set the albedos of an albedo sweep.
+ *
+ *  @param[in] *albedo_list  A comma separated list of albedos, or an empty
+ *                           string for no sweep.
+ *
+ * ************************************************************************** */
+
+static void
+init_albedo_sweep(char *albedo_list)
+{
+  free(SWEEP_ALBEDOS);
+  SWEEP_ALBEDOS = NULL;
+  N_SWEEP = 0;
+
+  if(strlen(albedo_list) == 0)
+    return;
+
+  SWEEP_ALBEDOS = malloc(MAX_SWEEP_ALBEDOS * sizeof *SWEEP_ALBEDOS);
+  for(char *save, *token = strtok_r(albedo_list, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+  {
+    char *end;
+    double albedo = strtod(token, &end);
+    if(end == token || *end != '\0' || albedo < 0 || albedo > 1)
+    {
+      parameter_error("albedo_sweep must be a comma separated list of albedos between 0 and 1, not '%s'", token);
+      return;
+    }
+    if(N_SWEEP == MAX_SWEEP_ALBEDOS)
+    {
+      parameter_error("albedo_sweep can have at most %d albedos", MAX_SWEEP_ALBEDOS);
+      return;
+    }
+    SWEEP_ALBEDOS[N_SWEEP++] = albedo;
+  }
+}
+
+/* ************************************************************************** */
+/** parse_layer_list
+ *
+ *  @brief Parse a comma separated list of layer properties.
+ *
+ *  @param[in] *name         The name of the parameter, for error messages.
+ *  @param[in, out] *list    The comma separated list, which is tokenised.
+ *  @param[out] *n_values    The number of values in the list.
+ *
+ *  @return The values, or NULL for an empty list or an error when EMBEDDED.
+ *
+ * ************************************************************************** */
+
+static double *
+parse_layer_list(char *name, char *list, int *n_values)
+{
+  *n_values = 0;
+
+  if(strlen(list) == 0)
+    return NULL;
+
+  double *values = malloc((strlen(list) / 2 + 1) * sizeof *values);
+  for(char *save, *token = strtok_r(list, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+  {
+    char *end;
+    values[*n_values] = strtod(token, &end);
+    if(end == token || *end != '\0')
+    {
+      parameter_error("%s must be a comma separated list of numbers, not '%s'", name, token);
+      free(values);
+      *n_values = 0;
+      return NULL;
+    }
+    (*n_values)++;
+  }
+
+  return values;
+}
+
+/* ************************************************************************** */
+/** init_slab_layers
+ *
+ *  @brief Set the layers of a stratified slab.
+ *
+ *  @param[in] *opacity_list    A comma separated list of layer opacities, or
+ *                              an empty string.
+ *  @param[in] *thickness_list  A comma separated list of layer thicknesses,
+ *                              or an empty string for equal layers.
+ *  @param[in] *albedo_list     A comma separated list of layer albedos, or an
+ *                              empty string for SCATTERING_ALBEDO.
+ *  @param[in] *layers_file     The filename of a layers file, or an empty
+ *                              string.
+ *
+ *  @details
+ *
+ *  The slab is uniform unless layers.opacity or layers.file is given. Both
+ *  cannot be given at once. TAU_MAX and SCATTERING_ALBEDO must already be
+ *  set.
+ *
+ * ************************************************************************** */
+
+static void
+init_slab_layers(char *opacity_list, char *thickness_list, char *albedo_list, char *layers_file)
+{
+  int n_opacity, n_thickness, n_albedo;
+
+  free_layers(LAYERS);
+  LAYERS = NULL;
+
+  if(strlen(layers_file) > 0)
+  {
+    if(strlen(opacity_list) > 0 || strlen(thickness_list) > 0 || strlen(albedo_list) > 0)
+    {
+      parameter_error("layers.file cannot be used with layers.opacity, layers.thickness or layers.albedo");
+      return;
+    }
+    LAYERS = read_layers(layers_file);
+    return;
+  }
+
+  if(strlen(opacity_list) == 0)
+  {
+    if(strlen(thickness_list) > 0 || strlen(albedo_list) > 0)
+    {
+      parameter_error("layers.thickness and layers.albedo need layers.opacity");
+      return;
+    }
+    return;
+  }
+
+  double *opacity = parse_layer_list("layers.opacity", opacity_list, &n_opacity);
+  double *thickness = parse_layer_list("layers.thickness", thickness_list, &n_thickness);
+  double *albedo = parse_layer_list("layers.albedo", albedo_list, &n_albedo);
+
+  if((thickness && n_thickness != n_opacity) || (albedo && n_albedo != n_opacity))
+    parameter_error("layers.thickness and layers.albedo must have one value for each of the %d layers of "
+                    "layers.opacity", n_opacity);
+  else if(PARAMETER_ERROR[0] == '\0')
+    LAYERS = init_layers(n_opacity, thickness, opacity, albedo);
+
+  free(opacity);
+  free(thickness);
+  free(albedo);
+}
+
 /* ************************************************************************** */
 /** get_all_parameters
  *
  *  @brief Main control function for getting parameters from file
  *
- *  @param[in] *file_name  The filename of the input file.
+ *  @param[in, out] *table  The table of parameters read from the input file.
+ *  @param[out] *hist       The number of histogram bins is set.
+ *  @param[out] *moments    The number of moment levels is set.
  *
- *  @return 0
+ *  @return true if the parameters can be used. Only false when EMBEDDED, with
+ *  the reason in PARAMETER_ERROR, as the program otherwise exits.
  *
  *  @details
  *
+ *  For a parameter sweep, the parameters of the point chosen by
+ *  select_parameter_point are set.
+ *
  * ************************************************************************** */
 
-void
-get_all_parameters(char *file_name, Histogram_t *hist, Moments_t *moments)
+int
+get_all_parameters(ParameterTable_t *table, Histogram_t *hist, Moments_t *moments)
 {
-  FILE *f;
-  if((f = fopen(file_name, "r")) == NULL)
+  union ParameterUnion default_value;
+  char engine[LINE_LEN];
+  char sampler[LINE_LEN];
+  char phase_file[LINE_LEN];
+  char layer_opacity[LINE_LEN];
+  char layer_thickness[LINE_LEN];
+  char layer_albedo[LINE_LEN];
+  char layers_file[LINE_LEN];
+  char peel_mu[LINE_LEN];
+  char sweep_albedos[LINE_LEN];
+  char output_format[LINE_LEN];
+
+  N_PHOTONS = (long) get_single_parameter(table, "n_photons", TYPE_DOUBLE)._double;
+  long min_batch_size = N_PHOTONS / DEFAULT_MIN_BATCHES > 1 ? N_PHOTONS / DEFAULT_MIN_BATCHES : 1;
+  default_value._double = min_batch_size < DEFAULT_BATCH_SIZE ? min_batch_size : DEFAULT_BATCH_SIZE;
+  BATCH_SIZE = (int) get_optional_parameter(table, "batch_size", TYPE_DOUBLE, default_value)._double;
+  OUTPUT_FREQUENCY = (int) get_single_parameter(table, "output_frequency", TYPE_DOUBLE)._double;
+  default_value._double = 10;
+  PROGRESS_INTERVAL = get_optional_parameter(table, "progress.interval", TYPE_DOUBLE, default_value)._double;
+  SEED = get_single_parameter(table, "seed", TYPE_INT)._int;
+  TAU_MAX = get_single_parameter(table, "tau_max", TYPE_DOUBLE)._double;
+  SCATTERING_ALBEDO = get_single_parameter(table, "scatter_albedo", TYPE_DOUBLE)._double;
+  get_optional_string_parameter(table, "transport_engine", engine, "history");
+  get_optional_string_parameter(table, "direction.sampler", sampler, "trig");
+  get_optional_string_parameter(table, "scatter.phase_file", phase_file, "");
+  get_optional_string_parameter(table, "layers.opacity", layer_opacity, "");
+  get_optional_string_parameter(table, "layers.thickness", layer_thickness, "");
+  get_optional_string_parameter(table, "layers.albedo", layer_albedo, "");
+  get_optional_string_parameter(table, "layers.file", layers_file, "");
+  get_optional_string_parameter(table, "output.format", output_format, "text");
+
+  default_value._double = 0;
+  PHASE_G = get_optional_parameter(table, "scatter.g", TYPE_DOUBLE, default_value)._double;
+
+  default_value._int = false;
+  MRW_ENABLED = get_optional_parameter(table, "mrw.enabled", TYPE_INT, default_value)._int;
+  default_value._int = DEFAULT_MRW_CRITICAL_SCATTERS;
+  MRW_CRITICAL_SCATTERS = get_optional_parameter(table, "mrw.critical_scatters", TYPE_INT, default_value)._int;
+  default_value._double = DEFAULT_MRW_MIN_RADIUS;
+  MRW_MIN_RADIUS = get_optional_parameter(table, "mrw.min_radius", TYPE_DOUBLE, default_value)._double;
+  default_value._int = false;
+  MRW_VALIDATE = get_optional_parameter(table, "mrw.validate", TYPE_INT, default_value)._int;
+
+  default_value._int = false;
+  IMPLICIT_CAPTURE = get_optional_parameter(table, "implicit_capture", TYPE_INT, default_value)._int;
+  default_value._double = DEFAULT_ROULETTE_THRESHOLD;
+  ROULETTE_THRESHOLD = get_optional_parameter(table, "roulette.threshold", TYPE_DOUBLE, default_value)._double;
+  default_value._double = DEFAULT_ROULETTE_SURVIVAL;
+  ROULETTE_SURVIVAL = get_optional_parameter(table, "roulette.survival", TYPE_DOUBLE, default_value)._double;
+
+  default_value._double = 0;
+  PATH_STRETCH = get_optional_parameter(table, "path_stretch", TYPE_DOUBLE, default_value)._double;
+  default_value._int = false;
+  STRETCH_VALIDATE = get_optional_parameter(table, "path_stretch.validate", TYPE_INT, default_value)._int;
+  default_value._int = false;
+  ENGINE_VALIDATE = get_optional_parameter(table, "transport_engine.validate", TYPE_INT, default_value)._int;
+
+  get_optional_string_parameter(table, "albedo_sweep", sweep_albedos, "");
+
+  default_value._int = false;
+  ESCAPE_LOG = get_optional_parameter(table, "escape_log", TYPE_INT, default_value)._int;
+
+  default_value._int = false;
+  int peel_off = get_optional_parameter(table, "peel_off", TYPE_INT, default_value)._int;
+  get_optional_string_parameter(table, "peel_off.mu", peel_mu, "");
+
+  default_value._double = 0;
+  TARGET_REL_ERROR = get_optional_parameter(table, "target_rel_error", TYPE_DOUBLE, default_value)._double;
+  default_value._int = false;
+  TARGET_MOMENTS = get_optional_parameter(table, "target_rel_error.moments", TYPE_INT, default_value)._int;
+  default_value._double = 0;
+  TIME_LIMIT = get_optional_parameter(table, "time_limit", TYPE_DOUBLE, default_value)._double;
+
+  default_value._double = 0;
+  CHECKPOINT_INTERVAL = get_optional_parameter(table, "checkpoint.interval", TYPE_DOUBLE, default_value)._double;
+  get_optional_string_parameter(table, "checkpoint.file", CHECKPOINT_FILE, DEFAULT_CHECKPOINT_FILE);
+
+#ifdef METRICS_ON
+  default_value._double = 10;
+  METRICS_INTERVAL = get_optional_parameter(table, "metrics.interval", TYPE_DOUBLE, default_value)._double;
+#else
+  if(find_parameter(table, "metrics.interval") && RANK == 0)
+    printf("metrics.interval is ignored, as mcrt was built without MCRT_METRICS\n");
+#endif
+
+  hist->n_bins = get_single_parameter(table, "hist.n_bins", TYPE_INT)._int;
+  moments->n_levels = get_single_parameter(table, "moments.n_levels", TYPE_INT)._int;
+  if(PARAMETER_ERROR[0] != '\0')
+    return false;
+
+  if(strcmp(engine, "history") == 0)
   {
-    printf("Cannot open input file %s", file_name);
-    exit(1);
+    TRANSPORT_ENGINE = ENGINE_HISTORY;
+  }
+  else if(strcmp(engine, "event") == 0)
+  {
+    TRANSPORT_ENGINE = ENGINE_EVENT;
+  }
+  else
+  {
+    parameter_error("Unknown transport_engine '%s', expected history or event", engine);
+    return false;
+  }
+
+  if(strcmp(sampler, "trig") == 0)
+  {
+    DIRECTION_SAMPLER = DIRECTION_TRIG;
+  }
+  else if(strcmp(sampler, "sqrt") == 0)
+  {
+    DIRECTION_SAMPLER = DIRECTION_SQRT;
+  }
+  else if(strcmp(sampler, "rejection") == 0)
+  {
+    DIRECTION_SAMPLER = DIRECTION_REJECTION;
+  }
+  else if(strcmp(sampler, "table") == 0)
+  {
+    DIRECTION_SAMPLER = DIRECTION_TABLE;
+    init_directions();
+  }
+  else
+  {
+    parameter_error("Unknown direction.sampler '%s', expected trig, sqrt, rejection or table", sampler);
+    return false;
   }
 
-  N_PHOTONS = (int) get_single_parameter(f, "n_photons", TYPE_DOUBLE)._double;
-  OUTPUT_FREQUENCY = (int) get_single_parameter(f, "output_frequency", TYPE_DOUBLE)._double;
-  SEED = get_single_parameter(f, "seed", TYPE_INT)._int;
-  TAU_MAX = get_single_parameter(f, "tau_max", TYPE_DOUBLE)._double;
-  SCATTERING_ALBEDO = get_single_parameter(f, "scatter_albedo", TYPE_DOUBLE)._double;
+  if(strcmp(output_format, "text") == 0)
+  {
+    OUTPUT_FORMAT = FORMAT_TEXT;
+  }
+  else if(strcmp(output_format, "binary") == 0)
+  {
+    OUTPUT_FORMAT = FORMAT_BINARY;
+  }
+  else
+  {
+    parameter_error("Unknown output.format '%s', expected text or binary", output_format);
+    return false;
+  }
 
-  hist->n_bins = get_single_parameter(f, "hist.n_bins", TYPE_INT)._int;
-  moments->n_levels = get_single_parameter(f, "moments.n_levels", TYPE_INT)._int;
+  init_peel_off_angles(peel_off, peel_mu, hist->n_bins);
+  init_albedo_sweep(sweep_albedos);
+  init_phase_function(phase_file);
+  init_slab_layers(layer_opacity, layer_thickness, layer_albedo, layers_file);
+  if(PARAMETER_ERROR[0] != '\0')
+    return false;
 
-  if(fclose(f))
+  if(BATCH_SIZE < 1)
   {
-    printf("Cannot close file %s\n", file_name);
-    exit(1);
+    parameter_error("batch_size must be at least 1");
+    return false;
   }
+
+  if(MRW_VALIDATE)
+  {
+    MRW_ENABLED = true;
+    if(TARGET_REL_ERROR > 0 && RANK == 0)
+      printf("target_rel_error is ignored with mrw.validate, as both runs must transport every photon\n");
+    if(TIME_LIMIT > 0 && RANK == 0)
+      printf("time_limit is ignored with mrw.validate, as both runs must transport every photon\n");
+    TARGET_REL_ERROR = 0;
+    TIME_LIMIT = 0;
+  }
+
+  if(STRETCH_VALIDATE)
+  {
+    if(MRW_VALIDATE)
+    {
+      parameter_error("mrw.validate and path_stretch.validate cannot be used together");
+      return false;
+    }
+    if(TARGET_REL_ERROR > 0 && RANK == 0)
+      printf("target_rel_error is ignored with path_stretch.validate, as both runs must transport every photon\n");
+    if(TIME_LIMIT > 0 && RANK == 0)
+      printf("time_limit is ignored with path_stretch.validate, as both runs must transport every photon\n");
+    TARGET_REL_ERROR = 0;
+    TIME_LIMIT = 0;
+  }
+
+  if(ENGINE_VALIDATE)
+  {
+    if(MRW_VALIDATE || STRETCH_VALIDATE)
+    {
+      parameter_error("transport_engine.validate cannot be used with mrw.validate or path_stretch.validate");
+      return false;
+    }
+    TRANSPORT_ENGINE = ENGINE_EVENT;
+    if(TARGET_REL_ERROR > 0 && RANK == 0)
+      printf("target_rel_error is ignored with transport_engine.validate, as both runs must transport every photon\n");
+    if(TIME_LIMIT > 0 && RANK == 0)
+      printf("time_limit is ignored with transport_engine.validate, as both runs must transport every photon\n");
+    TARGET_REL_ERROR = 0;
+    TIME_LIMIT = 0;
+  }
+
+  if(PATH_STRETCH < 0 || PATH_STRETCH >= 1 || (STRETCH_VALIDATE && PATH_STRETCH == 0))
+  {
+    parameter_error("path_stretch must be at least 0 and less than 1, and above 0 for path_stretch.validate");
+    return false;
+  }
+
+  if(PATH_STRETCH > 0 && RANK == 0 && SCATTERING_ALBEDO * atanh(PATH_STRETCH) / PATH_STRETCH > 1.0)
+    printf("path_stretch %g is too large for scatter_albedo %g, the weights will grow with each scatter\n",
+           PATH_STRETCH, SCATTERING_ALBEDO);
+
+  if(MRW_ENABLED && MRW_MIN_RADIUS < 1.0)
+  {
+    parameter_error("mrw.min_radius must be at least 1, as the MRW assumes diffusion within the sphere");
+    return false;
+  }
+
+  if(MRW_ENABLED && SCATTERING_ALBEDO < 0.8 && RANK == 0)
+    printf("The MRW is only accurate for a scatter_albedo of at least 0.8, check it with mrw.validate\n");
+
+  if(MRW_ENABLED && N_PEEL > 0)
+  {
+    parameter_error("The MRW cannot be used with the peel-off estimator, as the scatters it replaces are not peeled "
+                    "off");
+    return false;
+  }
+
+  if(N_SWEEP > 0 && (MRW_ENABLED || PATH_STRETCH > 0 || MRW_VALIDATE || STRETCH_VALIDATE))
+  {
+    parameter_error("albedo_sweep cannot be used with the MRW or path length stretching");
+    return false;
+  }
+
+  if(PHASE_FUNCTION != PHASE_ISOTROPIC && (MRW_ENABLED || PATH_STRETCH > 0 || N_PEEL > 0))
+  {
+    parameter_error("scatter.g and scatter.phase_file cannot be used with the MRW, path length stretching or the "
+                    "peel-off estimator, as they assume isotropic scattering");
+    return false;
+  }
+
+  if(LAYERS != NULL && (MRW_ENABLED || PATH_STRETCH > 0 || N_PEEL > 0 || N_SWEEP > 0))
+  {
+    parameter_error("Layers cannot be used with the MRW, path length stretching, the peel-off estimator or "
+                    "albedo_sweep, as they assume a uniform slab");
+    return false;
+  }
+
+  if(ESCAPE_LOG && (N_SWEEP > 0 || TARGET_REL_ERROR > 0 || TIME_LIMIT > 0 || MRW_VALIDATE || STRETCH_VALIDATE))
+  {
+    parameter_error("escape_log cannot be used with albedo_sweep, target_rel_error, time_limit or validation, as the "
+                    "log must hold the escapes of exactly the photons tallied");
+    return false;
+  }
+
+  if(N_SWEEP > 0 && IMPLICIT_CAPTURE && RANK == 0)
+    printf("implicit_capture is ignored with albedo_sweep, as every photon is already weighted\n");
+
+  if((IMPLICIT_CAPTURE || N_SWEEP > 0) && (ROULETTE_SURVIVAL <= 0 || ROULETTE_SURVIVAL > 1))
+  {
+    parameter_error("roulette.survival must be greater than 0 and at most 1");
+    return false;
+  }
+
+  if(N_RANKS > 1)
+  {
+    char rank_suffix[32];
+    snprintf(rank_suffix, sizeof rank_suffix, ".%d", RANK);
+    if(strlen(CHECKPOINT_FILE) + strlen(rank_suffix) >= LINE_LEN)
+    {
+      parameter_error("checkpoint.file is too long");
+      return false;
+    }
+    strcat(CHECKPOINT_FILE, rank_suffix);
+  }
+
+  if(PATH_STRETCH > 0 && TRANSPORT_ENGINE == ENGINE_EVENT)
+  {
+    if(RANK == 0)
+      printf("path_stretch is not supported by the event engine, using the history engine instead\n");
+    TRANSPORT_ENGINE = ENGINE_HISTORY;
+  }
+
+  if(N_SWEEP > 0 && TRANSPORT_ENGINE == ENGINE_EVENT)
+  {
+    if(RANK == 0)
+      printf("albedo_sweep is not supported by the event engine, using the history engine instead\n");
+    TRANSPORT_ENGINE = ENGINE_HISTORY;
+  }
+
+  if(MRW_ENABLED && TRANSPORT_ENGINE == ENGINE_EVENT)
+  {
+    if(RANK == 0)
+      printf("The MRW is not supported by the event engine, using the history engine instead\n");
+    TRANSPORT_ENGINE = ENGINE_HISTORY;
+  }
+
+  if(PHASE_FUNCTION != PHASE_ISOTROPIC && TRANSPORT_ENGINE == ENGINE_EVENT)
+  {
+    if(RANK == 0)
+      printf("Anisotropic scattering is not supported by the event engine, using the history engine instead\n");
+    TRANSPORT_ENGINE = ENGINE_HISTORY;
+  }
+
+  if(LAYERS != NULL && TRANSPORT_ENGINE == ENGINE_EVENT)
+  {
+    if(RANK == 0)
+      printf("Layers are not supported by the event engine, using the history engine instead\n");
+    TRANSPORT_ENGINE = ENGINE_HISTORY;
+  }
+
+  if(ENGINE_VALIDATE && TRANSPORT_ENGINE != ENGINE_EVENT)
+  {
+    parameter_error("transport_engine.validate needs parameters which the event engine supports");
+    return false;
+  }
+
+  return true;
 }
 
 
@@ -0,0 +1,377 @@
+/* ************************************************************************** */
+/** @file phase.c
+ *
+ *  @brief Functions for scattering photons with an anisotropic phase
+ *  function.
+ *
+ *  The cosine of the scattering angle, between the directions before and
+ *  after a scatter, is drawn from the phase function, and a new direction is
+ *  found by rotating the old one by that angle about a random azimuth. There
+ *  are two phase functions besides isotropic scattering:
+ *
+ *    - Henyey-Greenstein, with asymmetry parameter scatter.g, whose
+ *      cumulative distribution can be inverted exactly,
+ *    - a table read from scatter.phase_file, which is taken to be linear
+ *      between its points. A segment is picked with an alias table, so the
+ *      cost does not depend on the number of points, and the cosine is then
+ *      found within it by inverting its cumulative distribution, a quadratic.
+ *
+ *  Either costs a sqrt or two more than an isotropic scatter. The phase file
+ *  has two columns, the cosine of the scattering angle, rising from -1 to 1,
+ *  and the phase function at it, in any units. Lines starting with # are
+ *  ignored.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#define MAX_PHASE_NODES 100000
+
+/* ************************************************************************** */
+/** build_alias_table
+ *
+ *  @brief Build an alias table for picking a segment of a phase table.
+ *
+ *  @param[in, out] *table  The phase table, with its nodes read.
+ *
+ *  @details
+ *
+ *  Segment i is picked with a probability proportional to its area,
+ *  (value[i] + value[i + 1]) / 2 * (mu[i + 1] - mu[i]). Vose's method splits
+ *  these into n columns of equal height, each holding at most two segments:
+ *  a column i is picked uniformly, and then segment i is kept with a
+ *  probability of alias_prob[i], and otherwise alias[i] is taken instead.
+ *
+ * ************************************************************************** */
+
+static void
+build_alias_table(PhaseTable_t *table)
+{
+  int n = table->n_nodes - 1;
+  double *scaled = malloc(n * sizeof *scaled);
+  int *small = malloc(n * sizeof *small);
+  int *large = malloc(n * sizeof *large);
+  int n_small = 0, n_large = 0;
+  double total = 0;
+
+  table->alias_prob = malloc(n * sizeof *table->alias_prob);
+  table->alias = malloc(n * sizeof *table->alias);
+
+  for(int i = 0; i < n; i++)
+  {
+    scaled[i] = 0.5 * (table->value[i] + table->value[i + 1]) * (table->mu[i + 1] - table->mu[i]);
+    total += scaled[i];
+  }
+
+  for(int i = 0; i < n; i++)
+  {
+    scaled[i] *= n / total;
+    table->alias[i] = i;
+    if(scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  while(n_small > 0 && n_large > 0)
+  {
+    int s = small[--n_small];
+    int l = large[n_large - 1];
+    table->alias_prob[s] = scaled[s];
+    table->alias[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if(scaled[l] < 1.0)
+    {
+      n_large--;
+      small[n_small++] = l;
+    }
+  }
+
+  while(n_large > 0)
+    table->alias_prob[large[--n_large]] = 1.0;
+  while(n_small > 0)
+    table->alias_prob[small[--n_small]] = 1.0;
+
+  free(scaled);
+  free(small);
+  free(large);
+}
+
+/* ************************************************************************** */
+/** read_phase_table
+ *
+ *  @brief Read a tabulated phase function from file.
+ *
+ *  @param[in] *file_name  The filename of the phase file.
+ *
+ *  @return The phase table, which is freed with free_phase_table, or NULL if
+ *  the file cannot be used when EMBEDDED.
+ *
+ *  @details
+ *
+ *  The cosines must rise strictly from -1 to 1 and the phase function must
+ *  not be negative, or the error is reported by parameter_error. The phase
+ *  function does not need to be normalised.
+ *
+ * ************************************************************************** */
+
+PhaseTable_t *
+read_phase_table(const char *file_name)
+{
+  FILE *f;
+  char line[LINE_LEN];
+  int capacity = 64;
+
+  if((f = fopen(file_name, "r")) == NULL)
+  {
+    parameter_error("Unable to open the phase file %s", file_name);
+    return NULL;
+  }
+
+  PhaseTable_t *table = calloc(1, sizeof *table);
+  table->mu = malloc(capacity * sizeof *table->mu);
+  table->value = malloc(capacity * sizeof *table->value);
+
+  while(fgets(line, LINE_LEN, f) != NULL)
+  {
+    double mu, value;
+    char *start = line + strspn(line, " \t");
+
+    if(*start == '#' || *start == '\n' || *start == '\r' || *start == '\0')
+      continue;
+
+    if(sscanf(start, "%lf %lf", &mu, &value) != 2)
+    {
+      parameter_error("Unable to read the line '%s' of the phase file %s", strtok(start, "\r\n"), file_name);
+      fclose(f);
+      free_phase_table(table);
+      return NULL;
+    }
+
+    if(table->n_nodes == MAX_PHASE_NODES)
+    {
+      parameter_error("The phase file %s has more than %d points", file_name, MAX_PHASE_NODES);
+      fclose(f);
+      free_phase_table(table);
+      return NULL;
+    }
+
+    if(table->n_nodes == capacity)
+    {
+      capacity *= 2;
+      table->mu = realloc(table->mu, capacity * sizeof *table->mu);
+      table->value = realloc(table->value, capacity * sizeof *table->value);
+    }
+
+    if((table->n_nodes > 0 && mu <= table->mu[table->n_nodes - 1]) || value < 0)
+    {
+      parameter_error("The cosines of the phase file %s must rise and its phase function must not be negative, at "
+                      "%g %g", file_name, mu, value);
+      fclose(f);
+      free_phase_table(table);
+      return NULL;
+    }
+
+    table->mu[table->n_nodes] = mu;
+    table->value[table->n_nodes] = value;
+    table->n_nodes++;
+  }
+
+  fclose(f);
+
+  if(table->n_nodes < 2 || table->mu[0] != -1.0 || table->mu[table->n_nodes - 1] != 1.0)
+  {
+    parameter_error("The phase file %s must have at least two points, with cosines from -1 to 1", file_name);
+    free_phase_table(table);
+    return NULL;
+  }
+
+  double max_value = 0;
+  for(int i = 0; i < table->n_nodes; i++)
+    max_value = fmax(max_value, table->value[i]);
+
+  if(max_value == 0)
+  {
+    parameter_error("The phase function of the phase file %s is zero everywhere", file_name);
+    free_phase_table(table);
+    return NULL;
+  }
+
+  build_alias_table(table);
+
+  return table;
+}
+
+/* ************************************************************************** */
+/** free_phase_table
+ *
+ *  @brief Free a phase table read by read_phase_table.
+ *
+ *  @param[in, out] *table  The phase table, or NULL.
+ *
+ * ************************************************************************** */
+
+void
+free_phase_table(PhaseTable_t *table)
+{
+  if(table == NULL)
+    return;
+
+  free(table->mu);
+  free(table->value);
+  free(table->alias_prob);
+  free(table->alias);
+  free(table);
+}
+
+/* ************************************************************************** */
+/** sample_henyey_greenstein
+ *
+ *  @brief Sample the cosine of the scattering angle from the Henyey-Greenstein
+ *  phase function.
+ *
+ *  @param[in] g  The asymmetry parameter, the mean cosine, not 0.
+ *  @param[in] u  A random number in (0, 1).
+ *
+ *  @return The cosine of the scattering angle.
+ *
+ *  @details
+ *
+ *  The inverse of the cumulative distribution of
+ *  p(mu) = (1 - g^2) / 2 (1 + g^2 - 2 g mu)^(3/2).
+ *
+ * ************************************************************************** */
+
+static inline double
+sample_henyey_greenstein(double g, double u)
+{
+  double s = (1.0 - g * g) / (1.0 - g + 2.0 * g * u);
+  double mu = (1.0 + g * g - s * s) / (2.0 * g);
+
+  return mu < -1.0 ? -1.0 : mu > 1.0 ? 1.0 : mu;
+}
+
+/* ************************************************************************** */
+/** sample_phase_table
+ *
+ *  @brief Sample the cosine of the scattering angle from a phase table.
+ *
+ *  @param[in] *table     The phase table.
+ *  @param[in, out] *rng  The photon's random number stream.
+ *
+ *  @return The cosine of the scattering angle.
+ *
+ *  @details
+ *
+ *  Within a segment with values p0 and p1 at its ends, the fraction t of the
+ *  way across it has the cumulative distribution
+ *  (p0 t + (p1 - p0) t^2 / 2) / ((p0 + p1) / 2). This is inverted for a
+ *  random v in the form t = v (p0 + p1) / (p0 + sqrt(p0^2 + (p1^2 - p0^2) v)),
+ *  which does not lose precision when p0 and p1 are close.
+ *
+ * ************************************************************************** */
+
+static inline double
+sample_phase_table(const PhaseTable_t *table, RNGStream_t *rng)
+{
+  double x = random_number(rng, 0, 1) * (table->n_nodes - 1);
+  int i = (int) x;
+
+  if(x - i >= table->alias_prob[i])
+    i = table->alias[i];
+
+  double v = random_number(rng, 0, 1);
+  double p0 = table->value[i];
+  double p1 = table->value[i + 1];
+  double t = v * (p0 + p1) / (p0 + sqrt(p0 * p0 + (p1 * p1 - p0 * p0) * v));
+
+  return table->mu[i] + t * (table->mu[i + 1] - table->mu[i]);
+}
+
+/* ************************************************************************** */
+/** rotate_direction
+ *
+ *  @brief Turn the direction of a photon through a scattering angle.
+ *
+ *  @param[in, out] *packet  The photon packet.
+ *  @param[in] cos_scatter   The cosine of the scattering angle.
+ *  @param[in] cosphi        The cosine of the azimuth of the scatter.
+ *  @param[in] sinphi        The sine of the azimuth of the scatter.
+ *
+ *  @details
+ *
+ *  The new direction makes an angle of acos(cos_scatter) with the old one,
+ *  at the given azimuth about it. Written in terms of the angles of the old
+ *  direction, the usual rotation formulae have no division by sintheta, so
+ *  they hold even for a photon travelling along the z axis. The sines of the
+ *  new direction are found from its cosines with sqrt, so the direction does
+ *  not drift from unit length over many scatters.
+ *
+ * ************************************************************************** */
+
+static inline void
+rotate_direction(PhotonPacket_t *packet, double cos_scatter, double cosphi, double sinphi)
+{
+  double sin_scatter = sqrt(1.0 - cos_scatter * cos_scatter);
+  double a = sin_scatter * cosphi;
+  double b = sin_scatter * sinphi;
+
+  double ux = packet->sintheta * packet->cosphi * cos_scatter + a * packet->costheta * packet->cosphi
+              - b * packet->sinphi;
+  double uy = packet->sintheta * packet->sinphi * cos_scatter + a * packet->costheta * packet->sinphi
+              + b * packet->cosphi;
+  double uz = packet->costheta * cos_scatter - a * packet->sintheta;
+
+  if(uz > 1.0)
+    uz = 1.0;
+  else if(uz < -1.0)
+    uz = -1.0;
+
+  double rho = sqrt(ux * ux + uy * uy);
+  packet->costheta = uz;
+  packet->sintheta = sqrt(1.0 - uz * uz);
+  if(rho > 0)
+  {
+    packet->cosphi = ux / rho;
+    packet->sinphi = uy / rho;
+  }
+  else
+  {
+    packet->cosphi = 1.0;
+    packet->sinphi = 0.0;
+  }
+}
+
+/* ************************************************************************** */
+/** anisotropic_scatter_photon
+ *
+ *  @brief Scatter a photon with the phase function PHASE_FUNCTION.
+ *
+ *  @param[in, out] packet  A pointer to the current photon
+ *  @param[in, out] rng     The photon's random number stream.
+ *
+ *  @details
+ *
+ *  The azimuth of the scatter is drawn with DIRECTION_SAMPLER.
+ *
+ * ************************************************************************** */
+
+void
+anisotropic_scatter_photon(PhotonPacket_t *packet, RNGStream_t *rng)
+{
+  double cos_scatter, cosphi, sinphi;
+
+  if(PHASE_FUNCTION == PHASE_HENYEY_GREENSTEIN)
+    cos_scatter = sample_henyey_greenstein(PHASE_G, random_number(rng, 0, 1));
+  else
+    cos_scatter = sample_phase_table(PHASE_TABLE, rng);
+
+  sample_azimuth(DIRECTION_SAMPLER, rng, &cosphi, &sinphi);
+  rotate_direction(packet, cos_scatter, cosphi, sinphi);
+}
@@ -0,0 +1,201 @@
+/* ************************************************************************** */
+/** @file progress.c
+ *
+ *  @brief Functions for reporting how many photons have been transported.
+ *
+ *  Each OpenMP thread counts the photons it transports in its own
+ *  ThreadProgress_t. A reporter thread sums the counts every
+ *  PROGRESS_INTERVAL seconds and prints the number of photons transported,
+ *  the rate and the time left, so the threads never wait on each other to
+ *  report their progress. Only rank 0 reports, and only for its own photons.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#if defined (_OPENMP)
+#include <omp.h>
+#endif
+
+/* ************************************************************************** */
+/** count_progress
+ *
+ *  @brief Sum the number of photons transported by every thread.
+ *
+ *  @param[in] *progress  The progress of the simulation.
+ *
+ *  @return The number of photons transported, including those transported
+ *  before a restart.
+ *
+ * ************************************************************************** */
+
+static long
+count_progress(Progress_t *progress)
+{
+  long n_done = progress->n_start;
+
+  for(int t = 0; t < progress->n_threads; t++)
+    n_done += atomic_load_explicit(&progress->threads[t].n_done, memory_order_relaxed);
+
+  return n_done;
+}
+
+/* ************************************************************************** */
+/** progress_reporter
+ *
+ *  @brief The main function of the reporter thread.
+ *
+ *  @param[in] *arg  The Progress_t of the simulation.
+ *
+ *  @details
+ *
+ *  Prints the progress every PROGRESS_INTERVAL seconds until it is told to
+ *  stop. The rate is that since the transport started, and the time left
+ *  assumes it stays the same.
+ *
+ * ************************************************************************** */
+
+static void *
+progress_reporter(void *arg)
+{
+  Progress_t *progress = arg;
+
+  pthread_mutex_lock(&progress->lock);
+  while(!progress->stop)
+  {
+    struct timespec wake;
+    get_deadline(progress->interval, &wake);
+    while(!progress->stop && pthread_cond_timedwait(&progress->wake, &progress->lock, &wake) == 0)
+      ;
+    if(progress->stop)
+      break;
+
+    long n_done = count_progress(progress);
+    double percent = (double) n_done / progress->n_total * 100;
+    double rate = (n_done - progress->n_start) / (get_wall_time() - progress->start_time);
+    if(rate > 0)
+      printf("%6.0ld photon packets transported (%3.0f%%), %.3g photons/s, %.0f s left\n", n_done, percent, rate,
+             (progress->n_total - n_done) / rate);
+    else
+      printf("%6.0ld photon packets transported (%3.0f%%)\n", n_done, percent);
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&progress->lock);
+
+  return NULL;
+}
+
+/* ************************************************************************** */
+/** start_progress
+ *
+ *  @brief Zero the count of every thread and start the reporter thread.
+ *
+ *  @param[out] *progress  The progress of the simulation.
+ *  @param[in] n_photons   The number of photons this rank will transport.
+ *  @param[in] n_done      The number of them already transported, when
+ *                         restarting.
+ *
+ *  @details
+ *
+ *  The reporter thread is only started if the progress is reported and
+ *  PROGRESS_INTERVAL is above 0.
+ *
+ * ************************************************************************** */
+
+void
+start_progress(Progress_t *progress, long n_photons, long n_done)
+{
+#if defined(_OPENMP)
+  progress->n_threads = omp_get_max_threads();
+#else
+  progress->n_threads = 1;
+#endif
+
+  progress->threads = aligned_calloc(progress->n_threads, sizeof *progress->threads);
+  progress->n_total = n_photons > 0 ? n_photons : 1;
+  progress->n_start = n_done;
+  progress->start_time = get_wall_time();
+  progress->interval = PROGRESS_INTERVAL;
+  progress->report = RANK == 0 && !EMBEDDED;
+
+  progress->stop = false;
+  progress->running = false;
+  if(progress->report && progress->interval > 0)
+  {
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_cond_init(&progress->wake, NULL);
+    if(pthread_create(&progress->reporter, NULL, progress_reporter, progress))
+    {
+      printf("Unable to start the progress reporter\n");
+      exit(1);
+    }
+    progress->running = true;
+  }
+}
+
+/* ************************************************************************** */
+/** add_progress
+ *
+ *  @brief Add to the number of photons transported by the calling thread.
+ *
+ *  @param[in, out] *progress  The progress of the simulation.
+ *  @param[in] n_photons       The number of photons transported.
+ *
+ * ************************************************************************** */
+
+void
+add_progress(Progress_t *progress, long n_photons)
+{
+#if defined(_OPENMP)
+  int thread = omp_get_thread_num();
+#else
+  int thread = 0;
+#endif
+
+  _Atomic long *n_done = &progress->threads[thread].n_done;
+  atomic_store_explicit(n_done, atomic_load_explicit(n_done, memory_order_relaxed) + n_photons, memory_order_relaxed);
+}
+
+/* ************************************************************************** */
+/** stop_progress
+ *
+ *  @brief Stop the reporter thread and report the final progress.
+ *
+ *  @param[in, out] *progress  The progress of the simulation.
+ *
+ * ************************************************************************** */
+
+void
+stop_progress(Progress_t *progress)
+{
+  if(progress->running)
+  {
+    pthread_mutex_lock(&progress->lock);
+    progress->stop = true;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->lock);
+    pthread_join(progress->reporter, NULL);
+    pthread_mutex_destroy(&progress->lock);
+    pthread_cond_destroy(&progress->wake);
+    progress->running = false;
+  }
+
+  if(progress->report)
+  {
+    long n_done = count_progress(progress);
+    double elapsed = get_wall_time() - progress->start_time;
+    printf("%6.0ld photon packets transported (%3.0f%%) in %.2f s, %.3g photons/s\n", n_done,
+           (double) n_done / progress->n_total * 100, elapsed,
+           elapsed > 0 ? (n_done - progress->n_start) / elapsed : 0.0);
+  }
+
+  aligned_free(progress->threads);
+  progress->threads = NULL;
+}
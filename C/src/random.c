@@ -8,60 +8,150 @@
  *  functions to set up and request a random number as well as random parameters
  *  used for the MC iterations.
  *
- *  (I basically stole the GSL initialisation functions from Nick/PYTHON :^)
+ *  Random numbers are generated with the counter-based Philox4x32-10 algorithm
+ *  (Salmon et al. 2011). A random number is a pure function of (seed, stream,
+ *  counter), so every photon packet is given its own stream, indexed by the
+ *  photon number. The random numbers a photon sees therefore do not depend on
+ *  which thread transports it or how many threads there are.
  *
  * ************************************************************************** */
 
 #include <stdio.h>
 #include <math.h>
-#include <gsl/gsl_rng.h>
+#include <stdint.h>
 
 #include "variables.h"
 #include "functions.h"
 
-gsl_rng *rng;
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+#define PHILOX_ROUNDS 10
 
 /* ************************************************************************** */
-/** init_gsl_seed
+/** fill_rng_buffer
  *
- *  @brief Initialise the random SEED for the GSL random number generator.
+ *  @brief Refill the buffer of a random number stream.
  *
- *  @param[in] seed
+ *  @param[in, out] *rng  The random number stream to refill.
  *
  *  @details
  *
- *  Initialises the GSL RNG algorithm using the SEED provided. The RNG algorithm
- *  choice should be thread safe!!!
+ *  Computes RNG_BUFFER_SIZE / 2 consecutive Philox4x32-10 blocks. The blocks
+ *  are independent of each other, so the rounds are applied to all of them at
+ *  once in a loop which the compiler vectorises.
+ *
+ *  Each block gives two doubles with 53 random bits each. The numbers are
+ *  offset by half a bit so that they lie in the open interval (0, 1), in the
+ *  same way as gsl_rng_uniform_pos.
+ *
+ * ************************************************************************** */
+
+SIMD_DISPATCH static void
+fill_rng_buffer(RNGStream_t *rng)
+{
+  enum { N_BLOCKS = RNG_BUFFER_SIZE / 2 };
+  uint32_t c0[N_BLOCKS], c1[N_BLOCKS], c2[N_BLOCKS], c3[N_BLOCKS];
+  uint64_t block = ((uint64_t) rng->counter[1] << 32) | rng->counter[0];
+
+  for(int b = 0; b < N_BLOCKS; b++)
+  {
+    c0[b] = (uint32_t) (block + b);
+    c1[b] = (uint32_t) ((block + b) >> 32);
+    c2[b] = rng->counter[2];
+    c3[b] = rng->counter[3];
+  }
+
+  uint32_t k0 = rng->key[0], k1 = rng->key[1];
+
+  for(int i = 0; i < PHILOX_ROUNDS; i++)
+  {
+    for(int b = 0; b < N_BLOCKS; b++)
+    {
+      uint64_t p0 = (uint64_t) PHILOX_M0 * c0[b];
+      uint64_t p1 = (uint64_t) PHILOX_M1 * c2[b];
+      uint32_t x0 = (uint32_t) (p1 >> 32) ^ c1[b] ^ k0;
+      uint32_t x2 = (uint32_t) (p0 >> 32) ^ c3[b] ^ k1;
+
+      c0[b] = x0;
+      c1[b] = (uint32_t) p1;
+      c2[b] = x2;
+      c3[b] = (uint32_t) p0;
+    }
+
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+
+  for(int b = 0; b < N_BLOCKS; b++)
+  {
+    rng->buffer[2 * b] = ((double) (((uint64_t) (c0[b] >> 5) << 26) | (c1[b] >> 6)) + 0.5) * 0x1.0p-53;
+    rng->buffer[2 * b + 1] = ((double) (((uint64_t) (c2[b] >> 5) << 26) | (c3[b] >> 6)) + 0.5) * 0x1.0p-53;
+  }
+
+  block += N_BLOCKS;
+  rng->counter[0] = (uint32_t) block;
+  rng->counter[1] = (uint32_t) (block >> 32);
+  rng->n_used = 0;
+}
+
+/* ************************************************************************** */
+/** init_rng_stream
+ *
+ *  @brief Initialise an independent random number stream.
+ *
+ *  @param[out] *rng    The stream to initialise.
+ *  @param[in] seed     The simulation SEED.
+ *  @param[in] stream   The stream index, usually the photon number.
+ *
+ *  @details
+ *
+ *  The seed is used as the Philox key and the stream index occupies the upper
+ *  64 bits of the counter. The lower 64 bits count the blocks drawn so far, so
+ *  each stream has 2^64 blocks available and no two streams can ever overlap.
+ *  The buffer is filled on the first call to random_number.
  *
  * ************************************************************************** */
 
 void
-init_gsl_seed(int seed)
+init_rng_stream(RNGStream_t *rng, uint64_t seed, uint64_t stream)
 {
-  rng = gsl_rng_alloc(gsl_rng_mt19937);
-  gsl_rng_set(rng, seed);
+  rng->key[0] = (uint32_t) seed;
+  rng->key[1] = (uint32_t) (seed >> 32);
+  rng->counter[0] = 0;
+  rng->counter[1] = 0;
+  rng->counter[2] = (uint32_t) stream;
+  rng->counter[3] = (uint32_t) (stream >> 32);
+  rng->n_used = RNG_BUFFER_SIZE;
 }
 
 /* ************************************************************************** */
-/** gsl_rand_num
+/** random_number
  *
  *  @brief Return a random number between the boundaries min and max.
  *
- *  @param[in] min  The minimum value the random number can take.
- *  @param[in] max  The maximum value the random number can take.
+ *  @param[in,out] *rng  The random number stream to draw from.
+ *  @param[in] min       The minimum value the random number can take.
+ *  @param[in] max       The maximum value the random number can take.
  *
  *  @return A random double between min and max.
  *
  *  @details
  *
- *  This should be thread safe!!!
+ *  Numbers are taken from the stream's buffer, which is refilled a few blocks
+ *  at a time. Only the stream passed in is modified, hence this is thread safe
+ *  as long as streams are not shared.
  *
  * ************************************************************************** */
 
 double
-gsl_rand_num(double min, double max)
+random_number(RNGStream_t *rng, double min, double max)
 {
-  double rand_num = gsl_rng_uniform_pos(rng);
+  if(rng->n_used == RNG_BUFFER_SIZE)
+    fill_rng_buffer(rng);
+
+  double rand_num = rng->buffer[rng->n_used++];
   return min + ((max - min) * rand_num);
 }
 
@@ -70,6 +160,8 @@ gsl_rand_num(double min, double max)
  *
  *  @brief Return a random optical depth.
  *
+ *  @param[in,out] *rng  The random number stream to draw from.
+ *
  *  @return a random optical depth
  *
  *  @details
@@ -79,9 +171,9 @@ gsl_rand_num(double min, double max)
  * ************************************************************************** */
 
 double
-random_tau(void)
+random_tau(RNGStream_t *rng)
 {
-  return -1.0 * log(1 - gsl_rand_num(0, 1));
+  return -1.0 * log(1 - random_number(rng, 0, 1));
 }
 
 /* ************************************************************************** */
@@ -89,6 +181,7 @@ random_tau(void)
  *
  *  @brief Generate a random isotropic theta and phi direction.
  *
+ *  @param[in,out] *rng   The random number stream to draw from.
  *  @param[in,out] *theta A pointer for the random theta direction.
  *  @param[in,out] *phi   A pointer for the random phi direction.
  *
@@ -100,8 +193,8 @@ random_tau(void)
  * ************************************************************************** */
 
 void
-random_theta_phi(double *theta, double *phi)
+random_theta_phi(RNGStream_t *rng, double *theta, double *phi)
 {
-  *theta = acos(2 * gsl_rand_num(0, 1) - 1);
-  *phi = 2 * PI * gsl_rand_num(0, 1);
+  *theta = acos(2 * random_number(rng, 0, 1) - 1);
+  *phi = 2 * PI * random_number(rng, 0, 1);
 }
@@ -0,0 +1,211 @@
+/* ************************************************************************** */
+/** @file rebin.c
+ *
+ *  @brief The main function of mcrt_rebin, which bins the escape log of a
+ *  simulation into an intensity histogram with any number of bins.
+ *
+ *  Usage: mcrt_rebin [--bins n] [--theta] [--output file] escapes.bin ...
+ *
+ *  The bins are equal in mu, as in the simulation, or equal in theta with
+ *  --theta. The logs of every MPI rank can be given at once. The histogram is
+ *  written with the same columns as OUTPUT_FILE_INTENS, to
+ *  intensity_rebin.txt by default.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "variables.h"
+#include "functions.h"
+
+/* ************************************************************************** */
+/** bin_escape_log
+ *
+ *  @brief Add the events of an escape log to a histogram.
+ *
+ *  @param[in] *file_name     The escape log.
+ *  @param[in] n_bins         The number of bins.
+ *  @param[in] theta_bins     If true, the bins are equal in theta, otherwise
+ *                            they are equal in mu.
+ *  @param[in, out] *sum      The sum of the weights in each bin.
+ *  @param[in, out] *sum_sq   The sum of the squares of the weights in each
+ *                            bin.
+ *
+ *  @return The number of photons transported by the simulation.
+ *
+ *  @details
+ *
+ *  The log is memory mapped, as it is read once from start to end. The number
+ *  of photons is only written when the simulation finishes, so the program
+ *  exits if given the log of a simulation which was stopped.
+ *
+ * ************************************************************************** */
+
+static uint64_t
+bin_escape_log(const char *file_name, int n_bins, int theta_bins, double *sum, double *sum_sq)
+{
+  uint16_t one = 1;
+  uint8_t first_byte;
+  memcpy(&first_byte, &one, 1);
+  if(first_byte != 1)
+  {
+    printf("mcrt_rebin can only read escape logs on a little-endian machine\n");
+    exit(1);
+  }
+
+  int fd = open(file_name, O_RDONLY);
+  struct stat file_stat;
+  if(fd < 0 || fstat(fd, &file_stat) || file_stat.st_size < ESCAPE_HEADER_SIZE)
+  {
+    printf("Cannot open escape log %s\n", file_name);
+    exit(1);
+  }
+
+  const uint8_t *bytes = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(bytes == MAP_FAILED)
+  {
+    printf("Cannot map escape log %s\n", file_name);
+    exit(1);
+  }
+
+  uint32_t version[2];
+  uint64_t counts[2];
+  memcpy(version, bytes + sizeof ESCAPE_MAGIC, sizeof version);
+  memcpy(counts, bytes + sizeof ESCAPE_MAGIC + sizeof version, sizeof counts);
+  if(memcmp(bytes, ESCAPE_MAGIC, sizeof ESCAPE_MAGIC) != 0 || version[0] != ESCAPE_VERSION ||
+     version[1] != sizeof(EscapeEvent_t))
+  {
+    printf("%s is not a version %d escape log\n", file_name, ESCAPE_VERSION);
+    exit(1);
+  }
+
+  uint64_t n_photons = counts[1];
+  if(n_photons == 0)
+  {
+    printf("%s is incomplete, as the simulation did not finish\n", file_name);
+    exit(1);
+  }
+
+  uint64_t n_events = (file_stat.st_size - ESCAPE_HEADER_SIZE) / sizeof(EscapeEvent_t);
+  const EscapeEvent_t *events = (const EscapeEvent_t *) (bytes + ESCAPE_HEADER_SIZE);
+
+  for(uint64_t i = 0; i < n_events; i++)
+  {
+    double mu = events[i].costheta;
+    double x = theta_bins ? acos(mu) / (0.5 * PI) : mu;
+    int index = (int) (x * n_bins);
+    if(index >= n_bins)
+      index = n_bins - 1;
+    if(index < 0)
+      index = 0;
+    sum[index] += events[i].weight;
+    sum_sq[index] += (double) events[i].weight * events[i].weight;
+  }
+
+  munmap((void *) bytes, file_stat.st_size);
+  close(fd);
+
+  return n_photons;
+}
+
+/* ************************************************************************** */
+/** main
+ *
+ *  @brief The main function of mcrt_rebin.
+ *
+ *  @param[in] int argc. Number of command line arguments provided.
+ *  @param[in] char *argv[]. The command line arguments provided.
+ *
+ *  @return 0 on success, otherwise 1.
+ *
+ *  @details
+ *
+ *  The intensity in each bin is normalised as in convert_weight_to_intensity,
+ *  by the width of the bin in mu and the mu of its centre. The error is that
+ *  of the mean weight per photon, as every photon escapes at most once.
+ *
+ * ************************************************************************** */
+
+int
+main(int argc, char *argv[])
+{
+  int n_bins = 0;
+  int theta_bins = 0;
+  char *output = "intensity_rebin.txt";
+  int n_files = 0;
+  char **files = malloc(argc * sizeof *files);
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "--bins") == 0 && i + 1 < argc)
+      n_bins = (int) strtol(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--theta") == 0)
+      theta_bins = 1;
+    else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else
+      files[n_files++] = argv[i];
+  }
+
+  if(n_files == 0 || n_bins < 1)
+  {
+    printf("Usage: mcrt_rebin --bins n [--theta] [--output file] escapes.bin ...\n");
+    return 1;
+  }
+
+  double *sum = calloc(n_bins, sizeof *sum);
+  double *sum_sq = calloc(n_bins, sizeof *sum_sq);
+  uint64_t n_photons = 0;
+  for(int i = 0; i < n_files; i++)
+    n_photons += bin_escape_log(files[i], n_bins, theta_bins, sum, sum_sq);
+
+  FILE *f = fopen(output, "w");
+  if(f == NULL)
+  {
+    printf("Cannot open file %s\n", output);
+    return 1;
+  }
+
+  fprintf(f, "%-12s %-12s %-12s %-12s\n", "angle", "weight", "intensity", "error");
+  for(int i = 0; i < n_bins; i++)
+  {
+    double mu_lower, mu_upper, theta;
+    if(theta_bins)
+    {
+      mu_lower = cos((i + 1) * 0.5 * PI / n_bins);
+      mu_upper = cos(i * 0.5 * PI / n_bins);
+      theta = (i + 0.5) * 0.5 * PI / n_bins;
+    }
+    else
+    {
+      mu_lower = (double) i / n_bins;
+      mu_upper = (double) (i + 1) / n_bins;
+      theta = acos(0.5 * (mu_lower + mu_upper));
+    }
+
+    double norm = 1.0 / (2.0 * n_photons * cos(theta) * (mu_upper - mu_lower));
+    double variance = sum_sq[i] - sum[i] * sum[i] / n_photons;
+    double error = variance > 0 ? sqrt(variance) : 0;
+    fprintf(f, "%-12f %-12e %-12e %-12e\n", theta, sum[i], sum[i] * norm, error * norm);
+  }
+
+  if(fclose(f))
+  {
+    printf("Cannot close file %s\n", output);
+    return 1;
+  }
+
+  free(sum);
+  free(sum_sq);
+  free(files);
+
+  return 0;
+}
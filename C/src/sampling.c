@@ -0,0 +1,230 @@
+/* ************************************************************************** */
+/** @file sampling.c
+ *
+ *  @brief Batched kernels for turning uniform random numbers into random
+ *  optical depths and isotropic directions.
+ *
+ *  The C library log, sin and cos cannot be vectorised, so the kernels here use
+ *  their own branch-free polynomial approximations which are accurate to a
+ *  couple of ulp. Each kernel is a plain loop over arrays and is compiled for
+ *  several instruction sets with SIMD_DISPATCH, with the best version for the
+ *  CPU chosen at run time.
+ *
+ *  Only the event engine uses these, as it has a whole batch of photons which
+ *  need a new optical depth or direction at once. The history engine follows
+ *  one photon at a time and still calls random_tau and
+ *  isotropic_scatter_photon, one interaction at a time, so its results are
+ *  those of the C library. mcrt_bench --functions times both.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#define LN2 0.69314718055994530942
+#define SQRT2 1.41421356237309504880
+
+/* ************************************************************************** */
+/** polynomial_log
+ *
+ *  @brief A branch-free natural logarithm for positive, normal numbers.
+ *
+ *  @param[in] x  The number to take the logarithm of.
+ *
+ *  @return log(x)
+ *
+ *  @details
+ *
+ *  x is split into m * 2^e with m in [sqrt(1/2), sqrt(2)) by manipulating the
+ *  exponent bits directly. The exponent is converted to a double by placing it
+ *  in the mantissa of 2^52, as there is no vector conversion from a 64 bit
+ *  integer before AVX-512. log(m) is then found from the series
+ *  log(m) = 2 * atanh(s), s = (m - 1) / (m + 1), where |s| < 0.172 so that
+ *  eleven terms reach double precision.
+ *
+ * ************************************************************************** */
+
+static inline double
+polynomial_log(double x)
+{
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof bits);
+
+  uint64_t e_bits = (bits >> 52) | 0x4330000000000000ULL;
+  bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+
+  double m, exponent;
+  memcpy(&m, &bits, sizeof m);
+  memcpy(&exponent, &e_bits, sizeof exponent);
+  exponent -= 0x1.0p52 + 1023.0;
+
+  double big = m > SQRT2 ? 1.0 : 0.0;
+  m *= 1.0 - 0.5 * big;
+  exponent += big;
+
+  double s = (m - 1.0) / (m + 1.0);
+  double s2 = s * s;
+  double series = 1.0 / 21.0;
+  series = series * s2 + 1.0 / 19.0;
+  series = series * s2 + 1.0 / 17.0;
+  series = series * s2 + 1.0 / 15.0;
+  series = series * s2 + 1.0 / 13.0;
+  series = series * s2 + 1.0 / 11.0;
+  series = series * s2 + 1.0 / 9.0;
+  series = series * s2 + 1.0 / 7.0;
+  series = series * s2 + 1.0 / 5.0;
+  series = series * s2 + 1.0 / 3.0;
+  series = series * s2 + 1.0;
+
+  return 2.0 * s * series + exponent * LN2;
+}
+
+/* ************************************************************************** */
+/** polynomial_sincos_turns
+ *
+ *  @brief A branch-free sine and cosine of an angle given in turns.
+ *
+ *  @param[in] turns  The angle as a fraction of a full circle, i.e. 2 pi turns
+ *                    radians.
+ *  @param[out] *s    The sine of the angle.
+ *  @param[out] *c    The cosine of the angle.
+ *
+ *  @details
+ *
+ *  The angle is reduced to the nearest quarter turn, leaving |r| <= pi / 4,
+ *  where Taylor series to r^17 and r^18 are accurate to double precision. The
+ *  quarter turn then swaps and negates the results. The rounding is done by
+ *  adding and subtracting 1.5 * 2^52 rather than calling floor, which needs
+ *  SSE4.1 to be vectorised. Only angles in [0, 1] turns are supported.
+ *
+ * ************************************************************************** */
+
+static inline void
+polynomial_sincos_turns(double turns, double *s, double *c)
+{
+  double quarters = 4.0 * turns;
+  double q = (quarters + 0x1.8p52) - 0x1.8p52;
+  double r = (quarters - q) * (0.5 * PI);
+  double r2 = r * r;
+
+  double sr = -1.0 / 355687428096000.0;
+  sr = sr * r2 + 1.0 / 1307674368000.0;
+  sr = sr * r2 - 1.0 / 6227020800.0;
+  sr = sr * r2 + 1.0 / 39916800.0;
+  sr = sr * r2 - 1.0 / 362880.0;
+  sr = sr * r2 + 1.0 / 5040.0;
+  sr = sr * r2 - 1.0 / 120.0;
+  sr = sr * r2 + 1.0 / 6.0;
+  sr = r - r * r2 * sr;
+
+  double cr = 1.0 / 6402373705728000.0;
+  cr = cr * r2 - 1.0 / 20922789888000.0;
+  cr = cr * r2 + 1.0 / 87178291200.0;
+  cr = cr * r2 - 1.0 / 479001600.0;
+  cr = cr * r2 + 1.0 / 3628800.0;
+  cr = cr * r2 - 1.0 / 40320.0;
+  cr = cr * r2 + 1.0 / 720.0;
+  cr = cr * r2 - 1.0 / 24.0;
+  cr = cr * r2 + 0.5;
+  cr = 1.0 - r2 * cr;
+
+  double quadrant = q > 3.5 ? q - 4.0 : q;
+  double swap = (quadrant == 1.0 || quadrant == 3.0) ? 1.0 : 0.0;
+  double sign_s = quadrant > 1.5 ? -1.0 : 1.0;
+  double sign_c = (quadrant == 1.0 || quadrant == 2.0) ? -1.0 : 1.0;
+
+  *s = sign_s * (swap * cr + (1.0 - swap) * sr);
+  *c = sign_c * (swap * sr + (1.0 - swap) * cr);
+}
+
+/* ************************************************************************** */
+/** gather_random_numbers
+ *
+ *  @brief Draw the next random number from each of n streams.
+ *
+ *  @param[in] n            The number of streams.
+ *  @param[in, out] *rng    An array of n random number streams.
+ *  @param[out] *u          An array of n random numbers in (0, 1).
+ *
+ *  @details
+ *
+ *  Element i of u is drawn from stream i. The streams refill their buffers a
+ *  few blocks at a time, so most calls are a single load.
+ *
+ * ************************************************************************** */
+
+void
+gather_random_numbers(int n, RNGStream_t *rng, double *u)
+{
+  for(int i = 0; i < n; i++)
+    u[i] = random_number(&rng[i], 0, 1);
+}
+
+/* ************************************************************************** */
+/** sample_optical_depths
+ *
+ *  @brief Convert uniform random numbers into random optical depths.
+ *
+ *  @param[in] n       The number of optical depths.
+ *  @param[in] *u      An array of n random numbers in (0, 1).
+ *  @param[in] scale   A factor to multiply each optical depth by, i.e.
+ *                     1 / TAU_MAX to get a distance.
+ *  @param[out] *tau   An array of n random optical depths.
+ *
+ *  @details
+ *
+ *  The same transformation as random_tau, -log(1 - u).
+ *
+ * ************************************************************************** */
+
+SIMD_DISPATCH void
+sample_optical_depths(int n, const double *restrict u, double scale, double *restrict tau)
+{
+#pragma omp simd
+  for(int i = 0; i < n; i++)
+    tau[i] = -scale * polynomial_log(1.0 - u[i]);
+}
+
+/* ************************************************************************** */
+/** sample_isotropic_directions
+ *
+ *  @brief Convert pairs of uniform random numbers into isotropic directions.
+ *
+ *  @param[in] n            The number of directions.
+ *  @param[in] *u_theta     An array of n random numbers for theta.
+ *  @param[in] *u_phi       An array of n random numbers for phi.
+ *  @param[out] *costheta   The cosine of theta for each direction.
+ *  @param[out] *sintheta   The sine of theta for each direction.
+ *  @param[out] *cosphi     The cosine of phi for each direction.
+ *  @param[out] *sinphi     The sine of phi for each direction.
+ *
+ *  @details
+ *
+ *  The same distribution as random_theta_phi. Rather than taking the cosine
+ *  of an arccosine, cos(theta) = 2u - 1 is used directly and sin(theta) is
+ *  found from it, which is always positive as theta lies in [0, pi].
+ *
+ * ************************************************************************** */
+
+SIMD_DISPATCH void
+sample_isotropic_directions(int n, const double *restrict u_theta, const double *restrict u_phi,
+                            double *restrict costheta, double *restrict sintheta, double *restrict cosphi,
+                            double *restrict sinphi)
+{
+#pragma omp simd
+  for(int i = 0; i < n; i++)
+  {
+    double mu = 2.0 * u_theta[i] - 1.0;
+    double s, c;
+    polynomial_sincos_turns(u_phi[i], &s, &c);
+    costheta[i] = mu;
+    sintheta[i] = sqrt(1.0 - mu * mu);
+    cosphi[i] = c;
+    sinphi[i] = s;
+  }
+}
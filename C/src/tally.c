@@ -0,0 +1,985 @@
+/* ************************************************************************** */
+/** @file tally.c
+ *
+ *  @brief Functions for thread private tallies of the escape histogram and the
+ *  radiation moments, and for summing them in a fixed order.
+ *
+ *  Photons are transported in batches of BATCH_SIZE photons. Each batch is
+ *  accumulated by a single thread into its own cache line aligned tally, so no
+ *  synchronisation is required whilst transporting photons. Finished batches
+ *  are summed pairwise in a binary tree whose shape depends only on the batch
+ *  index, hence the final tallies for a given SEED are bit-identical no matter
+ *  how many threads are used.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <math.h>
+
+#ifdef MPI_ON
+#include <mpi.h>
+#endif
+
+#include "variables.h"
+#include "functions.h"
+
+/* ************************************************************************** */
+/** pad_to_cache_line
+ *
+ *  @brief Round a number of doubles up to fill a whole number of cache lines.
+ *
+ *  @param[in] n  The number of doubles.
+ *
+ *  @return The padded number of doubles.
+ *
+ * ************************************************************************** */
+
+static size_t
+pad_to_cache_line(size_t n)
+{
+  size_t per_line = CACHE_LINE / sizeof(double);
+  return (n + per_line - 1) / per_line * per_line;
+}
+
+/* ************************************************************************** */
+/** init_tally
+ *
+ *  @brief Allocate and zero a Tally_t struct.
+ *
+ *  @param[in, out] *tally  An uninitialised Tally_t struct.
+ *  @param[in] n_bins       The number of bins in the escape histogram.
+ *  @param[in] n_levels     The number of levels for the radiation moments.
+ *
+ *  @details
+ *
+ *  For each of the N_TALLY_SETS sets, the histogram, the peel-off weights and
+ *  the moments are placed in a single cache line aligned block, each starting
+ *  on a new cache line. The Histogram_t and Moments_t structs in the tally
+ *  point into this block.
+ *
+ * ************************************************************************** */
+
+void
+init_tally(Tally_t *tally, int n_bins, int n_levels)
+{
+  size_t bins_len = pad_to_cache_line(n_bins);
+  size_t peel_len = pad_to_cache_line(N_PEEL);
+  size_t levels_len = pad_to_cache_line(N_MOMENTS * (n_levels + 2));
+  size_t set_len = bins_len + peel_len + levels_len;
+
+  tally->batch = -1;
+  tally->n_sets = N_TALLY_SETS;
+  tally->n_data = tally->n_sets * set_len;
+  tally->data = aligned_calloc(tally->n_data, sizeof *tally->data);
+  tally->hist = malloc(tally->n_sets * sizeof *tally->hist);
+  tally->moments = malloc(tally->n_sets * sizeof *tally->moments);
+  if(tally->hist == NULL || tally->moments == NULL)
+  {
+    printf("Unable to allocate memory for a tally\n");
+    exit(1);
+  }
+
+  for(int s = 0; s < tally->n_sets; s++)
+  {
+    double *set = tally->data + s * set_len;
+    Histogram_t *hist = &tally->hist[s];
+    Moments_t *moments = &tally->moments[s];
+
+    hist->n_bins = n_bins;
+    hist->weight = set;
+    hist->weight_sq = NULL;
+    hist->intensity = NULL;
+    hist->error = NULL;
+    hist->n_batches = 0;
+    hist->theta = NULL;
+    hist->n_peel = N_PEEL;
+    hist->peel_weight = set + bins_len;
+    hist->peel_weight_sq = NULL;
+    hist->peel_intensity = NULL;
+    hist->peel_error = NULL;
+
+    moments->n_levels = n_levels;
+    moments->level = set + bins_len + peel_len;
+    moments->level_sq = NULL;
+    moments->n_batches = 0;
+  }
+}
+
+/* ************************************************************************** */
+/** zero_tally
+ *
+ *  @brief Reset every element of a tally to zero.
+ *
+ *  @param[in, out] *tally  An initialised Tally_t struct.
+ *
+ * ************************************************************************** */
+
+void
+zero_tally(Tally_t *tally)
+{
+  memset(tally->data, 0, tally->n_data * sizeof *tally->data);
+}
+
+/* ************************************************************************** */
+/** add_tally
+ *
+ *  @brief Add the contents of one tally to another.
+ *
+ *  @param[in, out] *total  The tally to add to.
+ *  @param[in] *tally       The tally to be added.
+ *
+ * ************************************************************************** */
+
+void
+add_tally(Tally_t *total, const Tally_t *tally)
+{
+  double *restrict a = total->data;
+  const double *restrict b = tally->data;
+
+  for(size_t i = 0; i < total->n_data; i++)
+    a[i] += b[i];
+}
+
+/* ************************************************************************** */
+/** free_tally
+ *
+ *  @brief Free the memory used by a Tally_t struct.
+ *
+ *  @param[in, out] *tally  An initialised Tally_t struct.
+ *
+ * ************************************************************************** */
+
+void
+free_tally(Tally_t *tally)
+{
+  aligned_free(tally->data);
+  free(tally->hist);
+  free(tally->moments);
+  tally->data = NULL;
+  tally->hist = NULL;
+  tally->moments = NULL;
+  tally->n_data = 0;
+}
+
+/* ************************************************************************** */
+/** init_tally_reducer
+ *
+ *  @brief Initialise an empty TallyReducer_t struct.
+ *
+ *  @param[in, out] *reducer  An uninitialised TallyReducer_t struct.
+ *  @param[in] n_bins         The number of bins in the escape histogram.
+ *  @param[in] n_levels       The number of levels for the radiation moments.
+ *
+ * ************************************************************************** */
+
+void
+init_tally_reducer(TallyReducer_t *reducer, int n_bins, int n_levels)
+{
+  reducer->n_bins = n_bins;
+  reducer->n_levels = n_levels;
+  reducer->next_batch = 0;
+  reducer->n_stack = 0;
+  reducer->n_pending = 0;
+  reducer->n_free = 0;
+  reducer->max_tallies = 0;
+  reducer->merging = false;
+  reducer->n_snapshots_waiting = 0;
+  reducer->pending = NULL;
+  reducer->free = NULL;
+  reducer->stop_batch = LONG_MAX;
+  reducer->start_time = get_wall_time();
+  init_tally(&reducer->squares, n_bins, n_levels);
+  init_tally(&reducer->check, n_bins, n_levels);
+}
+
+/* ************************************************************************** */
+/** get_batch_tally
+ *
+ *  @brief Get an empty tally for a thread to accumulate a batch of photons.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *  @param[in] batch          The index of the batch to be accumulated.
+ *
+ *  @return A zeroed tally owned by the calling thread until it is passed back
+ *  with submit_batch_tally.
+ *
+ *  @details
+ *
+ *  Tallies are re-used once they have been summed, so only a handful are ever
+ *  allocated. The capacity of the pending and free arrays is always at least
+ *  the number of tallies allocated, so they can never overflow.
+ *
+ * ************************************************************************** */
+
+Tally_t *
+get_batch_tally(TallyReducer_t *reducer, long batch)
+{
+  Tally_t *tally = NULL;
+
+#pragma omp critical (tally_reducer)
+{
+  if(reducer->n_free > 0)
+  {
+    tally = reducer->free[--reducer->n_free];
+  }
+  else
+  {
+    int n_tallies = reducer->max_tallies + 1;
+    reducer->pending = realloc(reducer->pending, n_tallies * sizeof *reducer->pending);
+    reducer->free = realloc(reducer->free, n_tallies * sizeof *reducer->free);
+    if(reducer->pending == NULL || reducer->free == NULL)
+    {
+      printf("Unable to allocate memory for batch tallies\n");
+      exit(1);
+    }
+    reducer->max_tallies = n_tallies;
+
+    tally = malloc(sizeof *tally);
+    init_tally(tally, reducer->n_bins, reducer->n_levels);
+  }
+}
+
+  zero_tally(tally);
+  tally->batch = batch;
+
+  return tally;
+}
+
+/* ************************************************************************** */
+/** batch_means_error
+ *
+ *  @brief The standard error of a sum of batches.
+ *
+ *  @param[in] sum        The sum of the batch values.
+ *  @param[in] sum_sq     The sum of the squares of the batch values.
+ *  @param[in] n_batches  The number of batches.
+ *
+ *  @return The standard error of sum, or 0 with fewer than two batches.
+ *
+ *  @details
+ *
+ *  The batches are treated as independent samples of the same size, so the
+ *  variance of the sum is n_batches times the sample variance of a batch. The
+ *  last batch is usually smaller than the rest, which is ignored.
+ *
+ * ************************************************************************** */
+
+double
+batch_means_error(double sum, double sum_sq, long n_batches)
+{
+  if(n_batches < 2)
+    return 0;
+
+  double variance = (sum_sq - sum * sum / n_batches) * n_batches / (n_batches - 1);
+
+  return variance > 0 ? sqrt(variance) : 0;
+}
+
+/* ************************************************************************** */
+/** add_batch_squares
+ *
+ *  @brief Add the square of each element of a batch tally to the reducer.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *  @param[in] *tally         A tally of a single batch.
+ *
+ *  @details
+ *
+ *  The moments of the batch are integrated on the fly, as the square of the
+ *  difference array is not the square of the moments.
+ *
+ * ************************************************************************** */
+
+static void
+add_batch_squares(TallyReducer_t *reducer, const Tally_t *tally)
+{
+  for(int s = 0; s < tally->n_sets; s++)
+  {
+    double running[N_MOMENTS] = {0};
+    const Histogram_t *hist = &tally->hist[s];
+    Histogram_t *hist_sq = &reducer->squares.hist[s];
+
+    for(int i = 0; i < reducer->n_bins; i++)
+      hist_sq->weight[i] += hist->weight[i] * hist->weight[i];
+
+    for(int i = 0; i < N_PEEL; i++)
+      hist_sq->peel_weight[i] += hist->peel_weight[i] * hist->peel_weight[i];
+
+    for(int i = 0; i < reducer->n_levels + 1; i++)
+    {
+      for(int m = 0; m < N_MOMENTS; m++)
+      {
+        running[m] += MOMENT(&tally->moments[s], i, m);
+        MOMENT(&reducer->squares.moments[s], i, m) += running[m] * running[m];
+      }
+    }
+  }
+}
+
+/* ************************************************************************** */
+/** relative_error_reached
+ *
+ *  @brief Check whether the relative error of a sum is below TARGET_REL_ERROR.
+ *
+ *  @param[in] sum        The sum of the batch values.
+ *  @param[in] sum_sq     The sum of the squares of the batch values.
+ *  @param[in] n_batches  The number of batches.
+ *  @param[in] target     The relative error to reach.
+ *
+ *  @return true if the error is small enough. A sum of zero has no relative
+ *  error, so it never has.
+ *
+ * ************************************************************************** */
+
+static int
+relative_error_reached(double sum, double sum_sq, long n_batches, double target)
+{
+  if(sum == 0)
+    return false;
+
+  return batch_means_error(sum, sum_sq, n_batches) <= target * fabs(sum);
+}
+
+/* ************************************************************************** */
+/** check_target_error
+ *
+ *  @brief Stop the reducer if the target relative error has been reached.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *
+ *  @details
+ *
+ *  The partial sums on the stack are added up in the check tally, and the
+ *  error of every histogram bin, and of J at every level if TARGET_MOMENTS is
+ *  set, of every set is compared to TARGET_REL_ERROR. This is only done every
+ *  CHECK_INTERVAL batches, after at least MIN_CHECK_BATCHES, as the batch
+ *  means error is unreliable with only a few batches.
+ *
+ *  Every histogram bin must have some weight before the target can be
+ *  reached, so a run does not stop before photons have escaped into every
+ *  bin. The mean intensity at some levels can be zero whatever the number of
+ *  photons, such as J- at the top of the slab, so levels of J with no weight
+ *  are left out of the check, which is reported when the target is reached.
+ *  As J is summed from a difference array, such a level is only zero to
+ *  rounding, so a level counts as having no weight below NO_WEIGHT_FRACTION
+ *  of the largest J of the set.
+ *
+ *  With MPI, each rank checks only its own tallies, as the threads cannot
+ *  take part in a reduction across ranks. The ranks transport the same number
+ *  of batches, so the relative error of their sum is that of each rank over
+ *  sqrt(N_RANKS), and each rank checks against TARGET_REL_ERROR *
+ *  sqrt(N_RANKS). The combined result then has about TARGET_REL_ERROR, rather
+ *  than being sqrt(N_RANKS) times more precise than asked for.
+ *
+ *  If the target has been reached, every batch from next_batch onwards is
+ *  thrown away. As the check depends only on the batches summed so far, the
+ *  simulation stops at the same batch no matter how many threads are used.
+ *
+ * ************************************************************************** */
+
+#define CHECK_INTERVAL 8
+#define MIN_CHECK_BATCHES 16
+#define NO_WEIGHT_FRACTION 1e-9
+
+static void
+check_target_error(TallyReducer_t *reducer)
+{
+  long n_batches = reducer->next_batch;
+  if(TARGET_REL_ERROR <= 0 || n_batches < MIN_CHECK_BATCHES || n_batches % CHECK_INTERVAL != 0)
+    return;
+
+  Tally_t *sum = &reducer->check;
+  Tally_t *squares = &reducer->squares;
+  double target = TARGET_REL_ERROR * sqrt(N_RANKS);
+  int n_unchecked = 0;
+
+  zero_tally(sum);
+  for(int i = reducer->n_stack - 1; i >= 0; i--)
+    add_tally(sum, reducer->stack[i]);
+
+  for(int s = 0; s < sum->n_sets; s++)
+  {
+    for(int i = 0; i < reducer->n_bins; i++)
+      if(!relative_error_reached(sum->hist[s].weight[i], squares->hist[s].weight[i], n_batches, target))
+        return;
+
+    if(TARGET_MOMENTS)
+    {
+      double j[2] = {0, 0};
+      double j_max = 0;
+      int m[2] = {MOMENT_J_PLUS, MOMENT_J_MINUS};
+      for(int i = 0; i < reducer->n_levels + 1; i++)
+      {
+        for(int k = 0; k < 2; k++)
+        {
+          j[k] += MOMENT(&sum->moments[s], i, m[k]);
+          j_max = fmax(j_max, fabs(j[k]));
+        }
+      }
+
+      j[0] = j[1] = 0;
+      for(int i = 0; i < reducer->n_levels + 1; i++)
+      {
+        for(int k = 0; k < 2; k++)
+        {
+          j[k] += MOMENT(&sum->moments[s], i, m[k]);
+          if(fabs(j[k]) <= NO_WEIGHT_FRACTION * j_max)
+            n_unchecked++;
+          else if(!relative_error_reached(j[k], MOMENT(&squares->moments[s], i, m[k]), n_batches, target))
+            return;
+        }
+      }
+    }
+  }
+
+#pragma omp atomic write
+  reducer->stop_batch = n_batches;
+
+  if(RANK == 0)
+  {
+    printf("Reached target_rel_error %g after %ld batches\n", TARGET_REL_ERROR, n_batches);
+    if(n_unchecked > 0)
+      printf("%d values of J with no weight were left out of the target_rel_error check\n", n_unchecked);
+  }
+}
+
+/* ************************************************************************** */
+/** check_time_limit
+ *
+ *  @brief Stop the reducer if it has run for longer than TIME_LIMIT.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *
+ *  @details
+ *
+ *  As for the target error, every batch from next_batch onwards is thrown
+ *  away, including any which are being transported.
+ *
+ * ************************************************************************** */
+
+static void
+check_time_limit(TallyReducer_t *reducer)
+{
+  if(TIME_LIMIT <= 0 || reducer->stop_batch != LONG_MAX || get_wall_time() - reducer->start_time < TIME_LIMIT)
+    return;
+
+#pragma omp atomic write
+  reducer->stop_batch = reducer->next_batch;
+
+  if(RANK == 0)
+    printf("Reached time_limit %g s after %ld batches\n", TIME_LIMIT, reducer->next_batch);
+}
+
+/* ************************************************************************** */
+/** batch_wanted
+ *
+ *  @brief Check whether a batch still needs to be transported.
+ *
+ *  @param[in] *reducer  An initialised TallyReducer_t struct.
+ *  @param[in] batch     The index of the batch.
+ *
+ *  @return false if the target error or time limit was reached before this
+ *  batch.
+ *
+ * ************************************************************************** */
+
+int
+batch_wanted(TallyReducer_t *reducer, long batch)
+{
+  long stop_batch;
+
+#pragma omp atomic read
+  stop_batch = reducer->stop_batch;
+
+  return batch < stop_batch;
+}
+
+/* ************************************************************************** */
+/** push_batch_tally
+ *
+ *  @brief Push the next batch tally in order on to the partial sum stack.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *  @param[in] *tally         The tally for batch reducer->next_batch.
+ *  @param[out] **retired     At least MAX_STACK_ORDER elements, to receive the
+ *                            tallies which have been added into another.
+ *
+ *  @return The number of retired tallies.
+ *
+ *  @details
+ *
+ *  This is a binary counter: whilst the top of the stack holds a partial sum
+ *  of the same order, the two are added and the order incremented. Batches
+ *  0 and 1 are summed, then batches 2 and 3, then (0 + 1) and (2 + 3) and so
+ *  on, so the order of the floating point operations is fixed.
+ *
+ *  This is called without the lock, by the thread which has claimed the
+ *  merge, so the retired tallies are handed back to be freed under the lock.
+ *
+ * ************************************************************************** */
+
+static int
+push_batch_tally(TallyReducer_t *reducer, Tally_t *tally, Tally_t **retired)
+{
+  int order = 0;
+  int n_retired = 0;
+
+  add_batch_squares(reducer, tally);
+
+  while(reducer->n_stack > 0 && reducer->stack_order[reducer->n_stack - 1] == order)
+  {
+    Tally_t *previous = reducer->stack[--reducer->n_stack];
+    add_tally(previous, tally);
+    retired[n_retired++] = tally;
+    tally = previous;
+    order++;
+  }
+
+  reducer->stack[reducer->n_stack] = tally;
+  reducer->stack_order[reducer->n_stack] = order;
+  reducer->n_stack++;
+  reducer->next_batch++;
+
+  check_target_error(reducer);
+  check_time_limit(reducer);
+
+  return n_retired;
+}
+
+/* ************************************************************************** */
+/** claim_next_pending
+ *
+ *  @brief Take the next batch in order from the pending batches, and claim
+ *  the merge if there is one. Must be called with the lock held.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *
+ *  @return The tally for batch reducer->next_batch, or NULL if it has not
+ *  finished or the reducer has been stopped.
+ *
+ * ************************************************************************** */
+
+static Tally_t *
+claim_next_pending(TallyReducer_t *reducer)
+{
+  Tally_t *next = NULL;
+
+  for(int i = 0; i < reducer->n_pending; i++)
+  {
+    if(reducer->pending[i]->batch == reducer->next_batch && reducer->next_batch < reducer->stop_batch)
+    {
+      next = reducer->pending[i];
+      reducer->pending[i] = reducer->pending[--reducer->n_pending];
+      break;
+    }
+  }
+
+  reducer->merging = next != NULL;
+
+  return next;
+}
+
+/* ************************************************************************** */
+/** merge_pending_tallies
+ *
+ *  @brief Push batches on to the stack for as long as the next is pending.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *  @param[in] *next          A tally from claim_next_pending, or NULL.
+ *
+ *  @details
+ *
+ *  The lock is only held to hand back the retired tallies and to claim the
+ *  next batch, so other threads can submit batches whilst the sums are done.
+ *  The merge is given up if a snapshot is waiting, which then takes it over
+ *  once the copy has been made.
+ *
+ * ************************************************************************** */
+
+static void
+merge_pending_tallies(TallyReducer_t *reducer, Tally_t *next)
+{
+  Tally_t *retired[MAX_STACK_ORDER];
+
+  while(next != NULL)
+  {
+    int n_retired = push_batch_tally(reducer, next, retired);
+
+#pragma omp critical (tally_reducer)
+{
+    for(int i = 0; i < n_retired; i++)
+      reducer->free[reducer->n_free++] = retired[i];
+
+    if(reducer->n_snapshots_waiting > 0)
+    {
+      reducer->merging = false;
+      next = NULL;
+    }
+    else
+    {
+      next = claim_next_pending(reducer);
+    }
+}
+  }
+}
+
+/* ************************************************************************** */
+/** submit_batch_tally
+ *
+ *  @brief Hand back a finished batch tally to be summed.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct.
+ *  @param[in] *tally         A tally from get_batch_tally which the thread has
+ *                            finished accumulating.
+ *
+ *  @details
+ *
+ *  Batches can finish out of order. A batch which finishes before an earlier
+ *  batch is kept as pending until every earlier batch has been pushed. Batches
+ *  after the reducer has been stopped are thrown away.
+ *
+ *  Only one thread pushes batches at a time. If no other thread is, the
+ *  calling thread claims the merge and pushes every batch which is ready,
+ *  including those submitted by other threads in the meantime.
+ *
+ * ************************************************************************** */
+
+void
+submit_batch_tally(TallyReducer_t *reducer, Tally_t *tally)
+{
+  Tally_t *next = NULL;
+  long stop_batch;
+
+#pragma omp atomic read
+  stop_batch = reducer->stop_batch;
+
+#pragma omp critical (tally_reducer)
+{
+  if(tally->batch >= stop_batch)
+    reducer->free[reducer->n_free++] = tally;
+  else
+    reducer->pending[reducer->n_pending++] = tally;
+
+  if(!reducer->merging && reducer->n_snapshots_waiting == 0)
+    next = claim_next_pending(reducer);
+}
+
+  merge_pending_tallies(reducer, next);
+}
+
+/* ************************************************************************** */
+/** snapshot_tally_reducer
+ *
+ *  @brief Copy the partial sums of a reducer, whilst it is in use.
+ *
+ *  @param[in] *reducer          An initialised TallyReducer_t struct.
+ *  @param[in, out] *checkpoint  The struct to copy the partial sums into. The
+ *                               tallies are allocated as they are needed and
+ *                               kept for the next snapshot.
+ *
+ *  @details
+ *
+ *  Only the batches which have been summed in order are copied. Pending batches
+ *  are left out, so they will be transported again on a restart. Submitting
+ *  batches is blocked whilst the copy is made, but threads transporting photons
+ *  are not.
+ *
+ *  The stack is changed without the lock whilst a merge is running, so the
+ *  copy waits for the merging thread to give up the merge, and then pushes
+ *  any batches which became ready in the meantime.
+ *
+ * ************************************************************************** */
+
+void
+snapshot_tally_reducer(TallyReducer_t *reducer, Checkpoint_t *checkpoint)
+{
+  Tally_t *next = NULL;
+  int waiting = false;
+  int copied = false;
+
+  while(!copied)
+  {
+#pragma omp critical (tally_reducer)
+{
+    if(reducer->merging)
+    {
+      if(!waiting)
+        reducer->n_snapshots_waiting++;
+      waiting = true;
+    }
+    else
+    {
+      if(waiting)
+        reducer->n_snapshots_waiting--;
+
+      for(int i = checkpoint->n_allocated; i < reducer->n_stack; i++)
+        init_tally(&checkpoint->stack[i], reducer->n_bins, reducer->n_levels);
+      if(reducer->n_stack > checkpoint->n_allocated)
+        checkpoint->n_allocated = reducer->n_stack;
+
+      if(checkpoint->squares.data == NULL)
+        init_tally(&checkpoint->squares, reducer->n_bins, reducer->n_levels);
+      memcpy(checkpoint->squares.data, reducer->squares.data, reducer->squares.n_data * sizeof(double));
+
+      checkpoint->next_batch = reducer->next_batch;
+      checkpoint->stop_batch = reducer->stop_batch;
+      checkpoint->n_stack = reducer->n_stack;
+      for(int i = 0; i < reducer->n_stack; i++)
+      {
+        checkpoint->stack_order[i] = reducer->stack_order[i];
+        memcpy(checkpoint->stack[i].data, reducer->stack[i]->data, reducer->stack[i]->n_data * sizeof(double));
+      }
+
+      if(reducer->n_snapshots_waiting == 0)
+        next = claim_next_pending(reducer);
+      copied = true;
+    }
+}
+  }
+
+  merge_pending_tallies(reducer, next);
+}
+
+/* ************************************************************************** */
+/** free_snapshot
+ *
+ *  @brief Free the tallies of a snapshot of a reducer.
+ *
+ *  @param[in, out] *checkpoint  A snapshot from snapshot_tally_reducer or
+ *                               read_checkpoint, which is left empty.
+ *
+ *  @details
+ *
+ *  The size of the tallies depends on the parameters, so a snapshot must be
+ *  freed before it is re-used for a simulation with different parameters.
+ *
+ * ************************************************************************** */
+
+void
+free_snapshot(Checkpoint_t *checkpoint)
+{
+  for(int i = 0; i < checkpoint->n_allocated; i++)
+    free_tally(&checkpoint->stack[i]);
+  if(checkpoint->squares.data != NULL)
+    free_tally(&checkpoint->squares);
+
+  checkpoint->n_allocated = 0;
+  checkpoint->n_stack = 0;
+}
+
+/* ************************************************************************** */
+/** restore_tally_reducer
+ *
+ *  @brief Set the state of an unused reducer from a checkpoint.
+ *
+ *  @param[in, out] *reducer  A TallyReducer_t struct, straight from
+ *                            init_tally_reducer.
+ *  @param[in] *checkpoint    The checkpoint to restore.
+ *
+ *  @details
+ *
+ *  Batch checkpoint->next_batch is the next to be submitted. As the partial
+ *  sums are identical to those before the checkpoint, the rest of the sum is
+ *  done in the same order and the final tallies are the same as a run which
+ *  was never stopped.
+ *
+ * ************************************************************************** */
+
+void
+restore_tally_reducer(TallyReducer_t *reducer, Checkpoint_t *checkpoint)
+{
+  for(int i = 0; i < checkpoint->n_stack; i++)
+  {
+    Tally_t *tally = get_batch_tally(reducer, i);
+    memcpy(tally->data, checkpoint->stack[i].data, tally->n_data * sizeof(double));
+    reducer->stack[i] = tally;
+    reducer->stack_order[i] = checkpoint->stack_order[i];
+  }
+
+  memcpy(reducer->squares.data, checkpoint->squares.data, reducer->squares.n_data * sizeof(double));
+
+  reducer->n_stack = checkpoint->n_stack;
+  reducer->next_batch = checkpoint->next_batch;
+  reducer->stop_batch = checkpoint->stop_batch;
+}
+
+/* ************************************************************************** */
+/** copy_tally_totals
+ *
+ *  @brief Copy the total of every batch, and the sum of their squares, into
+ *  histograms and moments.
+ *
+ *  @param[in] *total         The sum of the batch tallies.
+ *  @param[in] *squares       The sum of the squares of the batch tallies.
+ *  @param[in] n_batches      The number of batches summed.
+ *  @param[in, out] *hist     N_TALLY_SETS initialised Histogram_t structs.
+ *  @param[in, out] *moments  N_TALLY_SETS initialised Moments_t structs,
+ *                            which receive the moments still as a difference
+ *                            array.
+ *
+ *  @details
+ *
+ *  total can be NULL if no batches were summed.
+ *
+ * ************************************************************************** */
+
+void
+copy_tally_totals(const Tally_t *total, const Tally_t *squares, long n_batches, Histogram_t *hist,
+                  Moments_t *moments)
+{
+  for(int s = 0; s < squares->n_sets; s++)
+  {
+    size_t n_moments = N_MOMENTS * (moments[s].n_levels + 2);
+
+    if(total != NULL)
+    {
+      memcpy(hist[s].weight, total->hist[s].weight, hist[s].n_bins * sizeof *hist[s].weight);
+      memcpy(hist[s].peel_weight, total->hist[s].peel_weight, hist[s].n_peel * sizeof *hist[s].peel_weight);
+      memcpy(moments[s].level, total->moments[s].level, n_moments * sizeof *moments[s].level);
+    }
+
+    memcpy(hist[s].weight_sq, squares->hist[s].weight, hist[s].n_bins * sizeof *hist[s].weight_sq);
+    memcpy(hist[s].peel_weight_sq, squares->hist[s].peel_weight, hist[s].n_peel * sizeof *hist[s].peel_weight_sq);
+    memcpy(moments[s].level_sq, squares->moments[s].level, n_moments * sizeof *moments[s].level_sq);
+    hist[s].n_batches = moments[s].n_batches = n_batches;
+  }
+}
+
+/* ************************************************************************** */
+/** finish_tally_reducer
+ *
+ *  @brief Sum the partial sums on the stack and free the reducer.
+ *
+ *  @param[in, out] *reducer  An initialised TallyReducer_t struct, after every
+ *                            batch has been submitted.
+ *  @param[in, out] *hist     N_TALLY_SETS initialised Histogram_t structs to
+ *                            receive the total escape weights.
+ *  @param[in, out] *moments  N_TALLY_SETS initialised Moments_t structs to
+ *                            receive the total radiation moments, still as a
+ *                            difference array.
+ *
+ *  @return The number of batches summed.
+ *
+ *  @details
+ *
+ *  The remaining partial sums are added from the top of the stack down, which
+ *  again depends only on the number of batches. The sums of the squares of the
+ *  batches are also copied, for the errors.
+ *
+ * ************************************************************************** */
+
+long
+finish_tally_reducer(TallyReducer_t *reducer, Histogram_t *hist, Moments_t *moments)
+{
+  if(reducer->n_pending > 0 && reducer->stop_batch == LONG_MAX)
+  {
+    printf("Batch %ld was never submitted to the tally reducer\n", reducer->next_batch);
+    exit(1);
+  }
+
+  for(int i = 0; i < reducer->n_pending; i++)
+    reducer->free[reducer->n_free++] = reducer->pending[i];
+  reducer->n_pending = 0;
+
+  Tally_t *total = NULL;
+
+  if(reducer->n_stack > 0)
+  {
+    total = reducer->stack[reducer->n_stack - 1];
+    for(int i = reducer->n_stack - 2; i >= 0; i--)
+    {
+      add_tally(reducer->stack[i], total);
+      reducer->free[reducer->n_free++] = total;
+      total = reducer->stack[i];
+    }
+    reducer->free[reducer->n_free++] = total;
+    reducer->n_stack = 0;
+  }
+
+  copy_tally_totals(total, &reducer->squares, reducer->next_batch, hist, moments);
+  free_tally(&reducer->squares);
+  free_tally(&reducer->check);
+
+  for(int i = 0; i < reducer->n_free; i++)
+  {
+    free_tally(reducer->free[i]);
+    free(reducer->free[i]);
+  }
+
+  free(reducer->pending);
+  free(reducer->free);
+  reducer->pending = NULL;
+  reducer->free = NULL;
+  reducer->n_free = 0;
+  reducer->max_tallies = 0;
+
+  return reducer->next_batch;
+}
+
+/* ************************************************************************** */
+/** reduce_tally_across_ranks
+ *
+ *  @brief Sum the tallies of every MPI rank on to rank 0.
+ *
+ *  @param[in, out] *hist     The N_TALLY_SETS escape histograms of this rank,
+ *                            which are replaced by the total on rank 0.
+ *  @param[in, out] *moments  The N_TALLY_SETS difference arrays of the
+ *                            radiation moments of this rank, which are
+ *                            replaced by the total on rank 0.
+ *  @param[in, out] *n_photons  The number of photons transported by this rank,
+ *                              which is replaced by the total on rank 0.
+ *
+ *  @details
+ *
+ *  Does nothing without MPI. The order in which MPI_Reduce adds the ranks
+ *  together is up to the MPI library, so the results are only reproducible
+ *  for the same number of ranks and the same MPI library.
+ *
+ * ************************************************************************** */
+
+#ifdef MPI_ON
+static void
+reduce_doubles(double *values, int n)
+{
+  if(RANK == 0)
+    MPI_Reduce(MPI_IN_PLACE, values, n, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  else
+    MPI_Reduce(values, NULL, n, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+}
+#endif
+
+void
+reduce_tally_across_ranks(Histogram_t *hist, Moments_t *moments, long *n_photons)
+{
+#ifdef MPI_ON
+  long counts[2] = {*n_photons, hist->n_batches};
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    int n_moments = N_MOMENTS * (moments[s].n_levels + 2);
+    reduce_doubles(hist[s].weight, hist[s].n_bins);
+    reduce_doubles(hist[s].weight_sq, hist[s].n_bins);
+    reduce_doubles(hist[s].peel_weight, hist[s].n_peel);
+    reduce_doubles(hist[s].peel_weight_sq, hist[s].n_peel);
+    reduce_doubles(moments[s].level, n_moments);
+    reduce_doubles(moments[s].level_sq, n_moments);
+  }
+
+  if(RANK == 0)
+    MPI_Reduce(MPI_IN_PLACE, counts, 2, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  else
+    MPI_Reduce(counts, NULL, 2, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  *n_photons = counts[0];
+  for(int s = 0; s < N_TALLY_SETS; s++)
+    hist[s].n_batches = moments[s].n_batches = counts[1];
+#else
+  (void) hist;
+  (void) moments;
+  (void) n_photons;
+#endif
+}
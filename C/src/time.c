@@ -29,3 +29,49 @@ print_time(void)
   char *c_time_string = ctime(&current_time);
   printf("Current time: %s\n", c_time_string);
 }
+
+/* ************************************************************************** */
+/** get_wall_time
+ *
+ *  @brief Return the wall clock time in seconds.
+ *
+ *  @return The number of seconds since an arbitrary point in time.
+ *
+ *  @details
+ *
+ *  Only the difference between two calls is meaningful. Unlike clock, this
+ *  does not add up the time used by every thread.
+ *
+ * ************************************************************************** */
+
+double
+get_wall_time(void)
+{
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (double) now.tv_sec + 1.0e-9 * now.tv_nsec;
+}
+
+/* ************************************************************************** */
+/** get_deadline
+ *
+ *  @brief Return the time a number of seconds from now, for
+ *         pthread_cond_timedwait.
+ *
+ *  @param[in] seconds        The number of seconds from now.
+ *  @param[out] *deadline     The time, measured by the real time clock.
+ *
+ * ************************************************************************** */
+
+void
+get_deadline(double seconds, struct timespec *deadline)
+{
+  timespec_get(deadline, TIME_UTC);
+  deadline->tv_sec += (time_t) seconds;
+  deadline->tv_nsec += (long) (1e9 * (seconds - (time_t) seconds));
+  if(deadline->tv_nsec >= 1000000000L)
+  {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
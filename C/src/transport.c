@@ -10,6 +10,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <stdbool.h>
 
@@ -21,88 +22,170 @@
 #endif
 
 /* ************************************************************************** */
-/** isotropic_emit_photon
+/** stretched_scatter_photon
  *
- *  @brief Emit a photon at the origin of the plane isotropically.
+ *  @brief Scatter a photon into a direction biased towards the top of the
+ *  slab, for path length stretching.
+ *
+ *  @param[in, out] packet  A pointer to the current photon
+ *  @param[in, out] rng     The photon's random number stream.
+ *
+ *  @details
+ *
+ *  The new costheta is drawn from q(mu) = 1 / (2 c (1 - p mu)), where p is
+ *  PATH_STRETCH and c = ln((1 + p) / (1 - p)) / 2p normalises q. The weight
+ *  is multiplied by the ratio of the isotropic and biased distributions,
+ *  c (1 - p mu). This cancels the factor 1 / (1 - p mu) of the path length
+ *  stretching at the next interaction, so otherwise the weight would grow
+ *  with every scatter.
+ *
+ * ************************************************************************** */
+
+void
+stretched_scatter_photon(PhotonPacket_t *packet, RNGStream_t *rng)
+{
+  double p = PATH_STRETCH;
+  double ratio = (1.0 - p) / (1.0 + p);
+  double u = random_number(rng, 0, 1);
+  double cosphi, sinphi;
+  sample_azimuth(DIRECTION_SAMPLER, rng, &cosphi, &sinphi);
+  double mu = (1.0 - (1.0 + p) * pow(ratio, u)) / p;
+
+  if(mu > 1.0)
+    mu = 1.0;
+  else if(mu < -1.0)
+    mu = -1.0;
+
+  packet->weight *= -log(ratio) / (2.0 * p) * (1.0 - p * mu);
+  packet->cosphi = cosphi;
+  packet->sinphi = sinphi;
+  packet->costheta = mu;
+  packet->sintheta = sqrt(1.0 - mu * mu);
+}
+
+/* ************************************************************************** */
+/** move_photon
+ *
+ *  @brief Transport the photon a distance ds, in a direction (theta, phi).
  *
  *  @param[in,out] *packet  A pointer to the current MC photon packet.
+ *  @param[in] ds           The displacement for the photon to travel.
  *
  *  @details
  *
- *  Places a photon at the origin of the semi-infinte slab pointing in a
- *  randomly chosen direction. Various counters and indicator flags are set
- *  to show that the photon is newly emitted.
+ *  Updates the photon packet position in x, y and z depending on the distance
+ *  ds and the direction (theta, phi). The position is updated using equations
+ *  for a "spherical step".
  *
  * ************************************************************************** */
 
 void
-isotropic_emit_photon(PhotonPacket_t *packet)
+move_photon(PhotonPacket_t *packet, double ds)
 {
-  double mu, phi;
-  random_theta_phi(&mu, &phi);
-  packet->x = 0.0;
-  packet->y = 0.0;
-  packet->z = 0.0;
-  packet->cosphi = cos(phi);
-  packet->sinphi = sin(phi);
-  packet->costheta = sqrt(gsl_rand_num(0, 1));
-  packet->sintheta = sqrt(1 - packet->costheta * packet->costheta);
-  packet->absorb = false;
-  packet->escaped = false;
+  packet->x += ds * packet->sintheta * packet->cosphi;
+  packet->y += ds * packet->sintheta * packet->sinphi;
+  packet->z += ds * packet->costheta;
 }
 
 /* ************************************************************************** */
-/** isotropic_scatter_photon
+/** russian_roulette
  *
- *  @brief Points the photon packet in a new isotropic direction.
+ *  @brief Decide whether a low weight photon packet survives.
  *
- *  @param[in, out] packet  A pointer to the current photon
+ *  @param[in, out] *weight  The weight of the packet.
+ *  @param[in, out] *rng     The photon's random number stream.
  *
- *  @return 0
+ *  @return true if the packet survives, otherwise false.
  *
  *  @details
  *
- *  Points a photon packet in a new direction after an isotropic scattering
- *  event. The random mu and phi directions are generated from the
- *  random_cost_phi function and then a photon's sin and cos terms are updated
- *  to represent the new direction.
+ *  Packets with a weight of at least ROULETTE_THRESHOLD always survive without
+ *  drawing a random number. Otherwise the packet survives with probability
+ *  ROULETTE_SURVIVAL and its weight is increased to match, so the expected
+ *  weight is unchanged.
  *
  * ************************************************************************** */
 
-void
-isotropic_scatter_photon(PhotonPacket_t *packet)
+int
+russian_roulette(double *weight, RNGStream_t *rng)
 {
-  double mu, phi;
-  random_theta_phi(&mu, &phi);
+  if(*weight >= ROULETTE_THRESHOLD)
+    return true;
 
-  packet->cosphi = cos(phi);
-  packet->sinphi = sin(phi);
-  packet->costheta = cos(mu);
-  packet->sintheta = sin(mu);
+  if(random_number(rng, 0, 1) < ROULETTE_SURVIVAL)
+  {
+    *weight /= ROULETTE_SURVIVAL;
+    return true;
+  }
+
+  return false;
 }
 
 /* ************************************************************************** */
-/** move_photon
+/** stretched_path_weight
  *
- *  @brief Transport the photon a distance ds, in a direction (theta, phi).
+ *  @brief The weight correction for a path length sampled with stretching.
  *
- *  @param[in,out] *packet  A pointer to the current MC photon packet.
- *  @param[in] ds           The displacement for the photon to travel.
+ *  @param[in] z_orig    The position before the photon was moved.
+ *  @param[in] z         The position after the photon was moved.
+ *  @param[in] costheta  The cosine of the theta direction of the photon.
+ *
+ *  @return The factor to multiply the weight of the photon by.
  *
  *  @details
  *
- *  Updates the photon packet position in x, y and z depending on the distance
- *  ds and the direction (theta, phi). The position is updated using equations
- *  for a "spherical step".
+ *  The path length is sampled with the opacity scaled by s = 1 - p costheta,
+ *  where p is PATH_STRETCH. The weight is multiplied by the ratio of the true
+ *  to the sampled probability of what happened. For an interaction after an
+ *  optical depth tau this is exp(-p costheta tau) / s. A photon which leaves
+ *  the slab is only told that it reached the boundary, so the ratio is that
+ *  of the probabilities of getting that far, exp(-p costheta tau_boundary).
+ *  As costheta tau is the change in optical depth height, neither depends on
+ *  the direction except through s.
  *
  * ************************************************************************** */
 
-void
-move_photon(PhotonPacket_t *packet, double ds)
+static double
+stretched_path_weight(double z_orig, double z, double costheta)
 {
-  packet->x += ds * packet->sintheta * packet->cosphi;
-  packet->y += ds * packet->sintheta * packet->sinphi;
-  packet->z += ds * packet->costheta;
+  double rate = PATH_STRETCH * TAU_MAX;
+
+  if(z < 0.0)
+    return exp(rate * z_orig);
+  if(z > 1.0)
+    return exp(-rate * (1.0 - z_orig));
+
+  return exp(-rate * (z - z_orig)) / (1.0 - PATH_STRETCH * costheta);
+}
+
+/* ************************************************************************** */
+/** scatter_photon
+ *
+ *  @brief Peel off and then scatter a photon into a new direction.
+ *
+ *  @param[in, out] *packet  The current photon packet.
+ *  @param[in, out] *hist    The histogram to peel the photon off into.
+ *  @param[in, out] *rng     The photon's random number stream.
+ *
+ *  @details
+ *
+ *  The peel-off uses the weight before the scattering, as it accounts for the
+ *  true isotropic distribution of directions itself. The new direction is
+ *  biased with PATH_STRETCH, or otherwise drawn from PHASE_FUNCTION.
+ *
+ * ************************************************************************** */
+
+static void
+scatter_photon(PhotonPacket_t *packet, Histogram_t *hist, RNGStream_t *rng)
+{
+  peel_off_to_histogram(hist, packet->z, packet->weight, false);
+
+  if(PATH_STRETCH > 0)
+    stretched_scatter_photon(packet, rng);
+  else if(PHASE_FUNCTION != PHASE_ISOTROPIC)
+    anisotropic_scatter_photon(packet, rng);
+  else
+    isotropic_scatter_photon(packet, rng);
 }
 
 /* ************************************************************************** */
@@ -112,6 +195,7 @@ move_photon(PhotonPacket_t *packet, double ds)
  *
  *  @param[in, out] *hist     A pointer to an initialised Histogram_t struct.
  *  @param[in, out] *moments  A pointer to an initialised Moments_t struct.
+ *  @param[in, out] *rng      The random number stream for this photon.
  *
  *  @return 0
  *
@@ -136,10 +220,30 @@ move_photon(PhotonPacket_t *packet, double ds)
  *
  *  If a photon becomes trapped in an optically thick, the Modified Random
  *  Walk will be invoked to macrostep the photon. This will only occur when the
- *  photon has undergone mrw_critical_scatters scattering events. After each
- *  MRW step, this counter is reset to limit the number of MRW transport steps
- *  which can be done to help limit the number of MRW transport steps taken. If
- *  too many MRW steps are taken, this can limit the accuracy of the simulation.
+ *  photon has undergone MRW_CRITICAL_SCATTERS scattering events and the sphere
+ *  which fits between the photon and the edges of the slab has a radius of at
+ *  least MRW_MIN_RADIUS scattering mean free paths. After each MRW step, this counter is reset to limit
+ *  the number of MRW transport steps taken. If too many MRW steps are taken,
+ *  this can limit the accuracy of the simulation.
+ *
+ *  With IMPLICIT_CAPTURE, the photon is never absorbed outright. Instead it
+ *  always scatters and its weight is multiplied by the albedo, until Russian
+ *  roulette ends the history once the weight is small.
+ *
+ *  With PATH_STRETCH, path lengths towards the top of the slab are stretched
+ *  and those towards the bottom shortened, and the weight of the photon is
+ *  corrected after each step so that every tally remains unbiased. Scattered
+ *  directions are then biased towards the top as well, to keep the weights
+ *  bounded.
+ *
+ *  With LAYERS, the random optical depth is converted into a distance through
+ *  the layers of the slab, and the photon scatters with the albedo of the
+ *  layer it is in.
+ *
+ *  The photon is peeled off towards the observers in PEEL_MU when it is first
+ *  emitted and after every scattering. A photon re-emitted after leaving
+ *  through the bottom of the slab is not peeled off, as it always scatters or
+ *  is absorbed before it moves again.
  *
  *  After each position update, the J, H and K moments of the radiation field
  *  within the slab are updated accordinly to the number of levels the photon
@@ -148,31 +252,80 @@ move_photon(PhotonPacket_t *packet, double ds)
  * ************************************************************************** */
 
 void
-transport_single_photon(Histogram_t *hist, Moments_t *moments)
+transport_single_photon(Histogram_t *hist, Moments_t *moments, RNGStream_t *rng)
 {
+  int n_scatters = 0;
+  int layer = 0;
   PhotonPacket_t photon = PHOTON_INIT;
-  isotropic_emit_photon(&photon);
+  isotropic_emit_photon(&photon, rng);
+  peel_off_to_histogram(hist, photon.z, photon.weight, true);
 
   while(photon.escaped == false)
   {
+    if(MRW_ENABLED && n_scatters >= MRW_CRITICAL_SCATTERS)
+    {
+      double radius = mrw_sphere_radius(&photon);
+      if(SCATTERING_ALBEDO * radius >= MRW_MIN_RADIUS)
+      {
+        modified_random_walk(&photon, moments, rng, radius);
+        METRIC_ADD(COUNTER_MRW_STEPS, 1);
+        n_scatters = 0;
+        if(photon.absorb)
+          break;
+        continue;
+      }
+    }
+
     double z_orig = photon.z;
-    double ds = random_tau() / TAU_MAX;
-    move_photon(&photon, ds);
-    increment_radiation_moment_estimators(moments, z_orig, photon.z, photon.costheta);
+
+    if(PATH_STRETCH > 0)
+    {
+      double ds = random_tau(rng) / (TAU_MAX * (1.0 - PATH_STRETCH * photon.costheta));
+      move_photon(&photon, ds);
+      increment_stretched_moment_estimators(moments, z_orig, photon.z, photon.costheta, photon.weight,
+                                            PATH_STRETCH * TAU_MAX);
+      photon.weight *= stretched_path_weight(z_orig, photon.z, photon.costheta);
+    }
+    else
+    {
+      double ds = LAYERS ? layered_path_length(LAYERS, photon.z, photon.costheta, random_tau(rng), &layer)
+                         : random_tau(rng) / TAU_MAX;
+      move_photon(&photon, ds);
+      increment_radiation_moment_estimators(moments, z_orig, photon.z, photon.costheta, photon.weight);
+    }
 
     if(photon.z < 0.0)
     {
-      isotropic_emit_photon(&photon);
+      isotropic_emit_photon(&photon, rng);
+      METRIC_ADD(COUNTER_REEMISSIONS, 1);
+      layer = 0;
     }
+
+    double albedo = LAYERS ? LAYERS->layer[layer].albedo : SCATTERING_ALBEDO;
+
     if(photon.z > 1.0)
     {
       photon.escaped = true;
     }
+    else if(IMPLICIT_CAPTURE)
+    {
+      photon.weight *= albedo;
+      if(!russian_roulette(&photon.weight, rng))
+      {
+        photon.absorb = true;
+        break;
+      }
+      scatter_photon(&photon, hist, rng);
+      METRIC_ADD(COUNTER_SCATTERS, 1);
+      n_scatters++;
+    }
     else
     {
-      if(gsl_rand_num(0, 1) < SCATTERING_ALBEDO)
+      if(random_number(rng, 0, 1) < albedo)
       {
-        isotropic_scatter_photon(&photon);
+        scatter_photon(&photon, hist, rng);
+        METRIC_ADD(COUNTER_SCATTERS, 1);
+        n_scatters++;
       }
       else
       {
@@ -183,7 +336,372 @@ transport_single_photon(Histogram_t *hist, Moments_t *moments)
   }
 
   if(!photon.absorb && photon.escaped)
-    bin_photon_to_histogram(hist, photon.costheta);
+  {
+    bin_photon_to_histogram(hist, photon.costheta, photon.weight);
+    METRIC_ADD(COUNTER_ESCAPES, 1);
+    if(ESCAPE_LOG)
+      log_escape(&photon);
+  }
+  else
+  {
+    METRIC_ADD(COUNTER_ABSORPTIONS, 1);
+  }
+}
+
+/* ************************************************************************** */
+/** transport_sweep_photon
+ *
+ *  @brief Transport a photon once and tally it for every albedo of a sweep.
+ *
+ *  @param[in, out] *hist     N_SWEEP initialised Histogram_t structs, one for
+ *                            each albedo in SWEEP_ALBEDOS.
+ *  @param[in, out] *moments  N_SWEEP initialised Moments_t structs.
+ *  @param[in, out] *rng      The random number stream for this photon.
+ *
+ *  @details
+ *
+ *  The albedo only decides whether a photon survives an interaction, not
+ *  where it goes, so the photon is transported as in transport_single_photon
+ *  with an albedo of 1. After n interactions the photon is tallied for each
+ *  albedo with a weight of albedo^n, the probability that it would have
+ *  survived that long. Russian roulette is played on the largest of these
+ *  weights, so a sweep without an albedo of 1 still ends every history.
+ *
+ *  As there is no random number drawn to decide whether a photon is absorbed,
+ *  the histories differ from those of a single simulation with the same SEED.
+ *
+ * ************************************************************************** */
+
+void
+transport_sweep_photon(Histogram_t *hist, Moments_t *moments, RNGStream_t *rng)
+{
+  double weight[MAX_SWEEP_ALBEDOS];
+  PhotonPacket_t photon = PHOTON_INIT;
+  isotropic_emit_photon(&photon, rng);
+
+  for(int s = 0; s < N_SWEEP; s++)
+    weight[s] = 1.0;
+  peel_off_to_histograms(hist, N_SWEEP, photon.z, weight, true);
+
+  while(photon.escaped == false)
+  {
+    double z_orig = photon.z;
+    double ds = random_tau(rng) / TAU_MAX;
+    move_photon(&photon, ds);
+    for(int s = 0; s < N_SWEEP; s++)
+      increment_radiation_moment_estimators(&moments[s], z_orig, photon.z, photon.costheta, weight[s]);
+
+    if(photon.z < 0.0)
+    {
+      isotropic_emit_photon(&photon, rng);
+      METRIC_ADD(COUNTER_REEMISSIONS, 1);
+    }
+    if(photon.z > 1.0)
+    {
+      photon.escaped = true;
+    }
+    else
+    {
+      double max_weight = 0;
+      for(int s = 0; s < N_SWEEP; s++)
+      {
+        weight[s] *= SWEEP_ALBEDOS[s];
+        if(weight[s] > max_weight)
+          max_weight = weight[s];
+      }
+
+      double survivor_weight = max_weight;
+      if(max_weight == 0 || !russian_roulette(&survivor_weight, rng))
+      {
+        photon.absorb = true;
+        break;
+      }
+      for(int s = 0; s < N_SWEEP; s++)
+        weight[s] *= survivor_weight / max_weight;
+
+      if(PHASE_FUNCTION != PHASE_ISOTROPIC)
+        anisotropic_scatter_photon(&photon, rng);
+      else
+        isotropic_scatter_photon(&photon, rng);
+      METRIC_ADD(COUNTER_SCATTERS, 1);
+      peel_off_to_histograms(hist, N_SWEEP, photon.z, weight, false);
+    }
+  }
+
+  if(!photon.absorb && photon.escaped)
+  {
+    for(int s = 0; s < N_SWEEP; s++)
+      bin_photon_to_histogram(&hist[s], photon.costheta, weight[s]);
+    METRIC_ADD(COUNTER_ESCAPES, 1);
+  }
+  else
+  {
+    METRIC_ADD(COUNTER_ABSORPTIONS, 1);
+  }
+}
+
+/* ************************************************************************** */
+/** run_transport
+ *
+ *  @brief Transport N_PHOTONS photons and sum their tallies.
+ *
+ *  @param[in, out] *hist     N_TALLY_SETS initialised Histogram_t structs, in
+ *                            which the escape weights are returned.
+ *  @param[in, out] *moments  N_TALLY_SETS initialised Moments_t structs, in
+ *                            which the radiation moments are returned.
+ *  @param[in] restart        If true, continue from CHECKPOINT_FILE.
+ *
+ *  @return The number of photons transported, which is less than N_PHOTONS
+ *  if TARGET_REL_ERROR or TIME_LIMIT was reached, or TRANSPORT_STOPPED if the
+ *  simulation was stopped by SIGTERM.
+ *
+ *  @details
+ *
+ *  Each photon draws its random numbers from its own stream, indexed by the
+ *  photon number, so that the photon histories for a given SEED are the same
+ *  no matter how the photons are distributed between threads.
+ *
+ *  The photons are split into batches of BATCH_SIZE photons. A thread
+ *  transports a whole batch into its own private tally, which is then summed
+ *  in a fixed order by the TallyReducer_t. No synchronisation is required
+ *  whilst a batch is being transported and the final tallies do not depend on
+ *  the number of threads.
+ *
+ *  When running with MPI, each rank transports a contiguous range of batches
+ *  and the tallies of every rank are summed on to rank 0. As the photons keep
+ *  their global index, every photon still has its own random number stream.
+ *  The progress reported is that of rank 0. Each thread counts its own
+ *  photons and a reporter thread prints the total every PROGRESS_INTERVAL
+ *  seconds, see progress.c.
+ *
+ *  Checkpoints of the summed batches can be written as the simulation runs,
+ *  see checkpoint.c. If restart is true, the batches in CHECKPOINT_FILE are
+ *  not transported again. After SIGTERM, every rank writes a checkpoint and
+ *  TRANSPORT_STOPPED is returned, so that the caller can finalise MPI.
+ *
+ *  With FORMAT_BINARY, snapshots of the summed batches are written by a
+ *  background thread every OUTPUT_FREQUENCY photons, see binary_output.c.
+ *  With ESCAPE_LOG, every escaping photon is logged, see escape_log.c. When
+ *  built with MCRT_METRICS, the counters of each thread are written to a
+ *  metrics file as the simulation runs, see metrics.c.
+ *
+ *  Each thread runs with the PARAMETERS of the calling thread. When EMBEDDED,
+ *  only the photons are transported: there are no checkpoints, snapshots,
+ *  escape log or metrics, as these are shared by the whole process.
+ *
+ *  Once the TallyReducer_t finds that TARGET_REL_ERROR or TIME_LIMIT has been
+ *  reached, no more batches are started. Each thread takes the next batch from
+ *  a shared counter, so batches start in order and the threads leave the loop
+ *  at the first batch which is not wanted, however many batches are left.
+ *
+ * ************************************************************************** */
+
+long
+run_transport(Histogram_t *hist, Moments_t *moments, int restart)
+{
+  long n_done = 0;
+  TallyReducer_t reducer;
+  Progress_t progress;
+  Parameters_t *parameters = PARAMETERS;
+
+  init_tally_reducer(&reducer, hist->n_bins, moments->n_levels);
+
+  long n_batches = (N_PHOTONS + BATCH_SIZE - 1) / BATCH_SIZE;
+  long first_batch = n_batches * RANK / N_RANKS;
+  long last_batch = n_batches * (RANK + 1) / N_RANKS;
+  long first_photon = first_batch * BATCH_SIZE;
+  long last_photon = last_batch * BATCH_SIZE < N_PHOTONS ? last_batch * BATCH_SIZE : N_PHOTONS;
+  long n_rank_photons = last_photon - first_photon;
+  long first_restart_batch = first_batch;
+
+  if(!EMBEDDED)
+    init_checkpoints();
+  if(restart)
+  {
+    first_restart_batch = first_batch + read_checkpoint(&reducer);
+    n_done = first_restart_batch * BATCH_SIZE - first_photon;
+    if(n_done > n_rank_photons)
+      n_done = n_rank_photons;
+  }
+  if(!EMBEDDED)
+  {
+    start_snapshot_writer(&reducer, first_photon, last_photon, n_done);
+    start_escape_log();
+    start_metrics();
+  }
+  start_progress(&progress, n_rank_photons, n_done);
+
+  long next_batch = first_restart_batch;
+
+#pragma omp parallel \
+        default(none), \
+        shared(parameters, first_batch, last_batch, first_photon, last_photon, reducer, progress, next_batch)
+  while(true)
+  {
+    long batch;
+
+    PARAMETERS = parameters;
+
+#pragma omp atomic capture
+    batch = next_batch++;
+
+    if(batch >= last_batch || checkpoint_stop_requested() || !batch_wanted(&reducer, batch - first_batch))
+      break;
+
+    METRIC_ATTACH();
+    METRIC_TIMER_START(transport_start);
+
+    Tally_t *tally = get_batch_tally(&reducer, batch - first_batch);
+    long first = batch * BATCH_SIZE;
+    long last = first + BATCH_SIZE < N_PHOTONS ? first + BATCH_SIZE : N_PHOTONS;
+
+    if(TRANSPORT_ENGINE == ENGINE_EVENT)
+    {
+      transport_photon_batch(tally, first, last);
+      add_progress(&progress, last - first);
+      METRIC_ADD(COUNTER_PHOTONS, last - first);
+      METRIC_TIMER_STOP(TIMER_TRANSPORT, transport_start);
+
+      METRIC_TIMER_START(reduce_start);
+      submit_batch_tally(&reducer, tally);
+      poll_snapshot(&reducer, last - first);
+      poll_checkpoint(&reducer, first_photon, last_photon);
+      METRIC_TIMER_STOP(TIMER_REDUCE, reduce_start);
+      continue;
+    }
+
+    for(long i = first; i < last; i++)
+    {
+      RNGStream_t rng;
+      init_rng_stream(&rng, (uint64_t) SEED, (uint64_t) i);
+      if(N_SWEEP > 0)
+        transport_sweep_photon(tally->hist, tally->moments, &rng);
+      else
+        transport_single_photon(tally->hist, tally->moments, &rng);
+      add_progress(&progress, 1);
+    }
+
+    METRIC_ADD(COUNTER_PHOTONS, last - first);
+    METRIC_TIMER_STOP(TIMER_TRANSPORT, transport_start);
+
+    METRIC_TIMER_START(reduce_start);
+    submit_batch_tally(&reducer, tally);
+    poll_snapshot(&reducer, last - first);
+    poll_checkpoint(&reducer, first_photon, last_photon);
+    METRIC_TIMER_STOP(TIMER_REDUCE, reduce_start);
+  }
+
+  stop_progress(&progress);
+  if(!EMBEDDED)
+  {
+    stop_snapshot_writer();
+    stop_metrics();
+  }
+
+  if(checkpoint_stop_agreed())
+  {
+    stop_escape_log(0);
+    write_checkpoint(&reducer, first_photon, last_photon);
+    return TRANSPORT_STOPPED;
+  }
+
+  long n_photons = first_photon + finish_tally_reducer(&reducer, hist, moments) * BATCH_SIZE;
+  n_photons = (n_photons < last_photon ? n_photons : last_photon) - first_photon;
+  stop_escape_log(n_photons);
+
+  reduce_tally_across_ranks(hist, moments, &n_photons);
+  for(int s = 0; s < N_TALLY_SETS; s++)
+    integrate_moments(&moments[s]);
+
+  return n_photons;
+}
+
+/* ************************************************************************** */
+/** simulate_point
+ *
+ *  @brief Run the simulation for the parameters which are currently set and
+ *         write out the results.
+ *
+ *  @param[in] n_bins    The number of escape histogram bins.
+ *  @param[in] n_levels  The number of moment levels.
+ *  @param[in] restart   If true, continue from the last checkpoint.
+ *
+ *  @details
+ *
+ *  If MRW_VALIDATE or STRETCH_VALIDATE is set, the simulation is also run
+ *  without the MRW or path length stretching and the results of the two are
+ *  compared before the accelerated results are written out. Likewise with
+ *  ENGINE_VALIDATE, the simulation is also run with the history engine and
+ *  the results of the event engine are written out.
+ *
+ *  With MPI, only rank 0 holds the final tallies and writes them to file.
+ *
+ *  @return SIMULATION_DONE, SIMULATION_STOPPED if the simulation was stopped
+ *  by SIGTERM, in which case no results are written, or SIMULATION_FAILED if
+ *  the validation failed, in which case the results are still written.
+ *
+ * ************************************************************************** */
+
+static int
+simulate_point(int n_bins, int n_levels, int restart)
+{
+  long n_photons;
+  int agree = true;
+
+  Histogram_t *hist = malloc(N_TALLY_SETS * sizeof *hist);
+  Moments_t *moments = malloc(N_TALLY_SETS * sizeof *moments);
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    hist[s].n_bins = n_bins;
+    moments[s].n_levels = n_levels;
+    init_histogram(&hist[s]);
+    init_moments(&moments[s]);
+  }
+
+  if((MRW_VALIDATE || STRETCH_VALIDATE || ENGINE_VALIDATE) && restart)
+  {
+    printf("A simulation with mrw.validate, path_stretch.validate or transport_engine.validate cannot be restarted\n");
+    exit(1);
+  }
+
+  if(ESCAPE_LOG && restart)
+  {
+    printf("A simulation with escape_log cannot be restarted, as the log of the earlier run is incomplete\n");
+    exit(1);
+  }
+
+  if(OUTPUT_FORMAT == FORMAT_BINARY && RANK == 0)
+    begin_binary_output(restart);
+
+  if(MRW_VALIDATE)
+    n_photons = validate_mrw(hist, moments, &agree);
+  else if(STRETCH_VALIDATE)
+    n_photons = validate_path_stretch(hist, moments, &agree);
+  else if(ENGINE_VALIDATE)
+    n_photons = validate_event_engine(hist, moments, &agree);
+  else
+    n_photons = run_transport(hist, moments, restart);
+
+  int status = agree ? SIMULATION_DONE : SIMULATION_FAILED;
+  if(n_photons == TRANSPORT_STOPPED)
+    status = SIMULATION_STOPPED;
+
+  if(RANK == 0 && status != SIMULATION_STOPPED)
+  {
+    if(n_photons < N_PHOTONS)
+      printf("Transported %ld of %ld photons\n", n_photons, N_PHOTONS);
+    write_results(hist, moments, n_photons, RECORD_FINAL);
+  }
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    free_hist(&hist[s]);
+    free_moments(&moments[s]);
+  }
+  free(hist);
+  free(moments);
+
+  return status;
 }
 
 /* ************************************************************************** */
@@ -191,6 +709,9 @@ transport_single_photon(Histogram_t *hist, Moments_t *moments)
  *
  *  @brief Control the MC interations.
  *
+ *  @param[in] *file_name  The filename of the input file.
+ *  @param[in] restart     If true, continue from the last checkpoint.
+ *
  *  @details
  *
  *  Controls the flow of the MCRT iterations. The MCRT variables are initialised
@@ -201,47 +722,86 @@ transport_single_photon(Histogram_t *hist, Moments_t *moments)
  *  angles is calculated and then written to file, as well as the moments
  *  of the radiation of the field within the slab.
  *
+ *  If any numeric parameter is a list or a range, every combination of the
+ *  swept values is simulated in turn by this process. The input file is only
+ *  read once. Each point is parallelised over its batches on the whole OpenMP
+ *  thread pool, and a small point is still split into DEFAULT_MIN_BATCHES
+ *  batches unless batch_size is given. The points are not run concurrently,
+ *  as the checkpoints, snapshot writer, escape log and metrics are held once
+ *  per process. With "sweep.output dirs", the default, the results of each
+ *  point are written to the directory point_<point>. With "sweep.output
+ *  combined", the points share one set of output files, with the point as the
+ *  first column. The swept values of each point are listed in
+ *  OUTPUT_FILE_SWEEP. A sweep carries on past a point which fails its
+ *  validation.
+ *
+ *  @return SIMULATION_STOPPED if the simulation was stopped by SIGTERM,
+ *  SIMULATION_FAILED if the validation of any point failed, or
+ *  SIMULATION_DONE.
+ *
  * ************************************************************************** */
 
-void
-transport_all_photons(char *file_name)
+int
+transport_all_photons(char *file_name, int restart)
 {
-  int omp_counter = 0;
+  int status = SIMULATION_DONE;
+  ParameterTable_t table;
   Histogram_t hist;
   Moments_t moments;
+  char sweep_output[LINE_LEN];
 
-  get_all_parameters(file_name, &hist, &moments);
-  init_gsl_seed(SEED);
-  init_histogram(&hist);
-  init_moments(&moments);
+  read_parameter_table(file_name, &table);
+  get_all_parameters(&table, &hist, &moments);
+  get_optional_string_parameter(&table, "sweep.output", sweep_output, "dirs");
 
-#pragma omp parallel for \
-        default(none), \
-        schedule(dynamic), \
-        private(packet), \
-        shared(n_photons, hist, moments, output_freq, omp_counter)
-  for(int i = 0; i < N_PHOTONS; i++)
+  int n_points = n_parameter_points(&table);
+  if(n_points == 1)
   {
-    transport_single_photon(&hist, &moments);
+    status = simulate_point(hist.n_bins, moments.n_levels, restart);
+    free_parameter_table(&table);
+    return status;
+  }
 
-#if defined(_OPENMP)
-#pragma omp atomic
-    omp_counter += 1;
-#pragma omp critical
-{
-    if (omp_counter % OUTPUT_FREQUENCY == 0)
-        printf("%6.0d photon packets transported (%3.0f%%)\n", omp_counter, (double) omp_counter / N_PHOTONS * 100);
-}
-#else
-    if((i + 1) % OUTPUT_FREQUENCY == 0)
-      printf("%6.0d photon packets transported (%3.0f%%)\n", i + 1, (double) (i + 1) / N_PHOTONS * 100);
-#endif
+  int combined = strcmp(sweep_output, "combined") == 0;
+  if(!combined && strcmp(sweep_output, "dirs") != 0)
+  {
+    printf("Unknown sweep.output '%s', expected dirs or combined\n", sweep_output);
+    exit(1);
+  }
+
+  if(restart)
+  {
+    printf("A parameter sweep cannot be restarted\n");
+    exit(1);
+  }
+
+  for(int point = 0; point < n_points; point++)
+  {
+    select_parameter_point(&table, point);
+    get_all_parameters(&table, &hist, &moments);
+
+    if(combined)
+      OUTPUT_POINT = point;
+    else
+      snprintf(OUTPUT_DIR, LINE_LEN, "point_%d", point);
+
+    if(RANK == 0)
+      printf("\nSweep point %d of %d\n", point + 1, n_points);
+
+    int point_status = simulate_point(hist.n_bins, moments.n_levels, false);
+    if(point_status != SIMULATION_DONE)
+      status = point_status;
+    if(status == SIMULATION_STOPPED)
+      break;
   }
 
-  convert_weight_to_intensity(&hist);
-  ouput_intensity_to_file(&hist);
-  output_radiation_moments_to_file(&moments);
+  OUTPUT_POINT = -1;
+  OUTPUT_DIR[0] = '\0';
+
+  if(RANK == 0 && status != SIMULATION_STOPPED)
+    write_sweep_points(&table, n_points, combined);
+
+  free_parameter_table(&table);
 
-  free_hist(&hist);
-  free_moments(&moments);
+  return status;
 }
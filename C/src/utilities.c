@@ -10,6 +10,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
 
 #include "variables.h"
 #include "functions.h"
@@ -31,12 +35,10 @@ void
 free_moments(Moments_t *moments)
 {
   moments->n_levels = 0;
-  free(moments->j_plus);
-  free(moments->h_plus);
-  free(moments->k_plus);
-  free(moments->j_minus);
-  free(moments->h_minus);
-  free(moments->k_minus);
+  free(moments->level);
+  free(moments->level_sq);
+  moments->level = NULL;
+  moments->level_sq = NULL;
 }
 
 /* ************************************************************************** */
@@ -57,6 +59,73 @@ free_hist(Histogram_t *hist)
 {
   hist->n_bins = 0;
   free(hist->intensity);
+  free(hist->error);
   free(hist->weight);
+  free(hist->weight_sq);
   free(hist->theta);
+  free(hist->peel_weight);
+  free(hist->peel_weight_sq);
+  free(hist->peel_intensity);
+  free(hist->peel_error);
+  hist->n_peel = 0;
+}
+
+/* ************************************************************************** */
+/** aligned_calloc
+ *
+ *  @brief Allocate a zeroed array aligned to a cache line.
+ *
+ *  @param[in] n     The number of elements.
+ *  @param[in] size  The size of each element.
+ *
+ *  @return A pointer to the array, which must be freed with aligned_free.
+ *
+ *  @details
+ *
+ *  Used for data which is private to a thread, so that two threads never
+ *  write to the same cache line.
+ *
+ * ************************************************************************** */
+
+void *
+aligned_calloc(size_t n, size_t size)
+{
+  void *ptr;
+  size_t n_bytes = (n * size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+#if defined(_WIN32)
+  ptr = _aligned_malloc(n_bytes, CACHE_LINE);
+#else
+  if(posix_memalign(&ptr, CACHE_LINE, n_bytes))
+    ptr = NULL;
+#endif
+
+  if(ptr == NULL)
+  {
+    printf("Unable to allocate %zu bytes of aligned memory\n", n_bytes);
+    exit(1);
+  }
+
+  memset(ptr, 0, n_bytes);
+
+  return ptr;
+}
+
+/* ************************************************************************** */
+/** aligned_free
+ *
+ *  @brief Free memory allocated with aligned_calloc.
+ *
+ *  @param[in] ptr  The pointer to free.
+ *
+ * ************************************************************************** */
+
+void
+aligned_free(void *ptr)
+{
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
 }
@@ -0,0 +1,513 @@
+/* ************************************************************************** */
+/** @file validate.c
+ *
+ *  @brief Functions for checking that an accelerated or biased simulation
+ *  agrees with plain Monte Carlo transport, and that the event engine agrees
+ *  with the history engine.
+ *
+ * ************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+
+#include "variables.h"
+#include "functions.h"
+
+#define MIN_SAMPLED_BATCHES 5
+
+/* ************************************************************************** */
+/** print_verdict
+ *
+ *  @brief Print whether a chi squared shows that two results agree.
+ *
+ *  @param[in] *name      The name of the results, for the output.
+ *  @param[in] chi2       The sum of the squares of the differences in sigma.
+ *  @param[in] dof        The number of differences summed.
+ *  @param[in] max_sigma  The largest difference, in sigma.
+ *
+ *  @return true if the results agree.
+ *
+ *  @details
+ *
+ *  The chi squared is compared to its distribution with the Wilson-Hilferty
+ *  approximation, and the results are taken to disagree if the chi squared is
+ *  more than three sigma above its expected value.
+ *
+ * ************************************************************************** */
+
+static int
+print_verdict(const char *name, double chi2, int dof, double max_sigma)
+{
+  double scale = 2.0 / (9.0 * dof);
+  double z = (cbrt(chi2 / dof) - (1.0 - scale)) / sqrt(scale);
+
+  printf("%s: chi2 / dof = %f / %d, max |diff| = %.2f sigma\n", name, chi2, dof, max_sigma);
+  printf("%s: %s (z = %.2f)\n", name, z < 3.0 ? "AGREE" : "DISAGREE", z);
+
+  return z < 3.0;
+}
+
+/* ************************************************************************** */
+/** compare_histograms
+ *
+ *  @brief Compare two escape histograms bin by bin.
+ *
+ *  @param[in] *reference  The histogram from plain transport.
+ *  @param[in] *test       The histogram from the accelerated transport.
+ *
+ *  @return true if the histograms agree, or if nothing escaped.
+ *
+ *  @details
+ *
+ *  The escape weights are photon counts, so the difference between the two
+ *  in each bin has a variance of the sum of the two counts. With implicit
+ *  capture or path length stretching the packets carry weights, so the batch
+ *  means errors are used instead for the runs with weights. A run of unit
+ *  weights keeps the Poisson variance, from the mean of both runs, as its
+ *  batch means error is useless for bins with only a handful of photons. The
+ *  verdict is given by print_verdict.
+ *
+ * ************************************************************************** */
+
+static int
+compare_histograms(Histogram_t *reference, Histogram_t *test)
+{
+  int dof = 0;
+  double chi2 = 0;
+  double max_sigma = 0;
+
+  for(int i = 0; i < reference->n_bins; i++)
+  {
+    double poisson = 0.5 * (reference->weight[i] + test->weight[i]);
+    double ref_variance = poisson;
+    double test_variance = poisson;
+
+    if(IMPLICIT_CAPTURE)
+    {
+      double ref_error = batch_means_error(reference->weight[i], reference->weight_sq[i], reference->n_batches);
+      ref_variance = ref_error * ref_error;
+    }
+    if(IMPLICIT_CAPTURE || PATH_STRETCH > 0)
+    {
+      double test_error = batch_means_error(test->weight[i], test->weight_sq[i], test->n_batches);
+      test_variance = test_error * test_error;
+    }
+
+    double variance = ref_variance + test_variance;
+    if(variance <= 0)
+      continue;
+
+    double sigma = (test->weight[i] - reference->weight[i]) / sqrt(variance);
+    chi2 += sigma * sigma;
+    if(fabs(sigma) > max_sigma)
+      max_sigma = fabs(sigma);
+    dof++;
+  }
+
+  if(dof == 0)
+  {
+    printf("No photons escaped, unable to compare the escape histograms\n");
+    return true;
+  }
+
+  return print_verdict("Escape histogram", chi2, dof, max_sigma);
+}
+
+/* ************************************************************************** */
+/** sampled_batches
+ *
+ *  @brief The effective number of batches which contributed to a sum.
+ *
+ *  @param[in] sum     The sum of the batch values.
+ *  @param[in] sum_sq  The sum of the squares of the batch values.
+ *
+ *  @return sum^2 / sum_sq, which is the number of batches if they are equal
+ *          and 1 if only one batch has weight, or 0 for an empty sum.
+ *
+ * ************************************************************************** */
+
+static double
+sampled_batches(double sum, double sum_sq)
+{
+  return sum_sq > 0 ? sum * sum / sum_sq : 0;
+}
+
+/* ************************************************************************** */
+/** normal_deviate
+ *
+ *  @brief Convert a difference in units of its batch means error to the
+ *  normal deviate with the same tail probability.
+ *
+ *  @param[in] t             The difference divided by its estimated error.
+ *  @param[in] ref_var       The estimated variance of the reference.
+ *  @param[in] test_var      The estimated variance of the test.
+ *  @param[in] ref_batches   The number of batches in the reference.
+ *  @param[in] test_batches  The number of batches in the test.
+ *
+ *  @return The equivalent normal deviate.
+ *
+ *  @details
+ *
+ *  An error from a few batches is itself uncertain, so t follows Student's t
+ *  distribution, with the degrees of freedom of the two errors combined by the
+ *  Welch-Satterthwaite equation. With ten batches t^2 is 30% larger than a
+ *  normal deviate squared on average, which is enough to fail a correct run.
+ *  The conversion is the approximation of Wallace (1959).
+ *
+ * ************************************************************************** */
+
+static double
+normal_deviate(double t, double ref_var, double test_var, long ref_batches, long test_batches)
+{
+  double nu = (ref_var + test_var) * (ref_var + test_var) /
+              (ref_var * ref_var / (ref_batches - 1) + test_var * test_var / (test_batches - 1));
+  double z = sqrt(nu * log1p(t * t / nu)) * (8.0 * nu + 1.0) / (8.0 * nu + 3.0);
+
+  return t < 0 ? -z : z;
+}
+
+/* ************************************************************************** */
+/** sidak_limit
+ *
+ *  @brief The largest of several normal deviates which is still consistent
+ *  with all of them being noise.
+ *
+ *  @param[in] n  The number of deviates.
+ *
+ *  @return The deviate which one of n deviates exceeds in size with the same
+ *          probability as a single deviate exceeds three sigma.
+ *
+ *  @details
+ *
+ *  The Sidak correction, which holds however the deviates are correlated. The
+ *  two sided tail probability of each deviate is inverted with erfc by
+ *  bisection.
+ *
+ * ************************************************************************** */
+
+static double
+sidak_limit(int n)
+{
+  double p = -expm1(log1p(-erfc(3.0 / sqrt(2.0))) / n);
+  double low = 0;
+  double high = 40;
+
+  for(int i = 0; i < 60; i++)
+  {
+    double mid = 0.5 * (low + high);
+    if(erfc(mid / sqrt(2.0)) > p)
+      low = mid;
+    else
+      high = mid;
+  }
+
+  return 0.5 * (low + high);
+}
+
+/* ************************************************************************** */
+/** compare_moments
+ *
+ *  @brief Compare the mean intensity of two sets of radiation moments.
+ *
+ *  @param[in] *reference  The moments from plain transport.
+ *  @param[in] *test       The moments from the accelerated transport.
+ *
+ *  @return true if the mean intensities agree, or false if they disagree or
+ *          cannot be compared.
+ *
+ *  @details
+ *
+ *  J+ and J- are compared separately at each level, with the batch means
+ *  errors of both runs, as the squares of J+ + J- are not tallied. Levels
+ *  with no error, such as J- at the top of the slab, are left out. So are
+ *  levels which either run sampled in fewer than MIN_SAMPLED_BATCHES
+ *  batches, counted as sum^2 / sum_sq, as a batch means error from a handful
+ *  of photons is meaningless. These are the levels deep in a thick absorbing
+ *  slab which plain transport rarely or never reaches. Each difference is
+ *  converted to a normal deviate by normal_deviate, as the errors come from a
+ *  limited number of batches.
+ *
+ *  A photon crosses many levels, so neighbouring levels are strongly
+ *  correlated and a chi squared over the levels has far more scatter than its
+ *  degrees of freedom suggest. The verdict instead uses two statistics which
+ *  hold however the levels are correlated. The mean deviation of J+, and of
+ *  J-, has a variance of at most one, and shows a bias shared by many levels
+ *  if it is more than three. The largest deviation shows a bias at a few
+ *  levels if it is above sidak_limit. The largest relative difference in J
+ *  is reported over the levels which were compared.
+ *
+ *  If either run has fewer than MIN_SAMPLED_BATCHES batches, or no level can
+ *  be compared, the result is inconclusive and is not taken as agreement.
+ *
+ * ************************************************************************** */
+
+static int
+compare_moments(Moments_t *reference, Moments_t *test)
+{
+  int n_sparse = 0;
+  int n_compared[2] = {0, 0};
+  double sum_sigma[2] = {0, 0};
+  double max_sigma = 0;
+  double max_diff = 0;
+  int m[2] = {MOMENT_J_PLUS, MOMENT_J_MINUS};
+
+  if(reference->n_batches < MIN_SAMPLED_BATCHES || test->n_batches < MIN_SAMPLED_BATCHES)
+  {
+    printf("Mean intensity: INCONCLUSIVE, too few batches (%ld and %ld) for batch means errors, at least %d are "
+           "needed\n", reference->n_batches, test->n_batches, MIN_SAMPLED_BATCHES);
+    return false;
+  }
+
+  for(int i = 0; i < reference->n_levels + 1; i++)
+  {
+    int level_compared = false;
+
+    for(int k = 0; k < 2; k++)
+    {
+      double ref_error = batch_means_error(MOMENT(reference, i, m[k]), MOMENT_SQ(reference, i, m[k]),
+                                           reference->n_batches);
+      double test_error = batch_means_error(MOMENT(test, i, m[k]), MOMENT_SQ(test, i, m[k]), test->n_batches);
+      double variance = ref_error * ref_error + test_error * test_error;
+      if(variance <= 0)
+        continue;
+
+      if(sampled_batches(MOMENT(reference, i, m[k]), MOMENT_SQ(reference, i, m[k])) < MIN_SAMPLED_BATCHES ||
+         sampled_batches(MOMENT(test, i, m[k]), MOMENT_SQ(test, i, m[k])) < MIN_SAMPLED_BATCHES)
+      {
+        n_sparse++;
+        continue;
+      }
+
+      double sigma = normal_deviate((MOMENT(test, i, m[k]) - MOMENT(reference, i, m[k])) / sqrt(variance),
+                                    ref_error * ref_error, test_error * test_error, reference->n_batches,
+                                    test->n_batches);
+      sum_sigma[k] += sigma;
+      n_compared[k]++;
+      if(fabs(sigma) > max_sigma)
+        max_sigma = fabs(sigma);
+      level_compared = true;
+    }
+
+    double j_ref = MOMENT(reference, i, MOMENT_J_PLUS) + MOMENT(reference, i, MOMENT_J_MINUS);
+    double j_test = MOMENT(test, i, MOMENT_J_PLUS) + MOMENT(test, i, MOMENT_J_MINUS);
+    if(level_compared && j_ref > 0 && fabs(j_test - j_ref) / j_ref > max_diff)
+      max_diff = fabs(j_test - j_ref) / j_ref;
+  }
+
+  int n = n_compared[0] + n_compared[1];
+  if(n == 0)
+  {
+    printf("Mean intensity: INCONCLUSIVE, no level was sampled in at least %d batches by both runs\n",
+           MIN_SAMPLED_BATCHES);
+    return false;
+  }
+
+  double shift[2];
+  for(int k = 0; k < 2; k++)
+    shift[k] = n_compared[k] > 0 ? sum_sigma[k] / n_compared[k] : 0;
+  double limit = sidak_limit(n);
+  int agree = fabs(shift[0]) < 3.0 && fabs(shift[1]) < 3.0 && max_sigma < limit;
+
+  printf("Mean intensity: max relative diff = %f\n", max_diff);
+  if(n_sparse > 0)
+    printf("Mean intensity: %d of J+ and J- left out, as they were sampled in too few batches\n", n_sparse);
+  printf("Mean intensity: mean diff J+ = %.2f, J- = %.2f sigma, max |diff| = %.2f sigma of %.2f allowed\n",
+         shift[0], shift[1], max_sigma, limit);
+  printf("Mean intensity: %s over %d of J+ and J-\n", agree ? "AGREE" : "DISAGREE", n);
+
+  return agree;
+}
+
+/* ************************************************************************** */
+/** validate_against_reference
+ *
+ *  @brief Run the simulation with and without an acceleration and compare the
+ *  two.
+ *
+ *  @param[in, out] *hist     An initialised Histogram_t struct, which returns
+ *                            the escape weights with the acceleration.
+ *  @param[in, out] *moments  An initialised Moments_t struct, which returns
+ *                            the radiation moments with the acceleration.
+ *  @param[in] *turn_off      Turns the acceleration off in PARAMETERS.
+ *  @param[in] *name          The name of the acceleration, for the output.
+ *  @param[out] *agree        Set to true if the two runs agree. Only set on
+ *                            rank 0.
+ *
+ *  @return The number of photons transported with the acceleration, or
+ *  TRANSPORT_STOPPED if either simulation was stopped by SIGTERM.
+ *
+ *  @details
+ *
+ *  The reference simulation runs with its own copy of PARAMETERS, with the
+ *  acceleration turned off and a different SEED, so that the two results are
+ *  statistically independent and the parameters of the caller are never
+ *  changed. The wall time of each is printed to show the speed up. The
+ *  accelerated results are returned to be written out as usual. With MPI, the
+ *  comparison is made on rank 0.
+ *
+ * ************************************************************************** */
+
+static long
+validate_against_reference(Histogram_t *hist, Moments_t *moments, void (*turn_off)(void), const char *name,
+                           int *agree)
+{
+  Histogram_t ref_hist;
+  Moments_t ref_moments;
+  Parameters_t *parameters = PARAMETERS;
+  Parameters_t reference = *parameters;
+
+  ref_hist.n_bins = hist->n_bins;
+  ref_moments.n_levels = moments->n_levels;
+  init_histogram(&ref_hist);
+  init_moments(&ref_moments);
+
+  if(RANK == 0)
+    printf("Running the reference simulation without %s\n", name);
+  PARAMETERS = &reference;
+  turn_off();
+  SEED += 1;
+  double start = get_wall_time();
+  long n_ref_photons = run_transport(&ref_hist, &ref_moments, false);
+  double ref_time = get_wall_time() - start;
+  PARAMETERS = parameters;
+
+  if(n_ref_photons == TRANSPORT_STOPPED)
+  {
+    free_hist(&ref_hist);
+    free_moments(&ref_moments);
+    return TRANSPORT_STOPPED;
+  }
+
+  if(RANK == 0)
+    printf("Running the simulation with %s\n", name);
+  start = get_wall_time();
+  long n_photons = run_transport(hist, moments, false);
+  double test_time = get_wall_time() - start;
+
+  if(RANK == 0 && n_photons != TRANSPORT_STOPPED)
+  {
+    printf("\nWall time without %s: %f s\n", name, ref_time);
+    printf("Wall time with %s:    %f s (speed up %.2fx)\n", name, test_time, ref_time / test_time);
+    int hist_agree = compare_histograms(&ref_hist, hist);
+    int moments_agree = compare_moments(&ref_moments, moments);
+    *agree = hist_agree && moments_agree;
+    printf("Validation of %s: %s\n\n", name, *agree ? "PASSED" : "FAILED");
+  }
+
+  free_hist(&ref_hist);
+  free_moments(&ref_moments);
+
+  return n_photons;
+}
+
+/* ************************************************************************** */
+/** turn_off_mrw
+ *
+ *  @brief Turn the MRW off.
+ *
+ * ************************************************************************** */
+
+static void
+turn_off_mrw(void)
+{
+  MRW_ENABLED = false;
+}
+
+/* ************************************************************************** */
+/** validate_mrw
+ *
+ *  @brief Run the simulation with and without the MRW and compare the two.
+ *
+ *  @param[in, out] *hist     An initialised Histogram_t struct, which returns
+ *                            the escape weights with the MRW.
+ *  @param[in, out] *moments  An initialised Moments_t struct, which returns
+ *                            the radiation moments with the MRW.
+ *  @param[out] *agree        Set to true if the two runs agree.
+ *
+ *  @return The number of photons transported with the MRW.
+ *
+ * ************************************************************************** */
+
+long
+validate_mrw(Histogram_t *hist, Moments_t *moments, int *agree)
+{
+  return validate_against_reference(hist, moments, turn_off_mrw, "MRW", agree);
+}
+
+/* ************************************************************************** */
+/** turn_off_path_stretch
+ *
+ *  @brief Turn path length stretching off.
+ *
+ * ************************************************************************** */
+
+static void
+turn_off_path_stretch(void)
+{
+  PATH_STRETCH = 0;
+}
+
+/* ************************************************************************** */
+/** validate_path_stretch
+ *
+ *  @brief Run the simulation with and without path length stretching and
+ *  compare the two.
+ *
+ *  @param[in, out] *hist     An initialised Histogram_t struct, which returns
+ *                            the escape weights with stretching.
+ *  @param[in, out] *moments  An initialised Moments_t struct, which returns
+ *                            the radiation moments with stretching.
+ *  @param[out] *agree        Set to true if the two runs agree.
+ *
+ *  @return The number of photons transported with stretching.
+ *
+ * ************************************************************************** */
+
+long
+validate_path_stretch(Histogram_t *hist, Moments_t *moments, int *agree)
+{
+  return validate_against_reference(hist, moments, turn_off_path_stretch, "path stretching", agree);
+}
+
+/* ************************************************************************** */
+/** use_history_engine
+ *
+ *  @brief Switch from the event engine to the history engine.
+ *
+ * ************************************************************************** */
+
+static void
+use_history_engine(void)
+{
+  TRANSPORT_ENGINE = ENGINE_HISTORY;
+}
+
+/* ************************************************************************** */
+/** validate_event_engine
+ *
+ *  @brief Run the simulation with the history and the event engine and
+ *  compare the two.
+ *
+ *  @param[in, out] *hist     An initialised Histogram_t struct, which returns
+ *                            the escape weights of the event engine.
+ *  @param[in, out] *moments  An initialised Moments_t struct, which returns
+ *                            the radiation moments of the event engine.
+ *  @param[out] *agree        Set to true if the two runs agree.
+ *
+ *  @return The number of photons transported by the event engine.
+ *
+ *  @details
+ *
+ *  The engines draw the same random numbers, but their optical depths and
+ *  directions differ by rounding, so the histories part ways sooner or later.
+ *  As the reference has a different SEED, the comparison is statistical.
+ *
+ * ************************************************************************** */
+
+long
+validate_event_engine(Histogram_t *hist, Moments_t *moments, int *agree)
+{
+  return validate_against_reference(hist, moments, use_history_engine, "the event engine", agree);
+}
@@ -15,10 +15,21 @@
  *
  * ************************************************************************** */
 
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
 /* ************************************************************************** */
 /**
  *  @def PI
  *  The value of pi to many decimal places.
+ *  @def CACHE_LINE
+ *  The size of a cache line in bytes, used to align thread private data.
+ *  @def SIMD_DISPATCH
+ *  Compile a function for AVX-512, AVX2 and the baseline instruction set, with
+ *  the version to use picked at run time for the CPU. Only GCC on x86-64 Linux
+ *  supports this, elsewhere the function is compiled once as normal.
  *
  *  @def LINE_LEN
  *  The maximum number of characters a line read in file can be.
@@ -29,54 +40,598 @@
  *  not.
  *  @def DEFAULT_INI_FILE
  *  The filename for the default parameter input file.
+ *  @def DEFAULT_BATCH_SIZE
+ *  The largest number of photons in a batch if batch_size is not in the input
+ *  file.
+ *  @def DEFAULT_MIN_BATCHES
+ *  The number of batches the photons are split into at least if batch_size is
+ *  not in the input file, so that a small simulation still gives every thread
+ *  work.
+ *  @def DEFAULT_MRW_CRITICAL_SCATTERS
+ *  The default number of scatters before an MRW step is attempted.
+ *  @def DEFAULT_MRW_MIN_RADIUS
+ *  The default smallest sphere radius, in scattering mean free paths, for an
+ *  MRW step.
+ *  @def DEFAULT_ROULETTE_THRESHOLD
+ *  The default weight below which a packet plays Russian roulette.
+ *  @def DEFAULT_ROULETTE_SURVIVAL
+ *  The default probability of a packet surviving Russian roulette.
+ *  @def DEFAULT_CHECKPOINT_FILE
+ *  The default filename for checkpoints.
+ *  @def TRANSPORT_STOPPED
+ *  Returned by run_transport instead of a number of photons when the
+ *  simulation was stopped by SIGTERM.
+ *  @def SIMULATION_DONE
+ *  Returned by transport_all_photons when the simulation ran to the end.
+ *  @def SIMULATION_STOPPED
+ *  Returned by transport_all_photons when the simulation was stopped by
+ *  SIGTERM.
+ *  @def SIMULATION_FAILED
+ *  Returned by transport_all_photons when mrw.validate,
+ *  path_stretch.validate or transport_engine.validate did not show that the
+ *  results agree with the reference.
+ *  @def EVENT_LANES
+ *  The maximum number of photons held at once by the event based engine.
  *  @def OUTPUT_FILE_INTENS
  *  The default filename for the output intensity file.
+ *  @def OUTPUT_FILE_PEEL
+ *  The default filename for the output peel-off intensity file.
  *  @def OUTPUT_FILE_MOMENTS
  *  The default filename for the output moments file.
+ *  @def OUTPUT_FILE_SWEEP
+ *  The filename for the list of points in a parameter sweep.
+ *  @def OUTPUT_FILE_BINARY
+ *  The filename for the binary output file.
+ *  @def OUTPUT_FILE_ESCAPES
+ *  The filename for the log of escaping photons.
+ *  @def OUTPUT_FILE_METRICS
+ *  The filename for the metrics of a build with MCRT_METRICS.
  *  @def OUTPUT_FILE_PARS
  *  The default filename for the output simulation parameters file.
  *
  * ************************************************************************** */
 
 #define PI 3.1415926535897932
+#define CACHE_LINE 64
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define SIMD_DISPATCH __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_DISPATCH
+#endif
 
 #define LINE_LEN 256
 #define NO_PARAMETER '\0'
 #define DEFAULT_INI_FILE "plane.input"
+#define DEFAULT_BATCH_SIZE 10000
+#define DEFAULT_MIN_BATCHES 64
+#define DEFAULT_MRW_CRITICAL_SCATTERS 10
+#define DEFAULT_MRW_MIN_RADIUS 3.0
+#define DEFAULT_ROULETTE_THRESHOLD 0.1
+#define DEFAULT_ROULETTE_SURVIVAL 0.5
+#define DEFAULT_CHECKPOINT_FILE "mcrt.checkpoint"
+#define TRANSPORT_STOPPED -1
+#define SIMULATION_DONE 0
+#define SIMULATION_STOPPED 1
+#define SIMULATION_FAILED 2
+#define EVENT_LANES 1024
 #define OUTPUT_FILE_INTENS "intensity.txt"
+#define OUTPUT_FILE_PEEL "intensity_peel.txt"
 #define OUTPUT_FILE_MOMENTS "moments.txt"
+#define OUTPUT_FILE_SWEEP "sweep.txt"
+#define OUTPUT_FILE_BINARY "mcrt.bin"
+#define OUTPUT_FILE_ESCAPES "escapes.bin"
+#define OUTPUT_FILE_METRICS "metrics.prom"
 
 /* ************************************************************************** */
-/**
- *  Global variables
+/** @struct PhaseTable_t
+ *
+ *  @brief A tabulated phase function, linear between its points, see
+ *  phase.c.
+ *
+ *  @var PhaseTable_t::n_nodes
+ *  The number of points.
+ *  @var PhaseTable_t::mu
+ *  The cosine of the scattering angle at each point, from -1 to 1.
+ *  @var PhaseTable_t::value
+ *  The phase function at each point, unnormalised.
+ *  @var PhaseTable_t::alias_prob
+ *  The probability of keeping each segment when it is picked from the alias
+ *  table, one per segment between two points.
+ *  @var PhaseTable_t::alias
+ *  The segment taken instead of each segment when it is not kept.
+ *
+ * ************************************************************************** */
+
+typedef struct phase_table
+{
+    int n_nodes;
+    double *mu;
+    double *value;
+    double *alias_prob;
+    int *alias;
+} PhaseTable_t;
+
+/* ************************************************************************** */
+/** @struct Layer_t
+ *
+ *  @brief A layer of the slab, see layers.c.
+ *
+ *  @var Layer_t::z
+ *  The position of the bottom of the layer.
+ *  @var Layer_t::tau
+ *  The vertical optical depth from the bottom of the slab to the bottom of
+ *  the layer.
+ *  @var Layer_t::opacity
+ *  The optical depth per unit thickness of the slab within the layer.
+ *  @var Layer_t::albedo
+ *  The scattering albedo of the layer.
+ *
+ * ************************************************************************** */
+
+typedef struct layer
+{
+    double z;
+    double tau;
+    double opacity;
+    double albedo;
+} Layer_t;
+
+/* ************************************************************************** */
+/** @struct Layers_t
+ *
+ *  @brief The layers of a stratified slab, see layers.c.
+ *
+ *  @var Layers_t::n_layers
+ *  The number of layers.
+ *  @var Layers_t::layer
+ *  The layers from the bottom of the slab up, followed by one holding the
+ *  position and optical depth of the top of the slab.
+ *  @var Layers_t::tau_max
+ *  The vertical optical depth of the slab.
+ *  @var Layers_t::n_guide
+ *  The number of cells in the guide table.
+ *  @var Layers_t::guide_scale
+ *  n_guide / tau_max, which turns an optical depth into a cell of the guide
+ *  table.
+ *  @var Layers_t::guide
+ *  The layer at the bottom of each cell of the guide table, with the top
+ *  layer after the last cell.
+ *
+ * ************************************************************************** */
+
+typedef struct layers
+{
+    int n_layers;
+    Layer_t *layer;
+    double tau_max;
+    int n_guide;
+    double guide_scale;
+    int *guide;
+} Layers_t;
+
+/* ************************************************************************** */
+/** @struct Parameters_t
+ *
+ *  @brief The parameters of a simulation.
+ *
+ *  The code reads the parameters of the simulation being run through the
+ *  macros below, e.g. N_PHOTONS, which look them up in PARAMETERS. Each thread
+ *  has its own PARAMETERS pointer, so simulations with different parameters
+ *  can run on different threads at the same time, see libmcrt.c. The mcrt
+ *  program runs one simulation at a time with the parameters of the input
+ *  file, which every thread points at to begin with.
  *
- *  @var plane_vars::N_PHOTONS
+ *  @var Parameters_t::n_photons
  *  The number of Monte Carlo MCRT iterations. Physically, this is the number
  *  of photons which will be transported.
  *  Input label "N_PHOTONS"
- *  @var plane_vars::n_levels
- *  The number of levels used to calculated the moments of the radiation field.
- *  Input label "N_LEVELS"
- *  @var plane_vars::OUTPUT_FREQUENCY
- *  The progress bar output frequency.
+ *  @var Parameters_t::batch_size
+ *  The number of photons transported into the same private tally before it is
+ *  reduced into the total. Results for a SEED are only reproducible for the
+ *  same BATCH_SIZE. The default only depends on n_photons, never on the number
+ *  of threads or ranks.
+ *  Optional input label "batch_size"
+ *  @var Parameters_t::output_frequency
+ *  The number of photons between snapshots of the binary output.
  *  Input label "OUTPUT_FREQ"
- *  @var plane_vars::SEED
+ *  @var Parameters_t::progress_interval
+ *  The wall time in seconds between progress reports, or 0 to only report
+ *  when the transport finishes.
+ *  Optional input label "progress.interval"
+ *  @var Parameters_t::seed
  *  The SEED used for random number generation.
  *  Input label "SEED"
- *  @var plane_vars::TAU_MAX
+ *  @var Parameters_t::tau_max
  *  The maximum optical depth a photon can traverse.
  *  Input label "TAU_MAX"
- *  @var plane_vars::SCATTERING_ALBEDO
+ *  @var Parameters_t::scattering_albedo
  *  The scattering SCATTERING_ALBEDO for photon interactions.
  *  Input label "ALBEDO"
+ *  @var Parameters_t::transport_engine
+ *  The transport engine, either ENGINE_HISTORY or ENGINE_EVENT.
+ *  Optional input label "transport_engine"
+ *  @var Parameters_t::engine_validate
+ *  Run the simulation with the history and the event engine and compare the
+ *  results.
+ *  Optional input label "transport_engine.validate"
+ *  @var Parameters_t::direction_sampler
+ *  How isotropic directions are sampled, e.g. DIRECTION_TRIG.
+ *  Optional input label "direction.sampler"
+ *  @var Parameters_t::phase_function
+ *  The phase function of scattering, e.g. PHASE_ISOTROPIC. Anything but
+ *  isotropic scattering is only supported by the history engine, and cannot
+ *  be used with the MRW, path length stretching or the peel-off estimator,
+ *  which all assume isotropic scattering.
+ *  @var Parameters_t::phase_g
+ *  The asymmetry parameter of the Henyey-Greenstein phase function, the mean
+ *  cosine of the scattering angle, between -1 and 1. 0 is isotropic.
+ *  Optional input label "scatter.g"
+ *  @var Parameters_t::phase_table
+ *  The tabulated phase function, or NULL.
+ *  Optional input label "scatter.phase_file"
+ *  @var Parameters_t::layers
+ *  The layers of a stratified slab, or NULL for a uniform slab with
+ *  SCATTERING_ALBEDO. The layers make up TAU_MAX between them. Only supported
+ *  by the history engine, and cannot be used with the MRW, path length
+ *  stretching, the peel-off estimator or an albedo sweep, which all assume a
+ *  uniform slab.
+ *  Optional input labels "layers.opacity", "layers.thickness",
+ *  "layers.albedo" and "layers.file"
+ *  @var Parameters_t::mrw_enabled
+ *  Whether the Modified Random Walk is used for photons trapped deep within
+ *  the slab. Only supported by the history engine.
+ *  Optional input label "mrw.enabled"
+ *  @var Parameters_t::mrw_critical_scatters
+ *  The number of scatters a photon undergoes before an MRW step is attempted.
+ *  Optional input label "mrw.critical_scatters"
+ *  @var Parameters_t::mrw_min_radius
+ *  The smallest sphere, in scattering mean free paths, for which an MRW step is
+ *  taken.
+ *  Optional input label "mrw.min_radius"
+ *  @var Parameters_t::mrw_validate
+ *  Run the simulation with and without the MRW and compare the results.
+ *  Optional input label "mrw.validate"
+ *  @var Parameters_t::implicit_capture
+ *  Whether photon packets always scatter and lose a fraction 1 - albedo of
+ *  their weight at each interaction, rather than being absorbed outright.
+ *  Optional input label "implicit_capture"
+ *  @var Parameters_t::roulette_threshold
+ *  The weight below which a packet plays Russian roulette, with implicit
+ *  capture.
+ *  Optional input label "roulette.threshold"
+ *  @var Parameters_t::roulette_survival
+ *  The probability of a packet surviving Russian roulette. Its weight is
+ *  divided by this if it survives.
+ *  Optional input label "roulette.survival"
+ *  @var Parameters_t::path_stretch
+ *  The path length stretching parameter p, between 0 and 1. Path lengths are
+ *  sampled with the opacity scaled by 1 - p costheta, so photons travel
+ *  further towards the top of the slab, or 0 for unbiased sampling. Only
+ *  supported by the history engine.
+ *  Optional input label "path_stretch"
+ *  @var Parameters_t::stretch_validate
+ *  Run the simulation with and without path length stretching and compare
+ *  the results.
+ *  Optional input label "path_stretch.validate"
+ *  @var Parameters_t::n_sweep
+ *  The number of albedos in an albedo sweep, or 0 for a single simulation at
+ *  SCATTERING_ALBEDO. Every photon is traced once with an albedo of 1 and
+ *  tallied for each albedo with the weight albedo^n after n interactions.
+ *  Optional input label "albedo_sweep"
+ *  @var Parameters_t::sweep_albedos
+ *  The albedos of the sweep, given as a comma separated list by
+ *  "albedo_sweep". The results for each are written to albedo_<albedo>/.
+ *  @var Parameters_t::output_dir
+ *  The directory the output files are written to, or an empty string for the
+ *  current directory.
+ *  @var Parameters_t::escape_log
+ *  Whether to log the direction, position and weight of every escaping
+ *  photon to OUTPUT_FILE_ESCAPES, so they can be binned again with
+ *  mcrt_rebin.
+ *  Optional input label "escape_log"
+ *  @var Parameters_t::metrics_interval
+ *  The wall time in seconds between writes of OUTPUT_FILE_METRICS, or 0 to
+ *  only write it at the end. Ignored unless built with MCRT_METRICS.
+ *  Optional input label "metrics.interval"
+ *  @var Parameters_t::output_format
+ *  The format of the output files, either FORMAT_TEXT or FORMAT_BINARY.
+ *  Optional input label "output.format"
+ *  @var Parameters_t::output_point
+ *  The parameter sweep point being written when the points share combined
+ *  output files, or -1. It is written as the first column of every row.
+ *  @var Parameters_t::n_peel
+ *  The number of observer angles for the peel-off estimator, or 0 if it is
+ *  not used. With "peel_off" the observers are at the histogram bin centres.
+ *  Optional input labels "peel_off" and "peel_off.mu"
+ *  @var Parameters_t::peel_mu
+ *  The cosine of each observer angle of the peel-off estimator. Given as a
+ *  comma separated list by "peel_off.mu".
+ *  @var Parameters_t::target_rel_error
+ *  Stop the simulation once the relative error of every escape bin is below
+ *  this, or 0 to transport all N_PHOTONS. Bins with no weight have not
+ *  reached it. With MPI, each rank stops once its own error is below this
+ *  times sqrt(N_RANKS).
+ *  Optional input label "target_rel_error"
+ *  @var Parameters_t::target_moments
+ *  Whether the mean intensity at every level must also reach
+ *  TARGET_REL_ERROR.
+ *  Optional input label "target_rel_error.moments"
+ *  @var Parameters_t::time_limit
+ *  Stop the simulation once it has run for this many seconds of wall time,
+ *  or 0 for no limit. Where it stops depends on the speed of the machine, so
+ *  the results are not reproducible.
+ *  Optional input label "time_limit"
+ *  @var Parameters_t::checkpoint_interval
+ *  The wall time in seconds between checkpoints, or 0 for no periodic
+ *  checkpoints.
+ *  Optional input label "checkpoint.interval"
+ *  @var Parameters_t::checkpoint_file
+ *  The filename checkpoints are written to and restarted from. With MPI, the
+ *  rank is appended.
+ *  Optional input label "checkpoint.file"
+ *  @var Parameters_t::embedded
+ *  Whether the simulation is run through the libmcrt API, in which case no
+ *  progress is printed, no signal handlers are installed and no files are
+ *  written.
+ *  @var Parameters_t::parameter_error
+ *  The first parameter which could not be used, when EMBEDDED. Otherwise the
+ *  program exits with the message.
  *
  * ************************************************************************** */
 
-int N_PHOTONS;
-int OUTPUT_FREQUENCY;
-int SEED;
-double TAU_MAX;
-double SCATTERING_ALBEDO;
+typedef struct parameters
+{
+    long n_photons;
+    int batch_size;
+    int output_frequency;
+    double progress_interval;
+    int seed;
+    double tau_max;
+    double scattering_albedo;
+    int transport_engine;
+    int engine_validate;
+    int direction_sampler;
+    int phase_function;
+    double phase_g;
+    PhaseTable_t *phase_table;
+    Layers_t *layers;
+    int mrw_enabled;
+    int mrw_critical_scatters;
+    double mrw_min_radius;
+    int mrw_validate;
+    int implicit_capture;
+    double roulette_threshold;
+    double roulette_survival;
+    double path_stretch;
+    int stretch_validate;
+    int n_sweep;
+    double *sweep_albedos;
+    char output_dir[LINE_LEN];
+    int escape_log;
+    double metrics_interval;
+    int output_format;
+    int output_point;
+    int n_peel;
+    double *peel_mu;
+    double target_rel_error;
+    int target_moments;
+    double time_limit;
+    double checkpoint_interval;
+    char checkpoint_file[LINE_LEN];
+    int embedded;
+    char parameter_error[LINE_LEN];
+} Parameters_t;
+
+extern _Thread_local Parameters_t *PARAMETERS;
+
+#define N_PHOTONS (PARAMETERS->n_photons)
+#define BATCH_SIZE (PARAMETERS->batch_size)
+#define OUTPUT_FREQUENCY (PARAMETERS->output_frequency)
+#define PROGRESS_INTERVAL (PARAMETERS->progress_interval)
+#define SEED (PARAMETERS->seed)
+#define TAU_MAX (PARAMETERS->tau_max)
+#define SCATTERING_ALBEDO (PARAMETERS->scattering_albedo)
+#define TRANSPORT_ENGINE (PARAMETERS->transport_engine)
+#define ENGINE_VALIDATE (PARAMETERS->engine_validate)
+#define DIRECTION_SAMPLER (PARAMETERS->direction_sampler)
+#define PHASE_FUNCTION (PARAMETERS->phase_function)
+#define PHASE_G (PARAMETERS->phase_g)
+#define PHASE_TABLE (PARAMETERS->phase_table)
+#define LAYERS (PARAMETERS->layers)
+#define MRW_ENABLED (PARAMETERS->mrw_enabled)
+#define MRW_CRITICAL_SCATTERS (PARAMETERS->mrw_critical_scatters)
+#define MRW_MIN_RADIUS (PARAMETERS->mrw_min_radius)
+#define MRW_VALIDATE (PARAMETERS->mrw_validate)
+#define IMPLICIT_CAPTURE (PARAMETERS->implicit_capture)
+#define ROULETTE_THRESHOLD (PARAMETERS->roulette_threshold)
+#define ROULETTE_SURVIVAL (PARAMETERS->roulette_survival)
+#define PATH_STRETCH (PARAMETERS->path_stretch)
+#define STRETCH_VALIDATE (PARAMETERS->stretch_validate)
+#define N_SWEEP (PARAMETERS->n_sweep)
+#define SWEEP_ALBEDOS (PARAMETERS->sweep_albedos)
+#define OUTPUT_DIR (PARAMETERS->output_dir)
+#define ESCAPE_LOG (PARAMETERS->escape_log)
+#define METRICS_INTERVAL (PARAMETERS->metrics_interval)
+#define OUTPUT_FORMAT (PARAMETERS->output_format)
+#define OUTPUT_POINT (PARAMETERS->output_point)
+#define N_PEEL (PARAMETERS->n_peel)
+#define PEEL_MU (PARAMETERS->peel_mu)
+#define TARGET_REL_ERROR (PARAMETERS->target_rel_error)
+#define TARGET_MOMENTS (PARAMETERS->target_moments)
+#define TIME_LIMIT (PARAMETERS->time_limit)
+#define CHECKPOINT_INTERVAL (PARAMETERS->checkpoint_interval)
+#define CHECKPOINT_FILE (PARAMETERS->checkpoint_file)
+#define EMBEDDED (PARAMETERS->embedded)
+#define PARAMETER_ERROR (PARAMETERS->parameter_error)
+
+/* ************************************************************************** */
+/**
+ *  Global variables
+ *
+ *  @var RANK
+ *  The MPI rank of this process, or 0 without MPI.
+ *  @var N_RANKS
+ *  The number of MPI ranks, or 1 without MPI.
+ *
+ * ************************************************************************** */
+
+extern int RANK;
+extern int N_RANKS;
+
+/* ************************************************************************** */
+/**
+ *  @def N_TALLY_SETS
+ *  The number of sets of histograms and moments tallied for each photon, one
+ *  for each albedo in an albedo sweep.
+ *  @def MAX_SWEEP_ALBEDOS
+ *  The largest number of albedos in an albedo sweep.
+ *
+ * ************************************************************************** */
+
+#define N_TALLY_SETS (N_SWEEP > 0 ? N_SWEEP : 1)
+#define MAX_SWEEP_ALBEDOS 64
+
+/* ************************************************************************** */
+/**
+ *  @def ENGINE_HISTORY
+ *  Follow the history of one photon packet at a time.
+ *  Input value "history"
+ *  @def ENGINE_EVENT
+ *  Advance a structure of arrays of photon packets in stages.
+ *  Input value "event"
+ *
+ * ************************************************************************** */
+
+#define ENGINE_HISTORY 0
+#define ENGINE_EVENT 1
+
+/* ************************************************************************** */
+/**
+ *  @def DIRECTION_TRIG
+ *  Sample theta and phi and take their sines and cosines.
+ *  Input value "trig"
+ *  @def DIRECTION_SQRT
+ *  Sample costheta directly and find sintheta with sqrt.
+ *  Input value "sqrt"
+ *  @def DIRECTION_REJECTION
+ *  Marsaglia's rejection method, with no trigonometric functions.
+ *  Input value "rejection"
+ *  @def DIRECTION_TABLE
+ *  As DIRECTION_SQRT, with phi from a table of sines and cosines.
+ *  Input value "table"
+ *  @def N_DIRECTION_SAMPLERS
+ *  The number of direction samplers.
+ *
+ *  See direction.c for each method.
+ *
+ * ************************************************************************** */
+
+#define DIRECTION_TRIG 0
+#define DIRECTION_SQRT 1
+#define DIRECTION_REJECTION 2
+#define DIRECTION_TABLE 3
+#define N_DIRECTION_SAMPLERS 4
+
+/* ************************************************************************** */
+/**
+ *  @def PHASE_ISOTROPIC
+ *  Scatter isotropically.
+ *  @def PHASE_HENYEY_GREENSTEIN
+ *  Scatter with the Henyey-Greenstein phase function, for scatter.g.
+ *  @def PHASE_TABULATED
+ *  Scatter with the phase function of scatter.phase_file.
+ *
+ * ************************************************************************** */
+
+#define PHASE_ISOTROPIC 0
+#define PHASE_HENYEY_GREENSTEIN 1
+#define PHASE_TABULATED 2
+
+/* ************************************************************************** */
+/**
+ *  @def FORMAT_TEXT
+ *  Write the results as fixed width text columns.
+ *  Input value "text"
+ *  @def FORMAT_BINARY
+ *  Write the results, and snapshots of them as the simulation runs, to
+ *  OUTPUT_FILE_BINARY. See binary_output.c for the layout.
+ *  Input value "binary"
+ *  @def BINARY_MAGIC
+ *  The string at the start of a binary output file, including its
+ *  terminating null byte.
+ *  @def BINARY_RECORD_MAGIC
+ *  The string at the start of each record in a binary output file.
+ *  @def BINARY_VERSION
+ *  The version of the binary output layout.
+ *  @def BINARY_NAME_LEN
+ *  The length of the name of a section in a binary output file.
+ *  @def RECORD_SNAPSHOT
+ *  A record of the results part way through a simulation.
+ *  @def RECORD_FINAL
+ *  A record of the results at the end of a simulation.
+ *  @def SECTION_DOUBLE
+ *  A section holding an array of doubles.
+ *  @def SECTION_TEXT
+ *  A section holding text, of lines of a key and a value.
+ *
+ * ************************************************************************** */
+
+#define FORMAT_TEXT 0
+#define FORMAT_BINARY 1
+#define BINARY_MAGIC "MCRTBIN"
+#define BINARY_RECORD_MAGIC "RECORD\0"
+#define BINARY_VERSION 1
+#define BINARY_NAME_LEN 16
+#define RECORD_SNAPSHOT 0
+#define RECORD_FINAL 1
+#define SECTION_DOUBLE 1
+#define SECTION_TEXT 2
+
+/* ************************************************************************** */
+/**
+ *  @def ESCAPE_MAGIC
+ *  The string at the start of an escape log, including its terminating null
+ *  byte.
+ *  @def ESCAPE_VERSION
+ *  The version of the escape log layout.
+ *  @def ESCAPE_HEADER_SIZE
+ *  The size of the header of an escape log in bytes, after which the events
+ *  start.
+ *  @def ESCAPE_FLOATS
+ *  The number of floats in an EscapeEvent_t, which follow costheta.
+ *  @def ESCAPE_BUFFER_EVENTS
+ *  The number of events in the buffer of each thread.
+ *
+ * ************************************************************************** */
+
+#define ESCAPE_MAGIC "MCRTESC"
+#define ESCAPE_VERSION 2
+#define ESCAPE_HEADER_SIZE 64
+#define ESCAPE_FLOATS 4
+#define ESCAPE_BUFFER_EVENTS 65536
+
+/* ************************************************************************** */
+/**
+ *  @def BENCH_INPUTS
+ *  The number of pre-generated inputs cycled through when timing a function,
+ *  a power of two.
+ *  @def BENCH_MAX_RESULTS
+ *  The largest number of results in a benchmark run or baseline.
+ *  @def BENCH_MAX_GRID
+ *  The largest number of values of each axis of the simulation grid.
+ *  @def METRIC_NS_PER_CALL
+ *  A result timing a function, lower is better.
+ *  @def METRIC_PHOTONS_PER_SECOND
+ *  A result timing a whole simulation, higher is better.
+ *
+ * ************************************************************************** */
+
+#define BENCH_INPUTS 4096
+#define BENCH_MAX_RESULTS 256
+#define BENCH_MAX_GRID 8
+#define METRIC_NS_PER_CALL "ns_per_call"
+#define METRIC_PHOTONS_PER_SECOND "photons_per_second"
 
 /* ************************************************************************** */
 /** @struct PhotonPacket_t
@@ -99,6 +654,8 @@ double SCATTERING_ALBEDO;
  *  The cosine of the photon's phi direction.
  *  @var PhotonPacket_t::sinphi
  *  The sin of the photon's phi direction.
+ *  @var PhotonPacket_t::weight
+ *  The statistical weight of the packet, which is tallied instead of 1.
  *
  * ************************************************************************** */
 
@@ -111,9 +668,100 @@ typedef struct photon_packet
     double sintheta;
     double cosphi;
     double sinphi;
+    double weight;
 } PhotonPacket_t;
 
-#define PHOTON_INIT {false, false, 0, 0, 0, 0, 0, 0, 0};
+#define PHOTON_INIT {false, false, 0, 0, 0, 0, 0, 0, 0, 1.0};
+
+/* ************************************************************************** */
+/** @struct RNGStream_t
+ *
+ *  @brief Struct used to represent an independent stream of random numbers.
+ *
+ *  @var RNGStream_t::key
+ *  The Philox key, derived from the SEED.
+ *  @var RNGStream_t::counter
+ *  The Philox counter. The upper two words hold the stream index and the lower
+ *  two words the number of blocks drawn so far.
+ *  @var RNGStream_t::buffer
+ *  Random numbers generated from the last RNG_BUFFER_SIZE / 2 blocks.
+ *  @var RNGStream_t::n_used
+ *  The number of random numbers in buffer which have already been used.
+ *
+ * ************************************************************************** */
+
+#define RNG_BUFFER_SIZE 8
+
+typedef struct rng_stream
+{
+    uint32_t key[2];
+    uint32_t counter[4];
+    int n_used;
+    double buffer[RNG_BUFFER_SIZE];
+} RNGStream_t;
+
+/* ************************************************************************** */
+/** @struct PhotonBatch_t
+ *
+ *  @brief Struct used to hold many photon packets as a structure of arrays for
+ *  the event based transport engine.
+ *
+ *  @var PhotonBatch_t::capacity
+ *  The number of lanes, i.e. the maximum number of photons in flight.
+ *  @var PhotonBatch_t::n_active
+ *  The number of lanes holding a photon which is still being transported.
+ *  Active lanes are always kept at the start of the arrays.
+ *  @var PhotonBatch_t::status
+ *  One of PHOTON_ACTIVE, PHOTON_ESCAPED or PHOTON_ABSORBED for each lane.
+ *  @var PhotonBatch_t::x
+ *  The x position of each photon. Likewise for y, z and the direction
+ *  cosines and sines which mirror PhotonPacket_t.
+ *  @var PhotonBatch_t::weight
+ *  The statistical weight of each photon.
+ *  @var PhotonBatch_t::z_orig
+ *  The z position of each photon before it was last moved.
+ *  @var PhotonBatch_t::ds
+ *  The distance each photon will be moved in this step.
+ *  @var PhotonBatch_t::u
+ *  Scratch space for one random number per lane. Likewise for v.
+ *  @var PhotonBatch_t::new_costheta
+ *  Scratch space for the new direction of each scattered photon. Likewise for
+ *  the other new_ direction arrays.
+ *  @var PhotonBatch_t::scattered
+ *  The lanes which scatter in this step.
+ *  @var PhotonBatch_t::rng
+ *  The random number stream of each photon.
+ *  @var PhotonBatch_t::data
+ *  The block of memory which the double arrays point into.
+ *
+ * ************************************************************************** */
+
+#define PHOTON_ACTIVE 0
+#define PHOTON_ESCAPED 1
+#define PHOTON_ABSORBED 2
+
+typedef struct photon_batch
+{
+    int capacity;
+    int n_active;
+    int *status;
+    double *x, *y, *z;
+    double *costheta;
+    double *sintheta;
+    double *cosphi;
+    double *sinphi;
+    double *weight;
+    double *z_orig;
+    double *ds;
+    double *u, *v;
+    double *new_costheta;
+    double *new_sintheta;
+    double *new_cosphi;
+    double *new_sinphi;
+    int *scattered;
+    RNGStream_t *rng;
+    double *data;
+} PhotonBatch_t;
 
 /* ************************************************************************** */
 /** @struct Histogram_t
@@ -125,8 +773,23 @@ typedef struct photon_packet
  *  @var Histogram_t::weight
  *  Counters for the number of photons escaped from a binned escape angle,
  *  will be an array with n_bins elements.
+ *  @var Histogram_t::weight_sq
+ *  The sum over batches of the square of each batch's weight, for the
+ *  batch means error. NULL in batch tallies.
+ *  @var Histogram_t::intensity
+ *  The flux normalised intensity of each bin.
+ *  @var Histogram_t::error
+ *  The standard error of the intensity of each bin.
+ *  @var Histogram_t::n_batches
+ *  The number of batches summed into weight.
  *  @var Histogram_t::theta
  *  The binned escape angles, will be an array with n_bins elements.
+ *  @var Histogram_t::n_peel
+ *  The number of peel-off observer angles, N_PEEL.
+ *  @var Histogram_t::peel_weight
+ *  The peel-off estimate of the escaping weight per unit mu towards each
+ *  observer in PEEL_MU. Likewise peel_weight_sq, peel_intensity and
+ *  peel_error mirror the arrays for the bins.
  *
  * ************************************************************************** */
 
@@ -134,8 +797,16 @@ typedef struct intensity_histogram
 {
     int n_bins;
     double *weight;
+    double *weight_sq;
     double *intensity;
+    double *error;
+    long n_batches;
     double *theta;
+    int n_peel;
+    double *peel_weight;
+    double *peel_weight_sq;
+    double *peel_intensity;
+    double *peel_error;
 } Histogram_t;
 
 /* ************************************************************************** */
@@ -144,29 +815,489 @@ typedef struct intensity_histogram
  *  @brief Struct used to store the plus and minus moments of the radiation
  *  field.
  *
- *  @var Moments_t::j_plus
- *  An array of n_levels elements for the upwards J moment.
- *  @var Moments_t::h_plus
- *  An array of n_levels elements for the upwards H moment.
- *  @var Moments_t::k_plus
- *  An array of n_levels elements for the upwards K moment.
- *  @var Moments_t::j_minus
- *  An array of n_levels elements for the downwards J moment.
- *  @var Moments_t::h_minus
- *  An array of n_levels elements for the downwards H moment.
- *  @var Moments_t::k_minus
- *  An array of n_levels elements for the downwards K moment.
+ *  @var Moments_t::level
+ *  An array of N_MOMENTS * (n_levels + 2) elements. The moments at each level
+ *  are stored together, indexed by MOMENT_J_PLUS etc., so MOMENT(moments, i,
+ *  MOMENT_J_PLUS) is the upwards J moment at level i. Whilst photons are being
+ *  transported this holds the difference between each level and the one below
+ *  it, and integrate_moments turns it into the moments themselves. The extra
+ *  level is the end marker for ranges which include the top level.
+ *  @var Moments_t::level_sq
+ *  The sum over batches of the square of each batch's moments, laid out as
+ *  level, for the batch means error. This is never a difference array. NULL
+ *  in batch tallies.
+ *  @var Moments_t::n_batches
+ *  The number of batches summed into level.
  *
  * ************************************************************************** */
 
+#define MOMENT_J_PLUS 0
+#define MOMENT_H_PLUS 1
+#define MOMENT_K_PLUS 2
+#define MOMENT_J_MINUS 3
+#define MOMENT_H_MINUS 4
+#define MOMENT_K_MINUS 5
+#define N_MOMENTS 6
+
+#define MOMENT(moments, i, m) ((moments)->level[N_MOMENTS * (i) + (m)])
+#define MOMENT_SQ(moments, i, m) ((moments)->level_sq[N_MOMENTS * (i) + (m)])
+
 typedef struct radiation_moments
 {
     int n_levels;
-    double *h_plus, *h_minus;
-    double *j_plus, *j_minus;
-    double *k_plus, *k_minus;
+    double *level;
+    double *level_sq;
+    long n_batches;
 } Moments_t;
 
+/* ************************************************************************** */
+/** @struct Tally_t
+ *
+ *  @brief Struct used to accumulate the escape histogram and radiation moments
+ *  for a batch of photons.
+ *
+ *  @var Tally_t::batch
+ *  The index of the batch of photons accumulated in this tally.
+ *  @var Tally_t::n_sets
+ *  The number of histograms and moments, N_TALLY_SETS.
+ *  @var Tally_t::hist
+ *  The histograms of escape angle weights, one for each set. Only weight and
+ *  peel_weight are used and they point into data.
+ *  @var Tally_t::moments
+ *  The moments of the radiation field for each set, as a difference array
+ *  which points into data.
+ *  @var Tally_t::n_data
+ *  The total number of elements in data.
+ *  @var Tally_t::data
+ *  A single cache line aligned block holding every tally array, so that
+ *  tallies can be cleared and summed with a single loop.
+ *
+ * ************************************************************************** */
+
+typedef struct tally
+{
+    long batch;
+    int n_sets;
+    Histogram_t *hist;
+    Moments_t *moments;
+    size_t n_data;
+    double *data;
+} Tally_t;
+
+/* ************************************************************************** */
+/** @struct TallyReducer_t
+ *
+ *  @brief Struct used to sum the batch tallies in a fixed order.
+ *
+ *  @var TallyReducer_t::n_bins
+ *  The number of histogram bins in each tally.
+ *  @var TallyReducer_t::n_levels
+ *  The number of moment levels in each tally.
+ *  @var TallyReducer_t::next_batch
+ *  The index of the next batch to be pushed on to the stack.
+ *  @var TallyReducer_t::n_stack
+ *  The number of partial sums on the stack.
+ *  @var TallyReducer_t::stack
+ *  Partial sums of 2^stack_order[i] consecutive batches.
+ *  @var TallyReducer_t::stack_order
+ *  The order of each partial sum on the stack.
+ *  @var TallyReducer_t::n_pending
+ *  The number of finished batches waiting for an earlier batch to finish.
+ *  @var TallyReducer_t::pending
+ *  The finished batches which are waiting for an earlier batch to finish.
+ *  @var TallyReducer_t::n_free
+ *  The number of tallies available for re-use.
+ *  @var TallyReducer_t::free
+ *  The tallies available for re-use.
+ *  @var TallyReducer_t::max_tallies
+ *  The capacity of the pending and free arrays.
+ *  @var TallyReducer_t::merging
+ *  True whilst a thread is pushing batches on to the stack, which it does
+ *  without holding the lock.
+ *  @var TallyReducer_t::n_snapshots_waiting
+ *  The number of threads waiting for the pushing to stop to take a snapshot.
+ *  @var TallyReducer_t::squares
+ *  The sum of the squares of every batch which has been pushed, with the
+ *  moments integrated.
+ *  @var TallyReducer_t::stop_batch
+ *  Batches from this one onwards are thrown away, once the target error or
+ *  the time limit has been reached.
+ *  @var TallyReducer_t::start_time
+ *  The wall time the reducer was initialised, for TIME_LIMIT.
+ *  @var TallyReducer_t::check
+ *  A tally used for the sum of the stack when checking the error.
+ *
+ * ************************************************************************** */
+
+#define MAX_STACK_ORDER 64
+
+typedef struct tally_reducer
+{
+    int n_bins;
+    int n_levels;
+    long next_batch;
+    int n_stack;
+    Tally_t *stack[MAX_STACK_ORDER];
+    int stack_order[MAX_STACK_ORDER];
+    int n_pending;
+    Tally_t **pending;
+    int n_free;
+    Tally_t **free;
+    int max_tallies;
+    int merging;
+    int n_snapshots_waiting;
+    Tally_t squares;
+    long stop_batch;
+    double start_time;
+    Tally_t check;
+} TallyReducer_t;
+
+/* ************************************************************************** */
+/** @struct Checkpoint_t
+ *
+ *  @brief Struct used to hold a copy of the state of a TallyReducer_t, which
+ *  is everything required to restart a simulation.
+ *
+ *  @var Checkpoint_t::next_batch
+ *  The number of batches which have been summed. As each photon has its own
+ *  random number stream, this is also the position of every stream.
+ *  @var Checkpoint_t::n_stack
+ *  The number of partial sums.
+ *  @var Checkpoint_t::stack_order
+ *  The order of each partial sum, as in TallyReducer_t.
+ *  @var Checkpoint_t::stack
+ *  Copies of the partial sums.
+ *  @var Checkpoint_t::n_allocated
+ *  The number of tallies in stack which have been allocated.
+ *  @var Checkpoint_t::squares
+ *  A copy of the sum of the squares of the batches.
+ *  @var Checkpoint_t::stop_batch
+ *  A copy of the batch the reducer will stop at.
+ *
+ * ************************************************************************** */
+
+typedef struct checkpoint
+{
+    long next_batch;
+    int n_stack;
+    int stack_order[MAX_STACK_ORDER];
+    Tally_t stack[MAX_STACK_ORDER];
+    int n_allocated;
+    Tally_t squares;
+    long stop_batch;
+} Checkpoint_t;
+
+/* ************************************************************************** */
+/**
+ *  @def COUNTER_PHOTONS
+ *  The number of photons transported.
+ *  @def COUNTER_SCATTERS
+ *  The number of scatters, not counting MRW steps.
+ *  @def COUNTER_REEMISSIONS
+ *  The number of photons re-emitted after leaving through the bottom of the
+ *  slab.
+ *  @def COUNTER_LEVELS_CROSSED
+ *  The number of moment levels crossed, summed over every step.
+ *  @def COUNTER_ABSORPTIONS
+ *  The number of photons absorbed, or ended by Russian roulette.
+ *  @def COUNTER_ESCAPES
+ *  The number of photons which escaped through the top of the slab.
+ *  @def COUNTER_MRW_STEPS
+ *  The number of MRW steps.
+ *  @def TIMER_TRANSPORT
+ *  The time spent transporting batches of photons.
+ *  @def TIMER_REDUCE
+ *  The time spent handing batches to the reducer, and on checkpoints and
+ *  snapshots.
+ *
+ *  @def METRIC_ATTACH
+ *  Point THREAD_METRICS at the counters of the calling OpenMP thread.
+ *  @def METRIC_ADD
+ *  Add to a counter of the calling thread.
+ *  @def METRIC_TIMER_START
+ *  Declare a variable holding the time a phase started.
+ *  @def METRIC_TIMER_STOP
+ *  Add the time since METRIC_TIMER_START to a timer of the calling thread.
+ *
+ *  Without MCRT_METRICS, these macros compile to nothing.
+ *
+ * ************************************************************************** */
+
+#define COUNTER_PHOTONS 0
+#define COUNTER_SCATTERS 1
+#define COUNTER_REEMISSIONS 2
+#define COUNTER_LEVELS_CROSSED 3
+#define COUNTER_ABSORPTIONS 4
+#define COUNTER_ESCAPES 5
+#define COUNTER_MRW_STEPS 6
+#define N_COUNTERS 7
+#define TIMER_TRANSPORT 0
+#define TIMER_REDUCE 1
+#define N_TIMERS 2
+
+/* ************************************************************************** */
+/** @struct ThreadMetrics_t
+ *
+ *  @brief The counters and timers of one thread, on their own cache lines.
+ *
+ *  Only the thread they belong to adds to them, and the metrics writer only
+ *  reads them, so relaxed loads and stores are enough and the adds cost no
+ *  more than a normal add.
+ *
+ *  @var ThreadMetrics_t::counters
+ *  The counters, indexed by COUNTER_*.
+ *  @var ThreadMetrics_t::timer_ns
+ *  The timers in nanoseconds, indexed by TIMER_*.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    _Alignas(CACHE_LINE) _Atomic uint64_t counters[N_COUNTERS];
+    _Atomic uint64_t timer_ns[N_TIMERS];
+} ThreadMetrics_t;
+
+#ifdef METRICS_ON
+extern _Thread_local ThreadMetrics_t *THREAD_METRICS;
+
+#define METRIC_ATTACH() attach_thread_metrics()
+#define METRIC_ADD(counter, n)                                                                                      \
+  atomic_store_explicit(&THREAD_METRICS->counters[counter],                                                         \
+                        atomic_load_explicit(&THREAD_METRICS->counters[counter], memory_order_relaxed) + (n),       \
+                        memory_order_relaxed)
+#define METRIC_TIMER_START(start) double start = get_wall_time()
+#define METRIC_TIMER_STOP(timer, start)                                                                             \
+  atomic_store_explicit(&THREAD_METRICS->timer_ns[timer],                                                           \
+                        atomic_load_explicit(&THREAD_METRICS->timer_ns[timer], memory_order_relaxed) +              \
+                        (uint64_t) (1e9 * (get_wall_time() - (start))), memory_order_relaxed)
+#else
+#define METRIC_ATTACH() ((void) 0)
+#define METRIC_ADD(counter, n) ((void) 0)
+#define METRIC_TIMER_START(start) ((void) 0)
+#define METRIC_TIMER_STOP(timer, start) ((void) 0)
+#endif
+
+/* ************************************************************************** */
+/** @struct ThreadProgress_t
+ *
+ *  @brief The number of photons transported by one thread, on its own cache
+ *  line.
+ *
+ *  Only the thread it belongs to adds to it, and the progress reporter only
+ *  reads it, so the transport loop needs no synchronisation to count photons.
+ *
+ *  @var ThreadProgress_t::n_done
+ *  The number of photons the thread has transported.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    _Alignas(CACHE_LINE) _Atomic long n_done;
+} ThreadProgress_t;
+
+/* ************************************************************************** */
+/** @struct Progress_t
+ *
+ *  @brief The progress of a running simulation and the thread reporting it.
+ *
+ *  @var Progress_t::threads
+ *  The number of photons transported by each OpenMP thread.
+ *  @var Progress_t::n_threads
+ *  The number of threads in threads.
+ *  @var Progress_t::n_total
+ *  The number of photons this rank will transport.
+ *  @var Progress_t::n_start
+ *  The number of them transported before a restart.
+ *  @var Progress_t::start_time
+ *  The wall time the transport started.
+ *  @var Progress_t::interval
+ *  The wall time in seconds between reports, PROGRESS_INTERVAL.
+ *  @var Progress_t::report
+ *  Whether the progress is printed, which is only done by rank 0 and not
+ *  when EMBEDDED.
+ *  @var Progress_t::reporter
+ *  The reporter thread, if running.
+ *  @var Progress_t::lock
+ *  Held by the reporter thread except whilst it reports.
+ *  @var Progress_t::wake
+ *  Signalled to stop the reporter thread.
+ *  @var Progress_t::running
+ *  Whether the reporter thread was started.
+ *  @var Progress_t::stop
+ *  Whether the reporter thread has been told to stop.
+ *
+ * ************************************************************************** */
+
+typedef struct progress
+{
+    ThreadProgress_t *threads;
+    int n_threads;
+    long n_total;
+    long n_start;
+    double start_time;
+    double interval;
+    int report;
+    pthread_t reporter;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    int stop;
+} Progress_t;
+
+/* ************************************************************************** */
+/** @struct EscapeEvent_t
+ *
+ *  @brief An escaping photon in the escape log.
+ *
+ *  @var EscapeEvent_t::costheta
+ *  The cosine of the angle of the escape direction to the normal. It is kept
+ *  at full precision, so that binning it again gives the same bins as the
+ *  histogram.
+ *  @var EscapeEvent_t::phi
+ *  The azimuth of the escape direction, from -pi to pi.
+ *  @var EscapeEvent_t::x
+ *  The x position the photon left the slab, in units of its thickness.
+ *  @var EscapeEvent_t::y
+ *  The y position the photon left the slab, in units of its thickness.
+ *  @var EscapeEvent_t::weight
+ *  The weight of the photon packet.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    double costheta;
+    float phi;
+    float x;
+    float y;
+    float weight;
+} EscapeEvent_t;
+
+/* ************************************************************************** */
+/** @struct EscapeBuffer_t
+ *
+ *  @brief A buffer of escape events, filled by one thread at a time.
+ *
+ *  @var EscapeBuffer_t::n_events
+ *  The number of events in the buffer.
+ *  @var EscapeBuffer_t::next
+ *  The next buffer in the list of full or free buffers.
+ *  @var EscapeBuffer_t::events
+ *  The events.
+ *
+ * ************************************************************************** */
+
+typedef struct escape_buffer
+{
+    int n_events;
+    struct escape_buffer *next;
+    EscapeEvent_t events[ESCAPE_BUFFER_EVENTS];
+} EscapeBuffer_t;
+
+/* ************************************************************************** */
+/** @struct BenchResult_t
+ *
+ *  @brief A result of mcrt_bench.
+ *
+ *  @var BenchResult_t::name
+ *  The function or simulation timed, which is matched against the baseline.
+ *  @var BenchResult_t::metric
+ *  METRIC_NS_PER_CALL or METRIC_PHOTONS_PER_SECOND.
+ *  @var BenchResult_t::value
+ *  The best value of the repeats.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    char name[LINE_LEN];
+    char metric[32];
+    double value;
+} BenchResult_t;
+
+/* ************************************************************************** */
+/** @struct BinarySection_t
+ *
+ *  @brief A section of a record read from a binary output file.
+ *
+ *  @var BinarySection_t::name
+ *  The name of the section, null terminated.
+ *  @var BinarySection_t::type
+ *  SECTION_DOUBLE or SECTION_TEXT.
+ *  @var BinarySection_t::n
+ *  The number of values in the section.
+ *  @var BinarySection_t::data
+ *  The values, with a null byte after a SECTION_TEXT section.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    char name[BINARY_NAME_LEN];
+    uint32_t type;
+    uint64_t n;
+    void *data;
+} BinarySection_t;
+
+/* ************************************************************************** */
+/** @struct BinaryRecord_t
+ *
+ *  @brief A record read from a binary output file.
+ *
+ *  @var BinaryRecord_t::kind
+ *  RECORD_SNAPSHOT or RECORD_FINAL.
+ *  @var BinaryRecord_t::n_photons
+ *  The number of photons the results are for.
+ *  @var BinaryRecord_t::n_sections
+ *  The number of sections.
+ *  @var BinaryRecord_t::sections
+ *  The sections of the record.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    uint32_t kind;
+    uint64_t n_photons;
+    uint32_t n_sections;
+    BinarySection_t *sections;
+} BinaryRecord_t;
+
+/* ************************************************************************** */
+/**
+ *  @brief A parameter from the input file.
+ *
+ *  @details
+ *
+ *  A numeric parameter given as a comma separated list, or as a range
+ *  start:stop:step which includes stop, is an axis of a parameter sweep. Its
+ *  values are kept in values and index picks the one used by the current
+ *  sweep point.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    char name[LINE_LEN];
+    char value[LINE_LEN];
+    int n_values;
+    int index;
+    double *values;
+} Parameter_t;
+
+/* ************************************************************************** */
+/**
+ *  @brief Every parameter in the input file, read once.
+ *
+ * ************************************************************************** */
+
+typedef struct
+{
+    int n_parameters;
+    Parameter_t *parameters;
+} ParameterTable_t;
+
 /* ************************************************************************** */
 /**
  *
@@ -181,3 +1312,45 @@ union ParameterUnion
 
 #define TYPE_INT 0
 #define TYPE_DOUBLE 1
+
+/* ************************************************************************** */
+/** @struct MCRTContext_t
+ *
+ *  @brief A simulation run through the libmcrt API, see mcrt.h.
+ *
+ *  @var MCRTContext_t::parameters
+ *  The parameters of the simulation, which PARAMETERS points to whilst it
+ *  runs.
+ *  @var MCRTContext_t::table
+ *  The parameters set by mcrt_set and mcrt_read_input.
+ *  @var MCRTContext_t::n_sets
+ *  The number of tally sets in the results, N_TALLY_SETS, or 0 if the
+ *  simulation has not been run.
+ *  @var MCRTContext_t::hist
+ *  The escape histogram of each set, converted to intensities.
+ *  @var MCRTContext_t::moments
+ *  The integrated moments of each set.
+ *  @var MCRTContext_t::moment_values
+ *  The moments of each set divided by the number of photons, laid out as by
+ *  normalise_moments, followed by their errors.
+ *  @var MCRTContext_t::albedo
+ *  The albedo of each set.
+ *  @var MCRTContext_t::n_photons
+ *  The number of photons transported.
+ *  @var MCRTContext_t::error
+ *  The message of the last error.
+ *
+ * ************************************************************************** */
+
+typedef struct mcrt_context
+{
+    Parameters_t parameters;
+    ParameterTable_t table;
+    int n_sets;
+    Histogram_t *hist;
+    Moments_t *moments;
+    double *moment_values;
+    double *albedo;
+    long n_photons;
+    char error[LINE_LEN];
+} MCRTContext_t;
@@ -9,10 +9,213 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <math.h>
+#include <sys/stat.h>
 
 #include "variables.h"
 #include "functions.h"
 
+/* ************************************************************************** */
+/** output_path
+ *
+ *  @brief Get the path of an output file in OUTPUT_DIR.
+ *
+ *  @param[out] *path      The path of the file, LINE_LEN characters long.
+ *  @param[in] *file_name  The name of the output file.
+ *
+ *  @details
+ *
+ *  The program exits if the path is too long, rather than write to a
+ *  truncated path.
+ *
+ * ************************************************************************** */
+
+static void
+output_path(char *path, const char *file_name)
+{
+  int length;
+
+  if(strlen(OUTPUT_DIR) == 0)
+    length = snprintf(path, LINE_LEN, "%s", file_name);
+  else
+    length = snprintf(path, LINE_LEN, "%s/%s", OUTPUT_DIR, file_name);
+
+  if(length >= LINE_LEN)
+  {
+    printf("The path of output file %s in directory %s is too long\n", file_name, OUTPUT_DIR);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** open_output_file
+ *
+ *  @brief Open an output file in OUTPUT_DIR for writing.
+ *
+ *  @param[out] *path      The path of the file, LINE_LEN characters long.
+ *  @param[in] *file_name  The name of the output file.
+ *  @param[out] *is_new    true if the file is empty, so needs a header.
+ *
+ *  @return The open file, or NULL if it cannot be opened.
+ *
+ *  @details
+ *
+ *  When the points of a parameter sweep share the output files, the first
+ *  point replaces the file and the others append to it.
+ *
+ * ************************************************************************** */
+
+static FILE *
+open_output_file(char *path, const char *file_name, int *is_new)
+{
+  FILE *f;
+
+  output_path(path, file_name);
+  if((f = fopen(path, OUTPUT_POINT > 0 ? "a" : "w")) == NULL)
+    return NULL;
+
+  fseek(f, 0, SEEK_END);
+  *is_new = ftell(f) == 0;
+
+  return f;
+}
+
+/* ************************************************************************** */
+/** write_point_column
+ *
+ *  @brief Write the sweep point column of a row, if the points share the
+ *         output files.
+ *
+ *  @param[in] *f      The open output file.
+ *  @param[in] header  true to write the column name instead.
+ *
+ * ************************************************************************** */
+
+static void
+write_point_column(FILE *f, int header)
+{
+  if(OUTPUT_POINT < 0)
+    return;
+
+  if(header)
+    fprintf(f, "%-12s ", "point");
+  else
+    fprintf(f, "%-12d ", OUTPUT_POINT);
+}
+
+/* ************************************************************************** */
+/** set_output_dir
+ *
+ *  @brief Get the directory the results of a tally set are written to.
+ *
+ *  @param[out] *dir       The directory, LINE_LEN characters long.
+ *  @param[in] *base_dir   The output directory of the simulation.
+ *  @param[in] set         The tally set.
+ *
+ *  @details
+ *
+ *  For an albedo sweep, each albedo has the directory albedo_<albedo> inside
+ *  base_dir. The program exits if the directory is too long.
+ *
+ * ************************************************************************** */
+
+static void
+set_output_dir(char *dir, const char *base_dir, int set)
+{
+  int length;
+
+  if(N_SWEEP == 0)
+    length = snprintf(dir, LINE_LEN, "%s", base_dir);
+  else if(strlen(base_dir) == 0)
+    length = snprintf(dir, LINE_LEN, "albedo_%g", SWEEP_ALBEDOS[set]);
+  else
+    length = snprintf(dir, LINE_LEN, "%s/albedo_%g", base_dir, SWEEP_ALBEDOS[set]);
+
+  if(length >= LINE_LEN)
+  {
+    printf("The output directory %s is too long\n", base_dir);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** output_set_path
+ *
+ *  @brief Get the path of an output file of a tally set.
+ *
+ *  @param[out] *path      The path of the file, LINE_LEN characters long.
+ *  @param[in] set         The tally set.
+ *  @param[in] *file_name  The name of the output file.
+ *
+ *  @details
+ *
+ *  The program exits if the path is too long.
+ *
+ * ************************************************************************** */
+
+void
+output_set_path(char *path, int set, const char *file_name)
+{
+  char dir[LINE_LEN];
+
+  int length;
+
+  set_output_dir(dir, OUTPUT_DIR, set);
+  if(strlen(dir) == 0)
+    length = snprintf(path, LINE_LEN, "%s", file_name);
+  else
+    length = snprintf(path, LINE_LEN, "%s/%s", dir, file_name);
+
+  if(length >= LINE_LEN)
+  {
+    printf("The path of output file %s in directory %s is too long\n", file_name, dir);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** make_dir
+ *
+ *  @brief Create a directory, if it does not already exist.
+ *
+ *  @param[in] *dir  The directory, or an empty string for the current one.
+ *
+ * ************************************************************************** */
+
+static void
+make_dir(const char *dir)
+{
+  if(strlen(dir) > 0 && mkdir(dir, 0755) && errno != EEXIST)
+  {
+    printf("Cannot create directory %s\n", dir);
+    exit(1);
+  }
+}
+
+/* ************************************************************************** */
+/** make_output_dirs
+ *
+ *  @brief Create OUTPUT_DIR, and the directory of each tally set, if they do
+ *         not already exist.
+ *
+ * ************************************************************************** */
+
+void
+make_output_dirs(void)
+{
+  char dir[LINE_LEN];
+
+  make_dir(OUTPUT_DIR);
+  for(int s = 0; s < N_SWEEP; s++)
+  {
+    set_output_dir(dir, OUTPUT_DIR, s);
+    make_dir(dir);
+  }
+}
+
 /* ************************************************************************** */
 /** ouput_intensity_to_file
  *
@@ -23,28 +226,69 @@
  *
  *  @details
  *
+ *  If the peel-off estimator was used, its intensity towards each observer is
+ *  written to a separate file with the same columns, except that the weight
+ *  is replaced by the cosine of the observer angle.
+ *
  * ************************************************************************** */
 
 void
 ouput_intensity_to_file(Histogram_t *hist)
 {
   int i;
+  int is_new;
   FILE *f = NULL;
+  char path[LINE_LEN];
 
-  if((f = fopen(OUTPUT_FILE_INTENS, "w")) == NULL)
+  if((f = open_output_file(path, OUTPUT_FILE_INTENS, &is_new)) == NULL)
   {
-    printf("Cannot open file %s\n", OUTPUT_FILE_INTENS);
+    printf("Cannot open file %s\n", path);
     return;
   }
 
-  fprintf(f, "%-12s %-12s %-12s\n", "angle", "weight", "intensity");
+  if(is_new)
+  {
+    write_point_column(f, true);
+    fprintf(f, "%-12s %-12s %-12s %-12s\n", "angle", "weight", "intensity", "error");
+  }
 
   for(i = 0; i < hist->n_bins; i++)
-    fprintf(f, "%-12f %-12e %-12e\n", hist->theta[i], hist->weight[i], hist->intensity[i]);
+  {
+    write_point_column(f, false);
+    fprintf(f, "%-12f %-12e %-12e %-12e\n", hist->theta[i], hist->weight[i], hist->intensity[i], hist->error[i]);
+  }
 
   if(fclose(f))
   {
-    printf("Cannot close file %s\n", OUTPUT_FILE_INTENS);
+    printf("Cannot close file %s\n", path);
+    exit(-1);
+  }
+
+  if(hist->n_peel == 0)
+    return;
+
+  if((f = open_output_file(path, OUTPUT_FILE_PEEL, &is_new)) == NULL)
+  {
+    printf("Cannot open file %s\n", path);
+    return;
+  }
+
+  if(is_new)
+  {
+    write_point_column(f, true);
+    fprintf(f, "%-12s %-12s %-12s %-12s\n", "angle", "mu", "intensity", "error");
+  }
+
+  for(i = 0; i < hist->n_peel; i++)
+  {
+    write_point_column(f, false);
+    fprintf(f, "%-12f %-12f %-12e %-12e\n", acos(PEEL_MU[i]), PEEL_MU[i], hist->peel_intensity[i],
+      hist->peel_error[i]);
+  }
+
+  if(fclose(f))
+  {
+    printf("Cannot close file %s\n", path);
     exit(-1);
   }
 }
@@ -55,39 +299,165 @@ ouput_intensity_to_file(Histogram_t *hist)
  *  @brief Write the JHK moments of the radiation field to file.
  *
  *  @param[in] Moments *moments. An initialised Moments_t struct.
+ *  @param[in] n_photons         The number of photons transported.
  *
  *  @return 0
  *
  *  @details
  *
+ *  The moments are followed by their batch means errors, in the same order.
+ *
  * ************************************************************************** */
 
 void
-output_radiation_moments_to_file(Moments_t *moments)
+output_radiation_moments_to_file(Moments_t *moments, long n_photons)
 {
   int i;
+  int is_new;
   FILE *f = NULL;
+  char path[LINE_LEN];
 
-  if((f = fopen(OUTPUT_FILE_MOMENTS, "w")) == NULL)
+  if((f = open_output_file(path, OUTPUT_FILE_MOMENTS, &is_new)) == NULL)
   {
-    printf("Cannot access file %s\n", OUTPUT_FILE_MOMENTS);
+    printf("Cannot access file %s\n", path);
     exit(-1);
   }
 
-  fprintf(f, "%-12s %-12s %-12s %-12s %-12s %-12s %-12s\n", "level", "j_plus", "j_minus", "h_plus", "h_minus",
-    "k_plus", "k_minus");
+  int order[N_MOMENTS] = {MOMENT_J_PLUS, MOMENT_J_MINUS, MOMENT_H_PLUS, MOMENT_H_MINUS, MOMENT_K_PLUS, MOMENT_K_MINUS};
+
+  if(is_new)
+  {
+    write_point_column(f, true);
+    fprintf(f, "%-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s %-12s\n", "level", "j_plus",
+      "j_minus", "h_plus", "h_minus", "k_plus", "k_minus", "j_plus_err", "j_minus_err", "h_plus_err", "h_minus_err",
+      "k_plus_err", "k_minus_err");
+  }
 
   for(i = 0; i < moments->n_levels + 1; i++)
   {
-    fprintf(f, "%-12d %-12e %-12e %-12e %-12e %-12e %-12e\n", i + 1,
-      moments->j_plus[i] / N_PHOTONS, moments->j_minus[i] / N_PHOTONS,
-      moments->h_plus[i] / N_PHOTONS, moments->h_minus[i] / N_PHOTONS,
-      moments->k_plus[i] / N_PHOTONS, moments->k_minus[i] / N_PHOTONS);
+    write_point_column(f, false);
+    fprintf(f, "%-12d", i + 1);
+    for(int m = 0; m < N_MOMENTS; m++)
+      fprintf(f, " %-12e", MOMENT(moments, i, order[m]) / n_photons);
+    for(int m = 0; m < N_MOMENTS; m++)
+      fprintf(f, " %-12e", batch_means_error(MOMENT(moments, i, order[m]), MOMENT_SQ(moments, i, order[m]),
+        moments->n_batches) / n_photons);
+    fprintf(f, "\n");
+  }
+
+  if(fclose(f))
+  {
+    printf("Cannot close file %s\n", path);
+    exit(-1);
+  }
+}
+
+/* ************************************************************************** */
+/** write_results
+ *
+ *  @brief Write the intensity and moments of every tally set to file.
+ *
+ *  @param[in, out] *hist     N_TALLY_SETS Histogram_t structs, which are
+ *                            converted to intensities.
+ *  @param[in] *moments       N_TALLY_SETS integrated Moments_t structs.
+ *  @param[in] n_photons      The number of photons transported.
+ *  @param[in] kind           RECORD_FINAL at the end of the simulation,
+ *                            otherwise RECORD_SNAPSHOT.
+ *
+ *  @details
+ *
+ *  For an albedo sweep, the results for each albedo are written to the
+ *  directory albedo_<albedo> inside OUTPUT_DIR. With FORMAT_BINARY, the
+ *  results are added to the end of OUTPUT_FILE_BINARY as a record of the given
+ *  kind, otherwise the text files are replaced.
+ *
+ * ************************************************************************** */
+
+void
+write_results(Histogram_t *hist, Moments_t *moments, long n_photons, int kind)
+{
+  char base_dir[LINE_LEN];
+  char path[LINE_LEN];
+
+  strcpy(base_dir, OUTPUT_DIR);
+  make_output_dirs();
+
+  for(int s = 0; s < N_TALLY_SETS; s++)
+  {
+    convert_weight_to_intensity(&hist[s], n_photons);
+
+    if(OUTPUT_FORMAT == FORMAT_BINARY)
+    {
+      output_set_path(path, s, OUTPUT_FILE_BINARY);
+      write_binary_record(path, kind, &hist[s], &moments[s], s, n_photons);
+    }
+    else
+    {
+      set_output_dir(OUTPUT_DIR, base_dir, s);
+      ouput_intensity_to_file(&hist[s]);
+      output_radiation_moments_to_file(&moments[s], n_photons);
+    }
+  }
+
+  strcpy(OUTPUT_DIR, base_dir);
+}
+
+/* ************************************************************************** */
+/** write_sweep_points
+ *
+ *  @brief Write the value of every swept parameter at each point of a
+ *         parameter sweep to OUTPUT_FILE_SWEEP.
+ *
+ *  @param[in, out] *table  The table of parameters. The last point is left
+ *                          selected.
+ *  @param[in] n_points     The number of sweep points.
+ *  @param[in] combined     true if the points share the output files,
+ *                          otherwise each point is in the directory
+ *                          point_<point>.
+ *
+ * ************************************************************************** */
+
+void
+write_sweep_points(ParameterTable_t *table, int n_points, int combined)
+{
+  FILE *f;
+
+  if((f = fopen(OUTPUT_FILE_SWEEP, "w")) == NULL)
+  {
+    printf("Cannot open file %s\n", OUTPUT_FILE_SWEEP);
+    return;
+  }
+
+  fprintf(f, "%-12s", "point");
+  if(!combined)
+    fprintf(f, " %-12s", "directory");
+  for(int i = 0; i < table->n_parameters; i++)
+    if(table->parameters[i].n_values > 0)
+      fprintf(f, " %-12s", table->parameters[i].name);
+  fprintf(f, "\n");
+
+  for(int point = 0; point < n_points; point++)
+  {
+    char directory[LINE_LEN];
+    select_parameter_point(table, point);
+    fprintf(f, "%-12d", point);
+    if(!combined)
+    {
+      snprintf(directory, LINE_LEN, "point_%d", point);
+      fprintf(f, " %-12s", directory);
+    }
+    for(int i = 0; i < table->n_parameters; i++)
+    {
+      Parameter_t *parameter = &table->parameters[i];
+      if(parameter->n_values > 0)
+        fprintf(f, " %-12g", parameter->values[parameter->index]);
+    }
+    fprintf(f, "\n");
   }
 
   if(fclose(f))
   {
-    printf("Cannot close file %s\n", OUTPUT_FILE_MOMENTS);
+    printf("Cannot close file %s\n", OUTPUT_FILE_SWEEP);
     exit(-1);
   }
 }
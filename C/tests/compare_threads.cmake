@@ -0,0 +1,42 @@
+# Runs mcrt on the same input with one thread and with THREADS threads, and
+# fails if any output file differs. The batched tallies make the output
+# independent of the number of threads, so any difference is a bug.
+#
+# cmake -DMCRT=<mcrt> -DINPUT=<input> -DWORK_DIR=<dir> -DTHREADS=<n>
+#       -P compare_threads.cmake
+
+if(NOT THREADS)
+    set(THREADS 4)
+endif()
+
+foreach(n 1 ${THREADS})
+    set(dir ${WORK_DIR}/threads_${n})
+    file(REMOVE_RECURSE ${dir})
+    file(MAKE_DIRECTORY ${dir})
+    execute_process(
+            COMMAND ${CMAKE_COMMAND} -E env OMP_NUM_THREADS=${n} ${MCRT} ${INPUT}
+            WORKING_DIRECTORY ${dir}
+            RESULT_VARIABLE result
+            OUTPUT_QUIET
+    )
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "mcrt with ${n} threads exited with ${result}")
+    endif()
+endforeach()
+
+file(GLOB_RECURSE files RELATIVE ${WORK_DIR}/threads_1 ${WORK_DIR}/threads_1/*)
+if(NOT files)
+    message(FATAL_ERROR "mcrt with 1 thread wrote no output files")
+endif()
+
+foreach(file ${files})
+    execute_process(
+            COMMAND ${CMAKE_COMMAND} -E compare_files
+            ${WORK_DIR}/threads_1/${file} ${WORK_DIR}/threads_${THREADS}/${file}
+            RESULT_VARIABLE result
+    )
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${file} differs between 1 and ${THREADS} threads")
+    endif()
+    message(STATUS "${file} is the same with 1 and ${THREADS} threads")
+endforeach()